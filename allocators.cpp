@@ -29,3 +29,58 @@ void aligned_free(void* p)
         delete [] mem;
     }
 }
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+size_t page_size()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+void* page_alloc(size_t size)
+{
+    return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void page_free(void* p, size_t size)
+{
+    if(p) VirtualFree(p, 0, MEM_RELEASE);
+}
+
+void page_discard(void* p, size_t size)
+{
+    if(p) VirtualAlloc(p, size, MEM_RESET, PAGE_READWRITE);
+}
+
+#else
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t page_size()
+{
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+void* page_alloc(size_t size)
+{
+    void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+void page_free(void* p, size_t size)
+{
+    if(p) munmap(p, size);
+}
+
+void page_discard(void* p, size_t size)
+{
+    if(p) madvise(p, size, MADV_DONTNEED);
+}
+
+#endif
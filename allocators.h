@@ -4,9 +4,22 @@
 */
 #pragma once
 
+#include "orb_lib.h"
 
 #include <cstring>
 
 /** Return memory aligned to 16 bytes. Must be freed using alignedFree */
 unsigned char* aligned_alloc(size_t size);
 void aligned_free(void* p);
+
+/** Return size of a virtual memory page. */
+ORB_LIB size_t page_size();
+
+/** Map size bytes of page aligned memory directly from the OS. Size must be a multiple of
+ *  page_size(). Must be freed using page_free. */
+ORB_LIB void* page_alloc(size_t size);
+ORB_LIB void page_free(void* p, size_t size);
+
+/** Return the physical memory of the pages to the OS. The range stays mapped and can be
+ *  reused, but it's contents are undefined. */
+ORB_LIB void page_discard(void* p, size_t size);
@@ -5,6 +5,16 @@
 #include "iotools.h"
 #include "shims_and_types.h"
 #include <algorithm>
+#include <cstdlib>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 //#ifdef WIN32
@@ -82,10 +92,65 @@ bool directory_exists(std::string dirpath){
 
 std::tuple<std::string, bool> file_to_string(const char* path)
 {
+    MappedFile mapped(path);
+    if(mapped.is_open()) return mapped.contents_to_string();
+
+    // Files that can not be mapped, e.g. pipes, are read as streams.
     InputFile file(path);
     return file.contents_to_string();
 }
 
+#ifdef WIN32
+
+bool file_stamp(const char* path, FileStamp& out)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if(!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return false;
+    if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) return false;
+
+    out.size  = ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    out.mtime = (int64_t)(((uint64_t) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+    return true;
+}
+
+std::tuple<std::string, bool> canonical_path(const char* path)
+{
+    char buffer[MAX_PATH];
+    DWORD length = GetFullPathNameA(path, MAX_PATH, buffer, 0);
+    if(length == 0 || length >= MAX_PATH || GetFileAttributesA(buffer) == INVALID_FILE_ATTRIBUTES)
+        return std::make_tuple(std::string(), false);
+
+    return std::make_tuple(fix_path_to_posix_path(buffer), true);
+}
+
+#else
+
+bool file_stamp(const char* path, FileStamp& out)
+{
+    struct stat st;
+    if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    out.size  = (uint64_t) st.st_size;
+#ifdef __linux__
+    out.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    out.mtime = (int64_t) st.st_mtime;
+#endif
+    return true;
+}
+
+std::tuple<std::string, bool> canonical_path(const char* path)
+{
+    char* resolved = realpath(path, 0);
+    if(!resolved) return std::make_tuple(std::string(), false);
+
+    std::string result(resolved);
+    free(resolved);
+    return std::make_tuple(result, true);
+}
+
+#endif
+
 std::tuple<std::vector<uint8_t>, bool> file_to_bytes(const char* path)
 {
     InputFile file(path);
@@ -139,7 +204,7 @@ char platform_separator(){
 #ifdef WIN32
     return '\\';
 #else
-    return return '/';
+    return '/';
 #endif
 }
 
@@ -200,6 +265,107 @@ std::tuple<std::vector<uint8_t>, bool> InputFile::contents_to_bytes()
     return std::make_tuple(contents, success);
 }
 
+//////////// MappedFile //////////////////
+
+#ifdef WIN32
+
+MappedFile::MappedFile(const char* path):data_(""), size_(0), open_(false), file_(INVALID_HANDLE_VALUE), mapping_(0)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if(file == INVALID_HANDLE_VALUE) return;
+    file_ = file;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || GetFileType(file) != FILE_TYPE_DISK){close(); return;}
+    size_ = (size_t) size.QuadPart;
+
+    if(size_ > 0)
+    {
+        // Views of empty files can not be mapped.
+        mapping_ = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        const void* view = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : 0;
+        if(!view){close(); return;}
+        data_ = (const char*) view;
+    }
+
+    open_ = true;
+}
+
+void MappedFile::close()
+{
+    if(size_ > 0 && open_) UnmapViewOfFile(data_);
+    if(mapping_) CloseHandle(mapping_);
+    if(file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+
+    data_ = "";
+    size_ = 0;
+    open_ = false;
+    file_ = INVALID_HANDLE_VALUE;
+    mapping_ = 0;
+}
+
+#else
+
+MappedFile::MappedFile(const char* path):data_(""), size_(0), open_(false)
+{
+    // Opening a fifo for reading would block until it has a writer.
+    struct stat st;
+    if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return;
+
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0) return;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        size_ = (size_t) st.st_size;
+        open_ = true;
+
+        if(size_ > 0)
+        {
+            // Views of empty files can not be mapped.
+            void* view = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(view != MAP_FAILED)
+            {
+                data_ = (const char*) view;
+                if(size_ >= SEQUENTIAL_SIZE) madvise(view, size_, MADV_SEQUENTIAL);
+            }
+            else
+            {
+                size_ = 0;
+                open_ = false;
+            }
+        }
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    ::close(fd);
+}
+
+void MappedFile::close()
+{
+    if(size_ > 0 && open_) munmap((void*) data_, size_);
+
+    data_ = "";
+    size_ = 0;
+    open_ = false;
+}
+
+#endif
+
+MappedFile::~MappedFile(){close();}
+
+bool MappedFile::is_open(){return open_;}
+
+const char* MappedFile::data() {return data_;}
+
+size_t MappedFile::size() {return size_;}
+
+std::tuple<std::string, bool> MappedFile::contents_to_string()
+{
+    return std::make_tuple(std::string(data_, data_ + size_), open_);
+}
+
 //// OutputFile ////
 
 OutputFile::OutputFile(const char* path)
@@ -36,6 +36,21 @@ bool directory_exists(std::string dir);
 ORB_LIB std::tuple<std::string, bool>          file_to_string(const char* path);
 std::tuple<std::vector<uint8_t>, bool> file_to_bytes(const char* path);
 
+/** Size and modification time of a file, tells the versions of the file apart.*/
+struct FileStamp{
+    uint64_t size;
+    int64_t  mtime; //> Platform dependent unit
+
+    bool operator==(const FileStamp& s) const {return size == s.size && mtime == s.mtime;}
+    bool operator!=(const FileStamp& s) const {return !(*this == s);}
+};
+
+/** Stamp of the regular file at path. Return false if there is no such file.*/
+ORB_LIB bool file_stamp(const char* path, FileStamp& out);
+
+/** Absolute path of an existing file, '.', '..' and symbolic links resolved.*/
+ORB_LIB std::tuple<std::string, bool> canonical_path(const char* path);
+
 bool string_to_file(const char* path, const char* string);
 
 // All internal path operations expect '/' separator for paths
@@ -69,6 +84,38 @@ public:
     std::ifstream file_;
 };
 
+/** Read-only memory mapping of a whole regular file. Big files are advised to the OS to be read
+ *  sequentially.*/
+class ORB_LIB MappedFile{
+private:
+    MappedFile(const MappedFile& m){}
+    MappedFile& operator=(const MappedFile& m);
+public:
+    /** Files of at least this size are advised to be read sequentially.*/
+    enum{SEQUENTIAL_SIZE = 1 << 20};
+
+    MappedFile(const char* path);
+    ~MappedFile();
+
+    bool is_open();
+    void close();
+
+    /** The mapped contents, valid until close. Not null terminated.*/
+    const char* data();
+    size_t size();
+
+    std::tuple<std::string, bool> contents_to_string();
+
+private:
+    const char* data_;
+    size_t      size_;
+    bool        open_;
+#ifdef WIN32
+    void*       file_;
+    void*       mapping_;
+#endif
+};
+
 class OutputFile{
 private:
     OutputFile(const OutputFile& o){}
@@ -4,6 +4,7 @@
 */
 #include "math_tools.h"
 #include <stdint.h>
+#include <cstring>
 
 namespace
 {
@@ -67,7 +68,205 @@ uint32_t SuperFastHash (const char* data, int len) {
 
 
 
+/////////////// hash64 ////////////////
+
+#if !defined(ORB_HASH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ORB_HASH_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+// Odd constants with an even mix of set bits.
+const uint64_t P0 = 0xa0761d6478bd642full;
+const uint64_t P1 = 0xe7037ed1a0b428dbull;
+const uint64_t P2 = 0x8ebc6af09c88c6e3ull;
+const uint64_t P3 = 0x589965cc75374cc3ull;
+
+const size_t STRIPE_LEN        = 64;  //> Bytes per step of the long input loop
+const size_t STRIPES_PER_BLOCK = 16;  //> Steps between scrambles of the accumulators
+const size_t LONG_INPUT        = 256; //> Inputs longer than this take the striped path
+
+inline uint64_t read64(const uint8_t* p){uint64_t v; memcpy(&v, p, sizeof(v)); return v;}
+inline uint64_t read32(const uint8_t* p){uint32_t v; memcpy(&v, p, sizeof(v)); return v;}
+
+/** Replace a and b with the low and high halves of their 128 bit product. */
+inline void mul128(uint64_t& a, uint64_t& b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) a * b;
+    a = (uint64_t) r;
+    b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    a = _umul128(a, b, &b);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t) a, lb = (uint32_t) b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    a = lo;
+    b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+/** Fold the 128 bit product of a and b to 64 bits. */
+inline uint64_t mum(uint64_t a, uint64_t b){mul128(a, b); return a ^ b;}
+
+/** Keys of the striped path: stripe n of a block reads the 64 bytes from key n.*/
+struct StripeSecret
+{
+    static const size_t COUNT = STRIPE_LEN / 8 + STRIPES_PER_BLOCK + 8;
+    uint64_t key[COUNT];
+
+    StripeSecret()
+    {
+        uint64_t x = P3;
+        for(size_t i = 0; i < COUNT; ++i)
+        {
+            // splitmix64
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            key[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+/** Function local so that hashing during static initialization finds the keys built. */
+const StripeSecret& stripe_secret()
+{
+    static const StripeSecret secret;
+    return secret;
+}
+
+/** Add a 64 byte stripe to the accumulators: each lane gets the product of the halves of the
+ *  keyed input and the unkeyed input of its neighbour, so no input bits are lost.*/
+inline void accumulate_stripe(uint64_t* acc, const uint8_t* p, const uint64_t* key)
+{
+#if defined(ORB_HASH_SSE2)
+    for(size_t i = 0; i < 4; ++i)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) acc + i);
+        __m128i v = _mm_loadu_si128((const __m128i*) p + i);
+        __m128i k = _mm_xor_si128(v, _mm_loadu_si128((const __m128i*) key + i));
+        __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i*) acc + i, _mm_add_epi64(a, product));
+    }
+#else
+    for(size_t i = 0; i < 8; ++i)
+    {
+        uint64_t v = read64(p + 8 * i);
+        uint64_t k = v ^ key[i];
+        acc[i ^ 1] += v;
+        acc[i] += (k & 0xffffffffull) * (k >> 32);
+    }
+#endif
+}
+
+/** Spread the high bits of the accumulators to the bits the lane products see. */
+inline void scramble(uint64_t* acc, const uint64_t* key)
+{
+    const uint32_t prime = 0x9e3779b1u;
+#if defined(ORB_HASH_SSE2)
+    const __m128i m = _mm_set1_epi32((int) prime);
+    for(size_t i = 0; i < 4; ++i)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) acc + i);
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*) key + i));
+        __m128i lo = _mm_mul_epu32(a, m);
+        __m128i hi = _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), m), 32);
+        _mm_storeu_si128((__m128i*) acc + i, _mm_add_epi64(lo, hi));
+    }
+#else
+    for(size_t i = 0; i < 8; ++i)
+    {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc[i] = a * prime;
+    }
+#endif
+}
+
+uint64_t hash_long(const uint8_t* p, size_t len, uint64_t seed)
+{
+    uint64_t key[StripeSecret::COUNT];
+    const StripeSecret& secret = stripe_secret();
+    for(size_t i = 0; i < StripeSecret::COUNT; ++i) key[i] = secret.key[i] ^ seed;
+
+    uint64_t acc[8] = {P0, P1, P2, P3, ~P0, ~P1, ~P2, ~P3};
+
+    const size_t stripes = (len - 1) / STRIPE_LEN;
+    for(size_t s = 0; s < stripes; ++s)
+    {
+        size_t n = s % STRIPES_PER_BLOCK;
+        accumulate_stripe(acc, p + s * STRIPE_LEN, key + n);
+        if(n == STRIPES_PER_BLOCK - 1) scramble(acc, key + STRIPES_PER_BLOCK);
+    }
+    // The last stripe ends at the end of input and may overlap the previous one.
+    accumulate_stripe(acc, p + len - STRIPE_LEN, key + STRIPES_PER_BLOCK + 1);
+
+    uint64_t h = len * P0;
+    for(size_t i = 0; i < 8; i += 2) h += mum(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+    return mum(h ^ (h >> 29) ^ P1, seed ^ P2);
+}
+
+} // namespace
+
+uint64_t hash64(const void* data, size_t len, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    if(len > LONG_INPUT) return hash_long(p, len, seed);
+
+    seed ^= mum(seed ^ P0, P1);
+    uint64_t a, b;
+    if(len <= 16)
+    {
+        if(len >= 4)
+        {
+            size_t shift = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - shift);
+        }
+        else if(len > 0)
+        {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else a = b = 0;
+    }
+    else
+    {
+        size_t i = len;
+        for(; i > 16; i -= 16, p += 16) seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= P1;
+    b ^= seed;
+    mul128(a, b);
+    return mum(a ^ P0 ^ len, b ^ P1);
+}
+
 uint32_t hash32(const char* data, int len)
+{
+    uint64_t h = hash64(data, len);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t hash32(const char* data, int len, uint64_t seed)
+{
+    uint64_t h = hash64(data, len, seed);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t hash32_superfast(const char* data, int len)
 {
     return SuperFastHash(data, len);
 }
@@ -8,6 +8,9 @@
 #include<string>
 #include "tinymt32.h"
 #include <list>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 //
 //// Disable Eigen's alignment and vectorization, leave it to compiler
 //#define EIGEN_DONT_ALIGN 
@@ -30,10 +33,22 @@
 
 /////////////// Hash functions //////////////
 
+/** 64 bit hash of len bytes at data. Inputs of up to 16 bytes take two multiplies, inputs of up to
+ *  256 bytes are mixed 16 bytes per multiply and longer inputs 64 bytes per step in eight lanes,
+ *  with SSE2 unless ORB_HASH_NO_SIMD is defined. Each seed gives an unrelated hash function, a
+ *  secret random seed makes inputs that collide on purpose hard to construct.*/
+uint64_t hash64(const void* data, size_t len, uint64_t seed = 0);
+
+/** Hash of data folded to 32 bits, all 64 bits of hash64 affect the result. */
 uint32_t hash32(const char* data, int len);
 
+uint32_t hash32(const char* data, int len, uint64_t seed);
+
 uint32_t hash32(const std::string&  string);
 
+/** Paul Hsieh's SuperFastHash, the hash32 of earlier versions. Kept for comparison in benchmarks.*/
+uint32_t hash32_superfast(const char* data, int len);
+
 template<class T>
 uint32_t hash32(const T& hashable)
 {
@@ -41,25 +56,79 @@ uint32_t hash32(const T& hashable)
     return hash32((char*)&hashable, len);
 }
 
+/** Mix all bits of k to a 32 bit hash (finalizer of MurmurHash3).*/
+inline uint32_t hash_mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (uint32_t) k;
+}
+
+/** Combine the hash of the next element of a sequence to seed. The result depends on the order.*/
+inline uint32_t hash_combine32(uint32_t seed, uint32_t h)
+{
+    return seed ^ (h + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 
 ///////////////// Bit operations //////////////
 
-/** Count bits in field */
-inline const uint32_t count_bits(uint32_t field)
+/** Count bits in 32 bit field */
+inline uint32_t popcount32(uint32_t field)
 {
+#if defined(_MSC_VER)
+    return __popcnt(field);
+#elif defined(__GNUC__)
+    return (uint32_t) __builtin_popcount(field);
+#else
     uint32_t count = 0;
     for(; field; count++) field &= field - 1;
     return count;
+#endif
+}
+
+/** Count bits in 64 bit field */
+inline uint32_t popcount64(uint64_t field)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return (uint32_t) __popcnt64(field);
+#elif defined(__GNUC__)
+    return (uint32_t) __builtin_popcountll(field);
+#else
+    return popcount32((uint32_t) field) + popcount32((uint32_t)(field >> 32));
+#endif
+}
+
+/** Return index of lowest set bit. Field must not be zero. */
+inline uint32_t count_trailing_zeros64(uint64_t field)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, field);
+    return index;
+#elif defined(__GNUC__)
+    return (uint32_t) __builtin_ctzll(field);
+#else
+    uint32_t index = 0;
+    for(; !(field & 0x1); field >>= 1, index++){}
+    return index;
+#endif
+}
+
+/** Count bits in field */
+inline const uint32_t count_bits(uint32_t field)
+{
+    return popcount32(field);
 }
 
 /** Return index of lowest unset bit*/
 inline const uint32_t lowest_unset_bit(uint32_t field)
 {
     if(field == 0xffffffff) return 32; //> not found
-    uint32_t index = 0;
-    for(; (field & 0x1); field >>= 1, index++){}
-
-    return index;
+    return count_trailing_zeros64(~field);
 }
 
 /** Set nth bit in field. Return result. */
@@ -6,9 +6,6 @@
 #include "persistent_containers.h"
 #include "iotools.h"
 
-#include <regex>
-
-#include<stack>
 #include<cstring>
 #include<algorithm>
 #include<cstdlib>
@@ -18,7 +15,10 @@
 #include<tuple>
 #include<utility>
 #include<limits>
+#include<unordered_set>
+#include<unordered_map>
 #include<type_traits>
+#include<chrono>
 
 namespace {
 void local_assert(const char* msg)
@@ -52,22 +52,39 @@ void convert_to_int(NumberArray& arr)
     for(auto n = arr.begin(); n != arr.end(); ++n){int i = n->to_int(); n->set(i);}
 }
 
-struct Function{PrimitiveFunction fun;};
+struct Function
+{
+    PrimitiveFunction fun;
+    const char*       name; //> Name the primitive was added to the environment with, if any
+
+    Function():name(0){}
+};
 
 // ValuesAreEqual and ValueHash member implementations
 bool ValuesAreEqual::compare(const Value& k1, const Value& k2){return k1 == k2;} 
+
+bool ValuesAreOrdered::compare(const Value& k1, const Value& k2)
+{
+    if(k1.type != k2.type) return k1.type < k2.type;
+    if(k1.type == NUMBER)                        return k1.value.number < k2.value.number;
+    if(k1.type == STRING || k1.type == SYMBOL)   return *k1.value.string < *k2.value.string;
+    if(k1.type == BOOLEAN)                       return k1.value.boolean < k2.value.boolean;
+    return false;
+}
 uint32_t ValueHash::hash(const Value& h){return h.get_hash();}
 
-Value::Value():type(NIL){}
+Value::Value():type(NIL), interned(false){}
 
 void Value::dealloc()
 {
     if((type == STRING || type == SYMBOL) && value.string)
     {
-        delete value.string;
+        if(!interned) delete value.string;
     }
     else if(type == LIST && value.list)      { delete value.list;}
     else if(type == MAP && value.map)        { delete value.map;}
+    else if(type == SORTED_MAP && value.sorted_map) { delete value.sorted_map;}
+    else if(type == SET && value.set)        { delete value.set;}
     else if(type == OBJECT && value.object)  { delete value.object;}
     else if(type == VECTOR && value.vector)  { delete value.vector;}
     else if(type == FUNCTION && value.function)  { delete value.function;}
@@ -100,12 +117,15 @@ Value::Value(const Value& v)
 void Value::copy(const Value& v)
 {
     type = v.type;
+    interned = v.interned;
 
 #define COPY_PARAM_V(param_name) value. param_name = copy_new(v.value. param_name)
     if(type == NUMBER) value.number.set(v.value.number);
-    else if(type == SYMBOL || type == STRING) COPY_PARAM_V(string);
+    else if(type == SYMBOL || type == STRING) value.string = interned ? v.value.string : copy_new(v.value.string);
     else if(type == LIST)    COPY_PARAM_V(list);
     else if(type == MAP)     COPY_PARAM_V(map);
+    else if(type == SORTED_MAP) COPY_PARAM_V(sorted_map);
+    else if(type == SET)     COPY_PARAM_V(set);
     else if(type == OBJECT) value.object = v.value.object->copy();
     else if(type == VECTOR)  COPY_PARAM_V(vector);
     else if(type == FUNCTION) COPY_PARAM_V(function);
@@ -119,6 +139,7 @@ void Value::copy(const Value& v)
 void Value::movefrom(Value& v)
 {
     type = v.type;
+    interned = v.interned;
     void* that_value_ptr = reinterpret_cast<void*>(&v.value); 
     size_t value_size = sizeof(value);
     memcpy(reinterpret_cast<void*>(&value), that_value_ptr, sizeof(value));  
@@ -134,7 +155,10 @@ Value& Value::operator=(const Value& a)
 {
     if(&a != this)
     {
-        copy(a);
+        // Copy before releasing the old contents, a may be owned by them.
+        Value tmp(a);
+        dealloc();
+        movefrom(tmp);
     }
     
     return *this;
@@ -144,7 +168,9 @@ Value& Value::operator=(Value&& v)
 {
     if(&v != this)
     {
-        movefrom(v);
+        Value tmp(std::move(v));
+        dealloc();
+        movefrom(tmp);
     }
 
     return *this; 
@@ -174,10 +200,12 @@ bool Value::operator==(const Value& v) const
 
     if(type == NUMBER)            result = value.number == v.value.number;
     else if(type == NUMBER_ARRAY) result = (*value.number_array) == (*v.value.number_array);
-    else if(type == STRING || type == SYMBOL) result = (*value.string) == (*v.value.string);
+    else if(type == STRING || type == SYMBOL) result = value.string == v.value.string || (*value.string) == (*v.value.string);
     else if(type == VECTOR) result = (*value.vector) == *(v.value.vector);
     else if(type == LIST) result = (*(value.list) ==  *(v.value.list));
     else if(type == MAP) result = (*(value.map) == *(v.value.map));
+    else if(type == SORTED_MAP) result = (*(value.sorted_map) == *(v.value.sorted_map));
+    else if(type == SET) result = (*(value.set) == *(v.value.set));
     else if(type == OBJECT)
     {
         // TODO - what to do.
@@ -192,45 +220,60 @@ bool Value::operator==(const Value& v) const
     return result;
 }
 
-uint32_t hash_of_number(const Number& n){return *((uint32_t*) &n);}
-uint32_t accum_number_hash(const uint32_t& p, const Number& n){return p * hash_of_number(n);}
-uint32_t accum_value_hash(const uint32_t& p, const Value& v){return p * v.get_hash();}
+uint32_t hash_of_number(const Number& n)
+{
+    if(n.type == Number::INT) return hash_mix64((uint64_t)(uint32_t) n.value.intvalue);
+
+    double d = n.value.floatvalue == 0.0 ? 0.0 : n.value.floatvalue; // -0.0 == 0.0
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return hash_mix64(~bits);
+}
+uint32_t accum_number_hash(const uint32_t& p, const Number& n){return hash_combine32(p, hash_of_number(n));}
+uint32_t accum_value_hash(const uint32_t& p, const Value& v){return hash_combine32(p, v.get_hash());}
+
+/** Order sensitive hash of a sequence of values, seed tells sequence types apart. */
+template<class SEQ>
+uint32_t hash_of_sequence(uint32_t seed, const SEQ& seq)
+{
+    uint32_t h = seed;
+    for(auto i = seq.begin(); i != seq.end(); ++i) h = accum_value_hash(h, *i);
+    return h;
+}
+
+/** Hash of a map. The hashes of the entries are summed so that the result does not depend on the
+ *  order of iteration, which for a hash trie depends on the order of insertion of colliding keys.*/
+template<class MAP>
+uint32_t hash_of_map(uint32_t seed, const MAP& map, bool with_values)
+{
+    uint32_t h = seed;
+    for(auto i = map.begin(); i != map.end(); ++i)
+    {
+        uint64_t entry = with_values ? ((uint64_t) i->first.get_hash() << 32) | i->second.get_hash() : i->first.get_hash();
+        h += hash_mix64(entry);
+    }
+    return hash_combine32(h, (uint32_t) map.size());
+}
 
 uint32_t Value::get_hash() const
 {
-    // For collections produce a product of the hashes of contained elements
+    // Collections cache their hash in the container handle, elements are hashed only once.
     uint32_t h = 0;
 
     if(type == BOOLEAN) h = (uint32_t) value.boolean;
     else if(type == NIL) h = std::numeric_limits<uint32_t>::max();
     else if(type == NUMBER)  h = hash_of_number(value.number);
     else if(type == NUMBER_ARRAY){
-        uint32_t orig = 0;
+        uint32_t orig = NUMBER_ARRAY;
         h = orb::fold_left<uint32_t, NumberArray>(orig, accum_number_hash, *value.number_array);
     }
     else if(type == STRING || type == SYMBOL) h = hash32(*value.string);
-    else if(type == VECTOR)
-    {
-        uint32_t orig = 0;
-        h = orb::fold_left<uint32_t, Vector>(orig, accum_value_hash, *value.vector);
-    }
-    else if(type == LIST) 
-    {
-        uint32_t orig = 0;
-        h = orb::fold_left<uint32_t, List>(orig, accum_value_hash, *value.list);
-    }
-    else if(type == MAP)
-    {
-        uint32_t accum = 0;
-        Map::iterator i = value.map->begin();
-        Map::iterator end = value.map->end();
-        while(i != end)
-        {
-            accum = accum_value_hash(accum_value_hash(accum, i->first), i->second);
-            ++i;
-        }
-        h = accum;
-    }
+    else if(type == VECTOR) h = value.vector->hash([](const PVector& v){return hash_of_sequence(VECTOR, v);});
+    else if(type == LIST)   h = value.list->hash([](const List& l){return hash_of_sequence(LIST, l);});
+    else if(type == MAP)    h = value.map->hash([](const Map& m){return hash_of_map(MAP, m, true);});
+    else if(type == SORTED_MAP)
+        h = value.sorted_map->hash([](const SortedMap& m){return hash_of_map(SORTED_MAP, m, true);});
+    else if(type == SET)    h = value.set->hash([](const Map& m){return hash_of_map(SET, m, false);});
     else if(type == OBJECT)
     {
         // TODO
@@ -275,7 +318,7 @@ inline Number value_number(const Value& v){return v.type == NUMBER ? v.value.num
 
 inline List* value_list(const Value& v){return v.type == LIST ? v.value.list : 0;}
 
-inline Vector* value_vector(const Value& v){return v.type == VECTOR ? v.value.vector : 0;}
+inline PVector* value_vector(const Value& v){return v.type == VECTOR ? v.value.vector : 0;}
 
 const char* value_string(const Value& v){
     return (v.type == STRING ||  v.type == SYMBOL) ? v.value.string->c_str() : 0;
@@ -325,68 +368,226 @@ inline const Value* value_list_fourth(const Value& v)
     return value_list_nth(v, 3);
 }
 
-Vector* value_vector(Value& v){return v.type == VECTOR ? v.value.vector : 0;}
+PVector* value_vector(Value& v){return v.type == VECTOR ? v.value.vector : 0;}
 
 NumberArray* value_number_array(Value& v){return v.type == NUMBER_ARRAY ? v.value.number_array : 0;}
 
 Map* value_map(const Value& v){return v.type == MAP ? v.value.map : 0;}
+SortedMap* value_sorted_map(const Value& v){return v.type == SORTED_MAP ? v.value.sorted_map : 0;}
+Map* value_set(const Value& v){return v.type == SET ? v.value.set : 0;}
 IObject* value_object(const Value& v){return v.type == OBJECT ? v.value.object : 0;}
 
-void append_to_value_stl_list(std::list<Value>& ext_value_list, const Value& v)
-{
-    ext_value_list.push_back(v);
-}
-
 ///// Orb::Env //////
 
 
 // Custom Garbage collection to remove dangling references.
 namespace {
 
-void value_increment_references(const Value& v);
-void map_increment_references(Map& map);
-
-void list_increment_references(List& list)
+/** Calls the visitor once for each distinct collection handle reachable from the walked values.
+ *  Handles are Values stored in pool slots, so a node shared by several collections is walked
+ *  only once.*/
+template<class F>
+class HandleWalk
 {
+public:
+    HandleWalk(F& visitor):visitor_(visitor){}
+
+    void walk(const Value& v)
+    {
+        if(!orb::any_of(v.type, MAP, SET, SORTED_MAP) && !orb::any_of(v.type, LIST, VECTOR)) return;
+        if(!seen_.insert(&v).second) return;
+
+        if(v.type == MAP)             walk_map(*value_map(v));
+        else if(v.type == SET)        walk_map(*value_set(v));
+        else if(v.type == SORTED_MAP) walk_entries(*value_sorted_map(v));
+        else if(v.type == LIST)       walk_elements(*value_list(v));
+        else if(v.type == VECTOR)     walk_elements(*value_vector(v));
+    }
+
+    /** Walk a handle that is not stored in a Value, e.g. the environment.*/
+    void walk_map(Map& map){walk_entries(map);}
+
+private:
+    template<class M>
+    void walk_entries(M& map)
+    {
 #ifdef PRINT_GC
-    std::cout << "#Inc: List" << std::endl;
+        std::cout << "#Inc: Map" << std::endl;
 #endif
-    list.increment_ref();
-    auto e = list.end();
-    for(auto i = list.begin(); i != e; ++i)
+        visitor_(map);
+        auto e = map.end();
+        for(auto i = map.begin(); i != e; ++i)
+        {
+            walk(i->first);
+            walk(i->second);
+        }
+    }
+
+    /** Walks all the elements in the nodes of the sequence. The elements of other versions
+     *  sharing the nodes are live handles too.*/
+    template<class S>
+    void walk_elements(S& seq)
     {
-        value_increment_references(*i);
+#ifdef PRINT_GC
+        std::cout << "#Inc: Sequence" << std::endl;
+#endif
+        visitor_(seq);
+        seq.for_each_slot([this](const Value& v){walk(v);});
     }
-}
 
-void value_increment_references(const Value& v)
+    F&                               visitor_;
+    std::unordered_set<const Value*> seen_;
+};
+
+/** Handle visitor restoring the root reference counts cleared before collection.*/
+struct IncrementReferences
 {
-    if(v.type == MAP)
+    template<class H>
+    void operator()(H& handle) const {handle.increment_ref();}
+};
+
+
+/** Hash-consing table of literals read by ValueParser. Equal string and symbol literals share one
+ *  std::string owned by the table and marked interned in the values. Equal quoted constants are
+ *  copies of one value kept in the table, so they share its nodes. The kept values are gc roots.*/
+class ConstantTable
+{
+public:
+    ConstantTable():enabled(false)
     {
-        map_increment_references(*value_map(v));
+        stats_.strings = stats_.data = stats_.hits = stats_.saved_bytes = 0;
     }
-    else if(v.type == LIST)
+
+    bool enabled;
+
+    /** Return STRING or SYMBOL value sharing the payload of equal earlier literals.*/
+    Value string_value(Type type, const std::string& str)
     {
-        list_increment_references(*value_list(v));
+        auto inserted = strings_.insert(str);
+        if(!inserted.second) add_hit(sizeof(std::string) + str.size());
+
+        Value v;
+        v.type = type;
+        v.interned = true;
+        v.value.string = const_cast<std::string*>(&*inserted.first);
+        return v;
     }
-}
 
-void map_increment_references(Map& map)
+    /** Return copy of the constant equal to quoted v read first. Atoms are returned as is. */
+    Value data_value(const Value& v)
+    {
+        size_t bytes = 0;
+        if(v.type == LIST)                               bytes = v.value.list->size() * sizeof(Value);
+        else if(v.type == VECTOR)                        bytes = v.value.vector->size() * sizeof(Value);
+        else if(orb::any_of(v.type, MAP, SORTED_MAP))    bytes = count_entries(v) * 2 * sizeof(Value);
+        else if(v.type == SET)                           bytes = v.value.set->size() * 2 * sizeof(Value);
+        else return v;
+
+        auto inserted = data_.insert(v);
+        if(!inserted.second) add_hit(bytes);
+        return *inserted.first;
+    }
+
+    /** Walk the handles of the kept values, they are gc roots. */
+    template<class W>
+    void walk(W& walk) const
+    {
+        for(auto i = data_.begin(); i != data_.end(); ++i) walk.walk(*i);
+    }
+
+    ConstantStats stats() const
+    {
+        ConstantStats s = stats_;
+        s.strings = strings_.size();
+        s.data    = data_.size();
+        return s;
+    }
+
+private:
+    struct ValueHasher{size_t operator()(const Value& v) const {return v.get_hash();}};
+
+    static size_t count_entries(const Value& v)
+    {
+        return v.type == MAP ? v.value.map->size() : v.value.sorted_map->size();
+    }
+
+    void add_hit(size_t bytes)
+    {
+        ++stats_.hits;
+        stats_.saved_bytes += bytes;
+    }
+
+    std::unordered_set<std::string>        strings_; //> Node based, the strings do not move
+    std::unordered_set<Value, ValueHasher> data_;
+    ConstantStats                          stats_;
+};
+
+/** Imported files by canonical path. The parsed forms of a file and the bindings its evaluation
+ *  defined are kept while the size and modification time of the file are unchanged. The kept
+ *  values are gc roots.*/
+class ImportCache
 {
-#ifdef PRINT_GC
-    std::cout << "#Inc: Map" << std::endl;
-#endif
-    map.increment_ref();
-    auto e = map.end();
-    for(auto i = map.begin(); i != e; ++i)
+public:
+    struct Module
+    {
+        FileStamp stamp;
+        Value     forms;     //> The file as one (begin ...) form
+        Value     bindings;  //> Map of the definitions added or changed by evaluating forms
+        Value     result;
+        bool      evaluated; //> Bindings and result are set
+    };
+
+    ImportCache():caching(IMPORT_UNCACHED)
     {
-        value_increment_references(i->first);
-        value_increment_references(i->second);
+        stats.imports = stats.module_hits = stats.form_hits = stats.disk_hits = stats.misses = 0;
+        stats.read_seconds = stats.eval_seconds = 0.0;
     }
-}
 
+    ImportCaching caching;
+    std::string   dir;   //> Directory of binary forms, empty if none
+    ImportStats   stats;
 
-void collect_map_and_list_pools_with_roots(MapPool& map_pool, ListPool& list_pool, Map& map)
+    /** Return the module of path if its stamp is unchanged, else null.*/
+    Module* find(const std::string& path, const FileStamp& stamp)
+    {
+        auto i = modules_.find(path);
+        return (i != modules_.end() && i->second.stamp == stamp) ? &i->second : 0;
+    }
+
+    /** Return the module of path with forms, replacing an earlier version of the file. Node based,
+     *  the modules do not move.*/
+    Module& insert(const std::string& path, const FileStamp& stamp, const Value& forms)
+    {
+        Module& module  = modules_[path];
+        module.stamp    = stamp;
+        module.forms    = forms;
+        module.bindings = Value();
+        module.result   = Value();
+        module.evaluated = false;
+        return module;
+    }
+
+    void clear(){modules_.clear();}
+
+    /** Walk the handles of the kept values, they are gc roots. */
+    template<class W>
+    void walk(W& walk) const
+    {
+        for(auto i = modules_.begin(); i != modules_.end(); ++i)
+        {
+            walk.walk(i->second.forms);
+            walk.walk(i->second.bindings);
+            walk.walk(i->second.result);
+        }
+    }
+
+private:
+    std::unordered_map<std::string, Module> modules_;
+};
+
+void collect_pools_with_roots(MapPool& map_pool, SortedMapPool& sorted_map_pool, VectorPool& vector_pool,
+                              ListPool& list_pool, Map& map, const ConstantTable& constants,
+                              const ImportCache& imports)
 {
     // Mark all cells that can be visited only through root node
     // #1 Set reference counts to zero for all roots.
@@ -395,12 +596,27 @@ void collect_map_and_list_pools_with_roots(MapPool& map_pool, ListPool& list_poo
     // #3 Run garbage collection 
     // Caveats: If the dereferenced cells contain data to which a pointer is stored in 
     // some of the remaining cells, and it is deleted, the pointer is now invalid.
+    // Both previous cycles must be finished first as the deallocation of one pool releases
+    // references to the other.
+    map_pool.wait_for_collection();
+    sorted_map_pool.wait_for_collection();
+    vector_pool.wait_for_collection();
+    list_pool.wait_for_collection();
+
     map_pool.clear_root_refcounts();
+    sorted_map_pool.clear_root_refcounts();
+    vector_pool.clear_root_refcounts();
     list_pool.clear_root_refcounts();
 
-    map_increment_references(map);
+    IncrementReferences increment;
+    HandleWalk<IncrementReferences> walk(increment);
+    walk.walk_map(map);
+    constants.walk(walk);
+    imports.walk(walk);
 
     map_pool.gc();
+    sorted_map_pool.gc();
+    vector_pool.gc();
     list_pool.gc();
 }
 
@@ -408,7 +624,7 @@ void collect_map_and_list_pools_with_roots(MapPool& map_pool, ListPool& list_poo
 class Orb::Env
 {
 public:
-    Env()
+    Env():eval_depth_(0), track_sites_(false)
     {
         env_.reset(new Map(map_pool_.new_map()));
         load_default_env();
@@ -417,23 +633,97 @@ public:
 
     ~Env()
     {
+        map_pool_.wait_for_collection();
+        sorted_map_pool_.wait_for_collection();
+        vector_pool_.wait_for_collection();
+        list_pool_.wait_for_collection();
         map_pool_.kill();
+        sorted_map_pool_.kill();
+        vector_pool_.kill();
         list_pool_.kill();
     }
 
     size_t reserved_size_bytes()
     {
-        return list_pool_.reserved_size_bytes() + map_pool_.reserved_size_bytes();
+        return list_pool_.reserved_size_bytes() + map_pool_.reserved_size_bytes() + vector_pool_.reserved_size_bytes() +
+               sorted_map_pool_.reserved_size_bytes();
     }
 
     size_t live_size_bytes()
     {
-        return list_pool_.live_size_bytes() + map_pool_.live_size_bytes();
+        return list_pool_.live_size_bytes() + map_pool_.live_size_bytes() + vector_pool_.live_size_bytes() +
+               sorted_map_pool_.live_size_bytes();
+    }
+
+    ChunkStats memory_stats()
+    {
+        ChunkStats stats = list_pool_.chunk_stats();
+        stats += map_pool_.chunk_stats();
+        stats += vector_pool_.chunk_stats();
+        stats += sorted_map_pool_.chunk_stats();
+        return stats;
+    }
+
+    /** Bytes of all pool slots reserved so far. Monotonic. */
+    size_t allocated_bytes() const
+    {
+        return list_pool_.allocated_bytes() + map_pool_.allocated_bytes() + vector_pool_.allocated_bytes() +
+               sorted_map_pool_.allocated_bytes();
+    }
+
+    HeapCensus heap_census();
+
+    HeapAudit audit_heap();
+
+    /** Start a collection of each pool with its current root reference counts.*/
+    void gc_counted_roots()
+    {
+        map_pool_.gc();
+        sorted_map_pool_.gc();
+        vector_pool_.gc();
+        list_pool_.gc();
+    }
+
+    void set_allocation_sites(bool enabled)
+    {
+        track_sites_ = enabled;
+        if(enabled) sites_.clear();
+    }
+
+    /** Open an allocation site, the allocations until the matching end_site are attributed to it. */
+    void begin_site(const char* name)
+    {
+        SiteFrame frame = {name, allocated_bytes(), 0};
+        site_stack_.push_back(frame);
+    }
+
+    void end_site()
+    {
+        if(site_stack_.empty()) return;
+        SiteFrame frame = site_stack_.back();
+        site_stack_.pop_back();
+
+        size_t total = allocated_bytes() - frame.start;
+        HeapCensus::SiteUsage& usage = sites_[frame.name];
+        usage.calls++;
+        usage.pool_bytes += total - std::min(total, frame.nested);
+        if(!site_stack_.empty()) site_stack_.back().nested += total;
     }
 
     void gc()
     {
-        collect_map_and_list_pools_with_roots(map_pool_, list_pool_, *env_);
+        collect_pools_with_roots(map_pool_, sorted_map_pool_, vector_pool_, list_pool_, *env_, constants_, imports_);
+    }
+
+    /** Run minor collection on pools whose nursery is full. Call only when no node is
+     *  referred to without a handle, i.e. between top-level evaluations.*/
+    void minor_gc_if_needed()
+    {
+        // Maps first: deallocating keyvalues releases vector and list heads.
+        if(map_pool_.nursery_full())        map_pool_.minor_gc();
+        if(sorted_map_pool_.nursery_full()) sorted_map_pool_.minor_gc();
+        if(vector_pool_.nursery_full())     vector_pool_.minor_gc();
+        if(list_pool_.nursery_full())       list_pool_.minor_gc();
     }
 
     void add_fun(const char* name, PrimitiveFunction f);
@@ -447,9 +737,54 @@ public:
 
     // Locals
     MapPool              map_pool_;
+    SortedMapPool        sorted_map_pool_;
+    VectorPool           vector_pool_;
     ListPool             list_pool_;
     std::unique_ptr<Map> env_;
+    ConstantTable        constants_;
+    ImportCache          imports_;
     std::ostream*        out_;
+    int                  eval_depth_; //> Nesting of eval(Orb&, const Value*), e.g. through import
+
+    // Allocation sites
+    struct SiteFrame
+    {
+        const char* name;
+        size_t      start;  //> allocated_bytes() when the site was opened
+        size_t      nested; //> Bytes allocated by the sites opened within this one
+    };
+
+    bool                                           track_sites_;
+    std::vector<SiteFrame>                         site_stack_;
+    std::map<std::string, HeapCensus::SiteUsage>   sites_;
+    std::unordered_set<std::string>                primitive_names_; //> Node based, Function::name points here
+};
+
+/** Attributes the pool allocations made during its lifetime to the named site, when the
+ *  environment tracks allocation sites. A null name opens no site.*/
+class AllocationSite
+{
+public:
+    AllocationSite(Orb::Env& env, const char* name):env_(env), open_(env.track_sites_ && name)
+    {
+        if(open_) env_.begin_site(name);
+    }
+    ~AllocationSite(){if(open_) env_.end_site();}
+private:
+    Orb::Env& env_;
+    bool      open_;
+};
+
+/** Tracks nesting of top-level evaluations and runs minor collection when the outermost
+ *  evaluation is done. */
+class TopLevelEval
+{
+public:
+    TopLevelEval(Orb::Env& env):env_(env), site_(env, env.eval_depth_ == 0 ? "<eval>" : 0){++env_.eval_depth_;}
+    ~TopLevelEval(){if(--env_.eval_depth_ == 0) env_.minor_gc_if_needed();}
+private:
+    Orb::Env&      env_;
+    AllocationSite site_; //> Allocations outside primitives
 };
 
 
@@ -470,6 +805,14 @@ inline Map* new_map_alloc(Orb& m)
 
 inline MapPool& map_pool(Orb& m){return m.env()->map_pool_;}
 
+inline PVector* new_vector_alloc(Orb& m)
+{
+    return new PVector(m.env()->vector_pool_.new_vector());
+}
+
+template<class I>
+inline PVector new_vector(Orb& m, I begin, I end){return m.env()->vector_pool_.new_vector(begin, end);}
+
 inline Map new_map(Orb& m)
 {
     return m.env()->map_pool_.new_map();
@@ -588,6 +931,38 @@ Value make_value_map(const Map& oldmap)
     return a;
 }
 
+Value make_value_sorted_map(Orb& m)
+{
+    Value a;
+    a.type = SORTED_MAP;
+    a.value.sorted_map = new SortedMap(m.env()->sorted_map_pool_.new_map());
+    return a;
+}
+
+Value make_value_sorted_map(const SortedMap& oldmap)
+{
+    Value a;
+    a.type = SORTED_MAP;
+    a.value.sorted_map = new SortedMap(oldmap);
+    return a;
+}
+
+Value make_value_set(Orb& m)
+{
+    Value a;
+    a.type = SET;
+    a.value.set = new_map_alloc(m);
+    return a;
+}
+
+Value make_value_set(const Map& oldset)
+{
+    Value a;
+    a.type = SET;
+    a.value.set = new Map(oldset);
+    return a;
+}
+
 Value make_value_function(PrimitiveFunction f)
 {
     Value v;
@@ -606,57 +981,45 @@ Value make_value_object(IObject* alloced_object)
     return a;
 }
 
-Value make_value_vector()
+Value make_value_vector(Orb& m)
 {
-    // TODO ?
     Value a;
     a.type = VECTOR;
-    a.value.vector = new Vector;
+    a.value.vector = new_vector_alloc(m);
     return a;
 }
 
-Value make_value_vector(Vector& old, Value& v)
+Value make_value_vector(const PVector& old)
 {
-    // TODO ?
     Value a;
     a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    a.value.vector->push_back(v);
+    a.value.vector = new PVector(old);
     return a;
 }
 
-template<class I>
-Value make_value_vector(Vector& old, I app_begin, I app_end )
+Value make_value_vector(const PVector& old, const Value& v)
 {
-    // TODO ?
     Value a;
     a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    while(app_begin != app_end)
-    {
-        a.value.vector->push_back(*app_begin);
-        ++app_begin;
-    }
+    a.value.vector = new PVector(old.push_back(v));
     return a;
 }
 
-Value make_value_vector(Value& v, Vector& old)
+template<class I>
+Value make_value_vector(const PVector& old, I app_begin, I app_end)
 {
-    // TODO ?
     Value a;
     a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    a.value.vector->push_front(v);
+    a.value.vector = new PVector(old.append(app_begin, app_end));
     return a;
 }
 
 template<class I>
-Value make_value_vector(I begin, I end)
+Value make_value_vector(Orb& m, I begin, I end)
 {
-    // TODO ?
     Value a;
     a.type = VECTOR;
-    a.value.vector = new Vector(begin, end);
+    a.value.vector = new PVector(new_vector(m, begin, end));
     return a;
 }
 
@@ -698,102 +1061,123 @@ enum DelimEnum{
     QUOTE         = 7
 };
 
-typedef std::regex  regex_t;
-typedef std::cmatch cmatch_t;
-
-regex_t g_regfloat("^([-+]?[0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][-+]?[0-9]+)?$");
-regex_t g_regint("^(?:([-+]?[1-9][0-9]*)|(0)|(0[xX][0-9A-Fa-f]+)|0[bB]([01]+))$");
-
 typedef enum ParseResult_t{PARSE_NIL, PARSE_INT, PARSE_FLOAT} ParseResult;
 
-ParseResult parsenum(const char* num, const char* numend, int& intvalue, double& doublevalue)
+static inline bool is_decimal_digit(char c){return c >= '0' && c <= '9';}
+static inline bool is_binary_digit(char c){return c == '0' || c == '1';}
+static inline bool is_hex_digit(char c){return is_decimal_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');}
+
+static inline int digit_value(char c)
 {
-    cmatch_t res; 
-    ParseResult result = PARSE_NIL;
+    if(c <= '9') return c - '0';
+    else if(c <= 'F') return c - 'A' + 10;
+    else return c - 'a' + 10;
+}
 
-    if(std::regex_search(num, numend, res, g_regint))
-    {
-        std::string is = res[0].str();
+/** Return pointer to the first character in [begin, end) not accepted by is_digit_of_base.*/
+template<class F>
+static const char* skip_digits(const char* begin, const char* end, F is_digit_of_base)
+{
+    while(begin != end && is_digit_of_base(*begin)) begin++;
+    return begin;
+}
 
-        if(is[0] == '0')
-        {
-            if(is.size() == 1) intvalue = 0;
-            else if(is[1] == 'x' ||is[1] == 'X') intvalue = strtol(is.c_str(), 0, 16);
-            else if(is[1] == 'b' || is[1] == 'B') intvalue = strtol(res[3].str().c_str(), 0, 2); 
-        }
-        else
-        {
-            intvalue = atoi(is.c_str());
-        }
-        result = PARSE_INT;
-    }
-    else if(std::regex_search(num, numend, res, g_regfloat))
+/** Value of the digits in [begin, end), saturated to the int range.*/
+static int digits_to_int(const char* begin, const char* end, int base, bool negative)
+{
+    const long long limit = negative ? -(long long) std::numeric_limits<int>::min() : std::numeric_limits<int>::max();
+    long long value = 0;
+    for(const char* c = begin; c != end; ++c)
     {
-        std::string sf = res[0].str();
-        doublevalue = atof(sf.c_str());
-        result = PARSE_FLOAT;
+        value = value * base + digit_value(*c);
+        if(value > limit) return negative ? std::numeric_limits<int>::min() : std::numeric_limits<int>::max();
     }
-    return result;
-
+    return int(negative ? -value : value);
 }
 
-/** Return pointer either to the next newline ('\n') or to the end of the given range.
-*/
-const char* to_newline(const char* begin, const char* end)
+/** Convert the float literal in [begin, end) with strtod. Short literals are terminated in a
+ *  stack buffer instead of a string.*/
+static double chars_to_double(const char* begin, const char* end)
 {
-    const char* c = begin;
-    while(c != end && *c != '\n'){c++;}
-    return c;
+    char buffer[64];
+    size_t len = end - begin;
+    if(len < sizeof(buffer))
+    {
+        memcpy(buffer, begin, len);
+        buffer[len] = 0;
+        return strtod(buffer, 0);
+    }
+    return strtod(std::string(begin, end).c_str(), 0);
 }
 
-/** Return pointer to end of string. Returns the pointer to the last
- *  quote in strings delimited with " -characters.
- *
- *  @param begin Pointer to first element after the initial " in the string.
- *  @param end   Pointer to the null termination character for the string.
- *  @return      Pointer to the delimiting " in a string or to the end of the given range.
- */
-static const char* last_quote_of_string(const char* begin, const char* end)
+/** Lex the number literal in [num, numend) in a single pass. Accepted literals:
+ *  int:   [-+]?[1-9][0-9]* | 0 | 0[xX][0-9A-Fa-f]+ | 0[bB][01]+
+ *  float: ([-+]?[0-9]+(\.[0-9]*)? | \.[0-9]+)([eE][-+]?[0-9]+)?
+ *  Ints that do not fit int are saturated. Any other range is rejected with PARSE_NIL.*/
+ParseResult parsenum(const char* num, const char* numend, int& intvalue, double& doublevalue)
 {
-    const char* c = begin;
+    const char* c = num;
+    bool is_signed = c != numend && (*c == '+' || *c == '-');
+    bool negative = is_signed && *c == '-';
+    if(is_signed) c++;
 
-    while(c != end)
+    // Prefixed ints
+    if(!is_signed && numend - c > 1 && c[0] == '0')
     {
-        if(*c == '\\')
-        {
-            c++;
-            if(c == end) return c;
-        }
-        else if(*c == '"') 
+        int base = 0;
+        const char* digits = c + 2;
+        const char* digits_end = digits;
+        if(c[1] == 'x' || c[1] == 'X')      {base = 16; digits_end = skip_digits(digits, numend, is_hex_digit);}
+        else if(c[1] == 'b' || c[1] == 'B') {base = 2;  digits_end = skip_digits(digits, numend, is_binary_digit);}
+
+        if(base)
         {
-            return c;
+            if(digits == digits_end || digits_end != numend) return PARSE_NIL;
+            intvalue = digits_to_int(digits, digits_end, base, false);
+            return PARSE_INT;
         }
+    }
+
+    const char* int_begin = c;
+    const char* int_end = skip_digits(c, numend, is_decimal_digit);
+    c = int_end;
 
+    bool has_fraction = false;
+    bool has_exponent = false;
+
+    if(c != numend && *c == '.')
+    {
+        const char* frac_end = skip_digits(c + 1, numend, is_decimal_digit);
+        // A fraction without the integer part needs digits and may not be signed.
+        if(int_begin == int_end && (is_signed || frac_end == c + 1)) return PARSE_NIL;
+        has_fraction = true;
+        c = frac_end;
+    }
+    else if(int_begin == int_end) return PARSE_NIL;
+
+    if(c != numend && (*c == 'e' || *c == 'E'))
+    {
         c++;
+        if(c != numend && (*c == '+' || *c == '-')) c++;
+        const char* exp_end = skip_digits(c, numend, is_decimal_digit);
+        if(exp_end == c) return PARSE_NIL;
+        has_exponent = true;
+        c = exp_end;
     }
 
-    return c;
-}
+    if(c != numend) return PARSE_NIL;
 
-/** Match the pattern to the beginning of the given range.
- * @param pattern        Pattern to match
- * @param pattern_length Length of pattern (equalent to to strlen).
- * @param begin          Beginning of the range to scan.
- * @param end            End of the range to scan.
- * @return               True if the pattern matched the beginning of the range, otherwise false.
-*/
-static bool match_string(const char* pattern, const size_t pattern_length, const char* begin, const char* end)
-{
-    bool result = false;
-    size_t length = end - begin;
-    if(length >= pattern_length)
+    // Leading zeros and signed zeros are floats.
+    bool is_int = !has_fraction && !has_exponent &&
+                  (*int_begin != '0' || (int_end - int_begin == 1 && !is_signed));
+    if(is_int)
     {
-        size_t i = 0;
-        const char* c = begin;
-        result = true;
-        while(i++ < pattern_length && result){result = *pattern++ == *c++;}
+        intvalue = digits_to_int(int_begin, int_end, 10, negative);
+        return PARSE_INT;
     }
-    return result;
+
+    doublevalue = chars_to_double(num, numend);
+    return PARSE_FLOAT;
 }
 
 /** Look for the character in the given null terminated string. If value found return index of character in string. */
@@ -859,7 +1243,7 @@ struct ScopeError
         else if(result == SCOPE_LEFT_OPEN)
         {
             std::ostringstream os;
-            os << "Scope "  << scope << "at character " << char_on_line << " at line " << line << " not closed.";
+            os << "Scope "  << scope << " at character " << char_on_line << " at line " << line << " not closed.";
             return os.str();
         }
         else if(result == FAULTY_SCOPE_CLOSING)
@@ -873,156 +1257,225 @@ struct ScopeError
     }
 };
 
-/** Verify that given scope delimiters balance out.
- *  The scope start and scope end arrays must be of equal length and contain start and end characters symmetrical
- *  positions such that scope_start[i] and scope_end[i] contain a character pair for a particular scope.
- *  @param scope_start string of scope begin characters.
- *  @param scope_end   string of scope end characters.
- *  @return ScopeError containing the result of the check.
-*/
+static inline bool is_token_end(char c){return is_space(c) || is_delimiter(c) || c == 0;}
 
-static ScopeError check_scope(const char* begin, const char* end, const char* comment, const char* scope_start, const char* scope_end)
+/** Single pass parser of text to values. Parses either a string in memory or an input stream
+ *  read in chunks. The containers are parsed iteratively: the elements of open containers are
+ *  kept on one value stack and a container is built in place from it's range of the stack when
+ *  it closes. Scopes are checked as they close.
+ *
+ *  In data mode vectors, maps and sets are built while parsing instead of read as calls to the
+ *  functions that build them, and code forms are rejected: lists and symbols are data only when
+ *  quoted.
+ *
+ *  a. Unless reading string symbols are broken on ', whitespace, (, ) and ;;
+ *  b. if reading string string is broken only when reading matching quote as on start
+ *     \- will escape the following quote
+ */
+class ValueParser
 {
-    using namespace std;
+public:
 
-    const char* c              = begin;
-    const char* line_start_c   = c;
-    size_t      comment_length = strlen(comment);
-    int         line_number    = 0;
+    typedef const char* charptr;
 
-    std::stack<std::pair<int, std::pair<int, int>>> expected_closing; // Scope index; line number
+    enum Container{LIST, VECTOR, MAP, SET};
 
-    while(c < end)
+    /** Open container. */
+    struct Frame
     {
-        if(*c == '\n') line_start_c = c;
+        Container   container;
+        char        close;
+        char        open;
+        bool        quoted;
+        bool        in_quote; //> The container or one enclosing it is quoted
+        size_t      first;    //> Index of the first element in items_
+        int         line;
+        int         column;
+    };
 
-        if(match_string(comment, comment_length, c, end))
-        {
-            c = to_newline(c, end);
-            line_start_c = c;
-            line_number++;
-        }
+    Orb& orb_;
 
-        int scope_start_index = pos_in_string(*c, scope_start);
-        int scope_end_index = pos_in_string(*c, scope_end);
+    std::istream*     is_;         //> Input stream, 0 if parsing a string
+    size_t            chunk_size_;
+    std::vector<char> buffer_;     //> Characters read from is_
 
-        if(*c == '"')
-        {
-            c = last_quote_of_string(c+1, end);
-        }
-        else if(scope_start_index >= 0)
-        {
-            expected_closing.push(std::make_pair(scope_start_index, std::make_pair(c- line_start_c, line_number)));
-        }
-        else if(scope_end_index >= 0)
-        {
-            if(expected_closing.size() > 0 && expected_closing.top().first == scope_end_index)
-            {
-                expected_closing.pop();
-            }
-            else return ScopeError(ScopeError::FAULTY_SCOPE_CLOSING, *c, c - line_start_c, line_number);
-        }
+    charptr base_;   //> Beginning of the characters in memory
+    charptr keep_;   //> Beginning of the token being read, characters before it may be discarded
+    charptr c_;
+    charptr end_;
 
-        c++;
-    }
+    // Line numbers are counted lazily up to counted_, for error messages.
+    charptr counted_;
+    size_t  discarded_;  //> Number of characters discarded before base_
+    int     line_;
+    size_t  line_begin_;
+
+    std::vector<Frame> frames_;
+    std::vector<Value> items_;
+    bool               quote_;     //> The next value is quoted
+    bool               data_;      //> Data mode
 
-    if(expected_closing.size() > 0)
+    ValueParser(Orb& orb, bool data = false):orb_(orb), is_(0), chunk_size_(0), data_(data)
     {
-        int scp; std::pair<int,int> col_line;
-        std::tie(scp, col_line) = expected_closing.top();
-        return ScopeError(ScopeError::SCOPE_LEFT_OPEN, scope_start[scp] , col_line.first , col_line.second);
+        init(0, 0);
     }
 
-    return ScopeError();
-}
-
-/** Parse string to atom. Use one instance of AtomParser per string/atom pair. */
-class ValueParser
-{
-public:
-
-    Orb& orb_;
+    ValueParser(Orb& orb, std::istream& is, size_t chunk_size, bool data = false):
+        orb_(orb), is_(&is), chunk_size_(chunk_size), data_(data)
+    {
+        if(chunk_size_ == 0) chunk_size_ = 1;
+        init(0, 0);
+    }
 
-    ValueParser(Orb& orb):orb_(orb)
+    void init(const char* start, const char* end)
     {
-        reading_string = false;
+        base_ = keep_ = c_ = counted_ = start;
+        end_ = end;
+        discarded_ = 0;
+        line_ = 0;
+        line_begin_ = 0;
+        quote_ = false;
+        frames_.clear();
+        items_.clear();
+        Frame root = {LIST, 0, 0, false, false, 0, 0, 0};
+        frames_.push_back(root);
     }
 
-    bool reading_string;
+    ConstantTable& constants(){return orb_.env()->constants_;}
 
-    // TODO: Write explanation of the parsing sequence
-    //
-    // a. Unless reading string symbols are broken on ', whitespace, (, ) and ;;
-    // b. if reading string string is broken only when reading matching quote as on start
-    //    \- will escape the following quote
+    ListPool& list_pool(){return orb_.env()->list_pool_;}
 
-    typedef const char* charptr;
+    ////////// Input //////////
 
-    charptr c_;
-    charptr end_;
+    /** Read the next chunk of the stream after end_. Characters from keep_ on are kept, pointers
+     *  into them are moved with the buffer. Return false if no characters were added.*/
+    bool refill()
+    {
+        if(!is_ || !*is_) return false;
 
-    bool is(char ch){return *c_ == ch;}
+        advance_lines(keep_);
 
-    bool at_end(){return c_ >= end_;}
+        size_t kept = end_ - keep_;
+        size_t c_offset = c_ - keep_;
+        size_t counted_offset = counted_ - keep_;
+        discarded_ += keep_ - base_;
 
-    void init(const char* start, const char* end){c_ = start; end_ = end;}
+        if(kept && keep_ != buffer_.data()) memmove(buffer_.data(), keep_, kept);
+        if(buffer_.size() < kept + chunk_size_) buffer_.resize(kept + chunk_size_);
 
-    const char* next(){return c_ + 1;}
+        is_->read(buffer_.data() + kept, chunk_size_);
+        size_t count = size_t(is_->gcount());
 
-    void move_forward(){c_ = c_ + 1;}
+        base_ = keep_ = buffer_.data();
+        c_ = keep_ + c_offset;
+        counted_ = keep_ + counted_offset;
+        end_ = keep_ + kept + count;
 
-    void set(const char* chp){c_ = chp;}
+        return count > 0;
+    }
 
-    void to_newline()
+    /** Ensure there is a character at p, return false at end of input. Moves p with the buffer.*/
+    bool available(charptr& p)
     {
-        while(c_ != end_ && *c_ != '\n'){c_++;}
+        while(p == end_)
+        {
+            size_t offset = p - keep_;
+            bool more = refill();
+            p = keep_ + offset;
+            if(!more) return false;
+        }
+        return true;
     }
 
-    const char* parse_string()
+    void advance_lines(charptr p)
     {
-        return last_quote_of_string(next(),end_);
+        for(; counted_ < p; ++counted_)
+        {
+            if(*counted_ == '\n')
+            {
+                line_++;
+                line_begin_ = discarded_ + (counted_ - base_) + 1;
+            }
+        }
     }
 
-    bool parse_number(Number& out)
+    /** Line and column of p, starting from 1.*/
+    std::pair<int, int> position(charptr p)
     {
-        bool result = false;
-
-        const char* c = c_;
-        bool is_prefix = (*c == '+' || *c == '-');
-        bool next_is_num = (c_ != end_ && (c_ + 1) != end_) && is_digit(c[1]);
+        advance_lines(p);
+        return std::make_pair(line_ + 1, int(discarded_ + (p - base_) - line_begin_) + 1);
+    }
 
-        const char* begin = c_;
-        const char* end = 0;
+    ////////// Tokens //////////
 
-        if(is_digit(*c) || (is_prefix && next_is_num))
+    /** Skip comment from ; to the end of line.*/
+    void skip_comment()
+    {
+        for(;;)
         {
-            int intvalue;
-            double floatvalue;
+            keep_ = c_;
+            while(c_ != end_ && *c_ != '\n') c_++;
+            if(c_ != end_){c_++; return;}
+            if(!available(c_)) return;
+        }
+    }
 
-            end = c_ + 1;
-            while(!is_space(*end) && (! is_delimiter(*end)) && *end) end++;
+    /** Return true if the character after c_ is ch.*/
+    bool next_is(char ch)
+    {
+        keep_ = c_;
+        charptr p = c_ + 1;
+        return available(p) && *p == ch;
+    }
 
-            ParseResult r = parsenum(begin, end, intvalue, floatvalue);
-            result = r != PARSE_NIL;
+    /** Read string from the quote at c_. An unterminated string runs to the end of input.*/
+    Value read_string()
+    {
+        keep_ = c_;
+        charptr p = c_ + 1;
+        bool escaped = false;
 
-            if(r == PARSE_INT) out.set(intvalue);
-            else if(r == PARSE_FLOAT) out.set(floatvalue);
+        while(available(p))
+        {
+            if(escaped) escaped = false;
+            else if(*p == '\\') escaped = true;
+            else if(*p == '"') break;
+            p++;
         }
 
-        if(result) c_ = end - 1;
+        std::string formatted_string = format_string(keep_ + 1, p);
+        c_ = p != end_ ? p + 1 : p;
 
-        return result;
+        if(constants().enabled) return constants().string_value(STRING, formatted_string);
+        return make_value_string(formatted_string);
     }
 
-    bool parse_symbol(const char** begin, const char** end)
+    /** Read number, symbol or the constants nil, true and false from c_.*/
+    Value read_atom(bool quoted)
     {
-        bool result = false;
-        *begin = c_;
-        const char* last = c_ + 1;
-        while(!is_space(*last) && (! is_delimiter(*last)) && *last) last++;
-        *end = last;
-        result = true;
-        return result;
+        keep_ = c_;
+        charptr p = c_ + 1;
+        while(available(p) && !is_token_end(*p)) p++;
+
+        charptr begin = keep_;
+        c_ = p;
+
+        bool is_prefix = (*begin == '+' || *begin == '-');
+        if(is_digit(*begin) || (is_prefix && p - begin > 1 && is_digit(begin[1])))
+        {
+            int intvalue;
+            double floatvalue;
+            ParseResult r = parsenum(begin, p, intvalue, floatvalue);
+            if(r == PARSE_INT) return make_value_number(Number::make(intvalue));
+            else if(r == PARSE_FLOAT) return make_value_number(Number::make(floatvalue));
+        }
+
+        if(match_range(begin, p, "nil")) return Value();
+        else if(match_range(begin, p, "true")) return make_value_boolean(true);
+        else if(match_range(begin, p, "false")) return make_value_boolean(false);
+        else if(data_ && !quoted) throw data_error("symbol " + std::string(begin, p));
+        else if(constants().enabled) return constants().string_value(SYMBOL, std::string(begin, p));
+        else return make_value_symbol(begin, p);
     }
 
     std::string format_string(const char* begin, const char* end)
@@ -1050,241 +1503,237 @@ public:
             }
         }
         result.erase(i, result.end());
-        //*i = '\0';
         return result;
     }
 
-    Value get_value()
+    ////////// Containers //////////
+
+    template<class I>
+    List make_list(I begin, I end){return list_pool().new_list_from_range(std::make_move_iterator(begin), std::make_move_iterator(end));}
+
+    /** Term rewritings that we prefer to do in parsing rather than evaluation stage ("poor mans macro system").
+     *  Return list of the elements in range [begin, end).*/
+    List rewrite_list(std::vector<Value>::iterator begin, std::vector<Value>::iterator end)
     {
-        Number tmp_number;
-        const char* tmp_string_begin;
-        const char* tmp_string_end;
+        bool list_occupied = begin != end;
+        if(list_occupied && begin->is_str("defn"))        return rewrite_defn(begin, end);
+        else if(list_occupied && begin->is_str("."))      return rewrite_member_call(begin, end);
+        else                                              return make_list(begin, end);
+    }
 
-        if(is('"')) //> string
-        {
-            const charptr first = c_ + 1;
-            const charptr last = parse_string();
-            set(last + 1);
-            std::string formatted_string = format_string(first, last);
-            return make_value_string(formatted_string);
-        }
-        else if(is('(')) // Enter list
-        {
-            Value result = make_value_list(orb_);
-            move_forward();
-            recursive_parse(result);
-            return result;
-        }
-        else if(is('[')) // Enter vector
-        {
-            Value result = make_value_list(orb_);
-            move_forward();
-            recursive_parse(result);
-            *result.value.list = result.value.list->add(make_value_symbol("make-vector"));
-            return result;
-        }
-        else if(is('{')) // Enter map
-        {
-            Value result = make_value_list(orb_);
-            move_forward();
-            recursive_parse(result);
-            *result.value.list = result.value.list->add(make_value_symbol("make-map"));
-            return result;
-        }
-        else if(parse_number(tmp_number))
-        {
-            move_forward();
-            return make_value_number(tmp_number);
-        }
-        else if(parse_symbol(&tmp_string_begin, &tmp_string_end))
-        {
-            set(tmp_string_end);
-            if(match_range(tmp_string_begin, tmp_string_end, "nil")) return Value(); 
-            else if(match_range(tmp_string_begin, tmp_string_end, "true")) return make_value_boolean(true);
-            else if(match_range(tmp_string_begin, tmp_string_end, "false")) return make_value_boolean(false);
-            else return make_value_symbol(tmp_string_begin, tmp_string_end);
-        }
-        else
-        {
-            throw EvaluationException("get_value: Orb parse error.");
-            return Value();
-        }
+    List rewrite_defn(std::vector<Value>::iterator begin, std::vector<Value>::iterator end)
+    {
+        // (defn name params body) := (def name (fn params body))
+        if(end - begin < 4) throw EvaluationException("recursive_parse: defn must contain at least 3 params.");
+
+        Value lambda = make_value_list(make_list(begin + 2, end).add(make_value_symbol("fn")));
+        return list_pool().new_list(make_value_symbol("def"), begin[1], lambda);
     }
 
-    void rewrite_defn(std::list<Value>& build_list, List* list_ptr)
+    List rewrite_member_call(std::vector<Value>::iterator begin, std::vector<Value>::iterator end)
     {
-            if(build_list.size() < 4) throw EvaluationException("recursive_parse: defn must contain at least 3 params.");
+        // (. fun obj params) :=  (((fnext obj) fun) (first obj) params)
+        //                                 map       sym
+        //                                    function
+        if(end - begin < 3) throw EvaluationException("recursive_parse: member call must contain at least 3 params.");
 
-            // Decompose build list to parts
-            auto build_iter = build_list.begin(); //build_list := (defn iname ilambda_params)
-            auto iname = build_iter; ++iname;
-            auto ilambda_params = iname; ++ilambda_params;
-            auto iend = build_list.end();
+        // TODO: Add 'verify object' call somewhere in order not to make object
+        // evaluation errors so inscrutable.
 
-            std::list<Value> rewritten_list;
-            rewritten_list.push_back(make_value_symbol("def"));
-            rewritten_list.push_back(*iname);
+        const Value& funname = begin[1];
+        const Value& obj = begin[2];
 
-            // Compose lambda_expressions
-            std::list<Value> lambda_list;
-            lambda_list.push_back(make_value_symbol("fn"));
-            lambda_list.insert(lambda_list.end(), ilambda_params, iend);
+        Value innermap = make_value_list(list_pool().new_list(make_value_symbol("fnext"), obj));
+        Value outermap = make_value_list(list_pool().new_list(innermap, funname));
+        Value symcall = make_value_list(list_pool().new_list(make_value_symbol("first"), obj));
 
-            // Alloc storage for value containing lambda expression
-            rewritten_list.push_back(make_value_list(orb_));
-            List* lambda_list_ptr = value_list(rewritten_list.back());
-            *lambda_list_ptr = new_list(orb_, lambda_list);
+        return make_list(begin + 3, end).add(symcall).add(outermap);
+    }
 
-            *list_ptr = new_list(orb_, rewritten_list);
+    EvaluationException data_error(const std::string& form)
+    {
+        std::pair<int, int> pos = position(keep_);
+        std::ostringstream os;
+        os << "read_data: code form " << form << " at character " << pos.second << " at line " << pos.first
+           << " is not data, quote it.";
+        return EvaluationException(os.str());
     }
 
-    void rewrite_member_call(std::list<Value>& build_list, List* list_ptr)
+    /** Append the value to the open container. Quoted values are read as (quote value), except in data mode.*/
+    void push_value(Value&& v, bool quoted)
     {
-        // (. fun obj params) :=  (((fnext obj) fun) (first obj) params)
-        //                                 map       sym
-        //                                    function
-        if(build_list.size() < 3) throw EvaluationException("recursive_parse: member call must contain at least 3 params.");
+        if(quoted && !data_)
+        {
+            Value quote_sym = make_value_symbol("quote");
+            items_.push_back(make_value_list(list_pool().new_list(quote_sym, constants().enabled ? constants().data_value(v) : v)));
+        }
+        else items_.push_back(std::move(v));
+    }
 
-        // Decompose build list to parts
-        auto build_iter = build_list.begin(); //build_list := (. funname obj params)
-        auto funname = build_iter; ++funname;
-        auto obj = funname; ++obj;
-        auto params = obj; ++params;
-        auto iend = build_list.end();
+    /** Open container at c_. Vectors, sets and maps are read as calls of the functions that build
+     *  them, unless in data mode.*/
+    void open_frame(Container container, char open, char close)
+    {
+        bool in_quote = quote_ || frames_.back().in_quote;
+        if(data_ && container == LIST && !in_quote) throw data_error("list");
 
-        // TODO: Add 'verify object' call somewhere in order not to make object
-        // evaluation errors so inscrutable.
+        std::pair<int, int> pos = position(c_);
+        Frame f = {container, close, open, quote_, in_quote, items_.size(), pos.first, pos.second};
+        frames_.push_back(f);
+        quote_ = false;
+
+        if(!data_)
+        {
+            if(container == VECTOR)   items_.push_back(make_value_symbol("make-vector"));
+            else if(container == MAP) items_.push_back(make_value_symbol("make-map"));
+            else if(container == SET) items_.push_back(make_value_symbol("hash-set"));
+        }
+    }
 
-        // Populate outer list.
-        std::list<Value> rewritten_list;
+    /** Build the data container of the elements in range [begin, end).*/
+    Value make_data(Container container, std::vector<Value>::iterator begin, std::vector<Value>::iterator end)
+    {
+        if(container == VECTOR) return make_value_vector(orb_, std::make_move_iterator(begin), std::make_move_iterator(end));
+        else if(container == LIST) return make_value_list(make_list(begin, end));
 
-        rewritten_list.push_back(make_value_list(orb_));
-        List* outermaplist = value_list(*rewritten_list.rbegin());
-        rewritten_list.push_back(make_value_list(orb_));
-        List* symcalllist = value_list(*rewritten_list.rbegin());
-        rewritten_list.insert(rewritten_list.end(), params, iend);
+        Value result = container == MAP ? make_value_map(orb_) : make_value_set(orb_);
+        Map& map = container == MAP ? *value_map(result) : *value_set(result);
+        MapPool::Transient builder(map);
+        if(container == MAP)
+        {
+            if((end - begin) % 2 != 0) throw EvaluationException("read_data: map must contain key value pairs.");
+            for(; begin != end; begin += 2) builder.add(begin[0], begin[1]);
+        }
+        else
+        {
+            for(; begin != end; ++begin) builder.add(*begin, Value());
+        }
+        map = builder.persistent();
+        return result;
+    }
 
-        // Populate first inner list
-        *outermaplist = outermaplist->add(*funname);
-        Value innermaplist = make_value_list(orb_);
-        List* innermap = value_list(innermaplist);
-        *innermap = innermap->add(*obj);
-        *innermap = innermap->add(make_value_symbol("fnext"));
-        *outermaplist = outermaplist->add(innermaplist);
+    /** Close the innermost container with the character at c_.*/
+    void close_frame()
+    {
+        Frame& f = frames_.back();
+        if(frames_.size() == 1 || f.close != *c_)
+        {
+            std::pair<int, int> pos = position(c_);
+            throw EvaluationException(ScopeError(ScopeError::FAULTY_SCOPE_CLOSING, *c_, pos.second, pos.first).report());
+        }
+        if(quote_) throw EvaluationException("Quote cannot be empty.");
 
-        // Populate second inner list
-        *symcalllist =  symcalllist->add(*obj);
-        *symcalllist =  symcalllist->add(make_value_symbol("first"));
+        auto first = items_.begin() + f.first;
+        Value result = data_ ? make_data(f.container, first, items_.end()) :
+                       make_value_list(f.container == LIST ? rewrite_list(first, items_.end()) : make_list(first, items_.end()));
+        bool quoted = f.quoted;
 
-        *list_ptr = new_list(orb_, rewritten_list);
+        items_.erase(first, items_.end());
+        frames_.pop_back();
+        push_value(std::move(result), quoted);
     }
 
-    void recursive_parse(Value& root)
+    /** Parse until a value is completed at the top level. Return false at the end of input.*/
+    bool parse_form()
     {
-        if(orb::is_not(root.type, LIST))
-            throw EvaluationException("recursive_parse: root type is not LIST.");
+        const size_t top_level_items = items_.size();
 
-        std::list<Value> build_list;
+        for(;;)
+        {
+            keep_ = c_;
+            if(!available(c_)) break;
 
-        bool next_is_quoted = false;;
+            char ch = *c_;
 
-        while(! at_end())
-        {
-            if(is(';'))  //> Comment, go to newline
-            {
-                to_newline();
-                if(c_ != end_) move_forward();
-            }
-            else if(is(')') || is(']') || is('}')) // Exit container - scope was checked before this
+            if(ch == ';') skip_comment();
+            else if(is_space(ch)) c_++;
+            else if(ch == '\'')
             {
-                move_forward();
-                break;
+                quote_ = true;
+                c_++;
             }
-            else if(is_space(*c_))
+            else if(ch == ')' || ch == ']' || ch == '}')
             {
-                move_forward();
-                // Skip whitespace
-                // After this we know that the input is either number or symbol
+                close_frame();
+                c_++;
             }
-            else if(is('\''))
+            else if(ch == '(') {open_frame(LIST, '(', ')'); c_++;}
+            else if(ch == '[') {open_frame(VECTOR, '[', ']'); c_++;}
+            else if(ch == '{') {open_frame(MAP, '{', '}'); c_++;}
+            else if(ch == '#' && next_is('{')) {open_frame(SET, '{', '}'); c_ += 2;}
+            else if(ch == '"')
             {
-                next_is_quoted = true;
-                move_forward();
+                bool quoted = quote_;
+                quote_ = false;
+                push_value(read_string(), quoted);
             }
             else
             {
-                // append to root  
-                // push_to_value(root, get_value());
-                Value v = get_value();
-                if(next_is_quoted)
-                {
-                    Value quote_sym = make_value_symbol("quote");
-                    Value outer = make_value_list(orb_);
-                    *(outer.value.list) = outer.value.list->add(v);
-                    *(outer.value.list) = outer.value.list->add(quote_sym);
-                    append_to_value_stl_list(build_list, outer);
-                    next_is_quoted = false;
-                }
-                else
-                {
-                    append_to_value_stl_list(build_list, v);
-                }
+                bool quoted = quote_;
+                quote_ = false;
+                push_value(read_atom(quoted || frames_.back().in_quote), quoted);
             }
 
-            if(at_end()) break;
+            if(frames_.size() == 1 && items_.size() > top_level_items) return true;
         }
 
-        if(next_is_quoted) // Quoted flag was not used.
+        if(frames_.size() > 1)
         {
-            throw EvaluationException("Quote cannot be empty.");
+            const Frame& f = frames_.back();
+            throw EvaluationException(ScopeError(ScopeError::SCOPE_LEFT_OPEN, f.open, f.column, f.line).report());
         }
+        if(quote_) throw EvaluationException("Quote cannot be empty.");
 
+        return false;
+    }
 
-        List* list_ptr = value_list(root);
+    /** Parse characters in range [begin, end) to list (begin forms). The range is read in place.*/
+    orb_result parse(const char* begin, const char* end)
+    {
+        init(begin, end);
+        ValuePtr root(make_value_list_alloc(orb_), ValueDeleter());
 
-        // Term rewritings that we prefer to do in parsing rather than evaluation stage ("poor mans macro system").
-        bool list_occupied = !build_list.empty();
-        if(list_occupied && build_list.front().is_str("defn"))
-        {
-            rewrite_defn(build_list, list_ptr);
-        }
-        else if(list_occupied && build_list.front().is_str("."))
-        {
-            rewrite_member_call(build_list, list_ptr);
+        try{
+            while(parse_form()){}
+            *value_list(*root) = rewrite_list(items_.begin(), items_.end()).add(make_value_symbol("begin"));
+            items_.clear();
         }
-        else
-        {
-            *list_ptr = new_list(orb_, build_list);
+        catch(EvaluationException& e){
+            return orb_fail(e.get_message());
         }
+
+        return orb_result(root);
     }
 
-    orb_result parse(const char* str)
+    /** Parse the data value of the only top-level form in range [begin, end).*/
+    orb_result parse_data(const char* begin, const char* end)
     {
-        size_t size = strlen(str);
-        init(str, str + size);
-
-        ScopeError scope_result = check_scope(c_, end_, ";", "({[", ")}]");
-
-        if(!scope_result.success())
-        {
-            return orb_fail(scope_result.report());
-        }
-
-        Value* root = make_value_list_alloc(orb_);
+        init(begin, end);
+        return single_form();
+    }
 
+    orb_result single_form()
+    {
         try{
-            recursive_parse(*root);
+            ValuePtr form = next_form();
+            if(!form) return orb_fail("read_data: no value to read.");
+            if(next_form()) return orb_fail("read_data: more than one value to read, enclose the values in a vector.");
+            return orb_result(form);
         }
         catch(EvaluationException& e){
             return orb_fail(e.get_message());
         }
+    }
 
-        List* root_list = value_list(*root);
-        *root_list = root_list->add(make_value_symbol("begin"));
+    /** Parse the next top-level form of the stream. Return empty pointer at the end of input.*/
+    ValuePtr next_form()
+    {
+        if(!parse_form()) return ValuePtr();
 
-        return orb_result(ValuePtr(root, ValueDeleter()));
+        ValuePtr form(new Value(std::move(items_.back())), ValueDeleter());
+        items_.pop_back();
+        return form;
     }
-
 };
 
 ////// Orb ///////
@@ -1307,10 +1756,268 @@ Map& Orb::env_map(){
 
 void Orb::gc(){env_->gc();}
 
+void Orb::set_nursery_size(size_t node_count)
+{
+    env_->map_pool_.set_nursery_size(node_count);
+    env_->sorted_map_pool_.set_nursery_size(node_count);
+    env_->vector_pool_.set_nursery_size(node_count);
+    env_->list_pool_.set_nursery_size(node_count);
+}
+
+//////////// Heap census ////////////
+
+const char* HeapCensus::type_name(Type type)
+{
+    switch(type)
+    {
+        case NIL:           return "NIL";
+        case BOOLEAN:       return "BOOLEAN";
+        case NUMBER:        return "NUMBER";
+        case NUMBER_ARRAY:  return "NUMBER_ARRAY";
+        case STRING:        return "STRING";
+        case SYMBOL:        return "SYMBOL";
+        case VECTOR:        return "VECTOR";
+        case LIST:          return "LIST";
+        case MAP:           return "MAP";
+        case SORTED_MAP:    return "SORTED_MAP";
+        case SET:           return "SET";
+        case OBJECT:        return "OBJECT";
+        case FUNCTION:      return "FUNCTION";
+    }
+    return "";
+}
+
+namespace {
+
+size_t string_heap_bytes(const std::string& str)
+{
+    const char* data = str.data();
+    bool inline_buffer = data >= (const char*) &str && data < (const char*) (&str + 1);
+    return sizeof(std::string) + (inline_buffer ? 0 : str.capacity() + 1);
+}
+
+/** Bytes v owns outside the pools. Objects are opaque and counted as zero bytes.*/
+size_t owned_heap_bytes(const Value& v)
+{
+    switch(v.type)
+    {
+        case STRING:
+        case SYMBOL:       return v.interned ? 0 : string_heap_bytes(*v.value.string);
+        case LIST:         return sizeof(List);
+        case VECTOR:       return sizeof(PVector);
+        case MAP:
+        case SET:          return sizeof(Map);
+        case SORTED_MAP:   return sizeof(SortedMap);
+        case FUNCTION:     return sizeof(Function);
+        case NUMBER_ARRAY: return sizeof(NumberArray) + v.value.number_array->capacity() * sizeof(Number);
+        default:           return 0;
+    }
+}
+
+/** Counts each value slot once, however many handles share the node it is stored in. */
+class CensusWalk
+{
+public:
+    CensusWalk(HeapCensus& census):census_(census){}
+
+    void visit(const Value& v)
+    {
+        if(!seen_.insert(&v).second) return;
+
+        HeapCensus::TypeUsage& usage = census_.types[v.type];
+        usage.values++;
+        usage.heap_bytes += owned_heap_bytes(v);
+
+        if(v.type == MAP)             visit_entries(*value_map(v));
+        else if(v.type == SET)        visit_entries(*value_set(v));
+        else if(v.type == SORTED_MAP) visit_entries(*value_sorted_map(v));
+        else if(v.type == LIST)       visit_elements(*value_list(v));
+        else if(v.type == VECTOR)     visit_elements(*value_vector(v));
+    }
+
+    template<class M>
+    void visit_entries(M& map)
+    {
+        auto e = map.end();
+        for(auto i = map.begin(); i != e; ++i)
+        {
+            visit(i->first);
+            visit(i->second);
+        }
+    }
+
+    template<class S>
+    void visit_elements(S& seq)
+    {
+        auto e = seq.end();
+        for(auto i = seq.begin(); i != e; ++i) visit(*i);
+    }
+
+private:
+    HeapCensus&                      census_;
+    std::unordered_set<const Value*> seen_;
+};
+
+template<class P>
+void add_pool_usage(HeapCensus& census, const char* name, P& pool)
+{
+    HeapCensus::PoolUsage usage;
+    usage.name            = name;
+    usage.chunks          = pool.chunk_stats();
+    usage.allocated_bytes = pool.allocated_bytes();
+    census.pools.push_back(usage);
+}
+
+} // empty namespace
+
+HeapCensus Orb::Env::heap_census()
+{
+    HeapCensus census;
+    add_pool_usage(census, "list", list_pool_);
+    add_pool_usage(census, "map", map_pool_);
+    add_pool_usage(census, "sorted-map", sorted_map_pool_);
+    add_pool_usage(census, "vector", vector_pool_);
+
+    CensusWalk walk(census);
+    walk.visit_entries(*env_);
+
+    census.sites = sites_;
+    return census;
+}
+
+HeapCensus Orb::heap_census(){return env_->heap_census();}
+
+//////////// Heap audit ////////////
+
+namespace {
+
+/** Handle visitor counting the handles to each root, by pool.*/
+struct CountHandles
+{
+    RootRefcounts lists, vectors, maps, sorted_maps;
+
+    void operator()(List& h){h.for_each_root([this](const void* n){lists[n]++;});}
+    void operator()(PVector& h){h.for_each_root([this](const void* n){vectors[n]++;});}
+    void operator()(Map& h){h.for_each_root([this](const void* n){maps[n]++;});}
+    void operator()(SortedMap& h){h.for_each_root([this](const void* n){sorted_maps[n]++;});}
+};
+
+int count_of(const RootRefcounts& counts, const void* node)
+{
+    auto c = counts.find(node);
+    return c != counts.end() ? c->second : 0;
+}
+
+/** Add the roots reachable more often than counted to audit.uncounted. */
+void find_uncounted(HeapAudit& audit, const char* pool, const RootRefcounts& counted, const RootRefcounts& handles)
+{
+    for(auto h = handles.begin(); h != handles.end(); ++h)
+    {
+        int count = count_of(counted, h->first);
+        if(count >= h->second) continue;
+        HeapAudit::Root root = {pool, h->first, count, h->second, 0};
+        audit.uncounted.push_back(root);
+    }
+}
+
+/** Add the roots counted more often than reachable to audit.leaked, with the bytes they reach. */
+template<class P>
+void find_leaked(HeapAudit& audit, const char* pool_name, P& pool, const RootRefcounts& handles)
+{
+    RootRefcounts counted = pool.root_refcounts();
+    for(auto c = counted.begin(); c != counted.end(); ++c)
+    {
+        int count = count_of(handles, c->first);
+        if(c->second <= count) continue;
+        HeapAudit::Root root = {pool_name, c->first, c->second, count, 0};
+        root.bytes = pool.reachable_bytes(std::vector<const void*>(1, c->first));
+        audit.leaked.push_back(root);
+    }
+}
+
+} // empty namespace
+
+HeapAudit Orb::Env::audit_heap()
+{
+    HeapAudit audit;
+
+    CountHandles handles;
+    {
+        HandleWalk<CountHandles> walk(handles);
+        walk.walk_map(*env_);
+        constants_.walk(walk);
+        imports_.walk(walk);
+    }
+
+    find_uncounted(audit, "map", map_pool_.root_refcounts(), handles.maps);
+    find_uncounted(audit, "sorted-map", sorted_map_pool_.root_refcounts(), handles.sorted_maps);
+    find_uncounted(audit, "vector", vector_pool_.root_refcounts(), handles.vectors);
+    find_uncounted(audit, "list", list_pool_.root_refcounts(), handles.lists);
+
+    if(audit.uncounted.empty())
+    {
+        // Collect with the counted roots until the garbage referred to only from garbage is gone,
+        // what is left is pinned by the counts.
+        size_t live = memory_stats().live_bytes;
+        for(int i = 0; i < 16; ++i)
+        {
+            gc_counted_roots();
+            size_t after = memory_stats().live_bytes;
+            if(after == live) break;
+            live = after;
+        }
+
+        find_leaked(audit, "map", map_pool_, handles.maps);
+        find_leaked(audit, "sorted-map", sorted_map_pool_, handles.sorted_maps);
+        find_leaked(audit, "vector", vector_pool_, handles.vectors);
+        find_leaked(audit, "list", list_pool_, handles.lists);
+
+        // Measuring the leaks marked from them only, mark again from all roots.
+        gc_counted_roots();
+    }
+    else
+    {
+        // Collecting with the counted roots would free live nodes, recount them first.
+        gc();
+    }
+
+    audit.mark_mismatches = map_pool_.mark_mismatches() + sorted_map_pool_.mark_mismatches() +
+                            vector_pool_.mark_mismatches() + list_pool_.mark_mismatches();
+    return audit;
+}
+
+HeapAudit Orb::audit_heap(){return env_->audit_heap();}
+
+void Orb::set_allocation_sites(bool enabled){env_->set_allocation_sites(enabled);}
+
 size_t Orb::reserved_size_bytes(){return env_->reserved_size_bytes();}
 
 size_t Orb::live_size_bytes(){return env_->live_size_bytes();}
 
+ChunkStats Orb::memory_stats(){return env_->memory_stats();}
+
+void Orb::set_hash_consing(bool enabled){env_->constants_.enabled = enabled;}
+
+ConstantStats Orb::constant_stats(){return env_->constants_.stats();}
+
+void Orb::set_import_cache(ImportCaching caching)
+{
+    env_->imports_.caching = caching;
+    if(caching == IMPORT_UNCACHED) env_->imports_.clear();
+}
+
+void Orb::set_import_cache_dir(const std::string& dir){env_->imports_.dir = dir;}
+
+ImportStats Orb::import_stats(){return env_->imports_.stats;}
+
+void Orb::set_retained_empty_chunks(size_t count)
+{
+    env_->map_pool_.set_retained_empty_chunks(count);
+    env_->sorted_map_pool_.set_retained_empty_chunks(count);
+    env_->vector_pool_.set_retained_empty_chunks(count);
+    env_->list_pool_.set_retained_empty_chunks(count);
+}
+
 void Orb::set_output(std::ostream* os)
 {
     if(env_) env_->out_ = os;
@@ -1340,9 +2047,11 @@ void Orb::set_args(int argc, char* argv[])
     }
 
     int order = 0;
+    MapPool::Transient args(*map);
     for(auto &f : fixed_args){
-        *map = map->add(make_value_number(order++), make_value_string(f));
+        args.add(make_value_number(order++), make_value_string(f));
     }
+    *map = args.persistent();
 
     env_->def(make_value_symbol("sys/args"), argmap);
 
@@ -1368,10 +2077,46 @@ orb_result orb_fail(const std::string& str){
 }
 
 orb_result string_to_value(Orb& m, const char* str)
+{
+    return string_to_value(m, str, str + strlen(str));
+}
+
+orb_result string_to_value(Orb& m, const char* begin, const char* end)
 {
     ValueParser parser(m);
 
-    return parser.parse(str);
+    return parser.parse(begin, end);
+}
+
+orb_result read_data(Orb& m, const char* str)
+{
+    return read_data(m, str, str + strlen(str));
+}
+
+orb_result read_data(Orb& m, const char* begin, const char* end)
+{
+    ValueParser parser(m, true);
+
+    return parser.parse_data(begin, end);
+}
+
+orb_result read_data(Orb& m, std::istream& is)
+{
+    ValueParser parser(m, is, 64 * 1024, true);
+
+    return parser.single_form();
+}
+
+bool string_to_number(const char* begin, const char* end, Number& out)
+{
+    int intvalue;
+    double floatvalue;
+    ParseResult r = parsenum(begin, end, intvalue, floatvalue);
+
+    if(r == PARSE_INT) out.set(intvalue);
+    else if(r == PARSE_FLOAT) out.set(floatvalue);
+
+    return r != PARSE_NIL;
 }
 
 typedef std::string (*PrefixHelper)(const Value& v);
@@ -1442,9 +2187,37 @@ static void value_to_string_helper(std::ostream& os, const Value& v, PrefixHelpe
             os << "}";
             break;
         }
+        case SORTED_MAP:
+        {
+            SortedMap* map_ptr = v.value.sorted_map;
+            out() << "{";
+            auto mend = map_ptr->end();
+            for(auto m = map_ptr->begin(); m != mend; ++m)
+            {
+                value_to_string_helper(os, m->first, prfx);
+                os << " ";
+                value_to_string_helper(os, m->second, prfx);
+                os << " ";
+            }
+            os << "}";
+            break;
+        }
+        case SET:
+        {
+            Map* set_ptr = v.value.set;
+            out() << "#{";
+            auto send = set_ptr->end();
+            for(auto e = set_ptr->begin(); e != send; ++e)
+            {
+                value_to_string_helper(os, e->first, prfx);
+                os << " ";
+            }
+            os << "}";
+            break;
+        }
         case VECTOR:
         {
-            Vector* vec_ptr = v.value.vector;
+            PVector* vec_ptr = v.value.vector;
             out() << "[";
             for(auto i = vec_ptr->begin(); i != vec_ptr->end(); ++i)
             {
@@ -1516,6 +2289,8 @@ std::string value_type_to_string(const Value& v)
         case VECTOR:        return std::string("VECTOR");
         case LIST:          return std::string("LIST");
         case MAP:           return std::string("MAP");
+        case SORTED_MAP:    return std::string("SORTED_MAP");
+        case SET:           return std::string("SET");
         case OBJECT:        return std::string("OBJECT");
         case NUMBER_ARRAY:  return std::string("NUMBER ARRAY");
         case FUNCTION:           return std::string("FUNCTION");
@@ -1536,7 +2311,7 @@ Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map&
 
 bool is_self_evaluating(const Value& v)
 {
-    return v.type == NUMBER || v.type == STRING || v.type == MAP || v.type == NIL || v.type == BOOLEAN ||
+    return v.type == NUMBER || v.type == STRING || v.type == MAP || v.type == SORTED_MAP || v.type == SET || v.type == NIL || v.type == BOOLEAN ||
         v.type == NUMBER_ARRAY || v.type == VECTOR || v.type == FUNCTION;
 }
 
@@ -1909,6 +2684,8 @@ Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map&
 
     if(is_primitive_procedure(v))
     {
+        const char* name = v.value.function->name;
+        AllocationSite site(*orb.env(), name ? name : "<primitive>");
         return value_function(v)(orb, params, env);
     }
     else if(is_compound_procedure(v))
@@ -1966,9 +2743,38 @@ Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map&
             throw EvaluationException(std::string("apply: Attempting to apply map without key to search for."));
         }
     }
+    else if(v.type == SORTED_MAP)
+    {
+        SortedMap* m = value_sorted_map(v);
+
+        if(params.begin() != params.end())
+        {
+            orb::ConstOption<Value> result = m->try_get_value(*params.begin());
+            if(!result.is_valid()) return Value();
+            return *result;
+        }
+        else
+        {
+            throw EvaluationException(std::string("apply: Attempting to apply sorted map without key to search for."));
+        }
+    }
+    else if(v.type == SET)
+    {
+        Map* s = value_set(v);
+
+        if(params.begin() != params.end())
+        {
+            const Value& key = *params.begin();
+            return s->try_get_value(key).is_valid() ? key : Value();
+        }
+        else
+        {
+            throw EvaluationException(std::string("apply: Attempting to apply set without element to search for."));
+        }
+    }
     else if(v.type == VECTOR)
     {
-        Vector* vec = value_vector(v);
+        PVector* vec = value_vector(v);
         size_t param_size = params.size();
         if(param_size != 1)
         {
@@ -1997,6 +2803,7 @@ Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map&
 orb_result eval(Orb& m, const Value* v)
 {
     ValuePtr result(new Value(), ValueDeleter());
+    TopLevelEval top_level(*m.env());
 
     try
     {
@@ -2013,19 +2820,94 @@ orb_result eval(Orb& m, const Value* v)
         return orb_fail("Unknown error.");
     }
 
-    return orb_result(result);
+    return orb_result(result);
+}
+
+orb_result read_eval(Orb& m, const char* str){
+    return read_eval(m, str, str + strlen(str));
+}
+
+orb_result read_eval(Orb& m, const char* begin, const char* end){
+    orb_result parse_result = string_to_value(m, begin, end);
+    if(parse_result.valid()){
+        return eval(m, parse_result.as_value()->get());
+    }
+    else{
+        return parse_result;
+    }
+}
+
+orb_result read_eval(Orb& m, std::istream& is){
+    FormReader reader(m, is);
+    return read_eval(m, reader);
+}
+
+orb_result read_eval(Orb& m, FormReader& reader){
+    ValuePtr last(new Value(), ValueDeleter());
+
+    while(!reader.done()){
+        orb_result form = reader.next();
+        if(!form.valid()) return form;
+
+        orb_result result = eval(m, form.as_value()->get());
+        if(!result.valid()) return result;
+        last = *result;
+    }
+
+    return orb_result(last);
+}
+
+////// FormReader //////
+
+FormReader::FormReader(Orb& m, std::istream& is, size_t chunk_size, Mode mode):
+    parser_(new ValueParser(m, is, chunk_size, mode == DATA)), done_(false)
+{
+    advance();
+}
+
+FormReader::FormReader(Orb& m, const char* begin, const char* end, Mode mode):
+    parser_(new ValueParser(m, mode == DATA)), done_(false)
+{
+    parser_->init(begin, end);
+    advance();
+}
+
+FormReader::~FormReader()
+{
+    next_.reset();
+    delete parser_;
 }
 
-orb_result read_eval(Orb& m, const char* str){
-    orb_result parse_result = string_to_value(m, str);
-    if(parse_result.valid()){
-        return eval(m, parse_result.as_value()->get());
+/** Read ahead one form, so that done() is known before next() is called.*/
+void FormReader::advance()
+{
+    try{
+        next_ = parser_->next_form();
+        done_ = !next_;
     }
-    else{
-        return parse_result;
+    catch(EvaluationException& e){
+        next_.reset();
+        error_ = e.get_message();
+        done_ = false;
     }
 }
 
+orb_result FormReader::next()
+{
+    if(!error_.empty())
+    {
+        done_ = true;
+        return orb_fail(error_);
+    }
+    if(!next_) return orb_fail("FormReader: end of input.");
+
+    ValuePtr form = next_;
+    advance();
+    return orb_result(form);
+}
+
+bool FormReader::done() const {return done_;}
+
 const Value* get_value(Orb& m, const char* pathstr)
 {
     const Value* result = 0;
@@ -2354,18 +3236,7 @@ namespace {
         }
         else if(v->type == VECTOR)
         {
-            Vector* vec = value_vector(*v);
-
-            if(vec->size() > 0)
-            {
-                auto i = vec->begin();
-                ++i;
-                return make_value_vector(i , vec->end());
-            }
-            else
-            {
-                return make_value_vector();
-            }
+            return make_value_vector(value_vector(*v)->rest());
         }
         return Value();
     }
@@ -2379,8 +3250,7 @@ namespace {
         }
         else if(v->type == VECTOR)
         {
-            Vector* vec = v->value.vector;
-            if(vec->size() > 0) first = &(*vec)[0];
+            first = v->value.vector->first();
         }
         return first;
     }
@@ -2423,11 +3293,8 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = value_vector(*arg_start);
-                auto i = vec->begin();
-                auto e = vec->end();
-                if(i != e) ++i;
-                if(i != e) return *i;
+                const Value* second = value_vector(*arg_start)->get(1);
+                if(second) return *second;
             }
         }
         return Value();
@@ -2444,18 +3311,7 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = value_vector(*arg_start);
-
-                if(vec->size() > 1)
-                {
-                    auto i = vec->begin();
-                    ++i;++i;
-                    return make_value_vector(i , vec->end());
-                }
-                else
-                {
-                    return make_value_vector();
-                }
+                return make_value_vector(value_vector(*arg_start)->rest().rest());
             }
         }
         return Value();
@@ -2473,8 +3329,7 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = arg_start->value.vector;
-                if(vec->size() > 0) first = &(*vec)[0];
+                first = arg_start->value.vector->first();
             }
 
             if(first)
@@ -2555,7 +3410,7 @@ namespace {
 
     OPDEF(op_make_vector, arg_start, arg_end)
 
-        return make_value_vector(arg_start, arg_end);
+        return make_value_vector(m, arg_start, arg_end);
     }
 
     // Printers
@@ -2601,6 +3456,8 @@ namespace {
             if(arg_i->type == VECTOR)     {count = arg_i->value.vector->size();}
             else if(arg_i->type == LIST)  {count = arg_i->value.list->size();}
             else if(arg_i->type == MAP)   {count = arg_i->value.map->size();}
+            else if(arg_i->type == SORTED_MAP) {count = arg_i->value.sorted_map->size();}
+            else if(arg_i->type == SET)   {count = arg_i->value.set->size();}
             else if(arg_i->type == STRING){count = arg_i->value.string->size();}
     } return make_value_number(Number::make(count));}
 
@@ -2618,9 +3475,9 @@ namespace {
             }
             else if(snd->type == VECTOR)
             {
-                Vector* v = value_vector(*snd);
-                
-                return make_value_vector(*fst, *v);
+                // Prepending to a vector copies the elements.
+                PVector* v = value_vector(*snd);
+                return make_value_vector(new_vector(m, fst, fst + 1), v->begin(), v->end());
             }
             else throw EvaluationException("op_cons: value to append to must be LIST or VECTOR (was:" +  value_to_string(*snd) + ")."); 
         }
@@ -2644,7 +3501,7 @@ namespace {
             }
             else if(fst->type == VECTOR)
             {
-                Vector* v = value_vector(*fst);
+                PVector* v = value_vector(*fst);
                 ++arg_i; 
                 return make_value_vector(*v, arg_i, arg_end);
             }
@@ -2658,9 +3515,36 @@ namespace {
     // Add keyvalue pair to map
     OPDEF(op_insert_data, arg_i, arg_end)
         // Signature (add map key value key value key value ...)
+        //           (add set elem elem ...)
+
+        Map* set = value_set(args[0]);
+        if(set)
+        {
+            Value result = make_value_set(*set);
+            MapPool::Transient builder(*value_set(result));
+            for(++arg_i; arg_i != arg_end; ++arg_i) builder.add(*arg_i, Value());
+            *value_set(result) = builder.persistent();
+            return result;
+        }
 
         if(args.size() < 3 && args.size() % 2 == 0) throw EvaluationException("op_insert_data: wrong number of input arguments. Signature is (add map key value key value ...).");
 
+        SortedMap* sorted = value_sorted_map(args[0]);
+        if(sorted)
+        {
+            SortedMap resmap(*sorted);
+            ++arg_i;
+            while(arg_i != arg_end)
+            {
+                auto key = arg_i;
+                ++arg_i;
+                if(arg_i == arg_end) throw EvaluationException("op_insert_data: key without value.");
+                resmap = resmap.add(*key, *arg_i);
+                ++arg_i;
+            }
+            return make_value_sorted_map(resmap);
+        }
+
         Map* map = value_map(args[0]);
 
         if(!map){
@@ -2673,6 +3557,7 @@ namespace {
         ++arg_i;
 
         Map* resmap = value_map(result);
+        MapPool::Transient builder(*resmap);
 
         while(arg_i != arg_end)
         {
@@ -2680,9 +3565,10 @@ namespace {
             ++arg_i;
             auto value = arg_i;
             ++arg_i;
-            *resmap = resmap->add(*key, *value);
+            builder.add(*key, *value);
         }
 
+        *resmap = builder.persistent();
         return result;
     }
 
@@ -2690,6 +3576,23 @@ namespace {
     OPDEF(op_remove_data, arg_i, arg_end) 
                 // Signature (add map key value key value key value ...)
         if(args.size() < 2) throw EvaluationException("op_remove_data: wrong number of input arguments. Signature is (remove map key key...");
+
+        SortedMap* sorted = value_sorted_map(args[0]);
+        if(sorted)
+        {
+            SortedMap resmap(*sorted);
+            for(++arg_i; arg_i != arg_end; ++arg_i) resmap = resmap.remove(*arg_i);
+            return make_value_sorted_map(resmap);
+        }
+
+        Map* set = value_set(args[0]);
+        if(set)
+        {
+            Map resset(*set);
+            for(++arg_i; arg_i != arg_end; ++arg_i) resset = resset.remove(*arg_i);
+            return make_value_set(resset);
+        }
+
         Map* map = value_map(args[0]);
         if(!map){
             std::string first_str = value_to_typed_string(&args[0]);
@@ -2712,21 +3615,199 @@ namespace {
         return result;
     }
 
+    // Merge maps, the keys of later maps replace the keys of earlier ones
+    OPDEF(op_merge_maps, arg_i, arg_end)
+        // Signature (merge map map ...)
+        if(args.size() < 1) throw EvaluationException("op_merge_maps: wrong number of input arguments. Signature is (merge map map ...)");
+
+        Map* map = value_map(*arg_i);
+        if(!map){
+            std::string first_str = value_to_typed_string(&(*arg_i));
+            throw EvaluationException("op_merge_maps: arguments must be maps. You entered:" + first_str);
+        }
+
+        Value result = make_value_map(*map);
+        Map* resmap = value_map(result);
+
+        for(++arg_i; arg_i != arg_end; ++arg_i)
+        {
+            Map* other = value_map(*arg_i);
+            if(!other){
+                std::string arg_str = value_to_typed_string(&(*arg_i));
+                throw EvaluationException("op_merge_maps: arguments must be maps. You entered:" + arg_str);
+            }
+            *resmap = resmap->merge(*other);
+        }
+
+        return result;
+    }
+
+    // Return map of the keys of the second map that are missing or differ in the first
+    OPDEF(op_diff_maps, arg_i, arg_end)
+        // Signature (diff old-map new-map)
+        if(args.size() != 2) throw EvaluationException("op_diff_maps: wrong number of input arguments. Signature is (diff map map)");
+
+        Map* from = value_map(args[0]);
+        Map* to   = value_map(args[1]);
+        if(!from || !to){
+            std::string arg_str = value_to_typed_string(from ? &args[1] : &args[0]);
+            throw EvaluationException("op_diff_maps: arguments must be maps. You entered:" + arg_str);
+        }
+
+        return make_value_map(from->diff(*to));
+    }
+
+    // Sets
+
+    OPDEF(op_make_set, arg_i, arg_end)
+        // Signature (hash-set elem elem ...)
+        Value result = make_value_set(m);
+        MapPool::Transient builder(*value_set(result));
+        for(; arg_i != arg_end; ++arg_i) builder.add(*arg_i, Value());
+        *value_set(result) = builder.persistent();
+        return result;
+    }
+
+    OP_1_DEFN(op_value_is_set, vi)
+        if(vi->type == SET) return make_value_boolean(true);
+    } return make_value_boolean(false);}
+
+    typedef Map (MapPool::*SetAlgebraOp)(const Map&, const Map&);
+
+    /** Fold the set arguments with op, the first set is the left operand of the first op. */
+    Value fold_sets(VecIterator arg_i, VecIterator arg_end, SetAlgebraOp op, MapPool& pool, const char* name)
+    {
+        if(arg_i == arg_end) throw EvaluationException(std::string(name) + ": wrong number of input arguments. Signature is (" + name + " set set ...)");
+
+        Map* first = value_set(*arg_i);
+        if(!first) throw EvaluationException(std::string(name) + ": arguments must be sets. You entered:" + value_to_typed_string(&(*arg_i)));
+
+        Map result(*first);
+        for(++arg_i; arg_i != arg_end; ++arg_i)
+        {
+            Map* other = value_set(*arg_i);
+            if(!other) throw EvaluationException(std::string(name) + ": arguments must be sets. You entered:" + value_to_typed_string(&(*arg_i)));
+            result = (pool.*op)(result, *other);
+        }
+        return make_value_set(result);
+    }
+
+    // Set algebra works on the hash tries node by node: subtrees the sets share are not visited.
+    OPDEF(op_set_union, arg_i, arg_end)
+        return fold_sets(arg_i, arg_end, &MapPool::merge, map_pool(m), "union");
+    }
+
+    OPDEF(op_set_intersection, arg_i, arg_end)
+        return fold_sets(arg_i, arg_end, &MapPool::intersection, map_pool(m), "intersection");
+    }
+
+    OPDEF(op_set_difference, arg_i, arg_end)
+        return fold_sets(arg_i, arg_end, &MapPool::difference, map_pool(m), "difference");
+    }
+
+    // Sorted maps
+
+    OPDEF(op_make_sorted_map, arg_i, arg_end)
+        // Signature (sorted-map key value key value ...)
+        if(args.size() % 2 != 0) throw EvaluationException("op_make_sorted_map: wrong number of input arguments. Signature is (sorted-map key value key value ...)");
+
+        SortedMap map = m.env()->sorted_map_pool_.new_map();
+        for(; arg_i != arg_end; arg_i += 2) map = map.add(*arg_i, *(arg_i + 1));
+        return make_value_sorted_map(map);
+    }
+
+    typedef Value (*PrimitiveFunctionPtr)(Orb& m, Vector& args, Map& env);
+
+    /** Return true if v is the primitive function op. */
+    bool is_primitive(const Value& v, PrimitiveFunctionPtr op)
+    {
+        if(v.type != FUNCTION) return false;
+        const PrimitiveFunctionPtr* f = v.value.function->fun.target<PrimitiveFunctionPtr>();
+        return f && *f == op;
+    }
+
+    /** Return map entry as vector [key value]. */
+    Value sorted_map_entry(Orb& m, const SortedMap::value_type& kv)
+    {
+        Value entry[] = {kv.first, kv.second};
+        return make_value_vector(m, entry, entry + 2);
+    }
+
+    /** Return list of the entries of map in [begin, end). */
+    Value sorted_map_entries(Orb& m, SortedMap::iterator begin, const SortedMap::iterator& end)
+    {
+        std::vector<Value> entries;
+        for(; begin != end; ++begin) entries.push_back(sorted_map_entry(m, *begin));
+        Value result = make_value_list(m);
+        *value_list(result) = new_list(m, entries);
+        return result;
+    }
+
+    OPDEF(op_subseq, arg_i, arg_end)
+        // Signature (subseq sorted-map test key) or (subseq sorted-map start-test start-key end-test end-key)
+        // where the tests are <, <=, > or >=.
+        SortedMap* map = args.size() > 0 ? value_sorted_map(args[0]) : 0;
+        if(!map || (args.size() != 3 && args.size() != 5))
+            throw EvaluationException("op_subseq: Signature is (subseq sorted-map test key) or (subseq sorted-map start-test start-key end-test end-key).");
+
+        SortedMap::iterator begin = map->begin();
+        SortedMap::iterator end = map->end();
+
+        for(size_t i = 1; i < args.size(); i += 2)
+        {
+            const Value& test = args[i];
+            const Value& key = args[i + 1];
+            if(is_primitive(test, op_gt))              begin = map->upper_bound(key);
+            else if(is_primitive(test, op_gt_or_eq))   begin = map->lower_bound(key);
+            else if(is_primitive(test, op_less))       end = map->lower_bound(key);
+            else if(is_primitive(test, op_less_or_eq)) end = map->upper_bound(key);
+            else throw EvaluationException("op_subseq: test must be one of <, <=, > or >=. You entered:" + value_to_string(test));
+        }
+
+        // An empty range if the start is at or past the end.
+        if(begin == map->end() || (end != map->end() && !ValuesAreOrdered::compare(begin->first, end->first)))
+            return make_value_list(m);
+
+        return sorted_map_entries(m, begin, end);
+    }
+
+    OPDEF(op_rseq, arg_i, arg_end)
+        // Signature (rseq sorted-map) or (rseq vector)
+        if(args.size() != 1) throw EvaluationException("op_rseq: wrong number of input arguments. Signature is (rseq sorted-map) or (rseq vector)");
+
+        if(SortedMap* map = value_sorted_map(args[0])) return sorted_map_entries(m, map->rbegin(), map->rend());
+
+        if(PVector* vec = value_vector(args[0]))
+        {
+            std::vector<Value> elements;
+            elements.reserve(vec->size());
+            for(size_t i = vec->size(); i-- > 0;) elements.push_back((*vec)[i]);
+            Value result = make_value_list(m);
+            *value_list(result) = new_list(m, elements);
+            return result;
+        }
+
+        throw EvaluationException("op_rseq: argument must be a sorted map or a vector. You entered:" + value_to_typed_string(&args[0]));
+    }
+
     OPDEF(op_map_keys, arg_i, arg_end)
         if(args.size() != 1) throw EvaluationException("op_map_keys: wrong number of input arguments. Signature is (keys map)");
-        Map* map = value_map(*arg_i);
+        Map* map = arg_i->type == SET ? value_set(*arg_i) : value_map(*arg_i);
         if(!map){
             std::string value_type = value_type_to_string(*arg_i);
             throw EvaluationException("op_map_keys: argument must be a map. Type was:" + value_type  + ".");
         }
 
-        Value result = make_value_list(m);
-        List* lst = value_list(result);
-
+        std::vector<Value> elements;
+        elements.reserve(map->size());
         for(auto &kv : *map){
-            *lst = lst->add(kv.first);
+            elements.push_back(kv.first);
         }
 
+        Value result = make_value_list(m);
+        List* lst = value_list(result);
+        *lst = new_list(m, elements);
+
         return result;
     }
 
@@ -2738,13 +3819,16 @@ namespace {
             throw EvaluationException("op_map_vals: argument must be a map. Type was:" + value_type  + ".");
         }
 
-        Value result = make_value_list(m);
-        List* lst = value_list(result);
-
+        std::vector<Value> elements;
+        elements.reserve(map->size());
         for(auto &kv : *map){
-            *lst = lst->add(kv.second);
+            elements.push_back(kv.second);
         }
 
+        Value result = make_value_list(m);
+        List* lst = value_list(result);
+        *lst = new_list(m, elements);
+
         return result;
     }
 
@@ -2826,7 +3910,7 @@ namespace {
     
     Value do_iter_vector(Orb& m, Vector& args, Map& env){
         IterContext ic(args);
-        Vector* vector = value_vector(ic.collection);
+        PVector* vector = value_vector(ic.collection);
         return extract_apply(vector->begin(), vector->end(), ic, env, m);
     }
     
@@ -2904,7 +3988,7 @@ namespace {
             return result;
         }
         else{
-            return make_value_vector(result_vec.begin(), result_vec.end());
+            return make_value_vector(m, result_vec.begin(), result_vec.end());
         }
 
         return Value();
@@ -2921,6 +4005,7 @@ namespace {
 
         Value result = make_value_map(m);
         Map* resmap = value_map(result);
+        MapPool::Transient builder(*resmap);
 
         while(!done)
         {
@@ -2937,21 +4022,21 @@ namespace {
                 List* lst = value_list(applied);
                 const Value* key = lst->first();
                 const Value* value = lst->second();
-                if(key && value) *resmap = resmap->add(*key, *value);
+                if(key && value) builder.add(*key, *value);
                 else throw EvaluationException("map :: map Result list did not contain two elements."); 
             }
             else if(applied.type == VECTOR)
             {
-                Vector& vec(*value_vector(applied));
+                PVector& vec(*value_vector(applied));
                 size_t size = vec.size();
                 if(size != 2) throw EvaluationException("map :: map Result vector did not contain 2 elements. "); 
-                *resmap = resmap->add(vec[0], vec[1]);
+                builder.add(vec[0], vec[1]);
             }
             else if(applied.type == MAP)
             {
                 Map* map = value_map(applied);
                 for(auto& kv : *map){
-                    *resmap = resmap->add(kv.first, kv.second);
+                    builder.add(kv.first, kv.second);
                 }
             }
             else{
@@ -2962,6 +4047,7 @@ namespace {
             if(begin == end) done = true;
         }
 
+        *resmap = builder.persistent();
         return result;
     }
 
@@ -2973,8 +4059,8 @@ namespace {
     
     Value do_map_vector(Orb& m, Vector& args, Map& env){
         IterContext ic(args);
-        Vector* vector = value_vector(ic.collection);
-        return extract_apply_collect<Vector, Vector::iterator>(vector->begin(), vector->end(), ic, env, m);
+        PVector* vector = value_vector(ic.collection);
+        return extract_apply_collect<PVector, PVector::iterator>(vector->begin(), vector->end(), ic, env, m);
     }
     
     Value do_map_map(Orb& m, Vector& args, Map& env){
@@ -3018,38 +4104,348 @@ namespace {
     }
     // System ops
 
-    OPDEF(op_import_file, arg_i, arg_end)
+    // Binary forms of the import cache directory. A file holds the parsed forms of one source
+    // file: the header, the canonical path of the source and the forms as one value tree.
+    // Values are a type byte followed by the payload, native byte order.
 
-        Value* fst = (arg_i != arg_end) ? &*arg_i : 0;
+    const char     FORMS_MAGIC[4] = {'O', 'R', 'B', 'F'};
+    const uint32_t FORMS_VERSION  = 1;
 
-        if(fst && fst->type == STRING)
+    double seconds_since(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    std::string forms_cache_path(const std::string& dir, const std::string& source)
+    {
+        std::ostringstream name;
+        name << std::hex << hash32(source) << ".orbf";
+        return path_to_platform_string(path_join(dir, name.str()));
+    }
+
+    template<class T>
+    void write_pod(std::string& out, const T& t){out.append((const char*) &t, sizeof(T));}
+
+    void write_bytes(std::string& out, const std::string& str)
+    {
+        write_pod(out, (uint32_t) str.size());
+        out.append(str);
+    }
+
+    /** Append v to out. Return false if v holds values other than parsed code can. */
+    bool write_form(std::string& out, const Value& v)
+    {
+        write_pod(out, (uint8_t) v.type);
+
+        if(v.type == NIL) return true;
+        else if(v.type == BOOLEAN) write_pod(out, (uint8_t) v.value.boolean);
+        else if(v.type == NUMBER)
+        {
+            write_pod(out, (uint8_t) v.value.number.type);
+            if(v.value.number.type == Number::INT) write_pod(out, (int32_t) v.value.number.value.intvalue);
+            else                                   write_pod(out, v.value.number.value.floatvalue);
+        }
+        else if(v.type == STRING || v.type == SYMBOL) write_bytes(out, *v.value.string);
+        else if(v.type == LIST)
+        {
+            const List& list = *v.value.list;
+            write_pod(out, (uint32_t) list.size());
+            for(auto i = list.begin(); i != list.end(); ++i) if(!write_form(out, *i)) return false;
+        }
+        else return false;
+
+        return true;
+    }
+
+    /** Keep the forms of source in the cache directory. Written in full under a temporary name
+     *  first, readers never see a partial file.*/
+    void write_cached_forms(const std::string& dir, const std::string& source, const FileStamp& stamp, const Value& forms)
+    {
+        std::string out(FORMS_MAGIC, FORMS_MAGIC + 4);
+        write_pod(out, FORMS_VERSION);
+        write_pod(out, stamp.size);
+        write_pod(out, stamp.mtime);
+        write_bytes(out, source);
+        if(!write_form(out, forms)) return;
+
+        std::string path = forms_cache_path(dir, source);
+        std::string temp = path + ".tmp";
+        {
+            std::ofstream file(temp.c_str(), std::ios::out | std::ios::binary);
+            if(!file.write(out.data(), out.size())) return;
+        }
+
+        std::remove(path.c_str());
+        if(std::rename(temp.c_str(), path.c_str()) != 0) std::remove(temp.c_str());
+    }
+
+    /** Reads the binary forms of a mapped cache file. Fails on truncated or corrupt input. */
+    class BinaryFormReader
+    {
+    public:
+        BinaryFormReader(Orb& m, const char* begin, const char* end):m_(m), p_(begin), end_(end){}
+
+        template<class T>
+        bool read_pod(T& t)
         {
-            const char* path = value_string(*fst);
+            if((size_t)(end_ - p_) < sizeof(T)) return false;
+            memcpy(&t, p_, sizeof(T));
+            p_ += sizeof(T);
+            return true;
+        }
 
-            std::string contents;
-            bool        success;
-            std::tie(contents, success) = file_to_string(path);
+        bool read_bytes(std::string& str)
+        {
+            uint32_t size;
+            if(!read_pod(size) || (size_t)(end_ - p_) < size) return false;
+            str.assign(p_, p_ + size);
+            p_ += size;
+            return true;
+        }
 
-            if(success){
-                orb_result res = read_eval(m, contents.c_str());
+        bool read_form(Value& v)
+        {
+            uint8_t type;
+            if(!read_pod(type)) return false;
 
-                if(res.valid()){ 
-                    return *(res.as_value()->get());
-                } else {
-                    throw EvaluationException(res.message());
+            if(type == NIL) v = Value();
+            else if(type == BOOLEAN)
+            {
+                uint8_t b;
+                if(!read_pod(b)) return false;
+                v = make_value_boolean(b != 0);
+            }
+            else if(type == NUMBER)
+            {
+                uint8_t number_type;
+                if(!read_pod(number_type)) return false;
+                if(number_type == Number::INT)
+                {
+                    int32_t i;
+                    if(!read_pod(i)) return false;
+                    v = make_value_number((int) i);
+                }
+                else
+                {
+                    double d;
+                    if(!read_pod(d)) return false;
+                    v = make_value_number(d);
                 }
             }
-            else{
-                std::string msg = std::string("op_import_file: Could not read in file:") +
-                                  std::string(path);
-                throw EvaluationException(msg);
+            else if(type == STRING || type == SYMBOL)
+            {
+                std::string str;
+                if(!read_bytes(str)) return false;
+
+                ConstantTable& constants = m_.env()->constants_;
+                if(constants.enabled)    v = constants.string_value((Type) type, str);
+                else if(type == STRING)  v = make_value_string(str);
+                else                     v = make_value_symbol(str.c_str(), str.c_str() + str.size());
+            }
+            else if(type == LIST)
+            {
+                uint32_t count;
+                if(!read_pod(count) || (size_t)(end_ - p_) < count) return false;
+
+                std::vector<Value> elements(count);
+                for(uint32_t i = 0; i < count; ++i) if(!read_form(elements[i])) return false;
+
+                v = make_value_list(m_.env()->list_pool_.new_list_from_range(
+                        std::make_move_iterator(elements.begin()), std::make_move_iterator(elements.end())));
+            }
+            else return false;
+
+            return true;
+        }
+
+        bool at_end() const {return p_ == end_;}
+
+    private:
+        Orb&        m_;
+        const char* p_;
+        const char* end_;
+    };
+
+    /** Read the forms of source kept in the cache directory. Return false if there are none for
+     *  this version of source.*/
+    bool read_cached_forms(Orb& m, const std::string& dir, const std::string& source, const FileStamp& stamp, Value& forms)
+    {
+        MappedFile file(forms_cache_path(dir, source).c_str());
+        if(!file.is_open()) return false;
+
+        BinaryFormReader reader(m, file.data(), file.data() + file.size());
+
+        char        magic[4];
+        uint32_t    version;
+        FileStamp   kept;
+        std::string kept_source;
+
+        return reader.read_pod(magic) && memcmp(magic, FORMS_MAGIC, 4) == 0 &&
+               reader.read_pod(version) && version == FORMS_VERSION &&
+               reader.read_pod(kept.size) && reader.read_pod(kept.mtime) && kept == stamp &&
+               reader.read_bytes(kept_source) && kept_source == source &&
+               reader.read_form(forms) && reader.at_end();
+    }
+
+    /** Read and evaluate the file at path in the environment of m, reusing the cached forms and
+     *  definitions of the file as the import cache allows.*/
+    Value import_file(Orb& m, const char* path)
+    {
+        ImportCache& cache = m.env()->imports_;
+        ++cache.stats.imports;
+
+        std::string source;
+        bool        found;
+        FileStamp   stamp;
+        std::tie(source, found) = canonical_path(path);
+
+        if(!found || !file_stamp(source.c_str(), stamp))
+            throw EvaluationException(std::string("op_import_file: Could not read in file:") + std::string(path));
+
+        ImportCache::Module* module = cache.caching != IMPORT_UNCACHED ? cache.find(source, stamp) : 0;
+
+        if(module && module->evaluated && cache.caching == IMPORT_MODULES)
+        {
+            ++cache.stats.module_hits;
+            Map* bindings = value_map(module->bindings);
+            for(auto i = bindings->begin(); i != bindings->end(); ++i) m.env()->def(i->first, i->second);
+            return module->result;
+        }
+
+        Value forms;
+
+        if(module)
+        {
+            ++cache.stats.form_hits;
+            forms = module->forms;
+        }
+        else
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+
+            if(!cache.dir.empty() && read_cached_forms(m, cache.dir, source, stamp, forms))
+            {
+                ++cache.stats.disk_hits;
+            }
+            else
+            {
+                // The mapped file is parsed in place.
+                MappedFile file(source.c_str());
+                if(!file.is_open())
+                    throw EvaluationException(std::string("op_import_file: Could not read in file:") + std::string(path));
+
+                orb_result res = string_to_value(m, file.data(), file.data() + file.size());
+                if(!res.valid()) throw EvaluationException(res.message());
+
+                ++cache.stats.misses;
+                forms = *res.as_value()->get();
+                if(!cache.dir.empty()) write_cached_forms(cache.dir, source, stamp, forms);
             }
+
+            cache.stats.read_seconds += seconds_since(start);
+            if(cache.caching != IMPORT_UNCACHED) module = &cache.insert(source, stamp, forms);
+        }
+
+        Map before = m.env()->get_env();
+        auto start = std::chrono::high_resolution_clock::now();
+        Value result = eval(forms, m.env()->get_env(), m);
+        cache.stats.eval_seconds += seconds_since(start);
+
+        if(module && cache.caching == IMPORT_MODULES)
+        {
+            module->bindings  = make_value_map(before.diff(m.env()->get_env()));
+            module->result    = result;
+            module->evaluated = true;
         }
+
+        return result;
+    }
+
+    OPDEF(op_import_file, arg_i, arg_end)
+
+        Value* fst = (arg_i != arg_end) ? &*arg_i : 0;
+
+        if(fst && fst->type == STRING) return import_file(m, value_string(*fst));
         else throw EvaluationException("op_import_file: first value must be string"); 
 
         return Value();
     }
 
+    OPDEF(op_read_data, arg_i, arg_end)
+
+        Value* fst = (arg_i != arg_end) ? &*arg_i : 0;
+
+        if(fst && fst->type == STRING)
+        {
+            orb_result res = read_data(m, value_string(*fst));
+
+            if(res.valid()) return *(res.as_value()->get());
+            else throw EvaluationException(res.message());
+        }
+        else throw EvaluationException("op_read_data: first value must be string");
+
+        return Value();
+    }
+
+    /** Value of a count of bytes or items, integer while it fits.*/
+    Value make_value_size(size_t n)
+    {
+        if(n <= size_t(std::numeric_limits<int>::max())) return make_value_number(int(n));
+        return make_value_number(double(n));
+    }
+
+    OPDEF(op_heap_stats, arg_i, arg_end)
+        // Signature (sys/heap-stats)
+        // Returns {"types" {type {"values" n "heap-bytes" n}}
+        //          "pools" {pool {"allocated-bytes" n "live-bytes" n "reserved-bytes" n "chunks" n
+        //                         "empty-chunks" n "occupancy" [n n n n]}}
+        //          "sites" {site {"calls" n "pool-bytes" n}}}
+        HeapCensus census = m.env()->heap_census();
+        MapPool& pool = map_pool(m);
+
+        MapPool::Transient types(pool.new_map());
+        for(size_t t = 0; t < HeapCensus::TYPE_COUNT; ++t)
+        {
+            const HeapCensus::TypeUsage& u = census.types[t];
+            if(u.values == 0) continue;
+            MapPool::Transient usage(pool.new_map());
+            usage.add(make_value_string("values"), make_value_size(u.values));
+            usage.add(make_value_string("heap-bytes"), make_value_size(u.heap_bytes));
+            types.add(make_value_string(HeapCensus::type_name(Type(t))), make_value_map(usage.persistent()));
+        }
+
+        MapPool::Transient pools(pool.new_map());
+        for(auto p = census.pools.begin(); p != census.pools.end(); ++p)
+        {
+            Value occupancy[ChunkStats::OCCUPANCY_BINS];
+            for(size_t i = 0; i < ChunkStats::OCCUPANCY_BINS; ++i) occupancy[i] = make_value_size(p->chunks.occupancy[i]);
+
+            MapPool::Transient usage(pool.new_map());
+            usage.add(make_value_string("allocated-bytes"), make_value_size(p->allocated_bytes));
+            usage.add(make_value_string("live-bytes"), make_value_size(p->chunks.live_bytes));
+            usage.add(make_value_string("reserved-bytes"), make_value_size(p->chunks.chunk_bytes));
+            usage.add(make_value_string("chunks"), make_value_size(p->chunks.chunk_count));
+            usage.add(make_value_string("empty-chunks"), make_value_size(p->chunks.empty_chunk_count));
+            usage.add(make_value_string("occupancy"), make_value_vector(m, occupancy, occupancy + ChunkStats::OCCUPANCY_BINS));
+            pools.add(make_value_string(p->name), make_value_map(usage.persistent()));
+        }
+
+        MapPool::Transient sites(pool.new_map());
+        for(auto s = census.sites.begin(); s != census.sites.end(); ++s)
+        {
+            MapPool::Transient usage(pool.new_map());
+            usage.add(make_value_string("calls"), make_value_size(s->second.calls));
+            usage.add(make_value_string("pool-bytes"), make_value_size(s->second.pool_bytes));
+            sites.add(make_value_string(s->first), make_value_map(usage.persistent()));
+        }
+
+        MapPool::Transient stats(pool.new_map());
+        stats.add(make_value_string("types"), make_value_map(types.persistent()));
+        stats.add(make_value_string("pools"), make_value_map(pools.persistent()));
+        stats.add(make_value_string("sites"), make_value_map(sites.persistent()));
+        return make_value_map(stats.persistent());
+    }
+
     // TODO:while  dot cross str
     // map filter range apply count zip
 
@@ -3057,11 +4453,21 @@ namespace {
 #undef OP_1_DEFN
 }
 
+std::string import_cache_file(const std::string& dir, const char* path)
+{
+    std::string source;
+    bool        found;
+    std::tie(source, found) = canonical_path(path);
+    return found ? forms_cache_path(dir, source) : std::string();
+}
+
 //////////// Load environment ////////////
 
 void Orb::Env::add_fun(const char* name, PrimitiveFunction f)
 {
-    *env_ = env_->add(make_value_symbol(name), make_value_function(f));
+    Value fun = make_value_function(f);
+    fun.value.function->name = primitive_names_.insert(name).first->c_str();
+    *env_ = env_->add(make_value_symbol(name), fun);
 }
 
 void Orb::Env::def(const Value& key, const Value& value)
@@ -3098,6 +4504,7 @@ void Orb::Env::load_default_env()
     add_fun("boolean?", op_value_is_boolean);
     add_fun("symbol?", op_value_is_symbol);
     add_fun("map?", op_value_is_map);
+    add_fun("set?", op_value_is_set);
     add_fun("vector?", op_value_is_vector);
     add_fun("list?", op_value_is_list);
     add_fun("fn?", op_value_is_fn);
@@ -3114,6 +4521,15 @@ void Orb::Env::load_default_env()
 
     add_fun("insert", op_insert_data);
     add_fun("remove", op_remove_data);
+    add_fun("merge", op_merge_maps);
+    add_fun("diff", op_diff_maps);
+    add_fun("hash-set", op_make_set);
+    add_fun("union", op_set_union);
+    add_fun("intersection", op_set_intersection);
+    add_fun("difference", op_set_difference);
+    add_fun("sorted-map", op_make_sorted_map);
+    add_fun("subseq", op_subseq);
+    add_fun("rseq", op_rseq);
     add_fun("keys", op_map_keys);
     add_fun("vals", op_map_vals);
 
@@ -3126,6 +4542,9 @@ void Orb::Env::load_default_env()
     add_fun("read", wrap_function(file_to_string));
     add_fun("write", wrap_function(string_to_file));
     add_fun("import", op_import_file);
+    add_fun("read-data", op_read_data);
+
+    add_fun("sys/heap-stats", op_heap_stats);
 }
 
 void add_fun(Orb& m, const char* name, PrimitiveFunction f) {m.env()->add_fun(name, f);}
@@ -14,13 +14,16 @@
 #include<memory>
 #include<cstdint>
 #include<ostream>
+#include<istream>
 #include<deque>
 #include<functional>
 #include<vector>
+#include<map>
+#include<string>
 
 namespace orb{
 
-enum Type{NIL, BOOLEAN, NUMBER, NUMBER_ARRAY, STRING, SYMBOL, VECTOR, LIST, MAP, OBJECT, FUNCTION};
+enum Type{NIL, BOOLEAN, NUMBER, NUMBER_ARRAY, STRING, SYMBOL, VECTOR, LIST, MAP, SORTED_MAP, SET, OBJECT, FUNCTION};
 
 struct ORB_LIB Number{
     enum Type{INT, FLOAT};
@@ -124,14 +127,31 @@ public:
     static uint32_t hash(const Value& h);
 };
 
+/** Total order of values: by type, then by value for numbers, strings, symbols and booleans.*/
+class ORB_LIB ValuesAreOrdered {
+public:
+    static bool compare(const Value& k1, const Value& k2);
+};
 
+
+// Define ORB_CHAMP_MAP to store maps in the CHAMP encoded pool.
+#ifdef ORB_CHAMP_MAP
+typedef orb::PChampMapPool<Value, Value, ValuesAreEqual, ValueHash> MapPool;
+#else
 typedef orb::PMapPool<Value, Value, ValuesAreEqual, ValueHash> MapPool;
+#endif
 typedef MapPool::Map   Map;
 
+typedef orb::PSortedMapPool<Value, Value, ValuesAreOrdered> SortedMapPool;
+typedef SortedMapPool::Map                                  SortedMap;
+
 typedef orb::PListPool<Value>              ListPool;
 typedef orb::PListPool<Value>::List        List;
 typedef List::iterator VRefIterator;
 
+typedef orb::PVectorPool<Value>            VectorPool;
+typedef orb::PVectorPool<Value>::Vector    PVector;
+
 /**  Object interface */
 
 class IObject{
@@ -148,6 +168,8 @@ class ORB_LIB Value
 {
 public:
     Type type;
+    bool interned; //> String payload belongs to the constant table of the Orb, see Orb::set_hash_consing
+
 
     typedef std::deque<Value> Vector;
 
@@ -157,7 +179,9 @@ public:
         std::string* string; //> Data for string | symbol
         List*        list;
         Map*         map;
-        Vector*      vector;
+        SortedMap*   sorted_map;
+        Map*         set;    //> Set elements are the keys of a map with nil values
+        PVector*     vector;
         Function*    function;
         IObject*     object;
         NumberArray* number_array;
@@ -189,6 +213,89 @@ private:
 
 class Orb;
 
+/** Hash-consing statistics of the literals read by the parser, see Orb::set_hash_consing. */
+struct ConstantStats
+{
+    size_t strings;     //> Distinct string and symbol literals in the table
+    size_t data;        //> Distinct quoted constants in the table
+    size_t hits;        //> Literals read that reused a payload of the table
+    size_t saved_bytes; //> Estimate of the payload bytes that reused literals did not keep alive
+};
+
+/** Reuse of imported files, see Orb::set_import_cache. */
+enum ImportCaching{
+    IMPORT_UNCACHED, //> Read and evaluate the file on each import
+    IMPORT_FORMS,    //> Keep the parsed forms of the file, evaluate them on each import
+    IMPORT_MODULES   //> Keep also the definitions made by the file, rebind them on later imports
+};
+
+/** Counts and timing of the imports of an Orb, see Orb::import_stats. */
+struct ImportStats
+{
+    size_t imports;      //> Calls of import
+    size_t module_hits;  //> Imports that rebound the cached definitions, nothing was evaluated
+    size_t form_hits;    //> Imports that evaluated the cached forms, nothing was parsed
+    size_t disk_hits;    //> Imports whose forms were read from the cache directory
+    size_t misses;       //> Imports that parsed the file
+    double read_seconds; //> Parsing files and reading the cache directory
+    double eval_seconds; //> Evaluating the forms of the files
+};
+
+/** Breakdown of the memory of an Orb by value type, pool and allocation site, see Orb::heap_census. */
+struct ORB_LIB HeapCensus
+{
+    enum{TYPE_COUNT = FUNCTION + 1};
+
+    struct TypeUsage
+    {
+        size_t values;     //> Distinct values of the type reachable from the environment
+        size_t heap_bytes; //> Bytes the values own outside the pools: handles, strings, number arrays, functions
+        TypeUsage():values(0), heap_bytes(0){}
+    };
+
+    struct PoolUsage
+    {
+        std::string name;
+        size_t      allocated_bytes; //> Bytes of all slots reserved since the pool was created
+        ChunkStats  chunks;          //> Live and reserved bytes and chunk occupancy
+    };
+
+    struct SiteUsage
+    {
+        size_t calls;
+        size_t pool_bytes; //> Pool bytes reserved during the calls, less those of nested sites
+        SiteUsage():calls(0), pool_bytes(0){}
+    };
+
+    TypeUsage                        types[TYPE_COUNT]; //> By Type
+    std::vector<PoolUsage>           pools;
+    std::map<std::string, SiteUsage> sites;             //> Empty unless allocation sites are tracked
+
+    /** Name of type as used by the census, e.g. "LIST".*/
+    static const char* type_name(Type type);
+};
+
+/** Reference count audit of the pool roots, see Orb::audit_heap. */
+struct HeapAudit
+{
+    struct Root
+    {
+        std::string pool;
+        const void* node;
+        int         counted;  //> Reference count of the root in the pool
+        int         handles;  //> Handles to the root reachable from the environment
+        size_t      bytes;    //> Bytes reachable from the root, including slots shared with other roots
+    };
+
+    std::vector<Root> leaked;          //> Counted more often than reachable, pins garbage
+    std::vector<Root> uncounted;       //> Reachable more often than counted, a collection could free live nodes
+    size_t            mark_mismatches; //> Slots whose allocation disagreed with reachability after collection
+
+    HeapAudit():mark_mismatches(0){}
+
+    bool ok() const {return leaked.empty() && uncounted.empty() && mark_mismatches == 0;}
+};
+
 typedef Value::Vector Vector;
 typedef Vector::iterator VecIterator;
 typedef std::function<Value(Orb& m, Vector& args, Map& env)> PrimitiveFunction;
@@ -230,12 +337,58 @@ public:
     /** Garbage collect the used data structures.*/
     void gc();
 
+    /** Set the number of young nodes in a pool after which the pool is minor collected at the
+     *  end of a top-level evaluation.*/
+    void set_nursery_size(size_t node_count);
+
     /** Number of bytes used by the state.*/
     size_t reserved_size_bytes();
 
     /** Number of bytes marked used.*/
     size_t live_size_bytes();
 
+    /** Chunk and slab usage of the data structures, including fragmentation. */
+    ChunkStats memory_stats();
+
+    /** Set number of empty chunks each pool keeps for allocation after collection. The rest are
+     *  returned to the OS.*/
+    void set_retained_empty_chunks(size_t count);
+
+    /** Share one payload between equal string and symbol literals and between equal quoted
+     *  constants read after this, equality of shared payloads is decided by identity. Off by
+     *  default. Values with shared string payloads must not outlive the Orb.*/
+    void set_hash_consing(bool enabled);
+
+    /** Sizes of the hash-consing table and the allocations it saved. */
+    ConstantStats constant_stats();
+
+    /** Reuse the imports of a file while its canonical path, size and modification time are
+     *  unchanged. With IMPORT_MODULES the imported files are assumed to depend only on themselves:
+     *  a hit does not repeat the output of the file or read the definitions of the importer again.
+     *  IMPORT_UNCACHED by default.*/
+    void set_import_cache(ImportCaching caching);
+
+    /** Keep the parsed forms of imported files as binary files in the existing directory dir, later
+     *  Orbs read them instead of parsing the files. An empty dir stops using the directory.*/
+    void set_import_cache_dir(const std::string& dir);
+
+    /** Counts and timing of the imports since the Orb was created. */
+    ImportStats import_stats();
+
+    /** Walk the values reachable from the environment and the pools. Finishes ongoing collections.*/
+    HeapCensus heap_census();
+
+    /** Attribute pool allocations to the primitive that made them, reported in HeapCensus::sites.
+     *  Allocations outside primitives, e.g. of special forms and bindings, go to site "<eval>".
+     *  Enabling resets the tally. Off by default.*/
+    void set_allocation_sites(bool enabled);
+
+    /** Cross-check the root reference counts of the pools against the handles reachable from the
+     *  environment, collect the garbage and verify the chunk bitmaps against reachability.
+     *  Uncounted roots are repaired by a full collection. Values held by the host outside the
+     *  environment show as leaked. For debugging, walks the whole heap.*/
+    HeapAudit audit_heap();
+
     /** Set output stream for messages. */
     void set_output(std::ostream* os);
 
@@ -258,12 +411,81 @@ ORB_LIB orb_result orb_fail(const std::string& str);
 /** Parse string to value data structure.*/
 ORB_LIB orb_result string_to_value(Orb& m, const char* str);
 
+/** Parse characters in range [begin, end) to value data structure. The range need not be null
+ *  terminated, e.g. a mapped file, and is read in place.*/
+ORB_LIB orb_result string_to_value(Orb& m, const char* begin, const char* end);
+
+/** Read data: numbers, strings, booleans, nil, vectors, maps and sets, and quoted lists and symbols.
+ *  The containers are built while parsing, nothing is evaluated. Code forms, i.e. unquoted lists
+ *  and symbols, fail. Vectors, maps and sets are built also inside quoted lists. The string
+ *  must contain one value.*/
+ORB_LIB orb_result read_data(Orb& m, const char* str);
+
+/** Read the one data value of the characters in range [begin, end), as read_data of a string.*/
+ORB_LIB orb_result read_data(Orb& m, const char* begin, const char* end);
+
+/** Read the one data value of the stream, as read_data of a string.*/
+ORB_LIB orb_result read_data(Orb& m, std::istream& is);
+
+/** Parse number literal in range [begin, end). Return false if the range is not a number literal.*/
+ORB_LIB bool string_to_number(const char* begin, const char* end, Number& out);
+
 /** Evaluate the datastructure held within the atom in the context of the Orb env. Return result as atom.*/
 ORB_LIB orb_result eval(Orb& m, const Value* v);
 
 /** Parse string and evaluate result */
 ORB_LIB orb_result read_eval(Orb& m, const char* str);
 
+/** Parse characters in range [begin, end) and evaluate result.*/
+ORB_LIB orb_result read_eval(Orb& m, const char* begin, const char* end);
+
+/** Parse and evaluate the top-level forms of the stream one at a time. Return the result of the last form.*/
+ORB_LIB orb_result read_eval(Orb& m, std::istream& is);
+
+class ValueParser;
+
+/** Streaming parser. Reads the top-level forms of a stream one at a time, reading the stream in
+ *  chunks. Memory use is bounded by the chunk size and the largest form. In DATA mode the forms
+ *  are read as by read_data.*/
+class ORB_LIB FormReader
+{
+public:
+
+    enum Mode{CODE, DATA};
+
+    FormReader(Orb& m, std::istream& is, size_t chunk_size = 64 * 1024, Mode mode = CODE);
+
+    /** Read the forms of the characters in range [begin, end) in place, e.g. of a mapped file.*/
+    FormReader(Orb& m, const char* begin, const char* end, Mode mode = CODE);
+    ~FormReader();
+
+    /** Parse the next top-level form. Fails on malformed input and at the end of input, after which
+     *  done() is true.*/
+    orb_result next();
+
+    /** True if there are no more forms to read, or reading failed.*/
+    bool done() const;
+
+private:
+
+    FormReader(const FormReader&);
+    FormReader& operator=(const FormReader&);
+
+    ValueParser* parser_;
+    ValuePtr     next_;
+    std::string  error_;
+    bool         done_;
+
+    void advance();
+};
+
+/** Evaluate the remaining forms of the reader one at a time. Return the result of the last form.*/
+ORB_LIB orb_result read_eval(Orb& m, FormReader& reader);
+
+/** Path of the binary forms of the file at path in the import cache directory dir, see
+ *  Orb::set_import_cache_dir. Empty if there is no file at path.*/
+ORB_LIB std::string import_cache_file(const std::string& dir, const char* path);
+
 /** Parse and evaluate contents of file and return the result as a value data structure. */
 // TODO: orb_result readfile(Orb& m, const char* file_path);
 
@@ -299,9 +521,11 @@ ORB_LIB Type         value_type(const Value* v);
 // TOOD: add shorthand (. fun obj params) :=  (((fnext obj) fun) (first obj) params) = 
 //                           
 
-ORB_LIB Vector*      value_vector(Value& v);
+ORB_LIB PVector*     value_vector(Value& v);
 ORB_LIB NumberArray* value_number_array(Value& v);
 ORB_LIB Map*         value_map(const Value& v);
+ORB_LIB SortedMap*   value_sorted_map(const Value& v);
+ORB_LIB Map*         value_set(const Value& v);
 ORB_LIB IObject*     value_object(const Value& v);
 ORB_LIB Number       value_number(const Value& v);
 ORB_LIB List*        value_list(const Value& v);
@@ -328,13 +552,19 @@ ORB_LIB Value make_value_list(const List& oldlist);
 ORB_LIB Value make_value_map(Orb& m);
 ORB_LIB Value make_value_map(const Map& oldmap);
 
+ORB_LIB Value make_value_sorted_map(Orb& m);
+ORB_LIB Value make_value_sorted_map(const SortedMap& oldmap);
+
+ORB_LIB Value make_value_set(Orb& m);
+ORB_LIB Value make_value_set(const Map& oldset);
+
 ORB_LIB Value make_value_function(PrimitiveFunction f);
 
 ORB_LIB Value make_value_object(IObject* alloced_object);
 
-ORB_LIB Value make_value_vector();
-ORB_LIB Value make_value_vector(Vector& old, Value& v);
-ORB_LIB Value make_value_vector(Value& v, Vector& old);
+ORB_LIB Value make_value_vector(Orb& m);
+ORB_LIB Value make_value_vector(const PVector& old);
+ORB_LIB Value make_value_vector(const PVector& old, const Value& v);
 
 ORB_LIB Value make_value_number_array();
 ORB_LIB Value make_value_boolean(bool b);
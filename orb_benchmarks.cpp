@@ -0,0 +1,634 @@
+/** \file orb_benchmarks.cpp
+\author Mikko Kuitunen (mikko <dot> kuitunen <at> iki <dot> fi)
+MIT licence.
+
+Benchmarks. Not run by default, select with: orb-test benchmark
+*/
+#include "persistent_containers.h"
+#include "orb.h"
+#include <string>
+#include <sstream>
+#include <limits>
+#include <cmath>
+#include <unordered_map>
+#include "unittester.h"
+
+namespace {
+
+/** Evaluate script count times and report time and memory use. */
+void run_script_benchmark(const char* name, const char* script, int count, size_t nursery_size)
+{
+    orb::Orb m;
+    m.set_nursery_size(nursery_size);
+
+    bool valid = true;
+    double ms = ut_time_ms([&]()
+    {
+        for(int i = 0; i < count && valid; ++i)
+        {
+            orb::orb_result r = orb::read_eval(m, script);
+            valid = r.valid();
+        }
+    });
+
+    ut_test_out() << "  " << name << ": " << ms << " ms, live/reserved: " << m.live_size_bytes() << " B / "
+                  << m.reserved_size_bytes() << " B" << (valid ? "" : " (script failed)") << std::endl;
+}
+
+/** Build and drop lists and maps in pools with N element chunks, report time and stats. */
+template<size_t N>
+void run_chunk_capacity_benchmark()
+{
+    using namespace orb;
+
+    typedef PListPool<int, N> ListPool;
+    typedef PMapPool<int, int, AreEqual<int>, MapHash<int>, MapChunkGeometry<N, N, (N < 32 ? 32 : N)>> MapPool;
+
+    ListPool lists;
+    double list_ms = ut_time_ms([&]()
+    {
+        auto kept = lists.new_list(range_to_list(0, 1, 50000));
+        for(int r = 0; r < 20; ++r){auto tmp = lists.new_list(range_to_list(0, 1, 5000));}
+        lists.gc();
+        lists.wait_for_collection();
+    });
+
+    MapPool maps;
+    double map_ms = ut_time_ms([&]()
+    {
+        typename MapPool::Map kept = maps.new_map();
+        for(int i = 0; i < 5000; ++i) kept = kept.add(i, i);
+        for(int r = 0; r < 20; ++r){typename MapPool::Map tmp = kept.add(-r, r);}
+        maps.gc();
+        maps.wait_for_collection();
+    });
+
+    ChunkStats ls = lists.chunk_stats();
+    ChunkStats ms = maps.chunk_stats();
+    ut_test_out() << "  " << N << " slots: list " << list_ms << " ms (" << ls.chunk_count << " chunks, "
+                  << ls.fragmentation() * 100.0 << "% free), map " << map_ms << " ms (" << ms.chunk_count
+                  << " chunks, " << ms.fragmentation() * 100.0 << "% free)" << std::endl;
+}
+
+/** Replace random child arrays by arrays one element longer, as inserting to a map does, and
+ *  collect periodically. Report time and fragmentation of the array storage.*/
+template<class Box>
+void run_child_array_benchmark(const char* name, Box& box)
+{
+    typedef std::pair<void**, size_t> Array;
+
+    Random<int> rand(7);
+    std::vector<Array> live(5000, Array((void**) 0, 0));
+
+    double ms = ut_time_ms([&]()
+    {
+        for(int step = 0; step < 200000; ++step)
+        {
+            Array& a = live[uint32_t(rand.rand()) % live.size()];
+            a.second = a.second < 32 ? a.second + 1 : 1;
+            a.first = box.reserve_consecutive_elements(a.second);
+
+            if(step % 10000 == 9999)
+            {
+                box.lock_for_collection();
+                for(auto l = live.begin(); l != live.end(); ++l)
+                    if(l->first) box.set_marked_if_locked_array(l->first, l->second);
+                box.sweep_locked();
+                box.release_empty_chunks();
+            }
+        }
+    });
+
+    orb::ChunkStats s = box.stats();
+    ut_test_out() << "  " << name << ": " << ms << " ms, " << s.chunk_count << " chunks, live/chunk: "
+                  << s.live_bytes << " B / " << s.chunk_bytes << " B, fragmentation "
+                  << s.fragmentation() * 100.0 << "%" << std::endl;
+}
+
+/** Insert keys to a map of Pool, look them up and iterate the map. Report the time of each.*/
+template<class Pool>
+void run_map_benchmark(const char* name, const std::vector<int>& keys)
+{
+    Pool pool;
+    typename Pool::Map map = pool.new_map();
+
+    double insert_ms = ut_time_ms([&]()
+    {
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            map = map.add(keys[i], int(i));
+            if(i % 20000 == 19999) pool.gc();
+        }
+        pool.wait_for_collection();
+    });
+
+    size_t found = 0;
+    double lookup_ms = ut_time_ms([&]()
+    {
+        for(auto k = keys.begin(); k != keys.end(); ++k) if(map.try_get_value(*k).is_valid()) ++found;
+    });
+
+    int64_t sum = 0;
+    double iterate_ms = ut_time_ms([&]()
+    {
+        for(auto i = map.begin(); i != map.end(); ++i) sum += i->second;
+    });
+
+    pool.gc();
+    orb::ChunkStats s = pool.chunk_stats();
+    ut_test_out() << "  " << name << ": insert " << insert_ms << " ms, lookup " << lookup_ms << " ms, iterate "
+                  << iterate_ms << " ms, " << s.live_bytes << " B live" << (found == keys.size() ? "" : " (lookup failed)")
+                  << std::endl;
+}
+
+/** Build a map of keys, then alternate removing a key and inserting a new one. Report the time
+ *  of the interleaved updates.*/
+template<class Pool>
+void run_insert_remove_benchmark(const char* name, const std::vector<int>& keys, size_t updates)
+{
+    Pool pool;
+    typename Pool::Map map = pool.new_map();
+    std::vector<int> values(keys.size(), 0);
+    map = map.add(keys.begin(), keys.end(), values.begin(), values.end());
+
+    double update_ms = ut_time_ms([&]()
+    {
+        for(size_t i = 0; i < updates; ++i)
+        {
+            map = map.remove(keys[i % keys.size()]).add(-int(i) - 1, int(i));
+            if(i % 20000 == 19999) pool.gc();
+        }
+        pool.wait_for_collection();
+    });
+
+    pool.gc();
+    orb::ChunkStats s = pool.chunk_stats();
+    ut_test_out() << "  " << name << ": " << updates << " remove+insert " << update_ms << " ms, "
+                  << s.live_bytes << " B live" << (map.size() == keys.size() ? "" : " (size mismatch)") << std::endl;
+}
+
+/** Build lists of count elements by prepending and from a container, then traverse and compare
+ *  them. Width is the number of elements per node, width 1 is the layout of a linked list.*/
+template<size_t Width>
+void run_list_layout_benchmark(size_t count)
+{
+    typedef orb::PListPool<int, CHUNK_BUFFER_SIZE, Width> Pool;
+    Pool pool;
+    std::vector<int> elements;
+    for(size_t i = 0; i < count; ++i) elements.push_back(int(i));
+
+    typename Pool::List prepended = pool.new_list();
+    double prepend_ms = ut_time_ms([&](){for(size_t i = 0; i < count; ++i) prepended = prepended.add(int(i));});
+
+    typename Pool::List built = pool.new_list();
+    double build_ms = ut_time_ms([&](){built = pool.new_list(elements);});
+
+    int64_t sum = 0;
+    double traverse_ms = ut_time_ms([&](){for(auto i = built.begin(); i != built.end(); ++i) sum += *i;});
+
+    typename Pool::List copy = pool.new_list(elements);
+    bool equal = false;
+    double compare_ms = ut_time_ms([&](){equal = copy == built;});
+
+    pool.gc();
+    orb::ChunkStats s = pool.chunk_stats();
+    ut_test_out() << "  width " << Width << ": prepend " << prepend_ms << " ms, build " << build_ms
+                  << " ms, traverse " << traverse_ms << " ms, compare " << compare_ms << " ms, "
+                  << s.live_bytes << " B live" << (equal && sum > 0 ? "" : " (mismatch)") << std::endl;
+}
+
+/** Grow a sequence by appending count ranges of 100 elements to it's end, as conj on a list does.*/
+void run_append_benchmark(size_t count)
+{
+    using namespace orb;
+
+    std::list<int> range = range_to_list(0, 1, 100);
+
+    PListPool<int> lists;
+    PListPool<int>::List list = lists.new_list();
+    double list_ms = ut_time_ms([&](){for(size_t i = 0; i < count; ++i) list = list.add_end(range.begin(), range.end());});
+
+    PDequePool<int> deques;
+    PDequePool<int>::Deque deque = deques.new_deque();
+    double push_ms = ut_time_ms([&](){for(size_t i = 0; i < count; ++i) deque = deque.append(range.begin(), range.end());});
+
+    PDequePool<int>::Deque chunk = deques.new_deque(range);
+    PDequePool<int>::Deque joined = deques.new_deque();
+    double concat_ms = ut_time_ms([&](){for(size_t i = 0; i < count; ++i) joined = joined.concat(chunk);});
+
+    ut_test_out() << "  " << count << " appends: list add_end " << list_ms << " ms, deque push_back " << push_ms
+                  << " ms, deque concat " << concat_ms << " ms"
+                  << (list.size() == deque.size() && deque == joined ? "" : " (mismatch)") << std::endl;
+}
+
+/** Build a set of count keys and a version of it with a thousand keys added and removed. Time
+ *  union, intersection and difference of the two with the algebra of the pool, which skips the
+ *  subtrees the sets share, and by emulating them with lookups and adds over whole maps.*/
+template<class Pool>
+void run_set_algebra_benchmark(const char* name, size_t count)
+{
+    Pool pool;
+    std::vector<int> keys;
+    for(size_t i = 0; i < count; ++i) keys.push_back(int(i));
+    std::vector<int> values(count, 0);
+    typename Pool::Map a = pool.new_map().add(keys.begin(), keys.end(), values.begin(), values.end());
+
+    typename Pool::Map b = a;
+    for(int i = 0; i < 1000; ++i) b = b.remove(i * 997).add(-i - 1, 0);
+
+    typename Pool::Map set_union = pool.new_map(), set_common = pool.new_map(), set_only = pool.new_map();
+    double structural_ms = ut_time_ms([&]()
+    {
+        set_union  = a.merge(b);
+        set_common = a.intersection(b);
+        set_only   = a.difference(b);
+    });
+
+    typename Pool::Map map_union = pool.new_map(), map_common = pool.new_map(), map_only = pool.new_map();
+    double emulated_ms = ut_time_ms([&]()
+    {
+        typename Pool::Transient u(a), c(pool.new_map()), d(pool.new_map());
+        for(auto i = b.begin(); i != b.end(); ++i) if(!a.try_get_value(i->first).is_valid()) u.add(i->first, 0);
+        for(auto i = a.begin(); i != a.end(); ++i)
+        {
+            if(b.try_get_value(i->first).is_valid()) c.add(i->first, 0);
+            else                                     d.add(i->first, 0);
+        }
+        map_union  = u.persistent();
+        map_common = c.persistent();
+        map_only   = d.persistent();
+    });
+
+    bool equal = set_union == map_union && set_common == map_common && set_only == map_only;
+    ut_test_out() << "  " << name << ": " << count << " keys, structural " << structural_ms << " ms, map emulation "
+                  << emulated_ms << " ms" << (equal ? "" : " (mismatch)") << std::endl;
+}
+
+/** Make count distinct vectors [i j] and floats, count the hashes shared by several keys and time
+ *  building a map of them and looking each key up.*/
+void run_value_hash_benchmark(size_t count)
+{
+    using namespace orb;
+
+    Orb m;
+    std::vector<Value> keys;
+    for(size_t i = 0; keys.size() < count; ++i)
+    {
+        Value empty = make_value_vector(m);
+        Value first = make_value_vector(*empty.value.vector, make_value_number(int(i % 1000)));
+        keys.push_back(make_value_vector(*first.value.vector, make_value_number(int(i / 1000))));
+        keys.push_back(make_value_number(1.0 + double(i) / 1024.0));
+    }
+
+    std::unordered_map<uint32_t, size_t> hashes;
+    for(auto k = keys.begin(); k != keys.end(); ++k) ++hashes[k->get_hash()];
+    size_t colliding = 0;
+    for(auto h = hashes.begin(); h != hashes.end(); ++h) if(h->second > 1) colliding += h->second;
+
+    MapPool pool;
+    Map map = pool.new_map();
+    std::vector<Value> values(keys.size(), make_value_boolean(true));
+    double insert_ms = ut_time_ms([&](){map = map.add(keys.begin(), keys.end(), values.begin(), values.end());});
+
+    size_t found = 0;
+    double lookup_ms = ut_time_ms([&](){for(auto k = keys.begin(); k != keys.end(); ++k) if(map.try_get_value(*k).is_valid()) ++found;});
+
+    ut_test_out() << "  " << keys.size() << " keys: " << colliding << " keys share a hash ("
+                  << 100.0 * double(colliding) / double(keys.size()) << "%), insert " << insert_ms << " ms, lookup "
+                  << lookup_ms << " ms" << (found == keys.size() ? "" : " (lookup failed)") << std::endl;
+}
+
+/** Hash 64 MB as inputs of len bytes, report throughput and the mean deviation from 1/2 of the
+ *  probability that flipping an input bit flips an output bit. With 1000 samples an ideal hash
+ *  shows a bias of about 0.0126.*/
+template<class Hash>
+void run_string_hash_benchmark(const char* name, size_t len, Hash hash, size_t out_bits)
+{
+    Random<int> rand(21);
+    std::vector<char> data(len * 64);
+    for(auto c = data.begin(); c != data.end(); ++c) *c = char(rand.rand());
+
+    const size_t total = 64 << 20; // bytes
+    size_t count = total / len;
+    uint64_t sink = 0;
+    double ms = ut_time_ms([&]()
+    {
+        for(size_t i = 0; i < count; ++i) sink += hash(&data[(i & 63) * len], len);
+    });
+
+    // Flip up to 512 input bits spread over the input, on fresh random input for each sample.
+    const size_t samples = 1000;
+    const size_t tested  = std::min<size_t>(len * 8, 512);
+    std::vector<size_t> flips(tested * out_bits, 0);
+    for(size_t s = 0; s < samples; ++s)
+    {
+        char* input = &data[0];
+        for(size_t c = 0; c < len; ++c) input[c] = char(rand.rand());
+        uint64_t h = hash(input, len);
+        for(size_t t = 0; t < tested; ++t)
+        {
+            size_t bit = t * len * 8 / tested;
+            input[bit / 8] ^= char(1 << (bit % 8));
+            uint64_t diff = h ^ hash(input, len);
+            input[bit / 8] ^= char(1 << (bit % 8));
+            for(size_t o = 0; o < out_bits; ++o) flips[t * out_bits + o] += (diff >> o) & 1;
+        }
+    }
+    double bias = 0.0;
+    for(auto f = flips.begin(); f != flips.end(); ++f) bias += std::abs(double(*f) / samples - 0.5);
+    bias /= flips.size();
+
+    ut_test_out() << "  " << name << " " << len << " B: " << (total / (1 << 20)) / ms << " GB/s, avalanche bias "
+                  << bias << (sink ? "" : " (zero hashes)") << std::endl;
+}
+
+/** Read count definitions of equal quoted lists and compare them, with or without hash-consing.
+ *  Report the time to read and to compare, the live pool bytes after collection and the table.*/
+void run_hash_consing_benchmark(const char* name, size_t count, bool hash_consing)
+{
+    std::ostringstream defs, compares;
+    for(size_t i = 0; i < count; ++i)
+    {
+        defs << "(def k" << i << " '(\"a literal string longer than a short string buffer\" \"beta\" (1 2 3 4 5 6 7 8)))\n";
+        compares << "(= k0 k" << i << ")\n";
+    }
+    std::string def_script = defs.str(), compare_script = compares.str();
+
+    orb::Orb m;
+    m.set_hash_consing(hash_consing);
+    bool valid = true;
+    double read_ms = ut_time_ms([&](){valid = orb::read_eval(m, def_script.c_str()).valid();});
+    double compare_ms = ut_time_ms([&](){valid = valid && orb::read_eval(m, compare_script.c_str()).valid();});
+
+    m.gc();
+    orb::ConstantStats c = m.constant_stats();
+    ut_test_out() << "  " << name << ": read " << read_ms << " ms, compare " << compare_ms << " ms, "
+                  << m.live_size_bytes() << " B live, " << c.strings << " strings, " << c.data << " constants, "
+                  << c.hits << " hits, " << c.saved_bytes << " B saved" << (valid ? "" : " (script failed)") << std::endl;
+}
+
+/** Lex count number literals one at a time, then parse them as a single vector literal.
+ *  Report the throughput in MB/s of the source text.*/
+void run_number_parsing_benchmark(size_t count)
+{
+    Random<int> rand(23);
+    std::vector<std::string> literals;
+    std::ostringstream doc;
+    doc << "[";
+    for(size_t i = 0; i < count; ++i)
+    {
+        std::ostringstream lit;
+        int r = rand.rand();
+        switch(i % 4)
+        {
+            case 0: lit << r; break;
+            case 1: lit << (r % 100000) << "." << unsigned(r) % 1000; break;
+            case 2: lit << (r % 1000) * 0.001 << "e" << (r % 20); break;
+            default: lit << "0x" << std::hex << unsigned(r) % 0xffff; break;
+        }
+        literals.push_back(lit.str());
+        doc << lit.str() << " ";
+    }
+    doc << "]";
+    std::string text = doc.str();
+    double mb = double(text.size()) / (1 << 20);
+
+    size_t accepted = 0;
+    double lex_ms = ut_time_ms([&]()
+    {
+        orb::Number n;
+        for(auto l = literals.begin(); l != literals.end(); ++l)
+            accepted += orb::string_to_number(l->data(), l->data() + l->size(), n);
+    });
+
+    orb::Orb m;
+    bool valid = true;
+    double parse_ms = ut_time_ms([&](){valid = orb::string_to_value(m, text.c_str()).valid();});
+
+    ut_test_out() << "  " << count << " literals, " << mb << " MB: lex " << mb / (lex_ms * 0.001) << " MB/s, parse "
+                  << mb / (parse_ms * 0.001) << " MB/s" << (accepted == count && valid ? "" : " (parse failed)") << std::endl;
+}
+
+/** Parse a config-like script of count definitions as a string and as a stream of forms.
+ *  Report the throughput in MB/s.*/
+void run_stream_parsing_benchmark(size_t count)
+{
+    std::ostringstream doc;
+    for(size_t i = 0; i < count; ++i)
+    {
+        doc << "(def entry" << i << " {\"name\" \"entry " << i << "\" \"weights\" [" << i << " 0.5 -3 1e3]"
+            << " \"tags\" '(alpha beta) \"nested\" {\"id\" " << i << " \"on\" true}}) ; entry\n";
+    }
+    std::string text = doc.str();
+    double mb = double(text.size()) / (1 << 20);
+
+    orb::Orb m;
+    bool valid = true;
+    double string_ms = ut_time_ms([&](){valid = orb::string_to_value(m, text.c_str()).valid();});
+
+    size_t forms = 0;
+    double stream_ms = ut_time_ms([&]()
+    {
+        std::istringstream is(text);
+        orb::FormReader reader(m, is);
+        while(!reader.done() && reader.next().valid()) forms++;
+    });
+
+    ut_test_out() << "  " << count << " forms, " << mb << " MB: string " << mb / (string_ms * 0.001) << " MB/s, stream "
+                  << mb / (stream_ms * 0.001) << " MB/s" << (valid && forms == count ? "" : " (parse failed)") << std::endl;
+}
+
+/** Read a config of count entries in one map literal as data and by evaluating it. Report the
+ *  throughput in MB/s.*/
+void run_read_data_benchmark(size_t count)
+{
+    std::ostringstream doc;
+    doc << "{";
+    for(size_t i = 0; i < count; ++i)
+    {
+        doc << "\"entry" << i << "\" {\"name\" \"entry " << i << "\" \"weights\" [" << i << " 0.5 -3 1e3]"
+            << " \"tags\" #{\"alpha\" \"beta\"} \"on\" true}\n";
+    }
+    doc << "}";
+    std::string text = doc.str();
+    double mb = double(text.size()) / (1 << 20);
+
+    orb::Orb m;
+    bool valid = true;
+    double data_ms = ut_time_ms([&](){valid = orb::read_data(m, text.c_str()).valid();});
+    double eval_ms = ut_time_ms([&](){valid = valid && orb::read_eval(m, text.c_str()).valid();});
+
+    ut_test_out() << "  " << count << " entries, " << mb << " MB: read_data " << mb / (data_ms * 0.001) << " MB/s, read_eval "
+                  << mb / (eval_ms * 0.001) << " MB/s" << (valid ? "" : " (read failed)") << std::endl;
+}
+
+} // empty namespace
+
+/////////// Nursery ////////////
+
+UTEST(benchmark, nursery_scripts)
+{
+    const char* scripts[][2] = {
+        {"map-cons",   "(def xs (range 200)) (map xs (fn (x) (cons x '(1 2 3))))"},
+        {"map-insert", "(def m (make-map 1 2 3 4)) (map (range 200) (fn (x) (insert m x x)))"},
+        {"def",        "(def a (range 50)) (def b (range 50)) (def c (map a (fn (x) (+ x 1))))"}};
+
+    const int count = 50;
+    const size_t disabled = std::numeric_limits<size_t>::max();
+
+    for(auto& s : scripts)
+    {
+        ut_test_out() << s[0] << std::endl;
+        run_script_benchmark("without nursery", s[1], count, disabled);
+        run_script_benchmark("nursery 8192   ", s[1], count, 8192);
+        run_script_benchmark("nursery 1024   ", s[1], count, 1024);
+    }
+}
+
+UTEST(benchmark, nursery_minor_vs_full_collection)
+{
+    using namespace orb;
+
+    // Keep a long-lived map and produce short-lived maps from it.
+    typedef PMapPool<int, int> IIMapPool;
+
+    IIMapPool pool;
+    IIMapPool::Map base = pool.new_map();
+    for(int i = 0; i < 20000; ++i) base = base.add(i, i);
+    pool.gc();
+    pool.wait_for_collection();
+
+    const int rounds = 50;
+    double minor_ms = ut_time_ms([&]()
+    {
+        for(int r = 0; r < rounds; ++r)
+        {
+            for(int i = 0; i < 200; ++i){IIMapPool::Map tmp = base.add(-i, r);}
+            pool.minor_gc();
+        }
+    });
+
+    double full_ms = ut_time_ms([&]()
+    {
+        for(int r = 0; r < rounds; ++r)
+        {
+            for(int i = 0; i < 200; ++i){IIMapPool::Map tmp = base.add(-i, r);}
+            pool.gc();
+            pool.wait_for_collection();
+        }
+    });
+
+    ut_test_out() << "  minor collection: " << minor_ms / rounds << " ms" << std::endl;
+    ut_test_out() << "  full collection:  " << full_ms / rounds << " ms" << std::endl;
+}
+
+/////////// Literals ////////////
+
+UTEST(benchmark, literal_hash_consing)
+{
+    run_hash_consing_benchmark("copies      ", 5000, false);
+    run_hash_consing_benchmark("hash-consing", 5000, true);
+}
+
+/////////// Chunk capacity ////////////
+
+UTEST(benchmark, chunk_capacity_sweep)
+{
+    run_chunk_capacity_benchmark<32>();
+    run_chunk_capacity_benchmark<64>();
+    run_chunk_capacity_benchmark<256>();
+    run_chunk_capacity_benchmark<1024>();
+}
+
+/////////// Child arrays ////////////
+
+UTEST(benchmark, child_array_size_classes)
+{
+    orb::ChunkBox<void*, 32> consecutive;
+    orb::SizeClassChunkBox<void*, 32, 32> size_classes;
+    run_child_array_benchmark("consecutive slots", consecutive);
+    run_child_array_benchmark("size classes     ", size_classes);
+}
+
+/////////// Map encodings ////////////
+
+UTEST(benchmark, champ_vs_hamt_map)
+{
+    using namespace orb;
+
+    std::vector<int> keys;
+    Random<int> rand(13);
+    for(int i = 0; i < 200000; ++i) keys.push_back(rand.rand());
+
+    run_map_benchmark<PMapPool<int, int>>("PMapPool     ", keys);
+    run_map_benchmark<PChampMapPool<int, int>>("PChampMapPool", keys);
+}
+
+UTEST(benchmark, map_interleaved_insert_remove)
+{
+    using namespace orb;
+
+    std::vector<int> keys;
+    for(int i = 0; i < 1000000; ++i) keys.push_back(i);
+
+    run_insert_remove_benchmark<PMapPool<int, int>>("PMapPool     ", keys, 200000);
+    run_insert_remove_benchmark<PChampMapPool<int, int>>("PChampMapPool", keys, 200000);
+}
+
+UTEST(benchmark, set_algebra)
+{
+    using namespace orb;
+
+    run_set_algebra_benchmark<PMapPool<int, int>>("PMapPool     ", 1000000);
+    run_set_algebra_benchmark<PChampMapPool<int, int>>("PChampMapPool", 1000000);
+}
+
+UTEST(benchmark, value_hash_collisions)
+{
+    run_value_hash_benchmark(20000);
+}
+
+/////////// Hashing ////////////
+
+UTEST(benchmark, string_hash)
+{
+    size_t lengths[] = {8, 24, 64, 256, 4096};
+    for(size_t l = 0; l < 5; ++l)
+    {
+        size_t len = lengths[l];
+        run_string_hash_benchmark("SuperFastHash", len, [](const char* d, size_t n){return hash32_superfast(d, int(n));}, 32);
+        run_string_hash_benchmark("hash32       ", len, [](const char* d, size_t n){return hash32(d, int(n));}, 32);
+        run_string_hash_benchmark("hash64       ", len, [](const char* d, size_t n){return hash64(d, n);}, 64);
+    }
+}
+
+/////////// Lists ////////////
+
+UTEST(benchmark, list_node_width)
+{
+    run_list_layout_benchmark<1>(1000000);
+    run_list_layout_benchmark<8>(1000000);
+    run_list_layout_benchmark<16>(1000000);
+}
+
+UTEST(benchmark, sequence_append)
+{
+    run_append_benchmark(2000);
+}
+
+/////////// Parsing ////////////
+
+UTEST(benchmark, number_parsing)
+{
+    run_number_parsing_benchmark(200000);
+}
+
+UTEST(benchmark, stream_parsing)
+{
+    run_stream_parsing_benchmark(50000);
+}
+
+UTEST(benchmark, read_data_vs_read_eval)
+{
+    run_read_data_benchmark(50000);
+}
@@ -6,6 +6,7 @@
 
 #include "orb.h"
 #include <typeinfo>
+#include <limits>
 namespace orb{
 
 /*
@@ -72,6 +73,13 @@ inline orb::Value to_value<bool>(orb::Orb& m, const bool& val){return orb::make_
 template<>
 inline orb::Value to_value<std::string>(orb::Orb& m, const std::string& str){return orb::make_value_string(str);}
 
+/** Sizes are integers while they fit.*/
+template<>
+inline orb::Value to_value<size_t>(orb::Orb& m, const size_t& val)
+{
+    return val <= size_t(std::numeric_limits<int>::max()) ? orb::make_value_number(int(val)) : orb::make_value_number(double(val));
+}
+
 template<class P0, class P1>
 orb::Value to_value(orb::Orb& m, const std::tuple<P0, P1>& input)
 {
@@ -28,6 +28,26 @@ orb::Value make_InputFile(Orb& m, Vector& args, Map& env){
     return object_data_to_list(fmap, obj, m);
 }
 
+orb::Value make_MappedFile(Orb& m, Vector& args, Map& env){
+    typedef WrappedObject<MappedFile> WrappedMapped;
+
+    VecIterator arg_start = args.begin();
+    VecIterator arg_end = args.end();
+
+    std::string path;
+    ArgWrap(arg_start, arg_end).wrap(&path);
+
+    orb::Value obj = make_value_object(new WrappedMapped(path.c_str()));
+
+    FunMap fmap(m);
+    fmap.add("is_open",            wrap_member(&MappedFile::is_open));
+    fmap.add("close",              wrap_member(&MappedFile::close));
+    fmap.add("size",               wrap_member(&MappedFile::size));
+    fmap.add("contents_to_string", wrap_member(&MappedFile::contents_to_string));
+
+    return object_data_to_list(fmap, obj, m);
+}
+
 void outputfile_functions(orb::FunMap& fmap)
 {
     fmap.add("is_open", wrap_member(&OutputFile::is_open));
@@ -73,6 +93,7 @@ orb::Value make_OutputFileApp(orb::Orb& m, orb::Vector& args, orb::Map& env){
 void load_orb_unsafe_extensions(orb::Orb& m)
 {
     orb::add_fun(m , "InputFile", make_InputFile);
+    orb::add_fun(m , "MappedFile", make_MappedFile);
     orb::add_fun(m , "OutputFile", make_OutputFile);
     orb::add_fun(m , "OutputFileApp", make_OutputFileApp);
 }
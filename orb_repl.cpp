@@ -7,8 +7,11 @@ MIT licence.
 #include "orb.h"
 #include "orb_extensions.h"
 #include<iostream>
+#include<fstream>
 #include<cstring>
 #include <sstream>
+#include <vector>
+#include <chrono>
 
 
 void print_help()
@@ -16,7 +19,18 @@ void print_help()
     std::cout << "Welcome to Orb parser version " << ORB_VERSION << "\n" <<
                  "'help' Show this help.\n" <<
                  "'quit' Exit interpreter.\n" <<
-                 "'memory' Display used memory (live/reserved).\n";
+                 "'memory' Display used memory (live/reserved), fragmentation and heap census.\n" <<
+                 "'sites-on' 'sites-off' Toggle attributing allocations to primitives in 'memory'.\n" <<
+                 "'audit' Check reference counts and chunk bitmaps against reachability, collects garbage.\n" <<
+                 "'imports' Display import cache hits and time spent importing.\n";
+}
+
+void print_usage()
+{
+    std::cout << "Usage: orb [-t] [-m] [-c cache_dir] [file [args]]\n" <<
+                 "  -t  Print startup timing and import cache hits.\n" <<
+                 "  -m  Reuse the definitions of unchanged imported files instead of evaluating them again.\n" <<
+                 "  -c  Keep the parsed forms of imported files in cache_dir.\n";
 }
 
 //TODO: gc
@@ -60,6 +74,69 @@ void print_memory(std::ostream& os, const char* prefix, size_t live, size_t rese
     os << "(live/reserved): " << memory_string(live) << " / " << memory_string(reserved) << std::endl;
 }
 
+void print_fragmentation(std::ostream& os, const orb::ChunkStats& stats)
+{
+    os << "Chunks (empty/total): " << stats.empty_chunk_count << " / " << stats.chunk_count << std::endl;
+    os << "Fragmentation: " << int(stats.fragmentation() * 100.0 + 0.5) << " %" << std::endl;
+    os << "Mapped from OS: " << memory_string(stats.mapped_bytes) << " (discarded "
+       << memory_string(stats.discarded_bytes) << ")" << std::endl;
+}
+
+void print_heap_census(std::ostream& os, const orb::HeapCensus& census)
+{
+    os << "Values by type (count, heap bytes):" << std::endl;
+    for(size_t t = 0; t < orb::HeapCensus::TYPE_COUNT; ++t)
+    {
+        const orb::HeapCensus::TypeUsage& u = census.types[t];
+        if(u.values == 0) continue;
+        os << "  " << orb::HeapCensus::type_name(orb::Type(t)) << ": " << u.values << ", "
+           << memory_string(u.heap_bytes) << std::endl;
+    }
+
+    os << "Pools (live/reserved, allocated, chunk occupancy up to 1/4 1/2 3/4 full):" << std::endl;
+    for(auto p = census.pools.begin(); p != census.pools.end(); ++p)
+    {
+        os << "  " << p->name << ": " << memory_string(p->chunks.live_bytes) << " / "
+           << memory_string(p->chunks.chunk_bytes) << ", " << memory_string(p->allocated_bytes) << ",";
+        for(size_t i = 0; i < orb::ChunkStats::OCCUPANCY_BINS; ++i) os << " " << p->chunks.occupancy[i];
+        os << std::endl;
+    }
+
+    if(census.sites.empty()) return;
+    os << "Allocation sites (calls, pool bytes):" << std::endl;
+    for(auto s = census.sites.begin(); s != census.sites.end(); ++s)
+    {
+        os << "  " << s->first << ": " << s->second.calls << ", " << memory_string(s->second.pool_bytes) << std::endl;
+    }
+}
+
+void print_heap_audit(std::ostream& os, const orb::HeapAudit& audit)
+{
+    auto print_roots = [&os](const char* title, const std::vector<orb::HeapAudit::Root>& roots)
+    {
+        if(roots.empty()) return;
+        os << title << " (pool, counted/reachable, bytes):" << std::endl;
+        for(auto r = roots.begin(); r != roots.end(); ++r)
+        {
+            os << "  " << r->pool << " " << r->node << ": " << r->counted << " / " << r->handles << ", "
+               << memory_string(r->bytes) << std::endl;
+        }
+    };
+
+    print_roots("Leaked roots", audit.leaked);
+    print_roots("Uncounted roots", audit.uncounted);
+    os << "Mark mismatches: " << audit.mark_mismatches << std::endl;
+    os << (audit.ok() ? "Heap is consistent." : "Heap is NOT consistent.") << std::endl;
+}
+
+void print_import_stats(std::ostream& os, const orb::ImportStats& stats)
+{
+    os << "Imports: " << stats.imports << " (module hits " << stats.module_hits << ", form hits "
+       << stats.form_hits << ", disk hits " << stats.disk_hits << ", misses " << stats.misses << ")" << std::endl;
+    os << "Import reading/evaluation: " << stats.read_seconds * 1000.0 << " / " << stats.eval_seconds * 1000.0
+       << " ms" << std::endl;
+}
+
 void repl(orb::Orb& M)
 {
     using namespace orb;
@@ -110,6 +187,24 @@ void repl(orb::Orb& M)
             size_t live_size = M.live_size_bytes();
             size_t reserved_size = M.reserved_size_bytes();
             print_memory(cout, "Memory used ",live_size, reserved_size);
+            print_fragmentation(cout, M.memory_stats());
+            print_heap_census(cout, M.heap_census());
+        }
+        else if(strcmp(line, "audit") == 0)
+        {
+            print_heap_audit(cout, M.audit_heap());
+        }
+        else if(strcmp(line, "imports") == 0)
+        {
+            print_import_stats(cout, M.import_stats());
+        }
+        else if(strcmp(line, "sites-on") == 0)
+        {
+            M.set_allocation_sites(true);
+        }
+        else if(strcmp(line, "sites-off") == 0)
+        {
+            M.set_allocation_sites(false);
         }
         else if(strcmp(line, "gc") == 0)
         {
@@ -155,52 +250,93 @@ void repl(orb::Orb& M)
     }
 }
 
-void eval_file(const char* path, orb::Orb& M)
+void print_result(orb::Orb& M, orb::orb_result& result)
 {
+    if(result.valid()) {
+        printing_response(M, (*result).get());
+    } else {
+        std::cout << "Error:" << result.message() << std::endl;
+    }
+}
 
-    using std::cout;
-    using std::cin;
-    using std::endl;
-
-    std::string str;
-    bool        success;
+void eval_file(const char* path, orb::Orb& M)
+{
+    using namespace orb;
 
-    std::tie(str, success) = file_to_string(path);
+    // Forms are read and evaluated one at a time, in place from the mapped file. Files that can
+    // not be mapped are read as streams.
+    MappedFile mapped(path);
 
-    if(success)
+    if(mapped.is_open())
     {
-        using namespace orb;
+        FormReader reader(M, mapped.data(), mapped.data() + mapped.size());
+        orb_result result = read_eval(M, reader);
+        print_result(M, result);
+        return;
+    }
 
-        orb_result result = string_to_value(M, str.c_str());
+    std::ifstream file(path, std::ios::in | std::ios::binary);
 
-        if(result.valid()) {
-            eval_response(M, (*result).get());
-        } else {
-            std::cout << "Parse error:" << result.message() << std::endl;
-        }
+    if(file)
+    {
+        orb_result result = read_eval(M, file);
+        print_result(M, result);
     }
     else
     {
-        cout << "Could not read file:" << path << endl;
+        std::cout << "Could not read file:" << path << std::endl;
     }
 }
 
 int main(int argc, char* argv[])
 {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto elapsed_ms = [&start](){
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+
+    bool               timing = false;
+    orb::ImportCaching caching = orb::IMPORT_FORMS;
+    const char*        cache_dir = 0;
+
+    // Options precede the file, the script sees the program name, the file and its arguments.
+    int first = 1;
+    for(; first < argc && argv[first][0] == '-'; ++first)
+    {
+        if(strcmp(argv[first], "-t") == 0)                         timing = true;
+        else if(strcmp(argv[first], "-m") == 0)                    caching = orb::IMPORT_MODULES;
+        else if(strcmp(argv[first], "-c") == 0 && first + 1 < argc) cache_dir = argv[++first];
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    std::vector<char*> args(1, argv[0]);
+    args.insert(args.end(), argv + first, argv + argc);
 
     orb::Orb M;
     orb::load_orb_unsafe_extensions(M);
-    M.set_args(argc, argv);
+    M.set_args((int) args.size(), args.data());
+    M.set_import_cache(caching);
+    if(cache_dir) M.set_import_cache_dir(cache_dir);
 
-    if(argc == 1)
+    if(args.size() == 1)
     {
+        if(timing) std::cerr << "Startup: " << elapsed_ms() << " ms" << std::endl;
         repl(M);
     }
     else
     {
-        eval_file(argv[1], M);
+        eval_file(args[1], M);
+
+        if(timing)
+        {
+            std::cerr << "Startup: " << elapsed_ms() << " ms" << std::endl;
+            print_import_stats(std::cerr, M.import_stats());
+        }
     }
 
     return 0;
 }
-
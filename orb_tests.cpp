@@ -5,9 +5,17 @@ MIT licence.
 #include "persistent_containers.h"
 #include "orb.h"
 #include "orb_classwrap.h"
+#include "orb_extensions.h"
+#include "iotools.h"
 #include <string>
 #include <functional>
 #include <cassert>
+#include <regex>
+#include <limits>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
 
 using namespace std::placeholders;
 #include "unittester.h"
@@ -169,6 +177,192 @@ UTEST(orb, simple_evaluations)
 
 }
 
+UTEST(orb, map_merge_diff)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def a (make-map 1 2 3 4)) (def b (insert a 5 6 1 7)) (= (merge a b) b)"), "merge failed");
+    ASSERT_TRUE(is_true("(= (merge a (make-map 8 9) (make-map 8 10)) (insert a 8 10))"), "merge of several maps failed");
+    ASSERT_TRUE(is_true("(= (diff a b) (make-map 5 6 1 7))"), "diff of added keys failed");
+    ASSERT_TRUE(is_true("(= (diff b a) (make-map 1 2))"), "diff of changed keys failed");
+    ASSERT_TRUE(is_true("(!= a b)"), "map inequality failed");
+    ASSERT_TRUE(is_true("(!= a (insert a 9 9))"), "map inequality with a subset failed");
+}
+
+UTEST(orb, vector_operations)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def v (conj [1 2 3] 4 5)) (= (count v) 5)"), "conj failed");
+    ASSERT_TRUE(is_true("(= (v 4) 5)"), "vector index failed");
+    ASSERT_TRUE(is_true("(= (next v) [2 3 4 5])"), "next failed");
+    ASSERT_TRUE(is_true("(= (nnext v) [3 4 5])"), "nnext failed");
+    ASSERT_TRUE(is_true("(= (cons 0 v) [0 1 2 3 4 5])"), "cons failed");
+    ASSERT_TRUE(is_true("(= (fnext v) 2)"), "fnext failed");
+    m.gc();
+    ASSERT_TRUE(is_true("(= v [1 2 3 4 5])"), "vector changed by collection");
+}
+
+UTEST(orb, sorted_map)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def s (sorted-map 5 \"e\" 1 \"a\" 3 \"c\" 4 \"d\")) (= (count s) 4)"), "sorted-map failed");
+    ASSERT_TRUE(is_true("(= (s 3) \"c\")"), "sorted map lookup failed");
+    ASSERT_TRUE(is_true("(= (count (subseq s >= 3)) 3)"), "subseq failed");
+    ASSERT_TRUE(is_true("(= (first (subseq s >= 3)) [3 \"c\"])"), "subseq start failed");
+    ASSERT_TRUE(is_true("(= (count (subseq s > 1 < 5)) 2)"), "bounded subseq failed");
+    ASSERT_TRUE(is_true("(= (fnext (subseq s > 1 < 5)) [4 \"d\"])"), "bounded subseq end failed");
+    ASSERT_TRUE(is_true("(= (count (subseq s > 5)) 0)"), "empty subseq failed");
+    ASSERT_TRUE(is_true("(= (count (rseq (insert s 2 \"b\"))) 5)"), "rseq failed");
+    ASSERT_TRUE(is_true("(= (first (rseq s)) [5 \"e\"])"), "rseq order failed");
+    m.gc();
+    ASSERT_TRUE(is_true("(= (remove s 1 5) (sorted-map 3 \"c\" 4 \"d\"))"), "remove failed");
+}
+
+UTEST(orb, hash_set)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def s #{1 2 3 \"a\"}) (= (count s) 4)"), "set literal failed");
+    ASSERT_TRUE(is_true("(set? s)"), "set? failed");
+    ASSERT_TRUE(is_true("(= (s 2) 2)"), "set membership failed");
+    ASSERT_TRUE(is_true("(= (s 5) nil)"), "set non-membership failed");
+    ASSERT_TRUE(is_true("(= (insert s 4 1) #{1 2 3 4 \"a\"})"), "set insert failed");
+    ASSERT_TRUE(is_true("(= (remove s \"a\" 9) (hash-set 3 2 1))"), "set remove failed");
+    ASSERT_TRUE(is_true("(= (union s #{4} #{5 1}) #{1 2 3 4 5 \"a\"})"), "union failed");
+    ASSERT_TRUE(is_true("(= (intersection s #{2 3 4}) #{2 3})"), "intersection failed");
+    ASSERT_TRUE(is_true("(= (difference s #{2 3 4}) #{1 \"a\"})"), "difference failed");
+    ASSERT_TRUE(is_true("(= (difference (insert s 7) s) #{7})"), "difference of shared set failed");
+    m.gc();
+    ASSERT_TRUE(is_true("(= (count (keys s)) 4)"), "set changed by collection");
+}
+
+UTEST(orb, value_hash)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto hash_of = [&m](const char* str)
+    {
+        orb_result r = read_eval(m, str);
+        return r.valid() ? (*r.as_value())->get_hash() : 0;
+    };
+
+    ASSERT_TRUE(hash_of("[1 2 3]") != 0 && hash_of("(quote (1 2 3))") != 0, "sequence hash is zero");
+    ASSERT_TRUE(hash_of("[1 2 3]") != hash_of("[3 2 1]"), "sequence hash does not depend on order");
+    ASSERT_TRUE(hash_of("[1 [2 3]]") != hash_of("[[1 2] 3]"), "nested sequence hashes collide");
+    ASSERT_TRUE(hash_of("(make-map 1 2 3 4)") == hash_of("(make-map 3 4 1 2)"), "map hash depends on order");
+    ASSERT_TRUE(hash_of("(make-map 1 2 3 4)") != hash_of("(make-map 1 4 3 2)"), "map hash ignores values");
+    ASSERT_TRUE(hash_of("#{1 2}") == hash_of("#{2 1}") && hash_of("#{1 2}") != hash_of("#{1 3}"), "set hash failed");
+    ASSERT_TRUE(hash_of("1.5") != hash_of("1.25"), "float hash ignores high bits");
+    ASSERT_TRUE(hash_of("0.0") == hash_of("-0.0"), "hash of equal floats differ");
+
+    ASSERT_TRUE(compare_parsing<bool>(m, "(def keyed (make-map [1 2] 1 [2 1] 2 (quote (1 2)) 3)) (= (keyed [2 1]) 2)",
+                                      orb::value_boolean, true, orb::BOOLEAN), "lookup with collection key failed");
+}
+
+UTEST(orb, hash_consing)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def a \"text\") (def q '(1 \"text\" [2 3])) (= a \"text\")"), "literals without hash-consing failed");
+    ASSERT_TRUE(m.constant_stats().strings == 0 && m.constant_stats().hits == 0, "hash-consing is on by default");
+
+    m.set_hash_consing(true);
+    ASSERT_TRUE(is_true("(def b \"shared\") (def c '(1 \"shared\" [2 3])) (def d '(1 \"shared\" [2 3])) (= c d)"),
+                "equal quoted constants are not equal");
+    ConstantStats stats = m.constant_stats();
+    ASSERT_TRUE(stats.data == 1 && stats.hits >= 2 && stats.saved_bytes > 0, "quoted constants were not shared");
+    ASSERT_TRUE(is_true("(= b \"shared\")") && is_true("(= (first (next c)) b)"), "shared string literals are not equal");
+    ASSERT_TRUE(is_true("(= (insert (make-map) \"k\" 1) (insert (make-map) \"k\" 1))"), "shared map keys failed");
+
+    m.gc();
+    ASSERT_TRUE(is_true("(= c '(1 \"shared\" [2 3]))"), "quoted constant lost in collection");
+    ASSERT_TRUE(is_true("(= q '(1 \"text\" [2 3]))"), "constant read before hash-consing changed");
+    m.set_hash_consing(false);
+    ASSERT_TRUE(is_true("(= d '(1 \"shared\" [2 3]))"), "constant after hash-consing changed");
+}
+
+UTEST(orb, heap_census)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def l '(1 2 3)) (def s \"a string long enough not to fit in the inline buffer\") true"),
+                "definitions failed");
+
+    HeapCensus census = m.heap_census();
+    ASSERT_TRUE(census.types[LIST].values >= 1 && census.types[FUNCTION].values > 10, "values were not counted by type");
+    ASSERT_TRUE(census.types[STRING].heap_bytes > 50, "string payload was not counted");
+    ASSERT_TRUE(census.pools.size() == 4 && census.sites.empty(), "unexpected pools or sites");
+    for(auto p = census.pools.begin(); p != census.pools.end(); ++p)
+    {
+        size_t chunks = p->chunks.empty_chunk_count;
+        for(size_t i = 0; i < ChunkStats::OCCUPANCY_BINS; ++i) chunks += p->chunks.occupancy[i];
+        ASSERT_TRUE(chunks == p->chunks.chunk_count, "occupancy histogram does not cover the chunks");
+        ASSERT_TRUE(p->allocated_bytes >= p->chunks.live_bytes, "allocated bytes less than live bytes");
+    }
+
+    m.set_allocation_sites(true);
+    ASSERT_TRUE(is_true("(def v (cons 0 l)) (def w (cons 0 (cons 0 l))) true"), "cons failed");
+    census = m.heap_census();
+    ASSERT_TRUE(census.sites["cons"].calls == 3 && census.sites["cons"].pool_bytes > 0, "cons site was not tracked");
+    ASSERT_TRUE(census.sites["<eval>"].calls == 1, "top-level site was not tracked");
+
+    ASSERT_TRUE(is_true("(= 4 (count ((sys/heap-stats) \"pools\")))"), "sys/heap-stats pools failed");
+    ASSERT_TRUE(is_true("(map? (((sys/heap-stats) \"sites\") \"cons\"))"), "sys/heap-stats sites failed");
+    ASSERT_TRUE(is_true("(= 4 (count ((((sys/heap-stats) \"pools\") \"list\") \"occupancy\")))"),
+                "sys/heap-stats occupancy failed");
+}
+
+UTEST(orb, heap_audit)
+{
+    using namespace orb;
+
+    orb::Orb m;
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(def l '(1 2 3)) (def v [l l]) (def s (hash-set l v)) (def l (cons 0 l)) "
+                        "(defn f (x) (cons x l)) (def sm (sorted-map 1 (f 1))) true"), "definitions failed");
+
+    HeapAudit audit = m.audit_heap();
+    ASSERT_TRUE(audit.ok(), "heap of definitions failed the audit");
+
+    m.gc();
+    ASSERT_TRUE(m.audit_heap().ok(), "heap failed the audit after collection");
+
+    {
+        // A value held by the host is counted but not reachable from the environment.
+        orb_result held = read_eval(m, "(cons 5 l)");
+        ASSERT_TRUE(held.valid(), "evaluation failed");
+        audit = m.audit_heap();
+        ASSERT_TRUE(audit.leaked.size() == 1 && audit.uncounted.empty() && audit.mark_mismatches == 0,
+                    "held value was not reported");
+        ASSERT_TRUE(audit.leaked[0].pool == "list" && audit.leaked[0].counted == 1 && audit.leaked[0].handles == 0 &&
+                    audit.leaked[0].bytes > 0, "leaked root was not described");
+    }
+    ASSERT_TRUE(m.audit_heap().ok(), "released value was reported");
+    ASSERT_TRUE(is_true("(= (f 1) (cons 1 (cons 0 '(1 2 3))))"), "audit changed the heap");
+}
+
 UTEST(orb, simple_parsing)
 {
     using namespace orb;
@@ -198,6 +392,309 @@ UTEST(orb, simple_parsing)
 }
 
 
+UTEST(orb, streaming_parser)
+{
+    using namespace orb;
+
+    const char* script =
+        "; Forms of every kind\n"
+        "(def a '(1 2.5 \"str\\\"ing\" sym)) ; trailing comment\n"
+        "[1 [2 3] #{4 5} {\"k\" 'v}]\n"
+        "(defn f (x y) (+ x y))\n"
+        "'(quoted (list)) nil true false -7 0x1f\n"
+        "\"last \\n string\"";
+
+    Orb m;
+    orb_result whole = string_to_value(m, script);
+    ASSERT_TRUE(whole.valid(), "string parse failed");
+    const List& forms = *(*whole)->value.list;
+
+    // The forms read from the stream equal the forms of the string, whatever the chunk boundaries.
+    size_t chunk_sizes[] = {1, 2, 7, 4096};
+    for(auto chunk_size : chunk_sizes)
+    {
+        std::istringstream is(script);
+        FormReader reader(m, is, chunk_size);
+        auto f = forms.begin();
+        ++f; // begin
+
+        size_t count = 0;
+        while(!reader.done())
+        {
+            orb_result form = reader.next();
+            ASSERT_TRUE(form.valid() && f != forms.end(), "streamed form failed");
+            ASSERT_TRUE(**form == *f, "streamed form differs from string parse");
+            ++f; ++count;
+        }
+        ASSERT_TRUE(f == forms.end() && count == 10, "streamed form count differs from string parse");
+    }
+
+    // Evaluating a stream evaluates it's forms in order.
+    {
+        Orb s;
+        std::istringstream is("(def x 2) (defn g (y) (* x y)) (g 21)");
+        orb_result r = read_eval(s, is);
+        ASSERT_TRUE(r.valid() && (*r)->type == NUMBER && (*r)->value.number.to_int() == 42, "stream evaluation failed");
+    }
+
+    // Scope errors are reported at the scope.
+    auto message_of = [&m](const char* str){orb_result r = string_to_value(m, str); return r.valid() ? std::string() : r.message();};
+    ASSERT_TRUE(message_of("(1\n  (2 ; )\n 3)") == "Scope ( at character 1 at line 1 not closed.", "open scope");
+    ASSERT_TRUE(message_of("(1 \")\" 2]") == "Excess scope closing ] at character 9 at line 1.", "mismatched scope");
+    ASSERT_TRUE(message_of("1\n  }") == "Excess scope closing } at character 3 at line 2.", "excess scope");
+    ASSERT_TRUE(message_of("(1 ')") == "Quote cannot be empty.", "empty quote");
+
+    // Forms before a malformed one are read.
+    {
+        std::istringstream is("(def b 1) (b");
+        FormReader reader(m, is, 3);
+        ASSERT_TRUE(reader.next().valid(), "form before error failed");
+        ASSERT_TRUE(!reader.done() && !reader.next().valid() && reader.done(), "malformed form was read");
+    }
+}
+
+UTEST(orb, read_data)
+{
+    using namespace orb;
+
+    Orb m;
+    const char* data = "{\"k\" [1 2.5 {\"n\" #{1 2}}] \"l\" '(a (b) 3) \"s\" 'sym \"t\" true \"z\" nil} ; config";
+
+    // Data reads to the value the script evaluates to.
+    orb_result read = read_data(m, data);
+    orb_result evaluated = read_eval(m, data);
+    ASSERT_TRUE(read.valid() && evaluated.valid(), "reading data failed");
+    ASSERT_TRUE((*read)->type == MAP && **read == **evaluated, "data differs from evaluated script");
+
+    {
+        std::istringstream is(data);
+        orb_result streamed = read_data(m, is);
+        ASSERT_TRUE(streamed.valid() && **streamed == **read, "data differs from streamed data");
+    }
+
+    // Quoted code is data and is not evaluated.
+    orb_result quoted = read_data(m, "'(def x 1)");
+    ASSERT_TRUE(quoted.valid() && (*quoted)->type == LIST && get_value(m, "x") == 0, "quoted code was evaluated");
+
+    // Code forms and malformed data are rejected.
+    auto fails = [&m](const char* str){return !read_data(m, str).valid();};
+    ASSERT_TRUE(fails("(+ 1 2)") && fails("[1 x]") && fails("{\"a\" (f)}"), "code form was read as data");
+    ASSERT_TRUE(fails("{1}") && fails("1 2") && fails("") && fails("[1"), "malformed data was read");
+    ASSERT_TRUE(read_data(m, "[1 x]").message() ==
+                "read_data: code form symbol x at character 4 at line 1 is not data, quote it.", "code form was not located");
+
+    // Streams of data values.
+    {
+        std::istringstream is("{\"a\" 1}\n[2 3]\n'c");
+        FormReader reader(m, is, 4, FormReader::DATA);
+        Type types[] = {MAP, VECTOR, SYMBOL};
+        for(auto t : types)
+        {
+            orb_result r = reader.next();
+            ASSERT_TRUE(r.valid() && (*r)->type == t, "data stream value failed");
+        }
+        ASSERT_TRUE(reader.done(), "data stream did not end");
+    }
+
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+    ASSERT_TRUE(is_true("(= (read-data \"{\\\"a\\\" [1 2]}\") {\"a\" [1 2]})"), "read-data failed");
+}
+
+UTEST(orb, mapped_file_import)
+{
+    using namespace orb;
+
+    const char* path = "orb_mapped_file_test.orb";
+    const char* script = "(def imported 40) ; comment\n(+ imported 2)";
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        file << script;
+    }
+
+    {
+        MappedFile mapped(path);
+        ASSERT_TRUE(mapped.is_open() && mapped.size() == strlen(script) &&
+                    memcmp(mapped.data(), script, mapped.size()) == 0, "mapping file failed");
+
+        Orb m;
+        ASSERT_TRUE(read_eval(m, mapped.data(), mapped.data() + mapped.size()).valid(), "parsing mapped file failed");
+    }
+
+    ASSERT_TRUE(!MappedFile("orb_no_such_file.orb").is_open(), "missing file was mapped");
+
+    // Ranges need not be null terminated.
+    {
+        Orb m;
+        const char* str = "(+ 1 2) (";
+        orb_result r = read_eval(m, str, str + 7);
+        ASSERT_TRUE(r.valid() && (*r)->value.number.to_int() == 3, "parsing range failed");
+    }
+
+    Orb m;
+    load_orb_unsafe_extensions(m);
+    auto is_true = [&m](const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+
+    ASSERT_TRUE(is_true("(= (import \"orb_mapped_file_test.orb\") 42)"), "import failed");
+    ASSERT_TRUE(is_true("(def f (MappedFile \"orb_mapped_file_test.orb\")) (. 'is_open f)"), "scripted mapping failed");
+    ASSERT_TRUE(is_true("(= (. 'size f) 42)"), "scripted mapping size differs");
+    ASSERT_TRUE(is_true("(= (first (. 'contents_to_string f)) (first (read \"orb_mapped_file_test.orb\")))"), "mapped contents differ");
+
+    std::remove(path);
+}
+
+UTEST(orb, import_cache)
+{
+    using namespace orb;
+
+    const char* path = "orb_import_cache_test.orb";
+    auto write_module = [path](const char* script){
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file << script;
+    };
+    write_module("(def imports (+ imports 1)) (def module-value '(a \"b\" 1.5 -2 true nil)) imports");
+
+    auto is_true = [](Orb& m, const char* str){return compare_parsing<bool>(m, str, orb::value_boolean, true, orb::BOOLEAN);};
+    auto counts_are = [](Orb& m, size_t module_hits, size_t form_hits, size_t disk_hits, size_t misses){
+        ImportStats s = m.import_stats();
+        return s.module_hits == module_hits && s.form_hits == form_hits && s.disk_hits == disk_hits && s.misses == misses &&
+               s.imports == module_hits + form_hits + disk_hits + misses;
+    };
+
+    // Uncached files are read and evaluated on each import.
+    {
+        Orb m;
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (+ (import \"orb_import_cache_test.orb\") (import \"orb_import_cache_test.orb\")) 3)"), "uncached import failed");
+        ASSERT_TRUE(counts_are(m, 0, 0, 0, 2), "uncached imports were cached");
+    }
+
+    // Cached forms are evaluated on each import.
+    {
+        Orb m;
+        m.set_import_cache(IMPORT_FORMS);
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (+ (import \"orb_import_cache_test.orb\") (import \"./orb_import_cache_test.orb\")) 3)"), "form cached import failed");
+        ASSERT_TRUE(counts_are(m, 0, 1, 0, 1), "forms were not reused by canonical path");
+    }
+
+    // Cached definitions are rebound without evaluation, until the file changes.
+    {
+        Orb m;
+        m.set_import_cache(IMPORT_MODULES);
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (import \"orb_import_cache_test.orb\") 1)"), "module cached import failed");
+        ASSERT_TRUE(is_true(m, "(def imports 10) (def module-value 0) (= (import \"orb_import_cache_test.orb\") 1)"), "module cache hit failed");
+        ASSERT_TRUE(is_true(m, "(= imports 1)") && is_true(m, "(= module-value '(a \"b\" 1.5 -2 true nil))"), "definitions were not rebound");
+        ASSERT_TRUE(counts_are(m, 1, 0, 0, 1), "module was not reused");
+
+        write_module("(def imports (+ imports 100)) imports");
+        ASSERT_TRUE(is_true(m, "(= (import \"orb_import_cache_test.orb\") 101)"), "changed file was not read again");
+        ASSERT_TRUE(counts_are(m, 1, 0, 0, 2), "changed file was reused");
+        write_module("(def imports (+ imports 1)) (def module-value '(a \"b\" 1.5 -2 true nil)) imports");
+    }
+
+    // Forms kept in the cache directory are read by later Orbs.
+    std::string cached = import_cache_file(".", path);
+    ASSERT_TRUE(!cached.empty() && import_cache_file(".", "orb_no_such_file.orb").empty(), "cache file path failed");
+    std::remove(cached.c_str());
+    {
+        Orb m;
+        m.set_import_cache_dir(".");
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (import \"orb_import_cache_test.orb\") 1)") && counts_are(m, 0, 0, 0, 1), "import did not parse");
+    }
+    {
+        Orb m;
+        m.set_hash_consing(true);
+        m.set_import_cache_dir(".");
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (import \"orb_import_cache_test.orb\") 1)") && counts_are(m, 0, 0, 1, 0), "cached forms were not read");
+        ASSERT_TRUE(is_true(m, "(= module-value '(a \"b\" 1.5 -2 true nil))"), "cached forms differ");
+    }
+
+    // Corrupt cache files are parsed over.
+    {
+        std::ofstream file(cached.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        file << "ORBF garbage";
+    }
+    {
+        Orb m;
+        m.set_import_cache_dir(".");
+        ASSERT_TRUE(is_true(m, "(def imports 0) (= (import \"orb_import_cache_test.orb\") 1)") && counts_are(m, 0, 0, 0, 1), "corrupt cache was read");
+    }
+
+    std::remove(cached.c_str());
+    std::remove(path);
+}
+
+/** Reference number lexer: the std::regex patterns the hand-written lexer replaced.*/
+static bool regex_string_to_number(const char* begin, const char* end, orb::Number& out)
+{
+    static const std::regex regfloat("^([-+]?[0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][-+]?[0-9]+)?$");
+    static const std::regex regint("^(?:([-+]?[1-9][0-9]*)|(0)|(0[xX][0-9A-Fa-f]+)|0[bB]([01]+))$");
+
+    std::cmatch res;
+    if(std::regex_search(begin, end, res, regint))
+    {
+        std::string is = res[0].str();
+        if(res[3].matched)      out.set(int(strtol(is.c_str(), 0, 16)));
+        else if(res[4].matched) out.set(int(strtol(res[4].str().c_str(), 0, 2)));
+        else                    out.set(atoi(is.c_str()));
+        return true;
+    }
+    else if(std::regex_search(begin, end, res, regfloat))
+    {
+        out.set(atof(res[0].str().c_str()));
+        return true;
+    }
+    return false;
+}
+
+UTEST(orb, number_lexer)
+{
+    using namespace orb;
+
+    auto same_as_reference = [](const std::string& str)
+    {
+        Number expected, got;
+        expected.set(-1); got.set(-2);
+        bool expect_ok = regex_string_to_number(str.data(), str.data() + str.size(), expected);
+        bool ok = string_to_number(str.data(), str.data() + str.size(), got);
+        bool same = ok == expect_ok && (!ok || expected == got);
+        if(!same) ORB_TEST_LOG(std::string("number lexer differs from reference on: ") + str);
+        return same;
+    };
+
+    const char* corpus[] = {"0", "1", "-1", "+1", "-0", "+0", "00", "007", "10", "123456789", "-2147483647",
+        "0x", "0xf", "0XfF", "0x1g", "-0x1", "0b", "0b101", "0B1", "0b102", "+0b1",
+        "1.", "1.5", "-1.5", "+.5", ".5", "-.5", ".", "..", "1..2", "1.2.3", "1e", "1e5", "1E+5", "1e-5", "1e+", "-1.e2",
+        ".5e3", "e5", "+", "-", "", "1a", "a1", "1-", "0.0", "-0.0", "12345678901234567890.5", "1f", "0x.5"};
+    for(auto c : corpus) ASSERT_TRUE(same_as_reference(c), "lexer differs from reference on corpus");
+
+    // Random tokens over the alphabet of number literals.
+    const char alphabet[] = "0123456789+-.eExXbBaf";
+    Random<int> rand(5);
+    for(int i = 0; i < 20000; ++i)
+    {
+        std::string str;
+        size_t len = 1 + size_t(unsigned(rand.rand()) % 8);
+        for(size_t j = 0; j < len; ++j) str.push_back(alphabet[unsigned(rand.rand()) % (sizeof(alphabet) - 1)]);
+        ASSERT_TRUE(same_as_reference(str), "lexer differs from reference on random tokens");
+    }
+
+    // Ints outside the int range saturate.
+    auto int_of = [](const char* str)
+    {
+        Number n; n.set(0.0);
+        string_to_number(str, str + strlen(str), n);
+        return n.type == Number::INT ? n.to_int() : 0;
+    };
+    ASSERT_TRUE(int_of("2147483647") == std::numeric_limits<int>::max(), "int max");
+    ASSERT_TRUE(int_of("-2147483648") == std::numeric_limits<int>::min(), "int min");
+    ASSERT_TRUE(int_of("99999999999999999999") == std::numeric_limits<int>::max(), "saturated int");
+    ASSERT_TRUE(int_of("-99999999999999999999") == std::numeric_limits<int>::min(), "saturated negative int");
+    ASSERT_TRUE(int_of("0b101") == 5 && int_of("0x10") == 16, "prefixed int");
+
+    // Long float literals do not fit the conversion buffer.
+    std::string long_float = "1." + std::string(100, '5');
+    ASSERT_TRUE(same_as_reference(long_float), "long float literal");
+}
+
 #if 0
 class WrappedInStream{ public:
     virtual ~WrappedInStream(){}
@@ -7,6 +7,7 @@ MIT licence.
 #include<string>
 #include "unittester.h"
 #include<list>
+#include<set>
 #include <utility>
 
 //ADD_GROUP(collections_pmap);
@@ -41,6 +42,268 @@ UTEST(collections, PList_test)
     print_container(list_long);
 }
 
+UTEST(collections, PList_size)
+{
+    using namespace orb;
+
+    PListPool<int> pool;
+    auto list_a = pool.new_list(range_to_list(0, 1, 100));
+    auto list_b = list_a.rest().rest().add(0);
+    auto list_c = list_b.remove(list_b.begin());
+    auto list_d = pool.add(list_a, list_a.begin(), list_a.end()); // Length not known until counted
+
+    ASSERT_TRUE(list_a.size() == 100 && list_b.size() == 99 && list_c.size() == 98, "List length was not kept.");
+    ASSERT_TRUE(list_d.size() == 200 && list_d.add(1).size() == 201, "List length was not counted.");
+    ASSERT_TRUE(pool.new_list().size() == 0 && pool.new_list().add(1).size() == 1, "Empty list length failed.");
+}
+
+UTEST(collections, PList_unrolled_nodes)
+{
+    using namespace orb;
+
+    PListPool<int> pool;
+    auto list_a = pool.new_list(range_to_list(0, 1, 20)); // Last node partially filled
+    auto list_b = list_a.rest().add(-1);                 // Slot below the head is taken in place
+    auto list_c = list_a.rest().add(-2);                 // Slot already taken, copied to new node
+    auto third = list_a.begin();
+    ++third; ++third;
+    auto list_d = list_a.remove(third);                  // Copies the elements before the removed one
+
+    ASSERT_TRUE(list_a == pool.new_list(range_to_list(0, 1, 20)), "Shared nodes modified.");
+    ASSERT_TRUE(*list_b.first() == -1 && *list_c.first() == -2 && list_b.rest() == list_c.rest(), "Add failed.");
+    ASSERT_TRUE(list_d.size() == 19 && *list_d.second() == 1 && list_d.rrest() == list_a.rrest().rest(), "Remove failed.");
+
+    auto list_e = list_a.add_end(list_a.begin(), list_a.end());
+    ASSERT_TRUE(list_e.size() == 40 && list_e == pool.add(list_a, list_a.begin(), list_a.end()), "Append failed.");
+
+    pool.minor_gc();
+    pool.gc();
+    pool.wait_for_collection();
+    ASSERT_TRUE(list_b.size() == 20 && list_c.size() == 20 && *list_d.first() == 0, "Live list collected.");
+}
+
+UTEST(collections, PVector_test)
+{
+    using namespace orb;
+
+    PVectorPool<int> pool;
+    auto elements = range_to_list(0, 1, 2000); // Three levels with the tail
+    auto vec_a = pool.new_vector(elements);
+
+    bool in_order = vec_a.size() == 2000;
+    int expected = 0;
+    for(auto i = vec_a.begin(); i != vec_a.end(); ++i) in_order = in_order && *i == expected++;
+    ASSERT_TRUE(in_order, "Vector elements not in order.");
+    ASSERT_TRUE(vec_a[1500] == 1500 && vec_a.get(2000) == 0, "Vector index failed.");
+
+    // Old versions are not changed by assoc or by appending to a shared tail.
+    auto vec_b = vec_a.assoc(10, -1).assoc(1999, -2);
+    auto vec_c = vec_a.push_back(1);
+    auto vec_d = vec_a.push_back(2);
+    ASSERT_TRUE(vec_a[10] == 10 && vec_a[1999] == 1999 && vec_b[10] == -1 && vec_b[1999] == -2, "Vector assoc failed.");
+    ASSERT_TRUE(vec_c[2000] == 1 && vec_d[2000] == 2 && vec_a.size() == 2000, "Vector push_back failed.");
+
+    auto vec_e = vec_a.rest().rest();
+    ASSERT_TRUE(vec_e.size() == 1998 && *vec_e.first() == 2 && vec_e[1997] == 1999, "Vector rest failed.");
+    ASSERT_TRUE(vec_a == pool.new_vector(elements) && !(vec_a == vec_b), "Vector equality failed.");
+
+    pool.minor_gc();
+    pool.gc();
+    pool.wait_for_collection();
+    ASSERT_TRUE(vec_b[10] == -1 && vec_e[0] == 2 && vec_d[2000] == 2, "Live vector collected.");
+}
+
+UTEST(collections, PDeque_test)
+{
+    using namespace orb;
+
+    PDequePool<int> pool;
+    auto deque_a = pool.new_deque();
+    for(int i = 0; i < 1000; ++i) deque_a = deque_a.push_back(i).push_front(-i - 1);
+
+    bool in_order = deque_a.size() == 2000;
+    int expected = -1000;
+    for(auto i = deque_a.begin(); i != deque_a.end(); ++i) in_order = in_order && *i == expected++;
+    ASSERT_TRUE(in_order, "Deque elements not in order.");
+    ASSERT_TRUE(*deque_a.first() == -1000 && *deque_a.last() == 999 && deque_a[1500] == 500, "Deque access failed.");
+
+    auto deque_b = deque_a;
+    for(int i = 0; i < 1990; ++i) deque_b = i % 2 ? deque_b.rest() : deque_b.butlast();
+    ASSERT_TRUE(deque_b.size() == 10 && *deque_b.first() == -5 && *deque_b.last() == 4, "Deque pop failed.");
+    ASSERT_TRUE(deque_a.size() == 2000 && deque_a[0] == -1000, "Old version changed.");
+
+    // Concatenation of deques of several sizes, including with itself.
+    std::vector<int> sizes = {0, 1, 5, 37, 500};
+    bool concat_ok = true;
+    for(size_t i = 0; i < sizes.size(); ++i) for(size_t j = 0; j < sizes.size(); ++j)
+    {
+        auto left = pool.new_deque(range_to_list(0, 1, sizes[i]));
+        auto right = pool.new_deque(range_to_list(sizes[i], 1, sizes[i] + sizes[j]));
+        auto joined = left.concat(right);
+        concat_ok = concat_ok && joined == pool.new_deque(range_to_list(0, 1, sizes[i] + sizes[j]));
+        for(size_t k = 0; k < joined.size(); k += 7) concat_ok = concat_ok && joined[k] == int(k);
+    }
+    ASSERT_TRUE(concat_ok, "Deque concat failed.");
+
+    auto twice = deque_a.concat(deque_a);
+    ASSERT_TRUE(twice.size() == 4000 && twice[2000] == -1000 && twice[3999] == 999, "Deque concat with itself failed.");
+
+    pool.minor_gc();
+    pool.gc();
+    pool.wait_for_collection();
+    ASSERT_TRUE(deque_b.size() == 10 && twice[1000] == 0 && deque_a[1999] == 999, "Live deque collected.");
+    ASSERT_TRUE(pool.mark_mismatches() == 0, "Deque chunk bitmaps do not match reachability.");
+
+    std::vector<const void*> roots;
+    deque_b.for_each_root([&roots](const void* n){roots.push_back(n);});
+    ASSERT_TRUE(pool.root_refcounts().count(roots.front()) == 1 && pool.reachable_bytes(roots) > 0, "Deque root audit failed.");
+}
+
+UTEST(collections, PList_release_empty_chunks)
+{
+    using namespace orb;
+
+    PListPool<int> pool;
+    pool.set_retained_empty_chunks(2);
+    auto kept = pool.new_list(list(1, 2, 3));
+
+    {
+        auto peak = pool.new_list(range_to_list(0, 1, 100000));
+        pool.gc();
+    }
+
+    ChunkStats at_peak = pool.chunk_stats();
+    pool.gc();
+    ChunkStats after = pool.chunk_stats();
+
+    ASSERT_TRUE(after.chunk_count < at_peak.chunk_count, "Empty chunks were not released.");
+    ASSERT_TRUE(after.empty_chunk_count <= 2, "Too many empty chunks retained.");
+    ASSERT_TRUE(after.mapped_bytes < at_peak.mapped_bytes, "Empty slabs were not unmapped.");
+    ASSERT_TRUE(kept.size() == 3 && *kept.first() == 1, "Live list damaged by release.");
+
+    // Memory is reusable after release.
+    auto again = pool.new_list(range_to_list(0, 1, 1000));
+    ASSERT_TRUE(again.size() == 1000, "Allocation after release failed.");
+}
+
+UTEST(collections, PList_refcount_audit)
+{
+    using namespace orb;
+
+    PListPool<int> pool;
+    auto list_a = pool.new_list(range_to_list(0, 1, 100));
+    auto list_b = pool.new_list(list(1, 2, 3));
+    const void* head_a = 0;
+    const void* head_b = 0;
+    list_a.for_each_root([&head_a](const void* n){head_a = n;});
+    list_b.for_each_root([&head_b](const void* n){head_b = n;});
+
+    // Assignment must release the reference to the replaced head.
+    list_b = list_a;
+    RootRefcounts counts = pool.root_refcounts();
+    ASSERT_TRUE(counts.size() == 1 && counts[head_a] == 2 && counts.count(head_b) == 0, "Copy assignment leaked a root.");
+
+    list_b = pool.new_list(list(4, 5));
+    counts = pool.root_refcounts();
+    ASSERT_TRUE(counts.size() == 2 && counts[head_a] == 1, "Move assignment leaked a root.");
+
+    pool.gc();
+    ASSERT_TRUE(pool.mark_mismatches() == 0, "Chunk bitmaps do not match reachability after collection.");
+
+    std::vector<const void*> roots(1, head_a);
+    size_t bytes_a = pool.reachable_bytes(roots);
+    list_b.for_each_root([&roots](const void* n){roots.push_back(n);});
+    size_t bytes_all = pool.reachable_bytes(roots);
+    ASSERT_TRUE(bytes_a > 0 && bytes_a < bytes_all && bytes_all == pool.chunk_stats().live_bytes,
+                "Reachable bytes do not match the live bytes.");
+    ASSERT_TRUE(list_a.size() == 100 && *list_b.first() == 4, "Lists damaged by audit.");
+}
+
+UTEST(collections, Chunk_bitmap)
+{
+    using namespace orb;
+
+    ChunkBitmap<100> b;
+    ASSERT_TRUE(b.none() && b.find(false, 0) == 0, "Empty bitmap.");
+    b.set_range(0, 70);
+    ASSERT_TRUE(b.count() == 70 && b.find(false, 0) == 70, "Bitmap set range across words.");
+    b.reset(10);
+    ASSERT_TRUE(b.find_zero_run(2) == 70 && b.find_zero_run(1) == 10, "Bitmap zero run search.");
+    ASSERT_TRUE(b.find_zero_run(30) == 70, "Bitmap zero run at end.");
+    ASSERT_TRUE(b.find_zero_run(31) == 100, "Bitmap zero run not found.");
+    b.set_range(70, 30);
+    b.set(10);
+    ASSERT_TRUE(b.all(), "Full bitmap.");
+}
+
+UTEST(collections, PList_wide_chunks)
+{
+    using namespace orb;
+
+    // Chunk size not a multiple of the bitmap word.
+    PListPool<int, 200> pool;
+    auto kept = pool.new_list(range_to_list(0, 1, 1000));
+    {
+        auto dropped = pool.new_list(range_to_list(0, 1, 1000));
+    }
+    pool.gc();
+    pool.wait_for_collection();
+    ASSERT_TRUE(kept.size() == 1000, "Wide chunk list damaged by collection.");
+    ASSERT_TRUE(pool.chunk_stats().live_bytes < pool.chunk_stats().chunk_bytes, "Wide chunk collection failed.");
+}
+
+UTEST(collections, SizeClass_arrays)
+{
+    using namespace orb;
+
+    SizeClassChunkBox<int, 32, 8> box;
+    int* kept = box.reserve_consecutive_elements(32);
+    for(int i = 0; i < 32; ++i) kept[i] = i;
+    for(size_t n = 1; n <= 32; ++n) box.reserve_consecutive_elements(n);
+    ASSERT_TRUE(box.reserve_consecutive_elements(33) == 0, "Array larger than the largest size class.");
+
+    box.lock_for_collection();
+    box.set_marked_if_locked_array(kept, 32);
+    box.sweep_locked();
+
+    ASSERT_TRUE(box.live_size_bytes() == 32 * sizeof(int), "Size class collection failed.");
+    ASSERT_TRUE(box.class_stats(32).live_bytes == 32 * sizeof(int) && kept[31] == 31, "Kept array damaged.");
+}
+
+UTEST(collections, Hash64)
+{
+    using namespace orb;
+
+    std::vector<char> buffer(1024);
+    for(size_t i = 0; i < buffer.size(); ++i) buffer[i] = char(i * 131 + 7);
+
+    std::set<uint64_t> hashes;
+    for(size_t len = 0; len < 600; ++len) hashes.insert(hash64(&buffer[0], len));
+    ASSERT_TRUE(hashes.size() == 600, "Prefixes of a buffer have equal hashes.");
+
+    std::vector<char> moved(buffer.begin(), buffer.begin() + 500);
+    ASSERT_TRUE(hash64(&moved[0], 500) == hash64(&buffer[0], 500) && hash64(&moved[3], 31) == hash64(&buffer[3], 31),
+                "Hash depends on alignment.");
+    ASSERT_TRUE(hash64(&buffer[0], 40, 1) != hash64(&buffer[0], 40) && hash64(&buffer[0], 40, 1) == hash64(&buffer[0], 40, 1),
+                "Seeded hash failed.");
+
+    size_t lengths[] = {3, 16, 40, 300, 1000};
+    for(size_t l = 0; l < 5; ++l)
+    {
+        size_t len = lengths[l];
+        uint64_t h = hash64(&buffer[0], len);
+        for(size_t bit = 0; bit < len * 8; ++bit)
+        {
+            buffer[bit / 8] ^= char(1 << (bit % 8));
+            bool changed = hash64(&buffer[0], len) != h;
+            buffer[bit / 8] ^= char(1 << (bit % 8));
+            ASSERT_TRUE(changed, "Flipping a bit did not change the hash.");
+        }
+    }
+
+    ASSERT_TRUE(hash32(std::string("symbol")) == hash32("symbol", 6), "String hash differs from data hash.");
+}
+
 template<class M> void print_pmap(M& map)
 {
     ut_test_out() << "Contents of persistent map:" << std::endl;
@@ -143,7 +406,8 @@ SIMap map_remove_elements(const StlSIMap& map, SIMap pmap)
 }
 
 /** Return true if all elements in reference are found in map.*/
-bool verify_map_elements(const StlSIMap& reference, SIMap& map)
+template<class M>
+bool verify_map_elements(const StlSIMap& reference, M& map)
 {
     bool found = true;
 
@@ -328,6 +592,395 @@ UTEST(collections_pmap, PMap_write_and_find_elements)
 
 }
 
+UTEST(collections_pmap, PMap_concurrent_collect)
+{
+    using namespace orb;
+
+    // Start collection cycles while maps are being modified on this thread.
+    StlSIMap elements;
+    write_random_elements(2000, Random<int>(7), std::string("k"), elements);
+
+    SIMapPool pool;
+    SIMap map = pool.new_map();
+    StlSIMap inserted;
+    int count = 0;
+    for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+    {
+        map = map.add(i->first, i->second);
+        inserted[i->first] = i->second;
+        if(count % 100 == 0) pool.gc();
+    }
+
+    pool.wait_for_collection();
+    ASSERT_TRUE(verify_map_elements(inserted, map), "Map lost elements in concurrent collection.");
+
+    // Remove half of the elements, collect and verify remaining.
+    count = 0;
+    for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+    {
+        if(count % 2 == 0)
+        {
+            map = map.remove(i->first);
+            inserted.erase(i->first);
+        }
+        if(count % 200 == 0) pool.gc();
+    }
+
+    pool.gc();
+    ASSERT_TRUE(verify_map_elements(inserted, map), "Map lost elements in concurrent collection.");
+
+    // Run the same synchronously.
+    GcWorkers::instance().set_concurrent(false);
+    pool.gc();
+    ASSERT_TRUE(verify_map_elements(inserted, map), "Map lost elements in synchronous collection.");
+    GcWorkers::instance().set_concurrent(true);
+}
+
+UTEST(collections_pmap, PMap_minor_collect)
+{
+    using namespace orb;
+
+    StlSIMap elements;
+    write_random_elements(500, Random<int>(3), std::string("n"), elements);
+
+    SIMapPool pool;
+    SIMap old_map = map_insert_elements(elements, pool, false);
+    pool.gc();
+    pool.wait_for_collection();
+
+    // Short-lived versions die young, the kept one is promoted.
+    SIMap kept = old_map.add("kept", 1);
+    for(int i = 0; i < 100; ++i){SIMap tmp = old_map.add(std::to_string(i), i);}
+    size_t before = pool.live_size_bytes();
+    pool.minor_gc();
+    size_t after = pool.live_size_bytes();
+
+    StlSIMap kept_elements = elements;
+    kept_elements["kept"] = 1;
+    ASSERT_TRUE(after < before, "Minor collection did not release young nodes.");
+    ASSERT_TRUE(verify_map_elements(elements, old_map), "Minor collection released old nodes.");
+    ASSERT_TRUE(verify_map_elements(kept_elements, kept), "Minor collection released live young nodes.");
+
+    // Promoted nodes survive following minor collections.
+    pool.minor_gc();
+    ASSERT_TRUE(verify_map_elements(kept_elements, kept), "Minor collection released promoted nodes.");
+    pool.gc();
+    ASSERT_TRUE(verify_map_elements(kept_elements, kept), "Full collection released promoted nodes.");
+}
+
+UTEST(collections_pmap, PMap_wide_chunks)
+{
+    using namespace orb;
+
+    typedef PMapPool<std::string, int, AreEqual<std::string>, MapHash<std::string>,
+                     MapChunkGeometry<128, 256, 96>> WidePool;
+
+    StlSIMap elements;
+    write_random_elements(2000, Random<int>(11), std::string("w"), elements);
+
+    WidePool pool;
+    WidePool::Map map = pool.new_map();
+    for(auto i = elements.begin(); i != elements.end(); ++i) map = map.add(i->first, i->second);
+    pool.gc();
+    pool.wait_for_collection();
+
+    bool all_found = true;
+    for(auto i = elements.begin(); i != elements.end(); ++i)
+    {
+        auto v = map.try_get_value(i->first);
+        all_found = all_found && v.is_valid() && *v == i->second;
+    }
+    ASSERT_TRUE(all_found && map.size() == elements.size(), "Wide chunk map lost elements.");
+}
+
+class CollidingHash { public:
+    static uint32_t hash(const std::string& s){return (uint32_t) s.size();}
+};
+
+UTEST(collections_pmap, PMap_collision_collect)
+{
+    using namespace orb;
+
+    // Keys of same length collide. Older versions of the map must not change when
+    // the collision list is extended.
+    typedef PMapPool<std::string, int, AreEqual<std::string>, CollidingHash> CollidingPool;
+    CollidingPool pool;
+    auto map_a = pool.new_map().add("a", 1).add("b", 2);
+    auto map_b = map_a.add("c", 3);
+    pool.gc();
+    auto map_c = map_b.add("a", 4);
+    pool.gc();
+    pool.wait_for_collection();
+
+    ASSERT_TRUE(map_a.size() == 2 && !map_a.try_get_value("c").is_valid(), "Collision list of old map was modified.");
+    ASSERT_TRUE(map_b.size() == 3 && *map_b.try_get_value("a") == 1, "Collision list of old map was modified.");
+    ASSERT_TRUE(map_c.size() == 3 && *map_c.try_get_value("a") == 4, "Collision list replace failed.");
+}
+
+UTEST(collections_pmap, PMap_remove_path)
+{
+    using namespace orb;
+
+    typedef PMapPool<std::string, int> SIPool;
+
+    StlSIMap elements;
+    write_random_elements(2000, Random<int>(11), std::string("r"), elements);
+
+    SIPool pool;
+    SIPool::Map full = pool.new_map();
+    for(auto i = elements.begin(); i != elements.end(); ++i) full = full.add(i->first, i->second);
+    SIPool::Map map = full;
+    StlSIMap kept(elements);
+    int count = 0;
+    for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+    {
+        if(count % 3 == 0) continue;
+        map = map.remove(i->first);
+        kept.erase(i->first);
+        if(count % 250 == 0) pool.gc();
+    }
+    pool.gc();
+    pool.wait_for_collection();
+
+    ASSERT_TRUE(verify_map_elements(kept, map) && map.size() == kept.size(), "Map remove lost elements.");
+    ASSERT_TRUE(verify_map_elements(elements, full) && full.size() == elements.size(), "Map remove modified old version.");
+
+    for(auto i = elements.begin(); i != elements.end(); ++i) map = map.remove(i->first);
+    ASSERT_TRUE(map.begin() == map.end() && map.size() == 0, "Map remove all failed.");
+
+    // Removal from collision lists.
+    typedef PMapPool<std::string, int, AreEqual<std::string>, CollidingHash> CollidingPool;
+    CollidingPool cpool;
+    auto abc = cpool.new_map().add("a", 1).add("b", 2).add("c", 3).add("dd", 4);
+    auto ac = abc.remove("b");
+    auto c = ac.remove("a");
+    ASSERT_TRUE(abc.size() == 4 && ac.size() == 3 && !ac.try_get_value("b").is_valid() && *ac.try_get_value("c") == 3,
+                "Collision list remove failed.");
+    ASSERT_TRUE(c.size() == 2 && *c.try_get_value("c") == 3 && *c.try_get_value("dd") == 4, "Collision node remove failed.");
+    ASSERT_TRUE(c.remove("c").remove("dd").size() == 0, "Collision remove all failed.");
+}
+
+// Check merge, diff and equality of maps sharing most of their nodes.
+template<class Pool>
+bool check_merge_diff(const StlSIMap& elements)
+{
+    Pool pool;
+    typename Pool::Map base = pool.new_map();
+    for(auto i = elements.begin(); i != elements.end(); ++i) base = base.add(i->first, i->second);
+
+    typename Pool::Map changed = base.add("new", 1).add(elements.begin()->first, -1).remove(elements.rbegin()->first);
+    typename Pool::Map added   = pool.new_map().add("new", 1).add(elements.begin()->first, -1);
+
+    StlSIMap merged(elements);
+    merged["new"] = 1;
+    merged[elements.begin()->first] = -1;
+
+    bool ok = base.diff(changed) == added && base.diff(base).size() == 0;
+    ok = ok && changed.diff(base).size() == 2 && changed.diff(base).try_get_value(elements.rbegin()->first).is_valid();
+    typename Pool::Map merge = base.merge(changed);
+    ok = ok && verify_map_elements(merged, merge) && merge.size() == merged.size();
+    ok = ok && !(base == changed) && !(changed == base) && base.merge(added) == changed.add(elements.rbegin()->first,
+                                                                                          elements.rbegin()->second);
+    ok = ok && !(base == base.add("new", 1)) && !(base.add("new", 1) == base);
+    return ok;
+}
+
+UTEST(collections_pmap, PMap_merge_diff)
+{
+    using namespace orb;
+
+    StlSIMap elements;
+    write_random_elements(1000, Random<int>(17), std::string("m"), elements);
+
+    typedef PMapPool<std::string, int> HamtPool;
+    typedef PChampMapPool<std::string, int> ChampPool;
+
+    ASSERT_TRUE(check_merge_diff<HamtPool>(elements), "Hamt merge or diff failed.");
+    ASSERT_TRUE(check_merge_diff<ChampPool>(elements), "Champ merge or diff failed.");
+}
+
+// Check key intersection and difference of maps sharing most of their nodes.
+template<class Pool>
+bool check_set_algebra(const StlSIMap& elements)
+{
+    Pool pool;
+    typename Pool::Map base = pool.new_map();
+    for(auto i = elements.begin(); i != elements.end(); ++i) base = base.add(i->first, i->second);
+
+    const std::string& removed = elements.rbegin()->first;
+    typename Pool::Map changed = base.add("new", 1).add(elements.begin()->first, -1).remove(removed);
+
+    typename Pool::Map common = base.intersection(changed);
+    bool ok = common.size() == elements.size() - 1 && !common.try_get_value(removed).is_valid();
+    ok = ok && *common.try_get_value(elements.begin()->first) == elements.begin()->second;
+    ok = ok && base.intersection(base) == base && base.intersection(pool.new_map()).size() == 0;
+
+    typename Pool::Map only_base = base.difference(changed);
+    ok = ok && only_base == pool.new_map().add(removed, elements.rbegin()->second);
+    ok = ok && changed.difference(base) == pool.new_map().add("new", 1);
+    ok = ok && base.difference(base).size() == 0 && base.difference(pool.new_map()) == base;
+    return ok;
+}
+
+UTEST(collections_pmap, PMap_set_algebra)
+{
+    using namespace orb;
+
+    StlSIMap elements;
+    write_random_elements(1000, Random<int>(23), std::string("s"), elements);
+
+    typedef PMapPool<std::string, int> HamtPool;
+    typedef PChampMapPool<std::string, int> ChampPool;
+
+    ASSERT_TRUE(check_set_algebra<HamtPool>(elements), "Hamt intersection or difference failed.");
+    ASSERT_TRUE(check_set_algebra<ChampPool>(elements), "Champ intersection or difference failed.");
+}
+
+UTEST(collections_pmap, PChamp_insert_remove_collect)
+{
+    using namespace orb;
+
+    typedef PChampMapPool<std::string, int> ChampPool;
+
+    StlSIMap elements;
+    write_random_elements(2000, Random<int>(5), std::string("c"), elements);
+
+    ChampPool pool;
+    ChampPool::Map map = pool.new_map();
+    ChampPool::Map empty = map;
+    StlSIMap inserted;
+    int count = 0;
+    for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+    {
+        map = map.add(i->first, i->second);
+        inserted[i->first] = i->second;
+        if(count % 100 == 0) pool.gc();
+    }
+
+    pool.wait_for_collection();
+    ASSERT_TRUE(verify_map_elements(inserted, map) && map.size() == inserted.size(), "Champ map lost elements.");
+
+    ChampPool::Map full = map;
+    count = 0;
+    for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+    {
+        if(count % 2 == 0)
+        {
+            map = map.remove(i->first);
+            inserted.erase(i->first);
+        }
+        if(count % 200 == 0) pool.gc();
+    }
+
+    pool.minor_gc();
+    pool.gc();
+    ASSERT_TRUE(verify_map_elements(inserted, map) && map.size() == inserted.size(), "Champ map remove failed.");
+    ASSERT_TRUE(verify_map_elements(elements, full), "Champ map remove modified old version.");
+
+    for(auto i = elements.begin(); i != elements.end(); ++i) map = map.remove(i->first);
+    ASSERT_TRUE(map.begin() == map.end() && empty.size() == 0, "Champ map remove all failed.");
+}
+
+UTEST(collections_pmap, PChamp_collision_overflow)
+{
+    using namespace orb;
+
+    // All keys collide, more of them than fit in a collision node.
+    typedef PChampMapPool<std::string, int, AreEqual<std::string>, CollidingHash> CollidingPool;
+    CollidingPool pool;
+    CollidingPool::Map map = pool.new_map();
+    StlSIMap inserted;
+    for(int i = 0; i < 70; ++i)
+    {
+        std::string key = std::to_string(100 + i);
+        map = map.add(key, i);
+        inserted[key] = i;
+    }
+    auto kept = map;
+    map = map.add("100", -1).remove("101").remove("150");
+    pool.gc();
+    pool.wait_for_collection();
+
+    ASSERT_TRUE(verify_map_elements(inserted, kept) && kept.size() == 70, "Collision overflow lost elements.");
+    ASSERT_TRUE(map.size() == 68 && *map.try_get_value("100") == -1 && *kept.try_get_value("100") == 0,
+                "Collision overflow replace failed.");
+    ASSERT_TRUE(!map.try_get_value("150").is_valid() && map.try_get_value("169").is_valid(),
+                "Collision overflow remove failed.");
+}
+
+// Build a map with a transient, collecting midway, and check the source map is unchanged.
+template<class Pool>
+bool check_transient_build(const StlSIMap& elements)
+{
+    Pool pool;
+    typename Pool::Map base = pool.new_map().add("base", -1);
+    typename Pool::Map built = pool.new_map();
+    {
+        typename Pool::Transient t(base);
+        int count = 0;
+        for(auto i = elements.begin(); i != elements.end(); ++i, ++count)
+        {
+            t.add(i->first, i->second);
+            if(count % 500 == 0) pool.gc();
+            if(count % 300 == 0) pool.minor_gc();
+        }
+        t.add("base", -2);
+        built = t.persistent();
+        t.add("after", 1);
+    }
+    pool.gc();
+    pool.wait_for_collection();
+
+    StlSIMap expected(elements);
+    expected["base"] = -2;
+    return verify_map_elements(expected, built) && built.size() == expected.size() &&
+           base.size() == 1 && *base.try_get_value("base") == -1 && !built.try_get_value("after").is_valid();
+}
+
+UTEST(collections_pmap, PMap_transient_build)
+{
+    using namespace orb;
+
+    StlSIMap elements;
+    write_random_elements(3000, Random<int>(7), std::string("t"), elements);
+
+    typedef PMapPool<std::string, int> HamtPool;
+    typedef PChampMapPool<std::string, int> ChampPool;
+    typedef PChampMapPool<std::string, int, AreEqual<std::string>, CollidingHash> CollidingPool;
+
+    ASSERT_TRUE(check_transient_build<HamtPool>(elements), "Hamt transient build failed.");
+    ASSERT_TRUE(check_transient_build<ChampPool>(elements), "Champ transient build failed.");
+    ASSERT_TRUE(check_transient_build<CollidingPool>(StlSIMap(elements.begin(), std::next(elements.begin(), 80))),
+                "Colliding transient build failed.");
+}
+
+UTEST(collections_pmap, PSortedMap_test)
+{
+    using namespace orb;
+
+    PSortedMapPool<int, int> pool;
+    auto map = pool.new_map();
+    for(int i = 0; i < 1000; ++i) map = map.add((i * 7919) % 1000, i); // Keys 0-999 in scrambled order
+
+    bool in_order = map.size() == 1000;
+    int expected = 0;
+    for(auto i = map.begin(); i != map.end(); ++i) in_order = in_order && i->first == expected++;
+    ASSERT_TRUE(in_order, "Sorted map keys not in order.");
+    ASSERT_TRUE(map.try_get_value(7919 % 1000).is_valid() && *map.try_get_value(7919 % 1000) == 1, "Lookup failed.");
+
+    auto removed = map;
+    for(int i = 0; i < 1000; i += 2) removed = removed.remove(i);
+    ASSERT_TRUE(removed.size() == 500 && !removed.try_get_value(10).is_valid() && map.size() == 1000, "Remove failed.");
+    ASSERT_TRUE(removed.lower_bound(10)->first == 11 && removed.upper_bound(11)->first == 13, "Bounds failed.");
+    ASSERT_TRUE(removed.upper_bound(999) == removed.end() && removed.rbegin()->first == 999, "End bounds failed.");
+    ASSERT_TRUE(removed.rank(11) == 5 && removed.select(5)->first == 11 && removed.select(500) == removed.end(), "Rank failed.");
+
+    pool.minor_gc();
+    pool.gc();
+    pool.wait_for_collection();
+    ASSERT_TRUE(removed.size() == 500 && map.select(999)->first == 999 && *map.try_get_value(0) == 0, "Live map collected.");
+}
+
 #if 0
 UTEST(collections_pmap, PMap_combinations)
 {
@@ -6,5 +6,146 @@
 
 #include "persistent_containers.h"
 
+namespace orb{
 
+/////////// Collector threads //////////////
 
+GcWorkers& GcWorkers::instance()
+{
+    static GcWorkers workers;
+    return workers;
+}
+
+GcWorkers::GcWorkers():task_(0), generation_(0), running_(0), concurrent_(true), stop_(false)
+{
+    start_threads(0);
+}
+
+GcWorkers::~GcWorkers()
+{
+    stop_threads();
+}
+
+size_t GcWorkers::thread_count() const
+{
+    return markers_.size() + 1;
+}
+
+void GcWorkers::set_thread_count(size_t count)
+{
+    stop_threads();
+    start_threads(count);
+}
+
+bool GcWorkers::concurrent() const
+{
+    return concurrent_;
+}
+
+void GcWorkers::set_concurrent(bool concurrent)
+{
+    concurrent_ = concurrent;
+}
+
+void GcWorkers::start_threads(size_t count)
+{
+    if(count == 0) count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    stop_ = false;
+    // The thread calling run_parallel does it's share of marking.
+    for(size_t i = 1; i < count; ++i) markers_.push_back(std::thread(&GcWorkers::marker_loop, this, i));
+    collector_ = std::thread(&GcWorkers::collector_loop, this);
+}
+
+void GcWorkers::stop_threads()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    task_ready_.notify_all();
+    cycle_ready_.notify_all();
+
+    for(auto t = markers_.begin(); t != markers_.end(); ++t) t->join();
+    markers_.clear();
+    if(collector_.joinable()) collector_.join();
+}
+
+void GcWorkers::run_parallel(const std::function<void(size_t)>& task)
+{
+    // Only one marking run at a time.
+    std::lock_guard<std::mutex> parallel_lock(parallel_mutex_);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        running_ = markers_.size();
+        ++generation_;
+    }
+    task_ready_.notify_all();
+
+    task(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(running_ > 0) task_done_.wait(lock);
+    task_ = 0;
+}
+
+std::shared_future<void> GcWorkers::run_cycle(const std::function<void()>& job)
+{
+    std::packaged_task<void()> cycle(job);
+    std::shared_future<void> result = cycle.get_future().share();
+
+    if(!concurrent_)
+    {
+        cycle();
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cycles_.push_back(std::move(cycle));
+    }
+    cycle_ready_.notify_one();
+
+    return result;
+}
+
+void GcWorkers::marker_loop(size_t index)
+{
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for(;;)
+    {
+        while(!stop_ && generation_ == seen) task_ready_.wait(lock);
+        if(stop_) return;
+
+        seen = generation_;
+        const std::function<void(size_t)>* task = task_;
+
+        lock.unlock();
+        (*task)(index);
+        lock.lock();
+
+        if(--running_ == 0) task_done_.notify_all();
+    }
+}
+
+void GcWorkers::collector_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for(;;)
+    {
+        while(!stop_ && cycles_.empty()) cycle_ready_.wait(lock);
+        if(cycles_.empty()) return; // Pending cycles are finished before stopping.
+
+        std::packaged_task<void()> cycle(std::move(cycles_.front()));
+        cycles_.pop_front();
+
+        lock.unlock();
+        cycle();
+        lock.lock();
+    }
+}
+
+} // namespace orb
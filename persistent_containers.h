@@ -11,37 +11,56 @@
  *      - a simple linked list with distinct heads nodes for reference counting
  *  - persistent map PMap
  *      - a simple persistent map with node copying
+ *  - persistent map PChampMapPool::Map
+ *      - CHAMP encoded hash trie with the keyvalues stored inline in the nodes
  *
- * TODO: Should be straightforward to modify chunkbuffer so it supports parallel deallocation. 
+ * Parallel marking and concurrent deallocation.
  *
- * I quickly sketched the parallel marking & collection algorithm below. Might be faulty. TODO: verify.
+ * The collection is run in cycles. A cycle is started from the allocating (main) thread:
  *
- * For parallel marking, a portion of the chunks must be 'locked' so no new space can be allocated
- * from them prior to collecting. So, to parallellize:
+ * 1) the roots of the pool (heads with a non-zero reference count) are copied,
+ * 2) all chunks in chunkbox are 'locked' and divided to gc-groups. Locked chunks are not used for
+ *    allocation - new slots are reserved from fresh chunks (otherwise a slot could be reserved from a
+ *    chunk that has already gone through marking and would be erroneously collected even though it
+ *    should be reachable),
+ * 3) the cycle is passed to the collector thread and the main thread continues.
  *
- * 1) divide the chunks in chunkbuffer to gc-groups.
- * 2) one gc-group is selected for marking and deallocation (mad)
- * 3) during mad the gc-group is locked - no new slots can be allocated from it's chunks
- *    (otherwise a slot could be reserved from a chunk that's alread gone through marking and would be
- *     erroneously collected even though it should be reachable)
- *  4) pass marked gc-group for deallocation
- *  5) once deallocated, release gc-group once more into complete allocation pool
+ * The collector thread marks the locked chunks starting from the copied roots using the shared
+ * marking threads (GcWorkers) and once marking is done, deallocates the unused slots of one gc-group at
+ * a time. Each deallocated gc-group is released back to the allocation pool of the chunkbox, where the
+ * main thread picks it up on its next reservation.
  *
- *  There could be, say, two or three allocation groups? TODO: Needs more attention.
+ * Running marking concurrently with the main thread is safe as the links of nodes are not mutated
+ * once they have been made reachable from a root: nodes created after the roots were copied are not in
+ * the locked chunks and nodes reachable from the copied roots can only refer to older nodes.
+ * The reference count tables are guarded by a mutex as the destructors run by deallocation
+ * may release references to the pools.
  *
- * Once locked, the marking phase and deallocation phase can run in separate threads.
- * 1) Main thread locks allocation group g for mad (markeds pushed to concurrent filo queue)
- * 2) marking thread gets the next item from marking queue, marks them, and adds them to concurrent cleanup -queue
- * 3) deallocation thread gets the next item from cleanup -queue, deallocates unused slots and unlocks the allocation group
+ * Marking implementations for each datastructure are passed to ParallelMarker
+ * (i.e. how to navigate a hash array trie forest v.s. a list forest).
+ *
+ * Nursery.
+ *
+ * Slots reserved after the previous collection are young. Most of them die young (argument lists,
+ * path copies of intermediate maps) so a minor collection marks only the young slots reachable
+ * from the roots and frees the rest. Old nodes are not traced: a node can refer only to nodes older
+ * than itself, as nodes are not mutated once created. Nodes that are mutated in place after they
+ * have been promoted must be added to the remembered set of the pool (write barrier).
+ * Survivors are promoted in place since handles refer to the slots directly.
+ *
+ * Releasing memory.
+ *
+ * Chunks are allocated from slabs mapped directly from the OS (ChunkSlabs). After collection the
+ * empty chunks exceeding the retention count of the chunkbox are freed. Once a slab has no chunks
+ * it's pages are discarded and empty slabs beyond the retained count are unmapped.
  *
- * Should all types of chunkbuffers implement a collection -interface so two mark and deallocation queues can be used for all types of chunkbuffers.
- * The mark thread should contain different marking implementations for all data structures (i.e. how to navigate a hash array trie forest v.s. a list forest)
- * 
  * \author Mikko Kuitunen (mikko <dot> kuitunen <at> iki <dot> fi)
  * */
 #pragma once
 
 
+#include "orb_lib.h"
+#include "allocators.h"
 #include "math_tools.h"
 #include "shims_and_types.h"
 #include <cassert>
@@ -51,41 +70,299 @@
 #include<sstream>
 #include<new>
 #include<algorithm>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<future>
+#include<vector>
+#include<thread>
+#include<map>
 
 
 #define CHUNK_BUFFER_SIZE 32
 
 namespace orb{
 
-/** Chunk. Can be used only for storing classes with parameterless constructor and a destructor.*/
-template<class T>
+/////////// Collector threads //////////////
+
+/** Threads shared by the collectors of all pools: a set of marking threads and one collector
+ *  thread that runs the marking and deallocation of the collection cycles in the background. */
+class ORB_LIB GcWorkers
+{
+public:
+    static GcWorkers& instance();
+
+    GcWorkers();
+    ~GcWorkers();
+
+    /** Number of threads used for marking, the thread calling run_parallel included. */
+    size_t thread_count() const;
+
+    /** Set number of marking threads. Zero selects the hardware concurrency.*/
+    void set_thread_count(size_t count);
+
+    /** If concurrent is false collection cycles are run to completion on the calling thread. */
+    bool concurrent() const;
+    void set_concurrent(bool concurrent);
+
+    /** Run task(thread_index) on each marking thread. Returns once all have finished. */
+    void run_parallel(const std::function<void(size_t)>& task);
+
+    /** Run job on the collector thread (or immediately if not concurrent).
+     *  @return future that becomes ready once the job has finished.*/
+    std::shared_future<void> run_cycle(const std::function<void()>& job);
+
+private:
+    GcWorkers(const GcWorkers&);
+    GcWorkers& operator=(const GcWorkers&);
+
+    void start_threads(size_t count);
+    void stop_threads();
+    void marker_loop(size_t index);
+    void collector_loop();
+
+    std::vector<std::thread>                    markers_;
+    std::thread                                 collector_;
+    std::mutex                                  mutex_;
+    std::mutex                                  parallel_mutex_;
+    std::condition_variable                     task_ready_;
+    std::condition_variable                     task_done_;
+    std::condition_variable                     cycle_ready_;
+    const std::function<void(size_t)>*          task_;
+    uint64_t                                    generation_;
+    size_t                                      running_;
+    std::list<std::packaged_task<void()>>       cycles_;
+    bool                                        concurrent_;
+    bool                                        stop_;
+};
+
+/** Marks a graph of nodes using all marking threads. Each thread works from it's own stack and
+ *  shares surplus work on a common stack from which idle threads pick up more nodes.
+ *  The visit function is called as visit(node, stack) and must push the children of the
+ *  node to stack if the node was not marked previously. */
+template<class P>
+class ParallelMarker
+{
+public:
+    template<class Visit>
+    static void run(const std::vector<P>& roots, Visit visit)
+    {
+        GcWorkers& workers = GcWorkers::instance();
+        ParallelMarker marker(roots, workers.thread_count());
+        workers.run_parallel([&marker, &visit](size_t){marker.work(visit);});
+    }
+
+private:
+    enum{BATCH_SIZE = 64, SHARE_LIMIT = 256};
+
+    ParallelMarker(const std::vector<P>& roots, size_t threads)
+        :shared_(roots), threads_(threads), idle_(0), done_(false){}
+
+    /** Take work from shared stack to local. Returns false once all threads have run out of work.*/
+    bool take(std::vector<P>& local)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for(;;)
+        {
+            if(done_) return false;
+            if(!shared_.empty())
+            {
+                size_t count = std::min<size_t>(shared_.size(), BATCH_SIZE);
+                local.insert(local.end(), shared_.end() - count, shared_.end());
+                shared_.resize(shared_.size() - count);
+                return true;
+            }
+            if(++idle_ == threads_)
+            {
+                done_ = true;
+                wake_.notify_all();
+                return false;
+            }
+            wake_.wait(lock);
+            --idle_;
+        }
+    }
+
+    void share(std::vector<P>& local)
+    {
+        size_t count = local.size() / 2;
+        std::lock_guard<std::mutex> lock(mutex_);
+        shared_.insert(shared_.end(), local.begin(), local.begin() + count);
+        local.erase(local.begin(), local.begin() + count);
+        wake_.notify_all();
+    }
+
+    template<class Visit>
+    void work(Visit& visit)
+    {
+        std::vector<P> local;
+        while(take(local))
+        {
+            while(!local.empty())
+            {
+                P p = local.back();
+                local.pop_back();
+                if(p) visit(p, local);
+                if(local.size() > SHARE_LIMIT) share(local);
+            }
+        }
+    }
+
+    std::vector<P>          shared_;
+    size_t                  threads_;
+    size_t                  idle_;
+    bool                    done_;
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+};
+
+/** Bitmap of N bits stored in 64 bit words. */
+template<size_t N>
+struct ChunkBitmap
+{
+    enum{WORDS = (N + 63) / 64};
+
+    uint64_t words[WORDS];
+
+    ChunkBitmap(){clear();}
+
+    /** Mask of the valid bits in the last word.*/
+    static uint64_t last_mask(){return (N % 64) == 0 ? ~uint64_t(0) : ((uint64_t(1) << (N % 64)) - 1);}
+
+    void clear(){for(size_t w = 0; w < WORDS; ++w) words[w] = 0;}
+
+    bool test(size_t i) const {return (words[i / 64] >> (i % 64)) & 0x1;}
+    void set(size_t i){words[i / 64] |= uint64_t(1) << (i % 64);}
+    void reset(size_t i){words[i / 64] &= ~(uint64_t(1) << (i % 64));}
+
+    void set_range(size_t first, size_t count){for(size_t i = first; i < first + count; ++i) set(i);}
+
+    bool none() const
+    {
+        for(size_t w = 0; w < WORDS; ++w) if(words[w]) return false;
+        return true;
+    }
+
+    bool all() const
+    {
+        for(size_t w = 0; w + 1 < WORDS; ++w) if(~words[w]) return false;
+        return words[WORDS - 1] == last_mask();
+    }
+
+    size_t count() const
+    {
+        size_t c = 0;
+        for(size_t w = 0; w < WORDS; ++w) c += popcount64(words[w]);
+        return c;
+    }
+
+    /** Index of the first bit with value at or after start, or N if not found.*/
+    size_t find(bool value, size_t start) const
+    {
+        if(start >= N) return N;
+        size_t w = start / 64;
+        uint64_t word = (value ? words[w] : ~words[w]) & (~uint64_t(0) << (start % 64));
+        for(;;)
+        {
+            if(word)
+            {
+                size_t i = w * 64 + count_trailing_zeros64(word);
+                return i < N ? i : N;
+            }
+            if(++w == WORDS) return N;
+            word = value ? words[w] : ~words[w];
+        }
+    }
+
+    /** Index of the first run of count unset bits, or N if not found.*/
+    size_t find_zero_run(size_t count) const
+    {
+        size_t i = find(false, 0);
+        while(i + count <= N)
+        {
+            size_t end = find(true, i);
+            if(end - i >= count) return i;
+            i = find(false, end);
+        }
+        return N;
+    }
+
+    /** Call f(index) for each set bit. */
+    template<class F>
+    void for_each_set(F f) const
+    {
+        for(size_t w = 0; w < WORDS; ++w)
+        {
+            uint64_t word = words[w];
+            while(word)
+            {
+                f(w * 64 + count_trailing_zeros64(word));
+                word &= word - 1;
+            }
+        }
+    }
+};
+
+/** Bitmap that can be set from several threads. */
+template<size_t N>
+struct AtomicChunkBitmap
+{
+    enum{WORDS = ChunkBitmap<N>::WORDS};
+
+    std::atomic<uint64_t> words[WORDS];
+
+    AtomicChunkBitmap(){clear();}
+
+    void clear(){for(size_t w = 0; w < WORDS; ++w) words[w].store(0, std::memory_order_relaxed);}
+
+    /** Set bit. Returns true if the bit was not set before. */
+    bool set(size_t i)
+    {
+        uint64_t bit = uint64_t(1) << (i % 64);
+        return (words[i / 64].fetch_or(bit) & bit) == 0;
+    }
+
+    ChunkBitmap<N> load() const
+    {
+        ChunkBitmap<N> b;
+        for(size_t w = 0; w < WORDS; ++w) b.words[w] = words[w].load();
+        return b;
+    }
+};
+
+/** Chunk. Can be used only for storing classes with parameterless constructor and a destructor.
+ *  Stores N slots.*/
+template<class T, size_t N = CHUNK_BUFFER_SIZE>
 struct Chunk
 {
-    typename std::aligned_storage <sizeof(T), std::alignment_of<T>::value>::type buffer[CHUNK_BUFFER_SIZE];
-
-    /** Used for storing the allocation state of buffer, with array position matching bit position
-     *  1<<i : buffer[i]
-     *  i.e the expression
-     *  used_elements = 1<<n means buffer[n] is allocated.*/
-    uint32_t used_elements;
-    uint32_t mark_field; // use for garbage collection
+    enum{SIZE = N};
+    typedef ChunkBitmap<N> bitmap;
+
+    typename std::aligned_storage <sizeof(T), std::alignment_of<T>::value>::type buffer[N];
+
+    /** Used for storing the allocation state of buffer, with bit position matching array position
+     *  i.e. used_elements.test(n) means buffer[n] is allocated.*/
+    bitmap   used_elements;
+    AtomicChunkBitmap<N> mark_field; // use for garbage collection, set from marking threads
+    bitmap   young_field; // slots reserved after the previous collection, see ChunkBox::minor_begin
           
     Chunk*   next;
+    size_t   index;       // position in ChunkBox
 
     Chunk(){
-        used_elements = 0;
-        mark_field = 0;
         next = 0;
-        memset(buffer, 0 , CHUNK_BUFFER_SIZE * sizeof(T));
+        index = 0;
+        memset(buffer, 0 , N * sizeof(T));
     }
 
-    bool is_full(){return (used_elements == 0xffffffff);}
+    bool is_full() const {return used_elements.all();}
+    bool is_empty() const {return used_elements.none();}
 
     T* get_new()
     {
-        if(is_full()) return 0;
-        uint32_t index = lowest_unset_bit(used_elements);
-        used_elements = set_bit_on(used_elements, index);
+        size_t index = used_elements.find(false, 0);
+        if(index == N) return 0;
+        used_elements.set(index);
         T* address = ((T*)buffer) + index;
         T* t = new(address)T;
         return t;
@@ -93,63 +370,51 @@ struct Chunk
    
     T* at(size_t index) 
     {
-        return ((T*)buffer)[index];
+        return ((T*)buffer) + index;
     }
 
+    /** Return pointer to start of array if enough consecutive slots are found.*/
     T* get_new_array(const size_t count)
     {
         T* result = 0;
 
-        if(count > CHUNK_BUFFER_SIZE) return result;
-
-        // Return pointer to start of array if enough consecutive slots are found.
-        // Try to find a position where there are count free bits-
- 
-        // First make a mask such as 000001111 where the number of set fields is equal to the
-        // number of elements stored. 
-        uint32_t mask = 0;
-        uint32_t i = count;
-        while(i--) mask |= (1 << (i));
-        
-        uint32_t positions_to_search = CHUNK_BUFFER_SIZE - count + 1;
-        uint32_t array_start_index = 0;
+        if(count > N) return result;
 
-        while(positions_to_search--)
+        size_t array_start_index = used_elements.find_zero_run(count);
+        if(array_start_index != N)
         {
-            if((used_elements & mask) == 0)
-            {
-                result = ((T*) buffer) + array_start_index;
-                T* tmp;
-                for(size_t i = 0; i  < count; ++i) tmp = new(result + i)T;
-                (void) tmp;
-                used_elements |= mask;
-                break;
-            }
-            mask <<= 1;
-            array_start_index++;
+            result = ((T*) buffer) + array_start_index;
+            T* tmp;
+            for(size_t i = 0; i  < count; ++i) tmp = new(result + i)T;
+            (void) tmp;
+            used_elements.set_range(array_start_index, count);
         }
 
         return result;
     }
 
-    void set_marked(const T* ptr)
+    /** Index of slot. Pointers outside the chunk give an index >= N. */
+    size_t slot_index(const T* ptr) const
     {
-        uint32_t index = ptr - ((T*)buffer);
-        // Note: if ptr < buffer, then index will wrap (to a very large number >> CHUNK_BUFFER_SIZE)
-        // and the following clause will be false.
-        if(index < CHUNK_BUFFER_SIZE)
-        {
-            mark_field = set_bit_on(mark_field, index);
-        }
+        // Note: if ptr < buffer, then index will wrap (to a very large number >> N).
+        return size_t(ptr - ((const T*)buffer));
     }
 
-    T* begin(){return buffer;}
-    T* end(){return buffer + CHUNK_BUFFER_SIZE;}
+    /** Mark slot. Returns true if the slot was not marked before. */
+    bool set_marked(const T* ptr)
+    {
+        size_t index = slot_index(ptr);
+        if(index < N) return mark_field.set(index);
+        return false;
+    }
+
+    T* begin(){return (T*) buffer;}
+    T* end(){return ((T*) buffer) + N;}
 
     bool contains(const T* ptr)
     {
         return ptr >= ((T*) buffer) &&
-               ptr < (((T*) buffer) + CHUNK_BUFFER_SIZE);
+               ptr < (((T*) buffer) + N);
     }
 
     bool set_marked_if_contains(const T* elem)
@@ -166,7 +431,7 @@ struct Chunk
     bool set_marked_if_contains_array(const T* start, const size_t count)
     {
         bool result = false;
-        if(contains(start) && ((start - ((T*)buffer)) + count) <= CHUNK_BUFFER_SIZE)
+        if(contains(start) && ((start - ((T*)buffer)) + count) <= N)
         {
             for(size_t i = 0; i < count; ++i) set_marked(start + i);
 
@@ -175,50 +440,232 @@ struct Chunk
         return result;
     }
 
-    /** For each used/marked bit */
-    void collect_marked()
+    /** Deallocate the slots in candidates that are used but not marked.*/
+    void collect_unmarked(const bitmap& candidates)
     {
-        uint32_t is_used = (used_elements ^ mark_field) & used_elements;
-                              // 1 ^ 0 = 1
-        for(int index = 0; index < CHUNK_BUFFER_SIZE; ++index)
+        bitmap marked = mark_field.load();
+        bitmap dead;
+        for(size_t w = 0; w < bitmap::WORDS; ++w)
+            dead.words[w] = candidates.words[w] & used_elements.words[w] & ~marked.words[w];
+
+        T* slots = (T*) buffer;
+        bitmap& used = used_elements;
+        dead.for_each_set([slots, &used](size_t index)
         {
-            // If field is used but unmarked as active
-            if((is_used >> index)&0x1)
-            {
-                // Set slot unused and call destructor on allocated memory
-                used_elements = set_bit_off(used_elements, index);
-                T* t = &((T*)buffer)[index];
-                t->~T();
-            }
-        }
+            // Set slot unused and call destructor on allocated memory
+            used.reset(index);
+            slots[index].~T();
+        });
+    }
+
+    /** Deallocate used slots that are not marked.*/
+    void collect_marked()
+    {
+        collect_unmarked(used_elements);
     }
 
     /** Return total size used. */
     size_t reserved_size_bytes() const {return sizeof(*this);}
 
     /** Return size of referred storage used. */
-    size_t live_size_bytes() const {return sizeof(T) * count_bits(used_elements);}
+    size_t live_size_bytes() const {return sizeof(T) * used_elements.count();}
 
 };
 
 
-template<class T>
+/** Memory usage of chunk storage. */
+struct ChunkStats
+{
+    enum{OCCUPANCY_BINS = 4};
+
+    size_t chunk_count;
+    size_t empty_chunk_count;
+    size_t live_bytes;       //> Bytes in used slots
+    size_t chunk_bytes;      //> Bytes in chunks
+    size_t mapped_bytes;     //> Bytes in slabs mapped from the OS
+    size_t discarded_bytes;  //> Bytes in slabs returned to the OS with page_discard
+    size_t occupancy[OCCUPANCY_BINS]; //> Chunk count by share of used slots: (0,1/4], (1/4,1/2], (1/2,3/4], (3/4,1]
+
+    ChunkStats():chunk_count(0), empty_chunk_count(0), live_bytes(0), chunk_bytes(0), mapped_bytes(0),
+        discarded_bytes(0)
+    {
+        for(size_t i = 0; i < OCCUPANCY_BINS; ++i) occupancy[i] = 0;
+    }
+
+    /** Add a non-empty chunk with used of size slots in use to the occupancy histogram.*/
+    void add_occupancy(size_t used, size_t size)
+    {
+        size_t bin = (used * OCCUPANCY_BINS - 1) / size;
+        occupancy[bin < OCCUPANCY_BINS ? bin : OCCUPANCY_BINS - 1]++;
+    }
+
+    ChunkStats& operator+=(const ChunkStats& s)
+    {
+        chunk_count += s.chunk_count;
+        empty_chunk_count += s.empty_chunk_count;
+        live_bytes += s.live_bytes;
+        chunk_bytes += s.chunk_bytes;
+        mapped_bytes += s.mapped_bytes;
+        discarded_bytes += s.discarded_bytes;
+        for(size_t i = 0; i < OCCUPANCY_BINS; ++i) occupancy[i] += s.occupancy[i];
+        return *this;
+    }
+
+    /** Share of chunk memory not in use by live slots. */
+    double fragmentation() const {return chunk_bytes > 0 ? 1.0 - double(live_bytes) / double(chunk_bytes) : 0.0;}
+};
+
+/** Reference counts of the roots of a pool by node, see e.g. PListPool::root_refcounts. */
+typedef std::map<const void*, int> RootRefcounts;
+
+/** Storage for chunks. Chunks are allocated from slabs mapped directly from the OS. Once all chunks
+ *  of a slab are freed the physical pages of the slab are discarded. Empty slabs exceeding
+ *  the retained count are unmapped. */
+template<class C>
+class ChunkSlabs
+{
+public:
+    ChunkSlabs():retained_slabs_(1), discarded_count_(0)
+    {
+        size_t page = page_size();
+        size_t bytes = std::max<size_t>(SLAB_MIN_BYTES, sizeof(C) * 16);
+        slab_bytes_ = ((bytes + page - 1) / page) * page;
+        chunks_per_slab_ = slab_bytes_ / sizeof(C);
+    }
+
+    ~ChunkSlabs()
+    {
+        for(auto s = slabs_.begin(); s != slabs_.end(); ++s)
+        {
+            page_free(s->second.base, slab_bytes_);
+        }
+    }
+
+    C* allocate()
+    {
+        if(available_.empty()) map_slab();
+
+        Slab* slab = available_.back();
+        C* slot = slab->free.back();
+        slab->free.pop_back();
+
+        if(slab->used++ == 0 && slab->discarded)
+        {
+            slab->discarded = false;
+            --discarded_count_;
+        }
+        if(slab->free.empty()) available_.pop_back();
+
+        return new(slot) C;
+    }
+
+    void release(C* c)
+    {
+        c->~C();
+
+        Slab* slab = find_slab(c);
+        if(slab->free.empty()) available_.push_back(slab);
+        slab->free.push_back(c);
+
+        if(--slab->used == 0)
+        {
+            page_discard(slab->base, slab_bytes_);
+            slab->discarded = true;
+            ++discarded_count_;
+        }
+    }
+
+    /** Unmap empty slabs exceeding the retained count.*/
+    void trim()
+    {
+        size_t empty = discarded_count_;
+        for(auto s = slabs_.begin(); s != slabs_.end() && empty > retained_slabs_;)
+        {
+            if(s->second.used == 0)
+            {
+                Slab* slab = &s->second;
+                available_.erase(std::remove(available_.begin(), available_.end(), slab), available_.end());
+                page_free(slab->base, slab_bytes_);
+                if(slab->discarded) --discarded_count_;
+                s = slabs_.erase(s);
+                --empty;
+            }
+            else ++s;
+        }
+    }
+
+    /** Number of empty slabs kept mapped for reuse. */
+    void set_retained_slabs(size_t count){retained_slabs_ = count;}
+
+    size_t mapped_bytes() const {return slabs_.size() * slab_bytes_;}
+    size_t discarded_bytes() const {return discarded_count_ * slab_bytes_;}
+
+private:
+    enum{SLAB_MIN_BYTES = 64 * 1024};
+
+    struct Slab
+    {
+        char*           base;
+        size_t          used;
+        bool            discarded;
+        std::vector<C*> free;
+    };
+
+    ChunkSlabs(const ChunkSlabs&);
+    ChunkSlabs& operator=(const ChunkSlabs&);
+
+    void map_slab()
+    {
+        char* base = (char*) page_alloc(slab_bytes_);
+        if(!base) throw std::bad_alloc();
+
+        Slab& slab = slabs_[base];
+        slab.base = base;
+        slab.used = 0;
+        slab.discarded = false;
+        for(size_t i = chunks_per_slab_; i-- > 0;) slab.free.push_back(((C*) base) + i);
+        available_.push_back(&slab);
+    }
+
+    Slab* find_slab(const C* c)
+    {
+        auto s = slabs_.upper_bound((char*) c);
+        --s;
+        return &s->second;
+    }
+
+    std::map<char*, Slab> slabs_;     //> By base address
+    std::vector<Slab*>    available_; //> Slabs with free chunk slots
+    size_t                slab_bytes_;
+    size_t                chunks_per_slab_;
+    size_t                retained_slabs_;
+    size_t                discarded_count_;
+};
+
+/** Chunk storage. N is the number of slots in each chunk.*/
+template<class T, size_t N = CHUNK_BUFFER_SIZE>
 class ChunkBox
 {
 public:
-    typedef Chunk<T>                        chunk_type;
-    typedef std::list<chunk_type>           chunk_container;
-    typedef typename std::list<chunk_type>::iterator iterator;
+    typedef Chunk<T, N>                     chunk_type;
+    typedef std::vector<chunk_type*>        chunk_container;
+    typedef typename chunk_container::iterator iterator;
     
-    ChunkBox()
+    ChunkBox():group_count_(4), has_released_(false), young_count_(0), allocated_bytes_(0), retained_empty_chunks_(16)
     {
         free_chunks_ = new_chunk();
     }
 
+    ~ChunkBox()
+    {
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c) slabs_.release(*c);
+    }
+
     chunk_type* new_chunk()
     {
-        chunks_.push_back(chunk_type());
-        chunk_type* chunk = &chunks_.back();
+        chunk_type* chunk = slabs_.allocate();
+        chunk->index = chunks_.size();
+        chunks_.push_back(chunk);
         return chunk;
     }
 
@@ -226,10 +673,14 @@ public:
     {
         T* elem = 0;
 
+        if(has_released_.load(std::memory_order_acquire)) adopt_released_chunks();
+        if(!free_chunks_) free_chunks_ = new_chunk();
+
         if(free_chunks_)
         {
             elem = free_chunks_->get_new();
             chunk_type* chunk = free_chunks_;
+            set_young(chunk, elem, 1);
             // Check if free chunks is still free or do we need new chunks
             if(chunk->is_full())
             {
@@ -254,8 +705,10 @@ public:
     T* reserve_consecutive_elements(const size_t element_count)
     {
         T* result = 0;
-        if(element_count <= CHUNK_BUFFER_SIZE)
+        if(element_count <= N)
         {
+            if(has_released_.load(std::memory_order_acquire)) adopt_released_chunks();
+
             chunk_type* chunk = free_chunks_;
             chunk_type* first_chunk =  chunk;
             chunk_type* prev_chunk = 0;
@@ -264,6 +717,7 @@ public:
             {
                 if((result = chunk->get_new_array(element_count))) 
                 {
+                    set_young(chunk, result, element_count);
                     // Check if chunk still has space left and if not maintain free node list
                     if(chunk->is_full())
                     {
@@ -303,7 +757,7 @@ public:
                 // free list if the array does not consume it completely.
                 chunk_type* created_chunk = new_chunk();
 
-                if(element_count < CHUNK_BUFFER_SIZE)
+                if(element_count < N)
                 {
                     created_chunk->next = free_chunks_;
                     free_chunks_ = created_chunk;
@@ -311,6 +765,7 @@ public:
 
                 // At this point we know the operation cannot fail.
                 result = created_chunk->get_new_array(element_count);
+                set_young(created_chunk, result, element_count);
             }
         }
 
@@ -320,12 +775,13 @@ public:
     void refresh_free_chunk_list()
     {
         free_chunks_ = 0;
-        for(auto chunk = chunks_.begin(); chunk != chunks_.end(); ++chunk)
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
         {
+            chunk_type* chunk = *c;
             if(!chunk->is_full())
             {
                 chunk->next = free_chunks_;
-                free_chunks_ = &(*chunk);
+                free_chunks_ = chunk;
             }
         }
     }
@@ -334,7 +790,7 @@ public:
     {
         for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
         {
-            c->mark_field = 0;
+            (*c)->mark_field.clear();
         }
     }
 
@@ -343,121 +799,598 @@ public:
     void collect_chunks()
     {
         free_chunks_ = 0;
-        for(auto chunk = begin(); chunk != end(); ++chunk)
+        for(auto c = begin(); c != end(); ++c)
         {
+            chunk_type* chunk = *c;
             chunk->collect_marked();
 
             if(!chunk->is_full())
             {
                 chunk->next = free_chunks_;
-                free_chunks_ = &(*chunk);
+                free_chunks_ = chunk;
             }
         }
     }
 
     void set_marked_if_contained(const T* ptr)
     {
-        std::for_each(begin(), end(), [&ptr](chunk_type& c){c.set_marked_if_contains(ptr);});
+        std::for_each(begin(), end(), [&ptr](chunk_type* c){c->set_marked_if_contains(ptr);});
     }
     
     void set_marked_if_contained_array(const T* ptr, size_t size)
     {
         // TODO replace for_each with a loop that break immediately whem a match is found.
-        std::for_each(begin(), end(), [&ptr, &size](chunk_type& c){c.set_marked_if_contains_array(ptr, size);});
+        std::for_each(begin(), end(), [&ptr, &size](chunk_type* c){c->set_marked_if_contains_array(ptr, size);});
     }
 
-    iterator begin(){return chunks_.begin();}
-    iterator end(){return chunks_.end();}
+    /////// Collection cycle ///////
 
-    chunk_container& chunks(){return chunks_;}
-    chunk_type* free_chunks(){return free_chunks_;}
+    /** Number of gc-groups the locked chunks are divided to. */
+    size_t group_count() const {return group_count_;}
+    void set_group_count(size_t count){group_count_ = count > 0 ? count : 1;}
 
-    size_t reserved_size_bytes() const {
-        return sizeof(chunk_type) * chunks_.size();
+    /** Lock all current chunks from allocation for a collection cycle and clear their marks. Until the
+     *  gc-groups are released new elements are reserved from fresh chunks. */
+    void lock_for_collection()
+    {
+        if(has_released_.load(std::memory_order_acquire)) adopt_released_chunks();
+
+        locked_.clear();
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
+        {
+            chunk_type* chunk = *c;
+            chunk->next = 0;
+            chunk->mark_field.clear();
+            chunk->young_field.clear(); // Full collection, all survivors are old.
+            locked_.push_back(chunk);
+        }
+        young_.clear();
+        young_count_ = 0;
+
+        // Sort by address so the chunk containing a slot can be searched for.
+        std::sort(locked_.begin(), locked_.end());
+
+        free_chunks_ = 0;
     }
 
-    size_t live_size_bytes() const
+    /** Return the chunk in sorted chunk vector containing ptr or null.*/
+    static chunk_type* find_chunk(const std::vector<chunk_type*>& chunks, const T* ptr)
     {
-        auto collect = [](size_t r, const chunk_type& t)->size_t {return r + t.live_size_bytes();};
-        size_t init = 0;
-        return fold_left<size_t, chunk_container>(init, collect, chunks_);
+        auto i = std::upper_bound(chunks.begin(), chunks.end(), ptr,
+                                  [](const T* p, chunk_type* c){return p < (const T*) c->buffer;});
+        if(i == chunks.begin()) return 0;
+        --i;
+        return (*i)->contains(ptr) ? *i : 0;
     }
 
-private:
-    chunk_container chunks_;
-    chunk_type*     free_chunks_;
-};
+    /** Return the locked chunk containing ptr or null.*/
+    chunk_type* find_locked(const T* ptr) const {return find_chunk(locked_, ptr);}
 
+    /** Mark slot if it is in a locked chunk. Can be called from several threads.
+     *  @return true if the slot was not marked before.*/
+    bool set_marked_if_locked(const T* ptr)
+    {
+        chunk_type* chunk = find_locked(ptr);
+        return chunk ? chunk->set_marked(ptr) : false;
+    }
 
-/////////// Persistent list //////////////
-
-/** Pool manager and collector for persistent lists. 
- *  Not a particularly efficient implementation. */
-template<class T>
-class PListPool
-{
-public:
+    /** Mark slots of an array if it is in a locked chunk.
+     *  @return true if the first slot was not marked before.*/
+    bool set_marked_if_locked_array(const T* ptr, size_t count)
+    {
+        chunk_type* chunk = find_locked(ptr);
+        bool result = false;
+        if(chunk)
+        {
+            result = chunk->set_marked(ptr);
+            for(size_t i = 1; i < count; ++i) chunk->set_marked(ptr + i);
+        }
+        return result;
+    }
 
-    /** List node. */
-    struct Node
+    /** Deallocate the unmarked slots in the chunks of the given gc-group and release the chunks
+     *  for allocation. Called from the collector thread once marking is done.*/
+    void sweep_group(size_t group)
     {
-        Node* next;
-        T     data;
-    };
+        size_t count = locked_.size();
+        size_t first = (count * group) / group_count_;
+        size_t last  = (count * (group + 1)) / group_count_;
 
-    /** Stores head to List */
-    class List
+        for(size_t i = first; i < last; ++i) locked_[i]->collect_marked();
+
+        std::lock_guard<std::mutex> lock(released_mutex_);
+        released_.insert(released_.end(), locked_.begin() + first, locked_.begin() + last);
+        has_released_.store(true, std::memory_order_release);
+    }
+
+    /** Sweep all gc-groups. */
+    void sweep_locked()
     {
-    public:
-        struct iterator
-        {
-            Node* node;
-            iterator():node(0){}
-            iterator(Node* n):node(n){}
-            const T& operator*() const {return node->data;}
-            T& operator*() {return node->data;}
-            const T* operator->() const {return &(node->data);}
-            T* operator->() {return &(node->data);}
-            T* data_ptr() {return &node->data;}
-            void operator++(){if(node) node = node->next;}
-            bool operator!=(const iterator& i) const {return node != i.node;}
-            bool operator==(const iterator& i) const {return node == i.node;}
-        };
+        for(size_t g = 0; g < group_count_; ++g) sweep_group(g);
+        locked_.clear();
+    }
 
-    public:
+    /////// Audit ///////
 
-        typedef T value_type;
+    /** Bytes of the marked slots in the locked chunks. */
+    size_t marked_bytes_locked() const
+    {
+        size_t count = 0;
+        for(auto c = locked_.begin(); c != locked_.end(); ++c) count += (*c)->mark_field.load().count();
+        return count * sizeof(T);
+    }
 
-        List(PListPool& pool, Node* head):pool_(pool), head_(head){if(head_) pool_.add_ref(head_);}
-        ~List(){if(head_) pool_.remove_ref(head_);}
-       
-        List(const List& old_list):pool_(old_list.pool_), head_(old_list.head_)
-        {
-            if(head_) pool_.add_ref(head_);
-        }
+    /** Release the locked chunks for allocation without deallocating anything. Ends a cycle
+     *  that only marks.*/
+    void release_locked()
+    {
+        std::lock_guard<std::mutex> lock(released_mutex_);
+        released_.insert(released_.end(), locked_.begin(), locked_.end());
+        has_released_.store(true, std::memory_order_release);
+        locked_.clear();
+    }
 
-        List(List&& temp_list):pool_(temp_list.pool_), head_(temp_list.head_)
+    /** Number of slots whose allocation bit differs from their mark. Right after a full
+     *  collection the used slots are exactly the reachable ones, so any mismatch is a slot
+     *  freed while reachable.*/
+    size_t mark_mismatches() const
+    {
+        size_t count = 0;
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
         {
-            temp_list.head_ = 0;
+            typename chunk_type::bitmap marked = (*c)->mark_field.load();
+            for(size_t w = 0; w < chunk_type::bitmap::WORDS; ++w)
+                count += popcount64(marked.words[w] ^ (*c)->used_elements.words[w]);
         }
+        return count;
+    }
 
-        List& operator=(const List& list)
+    /** Move chunks released by the collector thread to the free chunk list. */
+    void adopt_released_chunks()
+    {
+        std::lock_guard<std::mutex> lock(released_mutex_);
+        for(auto c = released_.begin(); c != released_.end(); ++c)
         {
-            if(this != &list)
+            if(!(*c)->is_full())
             {
-                head_ = list.head_;
-                pool_ = list.pool_;
-                if(head_) pool_.add_ref(head_);
+                (*c)->next = free_chunks_;
+                free_chunks_ = *c;
             }
-            return *this;
         }
+        released_.clear();
+        has_released_.store(false, std::memory_order_release);
+    }
 
-        List& operator=(List&& list)
-        {
-            if(this != &list)
-            {
+    /////// Nursery ///////
+
+    // Slots reserved after the previous collection are young. Minor collection marks only the
+    // young slots reachable from the roots and deallocates the rest of them. The survivors are
+    // promoted in place by clearing their young bit - the slots cannot be moved as the handles
+    // refer to them directly.
+
+    /** Number of young slots.*/
+    size_t young_count() const {return young_count_;}
+
+    /** Bytes of all slots reserved since construction, freed or not. Monotonic.*/
+    size_t allocated_bytes() const {return allocated_bytes_;}
+
+    /** Prepare the chunks containing young slots for marking. Not to be called during a
+     *  collection cycle.*/
+    void minor_begin()
+    {
+        if(has_released_.load(std::memory_order_acquire)) adopt_released_chunks();
+
+        std::sort(young_.begin(), young_.end());
+        for(auto c = young_.begin(); c != young_.end(); ++c) (*c)->mark_field.clear();
+    }
+
+    /** Mark young slot. Can be called from several threads.
+     *  @return true if ptr is young and was not marked before.*/
+    bool set_marked_if_young(const T* ptr)
+    {
+        chunk_type* chunk = find_chunk(young_, ptr);
+        return chunk && chunk->young_field.test(chunk->slot_index(ptr)) ? chunk->set_marked(ptr) : false;
+    }
+
+    /** Mark young slots of an array. @return true if the first slot was young and not marked before.*/
+    bool set_marked_if_young_array(const T* ptr, size_t count)
+    {
+        bool result = set_marked_if_young(ptr);
+        if(result) for(size_t i = 1; i < count; ++i) set_marked_if_young(ptr + i);
+        return result;
+    }
+
+    /** Deallocate unmarked young slots and promote the marked ones.*/
+    void minor_sweep()
+    {
+        for(auto c = young_.begin(); c != young_.end(); ++c)
+        {
+            chunk_type* chunk = *c;
+            bool was_full = chunk->is_full();
+
+            chunk->collect_unmarked(chunk->young_field);
+            chunk->young_field.clear();
+            chunk->mark_field.clear();
+
+            // Chunks that are not full are already on the free list.
+            if(was_full && !chunk->is_full())
+            {
+                chunk->next = free_chunks_;
+                free_chunks_ = chunk;
+            }
+        }
+        young_.clear();
+        young_count_ = 0;
+    }
+
+    /////// Releasing memory ///////
+
+    /** Number of empty chunks kept for allocation after collection. */
+    size_t retained_empty_chunks() const {return retained_empty_chunks_;}
+    void set_retained_empty_chunks(size_t count){retained_empty_chunks_ = count;}
+
+    /** Return empty chunks exceeding the retained count to the slabs and unmap the slabs that
+     *  became empty. Not to be called during a collection cycle.*/
+    void release_empty_chunks()
+    {
+        if(has_released_.load(std::memory_order_acquire)) adopt_released_chunks();
+
+        size_t kept = 0;
+        bool released = false;
+        for(size_t i = 0; i < chunks_.size();)
+        {
+            chunk_type* chunk = chunks_[i];
+            if(chunk->is_empty() && chunk->young_field.none() && kept++ >= retained_empty_chunks_)
+            {
+                // Replace by the last chunk.
+                chunks_[i] = chunks_.back();
+                chunks_[i]->index = i;
+                chunks_.pop_back();
+                slabs_.release(chunk);
+                released = true;
+            }
+            else ++i;
+        }
+
+        if(released)
+        {
+            slabs_.trim();
+            refresh_free_chunk_list();
+        }
+    }
+
+    iterator begin(){return chunks_.begin();}
+    iterator end(){return chunks_.end();}
+
+    chunk_container& chunks(){return chunks_;}
+    chunk_type* free_chunks(){return free_chunks_;}
+
+    size_t reserved_size_bytes() const {
+        return sizeof(chunk_type) * chunks_.size();
+    }
+
+    size_t live_size_bytes() const
+    {
+        auto collect = [](size_t r, const chunk_type* t)->size_t {return r + t->live_size_bytes();};
+        size_t init = 0;
+        return fold_left<size_t, chunk_container>(init, collect, chunks_);
+    }
+
+    ChunkStats stats() const
+    {
+        ChunkStats s;
+        s.chunk_count = chunks_.size();
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
+        {
+            size_t used = (*c)->used_elements.count();
+            if(used == 0) s.empty_chunk_count++;
+            else s.add_occupancy(used, chunk_type::SIZE);
+        }
+        s.live_bytes = live_size_bytes();
+        s.chunk_bytes = reserved_size_bytes();
+        s.mapped_bytes = slabs_.mapped_bytes();
+        s.discarded_bytes = slabs_.discarded_bytes();
+        return s;
+    }
+
+private:
+    ChunkBox(const ChunkBox&);
+    ChunkBox& operator=(const ChunkBox&);
+
+    void set_young(chunk_type* chunk, const T* first, size_t count)
+    {
+        if(!first) return;
+        if(chunk->young_field.none()) young_.push_back(chunk);
+        chunk->young_field.set_range(chunk->slot_index(first), count);
+        young_count_ += count;
+        allocated_bytes_ += sizeof(T) * count;
+    }
+
+    ChunkSlabs<chunk_type>   slabs_;
+    chunk_container          chunks_;
+    chunk_type*              free_chunks_;
+
+    size_t                   group_count_;
+    std::vector<chunk_type*> locked_;       //> Chunks of the ongoing collection cycle, by address
+    std::vector<chunk_type*> released_;     //> Swept chunks waiting to be adopted to free list
+    std::mutex               released_mutex_;
+    std::atomic<bool>        has_released_;
+
+    std::vector<chunk_type*> young_;        //> Chunks containing young slots
+    size_t                   young_count_;
+    size_t                   allocated_bytes_;  //> Bytes of slots reserved over the lifetime of the box
+
+    size_t                   retained_empty_chunks_;
+};
+
+/** Fixed size array stored in one chunk slot. */
+template<class T, size_t Count>
+struct ChunkArray
+{
+    T elems[Count];
+};
+
+/** Storage for arrays of 1 to MaxCount elements. Each array length has it's own chunkbox where
+ *  an array takes a single slot (a size class), so reserving an array takes the first free slot
+ *  of the class instead of searching a chunk for enough consecutive free slots. Each chunk stores
+ *  N arrays. The interface matches ChunkBox::reserve_consecutive_elements and the array variants
+ *  of marking.
+ *
+ *  Array<T, Count> is the type stored in one slot. It's address must convert to the T* returned
+ *  by reserve_consecutive_elements, like ChunkArray or a block starting with a T header.*/
+template<class T, size_t MaxCount, size_t N = CHUNK_BUFFER_SIZE,
+         template<class, size_t> class Array = ChunkArray>
+class SizeClassChunkBox
+{
+public:
+    SizeClassChunkBox()
+    {
+        add_classes(std::integral_constant<size_t, MaxCount>());
+    }
+
+    ~SizeClassChunkBox()
+    {
+        for(auto c = classes_.begin(); c != classes_.end(); ++c) delete *c;
+    }
+
+    /** Reserve array of count elements. @return first element or null if count is out of range.*/
+    T* reserve_consecutive_elements(const size_t count)
+    {
+        return (count > 0 && count <= MaxCount) ? classes_[count - 1]->reserve() : 0;
+    }
+
+    bool set_marked_if_locked_array(const T* ptr, size_t count)
+    {
+        return classes_[count - 1]->set_marked_if_locked(ptr);
+    }
+
+    bool set_marked_if_young_array(const T* ptr, size_t count)
+    {
+        return classes_[count - 1]->set_marked_if_young(ptr);
+    }
+
+    /** Number of gc-groups, same in each size class. */
+    size_t group_count() const {return classes_.front()->group_count();}
+
+    void lock_for_collection(){for_each_class([](SizeClass* c){c->lock_for_collection();});}
+    void sweep_group(size_t group){for_each_class([group](SizeClass* c){c->sweep_group(group);});}
+    void sweep_locked(){for_each_class([](SizeClass* c){c->sweep_locked();});}
+    void release_locked(){for_each_class([](SizeClass* c){c->release_locked();});}
+    size_t marked_bytes_locked() const {return sum([](const SizeClass* c){return c->marked_bytes_locked();});}
+    size_t mark_mismatches() const {return sum([](const SizeClass* c){return c->mark_mismatches();});}
+    void minor_begin(){for_each_class([](SizeClass* c){c->minor_begin();});}
+    void minor_sweep(){for_each_class([](SizeClass* c){c->minor_sweep();});}
+    void release_empty_chunks(){for_each_class([](SizeClass* c){c->release_empty_chunks();});}
+
+    /** Number of empty chunks kept for allocation in each size class. */
+    void set_retained_empty_chunks(size_t count)
+    {
+        for_each_class([count](SizeClass* c){c->set_retained_empty_chunks(count);});
+    }
+
+    size_t young_count() const {return sum([](const SizeClass* c){return c->young_count();});}
+    size_t allocated_bytes() const {return sum([](const SizeClass* c){return c->allocated_bytes();});}
+    size_t reserved_size_bytes() const {return sum([](const SizeClass* c){return c->reserved_size_bytes();});}
+    size_t live_size_bytes() const {return sum([](const SizeClass* c){return c->live_size_bytes();});}
+
+    ChunkStats stats() const
+    {
+        ChunkStats s;
+        for(auto c = classes_.begin(); c != classes_.end(); ++c) s += (*c)->stats();
+        return s;
+    }
+
+    /** Stats of the arrays of count elements.*/
+    ChunkStats class_stats(size_t count) const {return classes_[count - 1]->stats();}
+
+private:
+    SizeClassChunkBox(const SizeClassChunkBox&);
+    SizeClassChunkBox& operator=(const SizeClassChunkBox&);
+
+    /** Interface of a size class, hides the array type of the chunkbox.*/
+    struct SizeClass
+    {
+        virtual ~SizeClass(){}
+        virtual T* reserve() = 0;
+        virtual size_t group_count() const = 0;
+        virtual bool set_marked_if_locked(const T* ptr) = 0;
+        virtual bool set_marked_if_young(const T* ptr) = 0;
+        virtual void lock_for_collection() = 0;
+        virtual void sweep_group(size_t group) = 0;
+        virtual void sweep_locked() = 0;
+        virtual void release_locked() = 0;
+        virtual size_t marked_bytes_locked() const = 0;
+        virtual size_t mark_mismatches() const = 0;
+        virtual void minor_begin() = 0;
+        virtual void minor_sweep() = 0;
+        virtual void release_empty_chunks() = 0;
+        virtual void set_retained_empty_chunks(size_t count) = 0;
+        virtual size_t young_count() const = 0;
+        virtual size_t allocated_bytes() const = 0;
+        virtual size_t reserved_size_bytes() const = 0;
+        virtual size_t live_size_bytes() const = 0;
+        virtual ChunkStats stats() const = 0;
+    };
+
+    template<size_t Count>
+    struct ArrayClass : public SizeClass
+    {
+        typedef Array<T, Count> array_type;
+
+        ChunkBox<array_type, N> box;
+
+        T* reserve(){return (T*) box.reserve_element();}
+        size_t group_count() const {return box.group_count();}
+        bool set_marked_if_locked(const T* ptr){return box.set_marked_if_locked((const array_type*) ptr);}
+        bool set_marked_if_young(const T* ptr){return box.set_marked_if_young((const array_type*) ptr);}
+        void lock_for_collection(){box.lock_for_collection();}
+        void sweep_group(size_t group){box.sweep_group(group);}
+        void sweep_locked(){box.sweep_locked();}
+        void release_locked(){box.release_locked();}
+        size_t marked_bytes_locked() const {return box.marked_bytes_locked();}
+        size_t mark_mismatches() const {return box.mark_mismatches();}
+        void minor_begin(){box.minor_begin();}
+        void minor_sweep(){box.minor_sweep();}
+        void release_empty_chunks(){box.release_empty_chunks();}
+        void set_retained_empty_chunks(size_t count){box.set_retained_empty_chunks(count);}
+        size_t young_count() const {return box.young_count();}
+        size_t allocated_bytes() const {return box.allocated_bytes();}
+        size_t reserved_size_bytes() const {return box.reserved_size_bytes();}
+        size_t live_size_bytes() const {return box.live_size_bytes();}
+        ChunkStats stats() const {return box.stats();}
+    };
+
+    void add_classes(std::integral_constant<size_t, 0>){}
+
+    template<size_t Count>
+    void add_classes(std::integral_constant<size_t, Count>)
+    {
+        add_classes(std::integral_constant<size_t, Count - 1>());
+        classes_.push_back(new ArrayClass<Count>());
+    }
+
+    template<class F>
+    void for_each_class(F f){for(auto c = classes_.begin(); c != classes_.end(); ++c) f(*c);}
+
+    template<class F>
+    size_t sum(F f) const
+    {
+        size_t s = 0;
+        for(auto c = classes_.begin(); c != classes_.end(); ++c) s += f(*c);
+        return s;
+    }
+
+    std::vector<SizeClass*> classes_; //> Class of arrays of n elements at n - 1
+};
+
+
+/////////// Persistent list //////////////
+
+/** Pool manager and collector for persistent lists. 
+ *  The list is unrolled: each node stores up to NodeWidth elements and lists share structure at
+ *  node granularity. A list handle refers to a node and the index of it's first element in it.
+ *  The slots of a node are taken from the last one down, so adding an element to the front of a
+ *  list writes to the free slot below it's head if no other list has taken that slot already.
+ *  Only the elements are written in place, the links of a node never change after creation.
+ *  ChunkSize is the number of nodes in each chunk. */
+template<class T, size_t ChunkSize = CHUNK_BUFFER_SIZE, size_t NodeWidth = 8>
+class PListPool
+{
+public:
+
+    enum{WIDTH = NodeWidth};
+
+    /** List node. The elements are at [first, WIDTH), followed by those of next from next_index on.*/
+    struct Node
+    {
+        Node*    next;
+        uint32_t next_index;
+        uint32_t first;       //> Lowest slot taken by any list
+        T        data[WIDTH];
+
+        Node():next(0), next_index(0), first(WIDTH){}
+    };
+
+    /** Stores head to List */
+    class List
+    {
+    public:
+        struct iterator
+        {
+            Node*    node;
+            uint32_t index;
+            iterator():node(0), index(0){}
+            iterator(Node* n, uint32_t i):node(n), index(i){}
+            const T& operator*() const {return node->data[index];}
+            T& operator*() {return node->data[index];}
+            const T* operator->() const {return node->data + index;}
+            T* operator->() {return node->data + index;}
+            T* data_ptr() {return node->data + index;}
+            void operator++()
+            {
+                if(node && ++index == WIDTH)
+                {
+                    index = node->next_index;
+                    node = node->next;
+                }
+            }
+            bool operator!=(const iterator& i) const {return node != i.node || index != i.index;}
+            bool operator==(const iterator& i) const {return node == i.node && index == i.index;}
+        };
+
+    public:
+
+        typedef T value_type;
+
+        static const size_t UNKNOWN_SIZE = ~size_t(0);
+
+        List(PListPool& pool, Node* head, uint32_t index = 0, size_t size = UNKNOWN_SIZE):pool_(pool), head_(head),
+            index_(head ? index : 0), size_(head ? size : 0), hash_(0), hashed_(false)
+        {
+            if(head_) pool_.add_ref(head_);
+        }
+
+        ~List(){if(head_) pool_.remove_ref(head_);}
+       
+        List(const List& old_list):pool_(old_list.pool_), head_(old_list.head_), index_(old_list.index_),
+            size_(old_list.size_), hash_(old_list.hash_), hashed_(old_list.hashed_)
+        {
+            if(head_) pool_.add_ref(head_);
+        }
+
+        List(List&& temp_list):pool_(temp_list.pool_), head_(temp_list.head_), index_(temp_list.index_),
+            size_(temp_list.size_), hash_(temp_list.hash_), hashed_(temp_list.hashed_)
+        {
+            temp_list.head_ = 0;
+        }
+
+        List& operator=(const List& list)
+        {
+            if(this != &list)
+            {
+                assert(&pool_ == &list.pool_);
+                if(head_) pool_.remove_ref(head_);
+                head_ = list.head_;
+                index_ = list.index_;
+                size_ = list.size_;
+                hash_ = list.hash_;
+                hashed_ = list.hashed_;
+                if(head_) pool_.add_ref(head_);
+            }
+            return *this;
+        }
+
+        List& operator=(List&& list)
+        {
+            if(this != &list)
+            {
+                assert(&pool_ == &list.pool_);
+                if(head_) pool_.remove_ref(head_);
                 head_ = list.head_;
-                pool_ = list.pool_;
+                index_ = list.index_;
+                size_ = list.size_;
+                hash_ = list.hash_;
+                hashed_ = list.hashed_;
                 list.head_ = 0;
             }
             return *this;
@@ -469,20 +1402,33 @@ public:
             if(head_) pool_.add_ref(head_);
         }
 
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const {if(head_) f((const void*) head_);}
+
+        /** Call f with each element in the nodes of the list, including the elements of other
+         *  lists sharing the nodes that are outside this one.*/
+        template<class F>
+        void for_each_slot(F f) const
+        {
+            for(Node* n = head_; n; n = n->next)
+                for(uint32_t i = n->first; i < WIDTH; ++i) f(n->data[i]);
+        }
+
         /** Find first element from list matching with predicate or return end. */ 
         iterator find(const List* list, std::function<bool(const T&)>& pred) const
         {
-            Node* n = head_;
-            while(n && ! pred(n->data)) n = n->next;
-            return iterator(n);
+            iterator i = begin(), e = end();
+            while(i != e && !pred(*i)) ++i;
+            return i;
         }
 
         /** Add element to list */
         List add(const T& data) const
         {
-            Node* n = pool_.new_node(data);
-            n->next = head_; // prepend new element to head
-            return List(pool_, n);
+            uint32_t index = index_;
+            Node* n = pool_.push_front(head_, index, data);
+            return List(pool_, n, index, size_ == UNKNOWN_SIZE ? size_ : size_ + 1);
         }
 
         /** Add iterator range to list.*/
@@ -499,31 +1445,20 @@ public:
             if(i.node != 0 && head_)
             {
                 // If node is first, just return a list starting from next node.
-                if(head_ == i.node) return List(pool_, head_->next);
+                if(i == begin()) return rest();
 
-                // Otherwise must duplicate nodes prior to node to remove
-                // [a]->[b]->[c]->[d]
+                // Otherwise must duplicate elements prior to element to remove
+                // [a b]->[c d]
                 //
-                //[a']->[b']->[d]
+                // [a' b']->[d]
+                iterator after = i;
+                ++after;
 
-                // find position
-                Node* n        = head_;
-                Node* new_head = pool_.copy(n);;
-                Node* build    = new_head;
-
-                n = n->next;
-
-                while(n && n != i.node)
-                {
-                    build->next = pool_.copy(n);
-                    build = build->next;
-                    n = n->next;
-                }
-                
-                // Finally tie to the next cell from to be removed
-                build->next = i.node->next;
+                uint32_t index;
+                size_t count;
+                Node* new_head = pool_.build(begin(), i, after.node, after.index, index, count);
 
-                return List(pool_, new_head);
+                return List(pool_, new_head, index, size_ == UNKNOWN_SIZE ? size_ : size_ - 1);
             }
             else
             {
@@ -534,54 +1469,75 @@ public:
         /** Return list containing all but the first element or emtpy list. */
         List rest() const
         {
-            return head_ ? List(pool_, head_->next) : List(pool_, 0);
+            if(!head_) return List(pool_, 0);
+            iterator i = begin();
+            ++i;
+            return List(pool_, i.node, i.index, size_ == UNKNOWN_SIZE ? size_ : size_ - 1);
         }
 
         /** Return list containing all but the two first elements or emtpy list. */
-        List rrest() const
-        {
-            if(head_ && head_->next) return List(pool_, head_->next->next);
-            else return List(pool_, 0);
-        }
+        List rrest() const {return rest().rest();}
 
         /** Return list containing all but the three first elements or emtpy list. */
-        List rrrest() const
-        {
-            if(head_ && head_->next && head_->next->next) return List(pool_, head_->next->next);
-            else return List(pool_, 0);
-        }
+        List rrrest() const {return rest().rest().rest();}
 
         /** Return reference to the first element of list or null.*/
         const T* first() const
         {
-            return head_ ? &head_->data : 0;
+            return head_ ? head_->data + index_ : 0;
         }
 
         /** Return the second element in the list or empty.*/ 
         const T* second() const
         {
-            if(head_ && head_->next && head_->next->next)
-                return &head_->next->next->data;
-            else return 0;
+            iterator i = begin(), e = end();
+            if(i != e) ++i;
+            return i != e ? &*i : 0;
         }
 
         bool empty() const {return head_ == 0;}
 
-        bool has_rest() const {return head_ ? head_->next != 0 : false;}
+        bool has_rest() const
+        {
+            if(!head_) return false;
+            return index_ + 1 < WIDTH || head_->next != 0;
+        }
 
-        iterator begin() const {return iterator(head_);}
-        iterator end() const {return iterator(0);}
+        iterator begin() const {return iterator(head_, index_);}
+        iterator end() const {return iterator(0, 0);}
 
+        /** Return number of elements. The length is counted on first call unless the list was
+         *  built from a list of known length.*/
         const size_t size() const
         {
-            size_t s = 0;
-            Node* n = head_;
-            while(n){ n = n->next; s++;}
-            return s;
+            if(size_ == UNKNOWN_SIZE)
+            {
+                size_t s = 0;
+                Node* n = head_;
+                uint32_t index = index_;
+                while(n){ s += WIDTH - index; index = n->next_index; n = n->next;}
+                size_ = s;
+            }
+            return size_;
+        }
+
+        /** Return hash_elements(*this). The hash is computed on the first call and copied with the handle.*/
+        template<class F>
+        uint32_t hash(F hash_elements) const
+        {
+            if(!hashed_)
+            {
+                hash_   = hash_elements(*this);
+                hashed_ = true;
+            }
+            return hash_;
         }
 
         bool operator==(const List& l) const
         {
+            if(head_ == l.head_ && index_ == l.index_) return true;
+            if(size_ != UNKNOWN_SIZE && l.size_ != UNKNOWN_SIZE && size_ != l.size_) return false;
+
             iterator i = begin(), last = end(), li = l.begin(), le = l.end();
             while(i != last && li != le)
             {
@@ -593,12 +1549,16 @@ public:
         }
 
     private:
-        PListPool& pool_;
-        Node*      head_; 
+        PListPool&     pool_;
+        Node*          head_; 
+        uint32_t       index_; //> Slot of the first element in head_
+        mutable size_t size_;  //> Cached length or UNKNOWN_SIZE
+        mutable uint32_t hash_;   //> Cached hash, valid if hashed_
+        mutable bool     hashed_;
     };
 
-    typedef Chunk<Node>                    node_chunk;
-    typedef ChunkBox<Node>                 node_chunk_box;
+    typedef ChunkBox<Node, ChunkSize>      node_chunk_box;
+    typedef typename node_chunk_box::chunk_type node_chunk;
 
     typedef std::unordered_map<Node*, int> ref_count_map;
     
@@ -608,11 +1568,13 @@ public:
         // Deleting ListPool before the end of the lifetime of all heads will result
         // in undefined behaviour.
         // Call destructor on unused elements
-        ref_count_.clear();
+        wait_for_collection();
+        clear_root_refcounts();
         gc(); 
+        wait_for_collection();
     }
 
-    PListPool()
+    PListPool():nursery_size_(8192)
     {
     }
 
@@ -630,6 +1592,7 @@ public:
     /** Remove reference to node */
     void remove_ref(Node* n)
     {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
         int* ref_count = try_get_value(ref_count_, n);
         if(ref_count && (*ref_count > 0)) --(*ref_count);
     }
@@ -637,169 +1600,145 @@ public:
     /** Add reference to node*/
     void add_ref(Node* n)
     {
-        if(has_key(ref_count_, n)) ref_count_[n]++;
-        else ref_count_[n] = 1;
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_[n]++;
     }
 
     /** Create new list from stl compatible container. */
     template<class Cont>
     List new_list(const Cont& container)
     {
-        if(container.size() == 0) return List(*this, 0);
-
-        auto i = container.begin();
-        Node* head = new_node(*i);
-        Node* node = head;
-        i++;
-
-        for(;i != container.end(); ++i)
-        {
-            node->next = new_node(*i);
-            node = node->next;
-        }
-
-        return List( *this, head);
+        return new_list_from_range(container.begin(), container.end());
     }
- 
+
+    /** Create new list from iterator range. */
     template<class I>
-    Node* add_elem(I i_begin, I i_end) 
+    List new_list_from_range(I i_begin, I i_end)
     {
-        if(i_begin == i_end) return 0;
-        else
-        {
-            Node* n = new_node(*i_begin);
-            ++i_begin;
-            n->next = add_elem(i_begin, i_end);
-            
-            return n;
-        }
+        uint32_t index;
+        size_t count;
+        Node* head = build(i_begin, i_end, 0, 0, index, count);
+        return List(*this, head, index, count);
     }
 
     /** Create new list by appending elements in iterator range to list. */
     template<class I>
     List add(const List& old, I i_begin, I i_end)
     {
-        //if(i_begin == i_end) return List(*old); // TODO: need this?
-
-
-        auto o_i = old.begin();
-        auto o_end = old.end();
-
-        Node* cpy_head = 0;
-        Node* cpy_pos = 0;
-
-        if(o_i == o_end){
-            Node* new_head = add_elem(i_begin, i_end);
-            return List( *this, new_head);
-        }else{
-
-            while(o_i != o_end)
-            {
-                Node* n = new_node(*o_i);
-
-                if(!cpy_head)
-                {
-                    cpy_head = n;
-                    cpy_pos = cpy_head;
-                }
-                else
-                {
-                    cpy_pos->next = n;
-                    cpy_pos = n;
-                }
-
-                ++o_i;
-            }
-
-            cpy_pos->next = add_elem(i_begin, i_end);
-            return List( *this, cpy_head);
-        }
+        // The appended elements are shared, the elements of old are copied in front of them.
+        uint32_t tail_index, index;
+        size_t tail_count, count;
+        Node* tail = build(i_begin, i_end, 0, 0, tail_index, tail_count);
+        Node* head = build(old.begin(), old.end(), tail, tail_index, index, count);
+        return List(*this, head, index, count + tail_count);
     }
 
-
     /** Create new list from a number of input values. */
     List new_list(const T& a)
     {
-        Node* head = new_node(a);
-
-        return List( *this, head);
+        T values[] = {a};
+        return new_list_from_range(values, values + 1);
     }
 
     /** Create new list from a number of input values. */
     List new_list(const T& a, const T& b)
     {
-        Node* head = new_node(a);
-        Node* node = head;
-
-        node->next = new_node(b);
-
-        return List( *this, head);
+        T values[] = {a, b};
+        return new_list_from_range(values, values + 2);
     }
 
     /** Create new list from a number of input values. */
     List new_list(const T& a, const T& b, const T& c)
     {
-        Node* head = new_node(a);
-        Node* node = head;
-
-        node->next = new_node(b);
-        node = node->next;
-
-        node->next = new_node(c);
-
-        return List( *this, head);
+        T values[] = {a, b, c};
+        return new_list_from_range(values, values + 3);
     }
 
-    // Return duplicate of existing node sans the links
-    Node* copy(Node* n)
+    /** Return head of list with data added in front of the list at head, index. If the slot below
+     *  index is free, data is stored there and head returned. index is set to the slot of data.*/
+    Node* push_front(Node* head, uint32_t& index, const T& data)
     {
-        Node* c = 0;
-        if(n)
+        if(head && index > 0 && head->first == index)
         {
-           c = new_node(n->data); 
+            head->data[--index] = data;
+            head->first = index;
+            return head;
         }
-        return c; 
-    }
 
-    Node* new_node(const T& data)
-    {
         Node* n = chunks_.reserve_element();
-        n->data = data;
-        n->next = 0;
+        n->first = WIDTH - 1;
+        n->data[WIDTH - 1] = data;
+        n->next = head;
+        n->next_index = head ? index : 0;
+        index = WIDTH - 1;
         return n;
     }
 
-    void mark_referenced(Node* node)
+    /** Copy elements of range to new nodes followed by the list at tail, tail_index. Returns the
+     *  head of the list or tail if the range is empty. The nodes are filled from the first one on,
+     *  so only the last node of the range may be partially filled.*/
+    template<class I>
+    Node* build(I i_begin, I i_end, Node* tail, uint32_t tail_index, uint32_t& head_index, size_t& count)
     {
-        auto chunks_end = chunks_.end();
-        auto chunk_iterator = chunks_end;
+        Node* head = 0;
+        Node* last = 0;
+        count = 0;
 
-        // Follow referenced nodes
-        while(node)
+        while(i_begin != i_end)
         {
-            // Store reference to previous chunk visited. If there is not too much
-            // fragmentation there is a fair chance that nodes have been reserved
-            // linearly and that the previous chunk contains this node.
+            Node* n = chunks_.reserve_element();
+            uint32_t used = 0;
+            for(; used < WIDTH && i_begin != i_end; ++i_begin) n->data[used++] = *i_begin;
+            count += used;
 
-            if(chunk_iterator != chunks_end && chunk_iterator->set_marked_if_contains(node))
+            if(used < WIDTH)
             {
-                node = node->next;
-                continue;
+                // Move the elements to the top slots.
+                for(uint32_t i = used; i-- > 0;) std::swap(n->data[i], n->data[WIDTH - used + i]);
             }
+            n->first = WIDTH - used;
 
-            // Find the chunk that contains the node and label used.
-            for(chunk_iterator = chunks_.begin(); chunk_iterator != chunks_end; ++chunk_iterator)
+            if(last)
+            {
+                last->next = n;
+                last->next_index = n->first;
+            }
+            else
             {
-                if(chunk_iterator->set_marked_if_contains(node)) break;
+                head = n;
+                head_index = n->first;
             }
+            last = n;
+        }
+
+        if(!last)
+        {
+            head_index = tail ? tail_index : 0;
+            return tail;
+        }
 
-            node = node->next;
-        }   
+        last->next = tail;
+        last->next_index = tail ? tail_index : 0;
+        return head;
     }
-    
+
+    /** Mark node if it was locked for the collection and continue to the tail. */
+    static void mark_referenced(node_chunk_box& chunks, Node* node, std::vector<Node*>& stack)
+    {
+        if(chunks.set_marked_if_locked(node)) stack.push_back(node->next);
+    }
+
+    /** Mark node if it is young and continue to the tail. Old nodes can not refer to
+     *  younger ones so the tail of an old node needs no marking. */
+    static void mark_young(node_chunk_box& chunks, Node* node, std::vector<Node*>& stack)
+    {
+        if(chunks.set_marked_if_young(node)) stack.push_back(node->next);
+    }
+
     /** Return number of bytes used by the chunk pool in total. */
     size_t reserved_size_bytes()
     {
+        wait_for_collection();
         size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
         size_t total = sizeof(*this) + ref_map_size + chunks_.reserved_size_bytes(); 
         return total;
@@ -807,550 +1746,3294 @@ public:
 
     size_t live_size_bytes()
     {
+        wait_for_collection();
         size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
         size_t total = sizeof(*this) + ref_map_size +  chunks_.live_size_bytes();
         return total;
     }
 
-    // Collect all slots taken by unvisitable nodes //TODO: 
+    /** Start a collection cycle of all slots taken by unvisitable nodes. The marking and
+     *  deallocation are run on the collector thread, see wait_for_collection. */
     void gc()
     {
-        // Currently bit expensive - the cost is 
-        //    constant * block_count (free all nodes) + m * block_count/2 (mark all visited nodes)
-        // where m is the number of live nodes in all the lists
+        wait_for_collection();
 
-        // First mark all as empty
-        chunks_.mark_all_empty();
+        // Clean up unused references and copy the heads of active lists as roots.
+        copy_roots();
 
-        // Then clean up unused references, visit all heads and mark visited nodes as active
-        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        // Lock chunks from allocation until the collector thread releases them.
+        chunks_.lock_for_collection();
 
-        // Now ref_count_ contains as keys the head nodes of active lists.
-        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) mark_referenced(r->first);
+        node_chunk_box* chunks = &chunks_;
+        const std::vector<Node*>* roots = &gc_roots_;
+        cycle_ = GcWorkers::instance().run_cycle([chunks, roots]()
+        {
+            ParallelMarker<Node*>::run(*roots, [chunks](Node* n, std::vector<Node*>& stack)
+            {
+                mark_referenced(*chunks, n, stack);
+            });
 
-        // Lastly, go through the blocks, deallocate free's slots and move chunks to free list
-        // if space became available on a full one
-        chunks_.collect_chunks();
+            // Lastly, go through the blocks, deallocate free slots and release the chunks back
+            // to allocation.
+            chunks->sweep_locked();
+        });
     }
 
-    /** Clear refcounts. Warning: use only if you know what you are doing. */
-    void clear_root_refcounts()
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
     {
-        ref_count_.clear();
+        if(cycle_.valid())
+        {
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            gc_roots_.clear();
+            chunks_.release_empty_chunks();
+        }
     }
 
-private:
-    node_chunk_box        chunks_;
-    ref_count_map         ref_count_;   //> Head node reference counts
+    /** Collect the nodes reserved after the previous collection. Runs on the calling thread.*/
+    void minor_gc()
+    {
+        wait_for_collection();
 
-};
+        copy_roots();
 
+        // Nodes mutated after they were promoted may refer to young nodes.
+        for(auto r = remembered_.begin(); r != remembered_.end(); ++r) gc_roots_.push_back((*r)->next);
+        remembered_.clear();
 
-/////////// Persistent map //////////////
+        chunks_.minor_begin();
 
-#if 1
-/** A persistent, self garbage-collecting version of Bagwell's persistent hash tries.
-    Hash key: uint32_t
+        node_chunk_box& chunks = chunks_;
+        ParallelMarker<Node*>::run(gc_roots_, [&chunks](Node* n, std::vector<Node*>& stack)
+        {
+            mark_young(chunks, n, stack);
+        });
 
-    The key is split to five 5-bit length fields and one 2-bit length field as
+        chunks_.minor_sweep();
+        chunks_.release_empty_chunks();
+        gc_roots_.clear();
+    }
 
-level  0     1     2     3     4     5   6
-    |aaaaa|bbbbb|ccccc|ddddd|eeeee|fffff|gg
-     0-31  0-31  0-31  0-31  0-31  0-31  0-3
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count){chunks_.set_retained_empty_chunks(count);}
 
-    where each level give the index to use at the child-node array at the given level.
+    ChunkStats chunk_stats()
+    {
+        wait_for_collection();
+        return chunks_.stats();
+    }
 
+    /** Bytes of all nodes reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const {return chunks_.allocated_bytes();}
 
-    Node: used_field: uint32_t
-          ref_array = Ref * [huffmanlength(used_field)]
+    /** Write barrier: add node to the remembered set if it is modified after creation. */
+    void remember(Node* n){remembered_.push_back(n);}
 
-    Each node contains 32 slots for children.
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return chunks_.young_count() >= nursery_size_;}
 
-    The ref_array is allocated only to the huffman length of the used_field (i.e. numbers of bits 1
-    in the field).
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
 
-    Each element in ref-array stores either: a) A reference to a child-node, b) A reference to the stored element or c) A reference to a list of stored elements in
-    case the hash-key is overwritten.
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_.clear();
+    }
 
-    The datum for the element is not stored inside the node, only a reference to it.
+    /** Copy of the positive root reference counts. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
 
-    The storage used by a node _without the stored elements_ is 
+    /** Bytes of the nodes reachable from roots. Marks on the calling thread without collecting.
+     *  Young nodes are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        chunks_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r) gc_roots_.push_back((Node*) *r);
+        node_chunk_box& chunks = chunks_;
+        ParallelMarker<Node*>::run(gc_roots_, [&chunks](Node* n, std::vector<Node*>& stack)
+        {
+            mark_referenced(chunks, n, stack);
+        });
+        gc_roots_.clear();
+        size_t bytes = chunks_.marked_bytes_locked();
+        chunks_.release_locked();
+        return bytes;
+    }
 
-    4 bytes (used_field) + 8 bytes (ref_array pointer) + elem_count(1 to 32) * 8 (ref_array contents) -> 20 to 268 bytes
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return chunks_.mark_mismatches();
+    }
 
-    The hash trie is used in a persistent manner - each modifications return a new root-node
-    with the path to the changed node re-allocated. The stored elements themselves are not
-    copied, only the references to them.
+private:
+    PListPool(const PListPool&);
+    PListPool& operator=(const PListPool&);
 
-    Each non-value type (i.e. that encompass more memory than just sizeof(T), std::string etc,
-    stored in the map must have it's own implementation of the hash32 function.
+    void copy_roots()
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        gc_roots_.clear();
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) gc_roots_.push_back(r->first);
+    }
 
-*/
+    node_chunk_box           chunks_;
+    ref_count_map            ref_count_;   //> Head node reference counts
+    std::mutex               ref_mutex_;
+    std::vector<Node*>       gc_roots_;    //> Roots of the ongoing collection cycle
+    std::shared_future<void> cycle_;
+    std::vector<Node*>       remembered_;  //> Write barrier, promoted nodes that have been modified
+    size_t                   nursery_size_;
 
-template<class K>
-class AreEqual { public:
-    static bool compare(const K& k1, const K& k2){return k1 == k2;} 
 };
 
-template<class H>
-class MapHash { public:
-    static uint32_t hash(const H& h){return get_hash32(h);}
-};
 
-template<class K, class V, class Compare = AreEqual<K>, class HashFun = MapHash<K>>
-class PMapPool
+/////////// Persistent vector //////////////
+
+/** Pool manager and collector for persistent vectors. A vector is a bit-partitioned trie of
+ *  WIDTH way branches over leaves of WIDTH elements (Bagwell, Hickey). The last leaf is kept
+ *  apart as the tail so that most appends do not touch the trie.
+ *
+ *  Index and assoc are O(log32 n), push_back is amortized O(1) and rest is O(1): the vector
+ *  handle stores the start and end index of the elements it sees.
+ *
+ *  A tail is appended to in place when the vector ends at the last slot taken from the leaf.
+ *  Versions that end earlier never read past their end, other appends copy the tail.
+ *  ChunkSize is the number of nodes in each chunk. */
+template<class T, size_t ChunkSize = CHUNK_BUFFER_SIZE>
+class PVectorPool
 {
 public:
 
-    /** Key-value pair. */
-    struct KeyValue{uint32_t hash; K first; V second;};
-   
-    static const V* keyvalue_match_get(const KeyValue& kv, const K& key, const uint32_t hash) 
+    enum{BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1};
+
+    /** Leaf of WIDTH elements. */
+    struct Leaf
     {
-        if(kv.hash == hash && Compare::compare(key, kv.first))
-            return &kv.second;
-        else return 0;
-    }
+        uint32_t used; //> Slots taken by any version
+        T        data[WIDTH];
 
-    /* Data structure types. */
-    
-    typedef          PListPool<const KeyValue*>       KeyValueListPool;
-    typedef typename PListPool<const KeyValue*>::List KeyValueList;
+        Leaf():used(0){}
+    };
 
-    struct RefCell;
+    /** Trie node. The children are leaves if shift is BITS and branches above that.*/
+    struct Branch
+    {
+        uint32_t shift;
+        void*    children[WIDTH];
 
-    struct Node
+        Branch():shift(BITS){for(size_t i = 0; i < WIDTH; ++i) children[i] = 0;}
+
+        Branch* branch(size_t i) const {return (Branch*) children[i];}
+        Leaf*   leaf(size_t i) const {return (Leaf*) children[i];}
+    };
+
+    /** Stores the root and tail of a vector. */
+    class Vector
     {
-        struct Ref
+    public:
+
+        /** Forward iterator, caches the data of the current leaf.*/
+        struct iterator
         {
-            Node* node;
-            Node& operator*(){return *node;}
-            Node& operator->(){return *node;}
+            const Vector* vector;
+            size_t        index;
+            const T*      leaf_data;
+
+            iterator():vector(0), index(0), leaf_data(0){}
+            iterator(const Vector* v, size_t i):vector(v), index(i), leaf_data(0)
+            {
+                if(i < v->end_) leaf_data = v->leaf_data(i);
+            }
+
+            const T& operator*() const {return leaf_data[index & MASK];}
+            const T* operator->() const {return leaf_data + (index & MASK);}
+            void operator++()
+            {
+                ++index;
+                if((index & MASK) == 0 && index < vector->end_) leaf_data = vector->leaf_data(index);
+            }
+            bool operator!=(const iterator& i) const {return index != i.index;}
+            bool operator==(const iterator& i) const {return index == i.index;}
         };
 
-        enum NodeType{EmptyNode, ValueNode, CollisionNode};
+        typedef T value_type;
 
-        uint32_t used;
-        Ref*     child_array; //> Pointer to an allocated child sequence
-       
-        /** For ValueNodes the keyvalue field is referenced. For
-         *  CollisionNodes the collision_list field is referenced. */ 
-        union
+        Vector(PVectorPool& pool, Branch* root, Leaf* tail, size_t start, size_t end)
+            :pool_(pool), root_(root), tail_(tail), start_(start), end_(end), hash_(0), hashed_(false)
         {
-            const KeyValue*     keyvalue;
-            KeyValueList* collision_list; 
-            //Before end of the trie tree hash collisions are just proapagated downwards.
-            //The collided elements are always only keyvalues.
-        }value;
-
-        NodeType type; 
+            add_refs();
+        }
 
-        Node():used(0), child_array(0){}
+        Vector(const Vector& v):pool_(v.pool_), root_(v.root_), tail_(v.tail_), start_(v.start_), end_(v.end_),
+            hash_(v.hash_), hashed_(v.hashed_)
+        {
+            add_refs();
+        }
 
-        ~Node()
+        Vector(Vector&& v):pool_(v.pool_), root_(v.root_), tail_(v.tail_), start_(v.start_), end_(v.end_),
+            hash_(v.hash_), hashed_(v.hashed_)
         {
-            if(type == CollisionNode && value.collision_list) delete value.collision_list;
+            v.root_ = 0;
+            v.tail_ = 0;
         }
 
-        /** Return number of elements stored */
-        size_t size(){ return count_bits(used);}
+        ~Vector(){remove_refs();}
 
-        /** Return pointer to hash value if type is not EmptyNode */
-        const uint32_t* hash_value()
+        Vector& operator=(const Vector& v)
         {
-            const uint32_t* result = 0;
-            if(type == CollisionNode)
+            if(this != &v)
             {
-                typename KeyValueList::iterator kvi = value.collision_list->begin();
-                const KeyValue* kv(*kvi.data_ptr());
-                result = &(kv->hash);
-
+                assert(&pool_ == &v.pool_);
+                remove_refs();
+                root_ = v.root_; tail_ = v.tail_; start_ = v.start_; end_ = v.end_;
+                hash_ = v.hash_; hashed_ = v.hashed_;
+                add_refs();
             }
-            else if(type == ValueNode)
+            return *this;
+        }
+
+        Vector& operator=(Vector&& v)
+        {
+            if(this != &v)
             {
-                result = &(value.keyvalue->hash);
+                assert(&pool_ == &v.pool_);
+                remove_refs();
+                root_ = v.root_; tail_ = v.tail_; start_ = v.start_; end_ = v.end_;
+                hash_ = v.hash_; hashed_ = v.hashed_;
+                v.root_ = 0;
+                v.tail_ = 0;
             }
-            return result;
+            return *this;
         }
 
-        /** Return true if the index signified by the index is used.*/
-        bool index_in_use(uint32_t index){return bit_is_on(used, index);}
-
-        /** Return index matching the bitfield. The bitfield must reflect an actually used bit.*/
-        uint32_t index(uint32_t bitfield){return count_bits(used & (bitfield - 1));}
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref(){add_refs();}
 
-        /** Return element corresponding to the hash-key.*/
-        Node* get_child_by_fieldindex(uint32_t parsed_index)
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const
         {
-            if(index_in_use(parsed_index))
-            {
-                uint32_t child_index = index(1 << parsed_index);
-                return child_array[child_index].node;
-            }
-            else
-            {
-                return 0;
-            }
+            if(root_) f((const void*) root_);
+            if(tail_) f((const void*) tail_);
         }
 
-        Node* get_child_by_hash_and_depth(const uint32_t hash, const uint32_t depth)
+        /** Call f with each element in the leaves of the vector, including the elements of other
+         *  versions sharing the leaves that are outside this one.*/
+        template<class F>
+        void for_each_slot(F f) const
         {
-            return get_child_by_fieldindex((hash >> (depth * 5)) & 0x1f);
+            if(root_) for_each_branch_slot(root_, f);
+            if(tail_) for(uint32_t i = 0; i < tail_->used; ++i) f(tail_->data[i]);
         }
 
-        /** Return reference matching the bit pattern or null if array is not large enough.*/
-        Ref* get(uint32_t key, uint32_t level)
+        size_t size() const {return end_ - start_;}
+        bool empty() const {return end_ == start_;}
+
+        /** Return element at index, the index must be less than size().*/
+        const T& operator[](size_t index) const
         {
-            Ref* result = 0;
-            uint32_t local_index = (key >> (level*5)) & 0x1f;
-            uint32_t child_index = index(1 << local_index);
-            if(child_index < size()) result = child_array + child_index;
-            return result;
+            size_t i = start_ + index;
+            return leaf_data(i)[i & MASK];
         }
 
-        Ref* begin(){return child_array;}
-        Ref* end(){return child_array + size();}
-    };
+        /** Return pointer to element at index or null if the index is out of range.*/
+        const T* get(size_t index) const {return index < size() ? &(*this)[index] : 0;}
 
-    static bool node_has_children(Node* n) {return n->child_array != 0;}
-    static bool node_has_keyvalues(Node* n) {return n->type != Node::EmptyNode;}
+        const T* first() const {return get(0);}
 
-    /**
-     * Iterator for the values in one node.
-     */
-    struct NodeValueIterator
-    {
-        Node* node;
-        typename KeyValueList::iterator iter;
-        typename KeyValueList::iterator end;
-        
-        const KeyValue* keyvalue;
-        bool      iteration_ongoing;
+        /** Return vector with value appended.*/
+        Vector push_back(const T& value) const {return pool_.push_back(*this, value);}
 
+        /** Return vector with the elements of the iterator range appended.*/
+        template<class I>
+        Vector append(I i_begin, I i_end) const
+        {
+            Vector v(*this);
+            for(; i_begin != i_end; ++i_begin) v = pool_.push_back(v, *i_begin);
+            return v;
+        }
 
-        NodeValueIterator():node(0), keyvalue(0), iteration_ongoing(false){}
+        /** Return vector with the element at index (less than size()) replaced by value.*/
+        Vector assoc(size_t index, const T& value) const {return pool_.assoc(*this, start_ + index, value);}
 
-        NodeValueIterator(Node* node_in):node(node_in), keyvalue(0), iteration_ongoing(false)
+        /** Return vector of all but the first element or empty vector. */
+        Vector rest() const
         {
-            if(node->type == Node::CollisionNode) end = node->value.collision_list->end();
+            return empty() ? *this : Vector(pool_, root_, tail_, start_ + 1, end_);
         }
 
-        /** Returns true as long as the iterator is ongoing. Once the iteration is complete
-         *  the internal reference to keyvalue is in undefined state. */
-        bool move_next()
+        iterator begin() const {return iterator(this, start_);}
+        iterator end() const {return iterator(this, end_);}
+
+        /** Return hash_elements(*this). The hash is computed on the first call and copied with the handle.*/
+        template<class F>
+        uint32_t hash(F hash_elements) const
         {
-            bool result = false;
-            switch(node->type)
+            if(!hashed_)
             {
-                case Node::ValueNode:
-                {
-                    if(!keyvalue)
-                    {
-                        // Can visit the only value only once.
-                        keyvalue = node->value.keyvalue;
-                        result = true;
-                    }
-                    break;
-                }
-                case Node::CollisionNode:
-                {
-                    if(iteration_ongoing)
-                    {
-                        ++iter;
-                        if(iter != end)
-                        {
-                            keyvalue = *iter;
-                            result = true;
-                        }
-                    }
-                    else
-                    {
-                        iteration_ongoing = true;
-                        // The list has at least two elements. No need to check for nil head.
-                        iter = node->value.collision_list->begin();
-                        keyvalue = *iter;
-                        result = true;
-                    }
-                    break;
-                }
-                case Node::EmptyNode:
-                default:
-                    break;
+                hash_   = hash_elements(*this);
+                hashed_ = true;
             }
-            return result;
+            return hash_;
         }
 
-        const KeyValue* current() const {return keyvalue;}
-    };
+        bool operator==(const Vector& v) const
+        {
+            if(size() != v.size()) return false;
+            if(root_ == v.root_ && tail_ == v.tail_ && start_ == v.start_) return true;
+            iterator i = begin(), last = end(), vi = v.begin();
+            for(; i != last; ++i, ++vi) if(!(*i == *vi)) return false;
+            return true;
+        }
 
-    // Itearator for children inside node.
-    struct NodeChildIterator
-    {
-        Node* node;
-        typename Node::Ref* iter;  
-        typename Node::Ref* end;  
-        bool iterating;
-        bool node_has_children;
+        friend class PVectorPool;
 
-        NodeChildIterator(Node* node_in):node(node_in), iterating(false), node_has_children(false)
+    private:
+        /** Index of the first element in the tail. */
+        size_t tail_offset() const {return end_ < WIDTH ? 0 : ((end_ - 1) >> BITS) << BITS;}
+
+        /** Return data of the leaf holding absolute index i.*/
+        const T* leaf_data(size_t i) const
         {
-            end = node->end();
-            if(node_in->size() > 0) node_has_children = true;
+            if(i >= tail_offset()) return tail_->data;
+            Branch* b = root_;
+            while(b->shift > BITS) b = b->branch((i >> b->shift) & MASK);
+            return b->leaf((i >> BITS) & MASK)->data;
         }
 
-        bool move_next()
+        void add_refs()
         {
-            if(!node_has_children) return false;
+            if(root_) pool_.add_ref(root_);
+            if(tail_) pool_.add_ref(tail_);
+        }
 
-            bool result = false;
-            if(iterating) 
+        template<class F>
+        static void for_each_branch_slot(const Branch* b, F& f)
+        {
+            for(size_t c = 0; c < WIDTH; ++c)
             {
-                iter++;
+                if(!b->children[c]) continue;
+                if(b->shift == BITS)
+                {
+                    const Leaf* leaf = b->leaf(c);
+                    for(uint32_t i = 0; i < leaf->used; ++i) f(leaf->data[i]);
+                }
+                else for_each_branch_slot(b->branch(c), f);
             }
-            else
-            {
-                iter = node->begin();
-                iterating = true;
-            }
-
-            if(iter != end) result = true;
+        }
 
-            return result;
+        void remove_refs()
+        {
+            if(root_) pool_.remove_ref(root_);
+            if(tail_) pool_.remove_ref(tail_);
         }
 
-        Node* current(){return iter->node;}
+        PVectorPool& pool_;
+        Branch*      root_;
+        Leaf*        tail_;
+        size_t       start_; //> Index of the first element
+        size_t       end_;   //> Index past the last element, number of elements in the trie and tail
+        mutable uint32_t hash_;   //> Cached hash, valid if hashed_
+        mutable bool     hashed_;
     };
-    
-    typedef Chunk<KeyValue>  keyvalue_chunk;
-    typedef Chunk<Node>      node_chunk;
-    typedef Chunk<typename Node::Ref> ref_chunk;
 
-    typedef ChunkBox<KeyValue>  keyvalue_chunk_box;
-    typedef ChunkBox<Node>      node_chunk_box;
-    typedef ChunkBox<typename Node::Ref> ref_chunk_box;
+    typedef ChunkBox<Branch, ChunkSize>           branch_chunk_box;
+    typedef ChunkBox<Leaf, ChunkSize>             leaf_chunk_box;
+    typedef std::unordered_map<Branch*, int>      branch_ref_count_map;
+    typedef std::unordered_map<Leaf*, int>        leaf_ref_count_map;
 
-    typedef std::unordered_map<Node*, int> refcount_map;
+    PVectorPool():nursery_size_(8192)
+    {
+    }
 
-    // Unordered iterator to map nodes
-    //
-    // The purpose is to support stl -like iteration.
-    class node_iterator
+    ~PVectorPool()
     {
-        // Use stack of node child iterators to keep track of state.
-        // Algorithm:
-        //  i)  Go to the leftmost node foundable
-        //  ii) iterate it's values
-        //  ii) go to node sibling, 
-        
-        FixedStack<NodeChildIterator, 8> iter_stack; //Max tree depth is 7 plus root.
-        NodeValueIterator value_iter;
+        kill();
+    }
 
-        const KeyValue* current;
+    /** Recycle all memory. */
+    void kill()
+    {
+        // Deleting VectorPool before the end of the lifetime of all vectors will result
+        // in undefined behaviour.
+        wait_for_collection();
+        clear_root_refcounts();
+        gc();
+        wait_for_collection();
+    }
 
-#define CURRENT_NODE iter_stack.top()->current()
+    /** Create new empty vector. */
+    Vector new_vector()
+    {
+        return Vector(*this, 0, 0, 0, 0);
+    }
 
-        // For each node:
-        // Iterate over each value in array. If value is a node, go into node.
-        public:
+    /** Create new vector from iterator range. */
+    template<class I>
+    Vector new_vector(I i_begin, I i_end)
+    {
+        return new_vector().append(i_begin, i_end);
+    }
 
-        node_iterator(Node* node):current(0)
+    /** Create new vector from stl compatible container. */
+    template<class Cont>
+    Vector new_vector(const Cont& container)
+    {
+        return new_vector(container.begin(), container.end());
+    }
+
+    void add_ref(Branch* b)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        branch_ref_count_[b]++;
+    }
+
+    void add_ref(Leaf* l)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        leaf_ref_count_[l]++;
+    }
+
+    void remove_ref(Branch* b)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(branch_ref_count_, b);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
+
+    void remove_ref(Leaf* l)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(leaf_ref_count_, l);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
+
+    /** Return vector with value appended to v. */
+    Vector push_back(const Vector& v, const T& value)
+    {
+        size_t tail_count = v.end_ - v.tail_offset();
+
+        if(v.tail_ && tail_count < WIDTH)
         {
-            if(node && node_has_children(node))
-            {
-                push_node(node);
-            }
+            Leaf* tail = v.tail_;
+            if(tail->used != tail_count) tail = copy_leaf(tail, tail_count);
+            tail->data[tail_count] = value;
+            tail->used = uint32_t(tail_count + 1);
+            return Vector(*this, v.root_, tail, v.start_, v.end_ + 1);
         }
 
-        // Latch onto the children of the node - make sure the node has children prior to pushing it
-        void push_node(Node* parent_node)
-        {
-            iter_stack.push(NodeChildIterator(parent_node));
-            NodeChildIterator* ni = iter_stack.top();
-            ni->move_next(); // Must succeed as node has children - now have a valid node
+        // Tail is full (or there is none yet): move it to the trie and start a new one.
+        Branch* root = v.tail_ ? push_tail(v.root_, v.end_ - WIDTH, v.tail_) : v.root_;
+        Leaf* tail = leaves_.reserve_element();
+        tail->data[0] = value;
+        tail->used = 1;
+        return Vector(*this, root, tail, v.start_, v.end_ + 1);
+    }
 
-            Node* node = ni->current();
-            if(node_has_keyvalues(node))
-            {
-                value_iter = NodeValueIterator(node);
-                advance(); // Move value_iter to valid value
-            }
-            else
-            {
-                // Push until a node with values is found.
-                push_node(node);
-            }
+    /** Return vector with the element at absolute index i replaced by value. */
+    Vector assoc(const Vector& v, size_t i, const T& value)
+    {
+        size_t tail_offset = v.tail_offset();
+        if(i >= tail_offset)
+        {
+            Leaf* tail = copy_leaf(v.tail_, v.end_ - tail_offset);
+            tail->data[i - tail_offset] = value;
+            return Vector(*this, v.root_, tail, v.start_, v.end_);
         }
+        return Vector(*this, assoc_path(v.root_, i, value), v.tail_, v.start_, v.end_);
+    }
 
-        void advance()
+    /** Start a collection cycle of all unvisitable nodes. The marking and deallocation are
+     *  run on the collector thread, see wait_for_collection. */
+    void gc()
+    {
+        wait_for_collection();
+
+        copy_roots();
+
+        branches_.lock_for_collection();
+        leaves_.lock_for_collection();
+
+        PVectorPool* pool = this;
+        cycle_ = GcWorkers::instance().run_cycle([pool]()
         {
-            if(value_iter.move_next())
-            {
-                current = value_iter.current();
-            }
-            else
-            {
-                NodeChildIterator* ni = iter_stack.top();
-                Node* node =ni->current();
-                // Ran out of values - find next node.
-                if(node_has_children(node))
-                {
-                    push_node(node);
-                }
-                else
-                {
-                    // Move to next sibling node or if none left pop.
-                    if(ni->move_next())
-                    {
-                        Node* next_node = ni->current();
-                        value_iter = NodeValueIterator(next_node);
-                        advance(); // Move value_iter to valid value
-                    }
-                    else
-                    {
-                        // No siblings left - pop stack
-                        pop();
-                    }
-                }
-            }
+            pool->mark_locked();
+            pool->branches_.sweep_locked();
+            pool->leaves_.sweep_locked();
+        });
+    }
+
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
+    {
+        if(cycle_.valid())
+        {
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            branch_roots_.clear();
+            leaf_roots_.clear();
+            branches_.release_empty_chunks();
+            leaves_.release_empty_chunks();
         }
+    }
 
-        void pop()
+    /** Collect the nodes reserved after the previous collection. Runs on the calling thread.
+     *  Nodes are not modified after creation other than by storing elements to leaves, so
+     *  old nodes never refer to young ones.*/
+    void minor_gc()
+    {
+        wait_for_collection();
+
+        copy_roots();
+
+        branches_.minor_begin();
+        leaves_.minor_begin();
+
+        for(auto l = leaf_roots_.begin(); l != leaf_roots_.end(); ++l) leaves_.set_marked_if_young(*l);
+
+        PVectorPool* pool = this;
+        ParallelMarker<Branch*>::run(branch_roots_, [pool](Branch* b, std::vector<Branch*>& stack)
         {
-            iter_stack.pop();
+            if(pool->branches_.set_marked_if_young(b)) pool->mark_children(b, stack, true);
+        });
+
+        branches_.minor_sweep();
+        leaves_.minor_sweep();
+        branches_.release_empty_chunks();
+        leaves_.release_empty_chunks();
+        branch_roots_.clear();
+        leaf_roots_.clear();
+    }
 
-            if(iter_stack.depth() > 0)
-            {
-                NodeChildIterator* ni = iter_stack.top();
-                if(ni->move_next())
-                {
-                    Node* node = ni->current();
-                    if(node_has_keyvalues(node))
-                    {
-                        value_iter = NodeValueIterator(node);
-                        advance();
-                    }
-                    else
-                    {
-                        push_node(node);
-                    }
-                }
-                else
-                {
-                    pop();
-                }
-            }
-            else
-            {
-                // Stack emtpy, nothing left to do - terminate iteration.
-                current = 0;
-            }
-        }
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count)
+    {
+        branches_.set_retained_empty_chunks(count);
+        leaves_.set_retained_empty_chunks(count);
+    }
 
-        void operator++(){advance();}
+    ChunkStats chunk_stats()
+    {
+        wait_for_collection();
+        ChunkStats stats = branches_.stats();
+        stats += leaves_.stats();
+        return stats;
+    }
 
-        bool operator==(const node_iterator& i){return current == i.current;}
-        bool operator!=(const node_iterator& i){return current != i.current;}
-        const KeyValue* data_ptr(){return current;}
-        const KeyValue& operator*(){return *current;}
-        const KeyValue* operator->(){return current;}
-    };
+    /** Bytes of all branches and leaves reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const {return branches_.allocated_bytes() + leaves_.allocated_bytes();}
 
-    /** The map class.*/
-    class Map
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return branches_.young_count() + leaves_.young_count() >= nursery_size_;}
+
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
     {
-    public:
-        typedef node_iterator iterator;
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        branch_ref_count_.clear();
+        leaf_ref_count_.clear();
+    }
 
-        typedef K key_type;
-        typedef V mapped_type;
-        typedef KeyValue value_type;
+    /** Copy of the positive root reference counts of branches and leaves. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = branch_ref_count_.begin(); r != branch_ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        for(auto r = leaf_ref_count_.begin(); r != leaf_ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
 
-        Map(PMapPool& pool, Node* root):pool_(pool), root_(root)
+    /** Bytes of the nodes reachable from roots. Marks on the calling thread without collecting.
+     *  Young nodes are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        branches_.lock_for_collection();
+        leaves_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r)
         {
-            if(root_) pool_.add_ref(root_);
+            if(leaves_.find_locked((const Leaf*) *r)) leaf_roots_.push_back((Leaf*) *r);
+            else                                      branch_roots_.push_back((Branch*) *r);
         }
+        mark_locked();
+        branch_roots_.clear();
+        leaf_roots_.clear();
+        size_t bytes = branches_.marked_bytes_locked() + leaves_.marked_bytes_locked();
+        branches_.release_locked();
+        leaves_.release_locked();
+        return bytes;
+    }
+
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return branches_.mark_mismatches() + leaves_.mark_mismatches();
+    }
+
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        wait_for_collection();
+        return sizeof(*this) + ref_map_bytes() + branches_.reserved_size_bytes() + leaves_.reserved_size_bytes();
+    }
+
+    size_t live_size_bytes()
+    {
+        wait_for_collection();
+        return sizeof(*this) + ref_map_bytes() + branches_.live_size_bytes() + leaves_.live_size_bytes();
+    }
+
+private:
+    PVectorPool(const PVectorPool&);
+    PVectorPool& operator=(const PVectorPool&);
+
+    /** Return copy of leaf with the first count elements.*/
+    Leaf* copy_leaf(const Leaf* leaf, size_t count)
+    {
+        Leaf* l = leaves_.reserve_element();
+        for(size_t i = 0; i < count; ++i) l->data[i] = leaf->data[i];
+        l->used = uint32_t(count);
+        return l;
+    }
 
-        Map(const Map& map):pool_(map.pool_), root_(map.root_)
+    Branch* copy_branch(const Branch* b)
+    {
+        Branch* c = branches_.reserve_element();
+        *c = *b;
+        return c;
+    }
+
+    /** Return branch at shift with leaf as the first leaf below.*/
+    Branch* new_path(uint32_t shift, Leaf* leaf)
+    {
+        Branch* b = branches_.reserve_element();
+        b->shift = shift;
+        b->children[0] = shift == BITS ? (void*) leaf : (void*) new_path(shift - BITS, leaf);
+        return b;
+    }
+
+    /** Return copy of root (may be null) with leaf added to hold elements from index i on.*/
+    Branch* push_tail(Branch* root, size_t i, Leaf* leaf)
+    {
+        if(!root) return new_path(BITS, leaf);
+
+        if((i >> root->shift) >= WIDTH)
         {
-            if(root_) pool_.add_ref(root_);
+            // Root is full, grow a level.
+            Branch* b = branches_.reserve_element();
+            b->shift = root->shift + BITS;
+            b->children[0] = root;
+            b->children[1] = new_path(root->shift, leaf);
+            return b;
         }
 
-        Map(Map&& map):pool_(map.pool_), root_(map.root_)
+        return push_path(root, i, leaf);
+    }
+
+    Branch* push_path(Branch* b, size_t i, Leaf* leaf)
+    {
+        Branch* c = copy_branch(b);
+        size_t index = (i >> b->shift) & MASK;
+        if(b->shift == BITS)       c->children[index] = leaf;
+        else if(b->children[index]) c->children[index] = push_path(b->branch(index), i, leaf);
+        else                       c->children[index] = new_path(b->shift - BITS, leaf);
+        return c;
+    }
+
+    Branch* assoc_path(Branch* b, size_t i, const T& value)
+    {
+        Branch* c = copy_branch(b);
+        size_t index = (i >> b->shift) & MASK;
+        if(b->shift == BITS)
         {
-            map.root_ = 0;
+            Leaf* leaf = copy_leaf(b->leaf(index), WIDTH);
+            leaf->data[i & MASK] = value;
+            c->children[index] = leaf;
         }
-
-        ~Map()
+        else
         {
-            if(root_) pool_.remove_ref(root_);
+            c->children[index] = assoc_path(b->branch(index), i, value);
         }
+        return c;
+    }
 
-        Map& operator=(const Map& map)
+    /** Mark the leaves of b or push it's child branches to the marking stack. */
+    /** Mark the nodes in locked chunks reachable from the roots of the cycle.*/
+    void mark_locked()
+    {
+        for(auto l = leaf_roots_.begin(); l != leaf_roots_.end(); ++l) leaves_.set_marked_if_locked(*l);
+
+        PVectorPool* pool = this;
+        ParallelMarker<Branch*>::run(branch_roots_, [pool](Branch* b, std::vector<Branch*>& stack)
         {
-            if(this != &map)
-            {
-                if(root_) pool_.remove_ref(root_);
-                pool_ = map.pool_;
-                root_ = map.root_;
-                pool_.add_ref(root_);
-            }
-            return *this;
-        }
+            if(pool->branches_.set_marked_if_locked(b)) pool->mark_children(b, stack, false);
+        });
+    }
 
-        Map& operator=(Map&& map)
+    void mark_children(Branch* b, std::vector<Branch*>& stack, bool minor)
+    {
+        for(size_t i = 0; i < WIDTH && b->children[i]; ++i)
         {
-            if(this != &map)
+            if(b->shift > BITS)
             {
-                if(root_) pool_.remove_ref(root_);
-                pool_ = map.pool_;
-                root_ = map.root_;
-                map.root_ = 0;
+                stack.push_back(b->branch(i));
+            }
+            else
+            {
+                if(minor) leaves_.set_marked_if_young(b->leaf(i));
+                else      leaves_.set_marked_if_locked(b->leaf(i));
             }
-            return *this;
         }
+    }
 
-        /** Warning: Use only if you know what you are doing. */
-        void increment_ref()
-        {
-            if(root_) pool_.add_ref(root_);
-        }
+    void copy_roots()
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        branch_ref_count_ = copyif(branch_ref_count_, [](const std::pair<Branch*, int>& p){return p.second > 0;});
+        leaf_ref_count_ = copyif(leaf_ref_count_, [](const std::pair<Leaf*, int>& p){return p.second > 0;});
+        branch_roots_.clear();
+        leaf_roots_.clear();
+        for(auto r = branch_ref_count_.begin(); r != branch_ref_count_.end(); ++r) branch_roots_.push_back(r->first);
+        for(auto r = leaf_ref_count_.begin(); r != leaf_ref_count_.end(); ++r) leaf_roots_.push_back(r->first);
+    }
+
+    size_t ref_map_bytes() const
+    {
+        return branch_ref_count_.size() * (sizeof(Branch*) + sizeof(int)) + leaf_ref_count_.size() * (sizeof(Leaf*) + sizeof(int));
+    }
+
+    branch_chunk_box         branches_;
+    leaf_chunk_box           leaves_;
+    branch_ref_count_map     branch_ref_count_; //> Root node reference counts
+    leaf_ref_count_map       leaf_ref_count_;   //> Tail reference counts
+    std::mutex               ref_mutex_;
+    std::vector<Branch*>     branch_roots_;     //> Roots of the ongoing collection cycle
+    std::vector<Leaf*>       leaf_roots_;
+    std::shared_future<void> cycle_;
+    size_t                   nursery_size_;
+};
+
+
+/////////// Persistent deque //////////////
+
+/** Pool manager and collector for persistent catenable deques. A deque is a 2-3 finger tree
+ *  (Hinze, Paterson) annotated with element counts: pushing and popping at either end are
+ *  amortized O(1), concatenation is O(log(min(n, m))) and indexing O(log n).
+ *
+ *  The tree nodes are immutable once created. Elements are stored in their own slots which
+ *  the trees share.
+ *  ChunkSize is the number of nodes in each chunk. */
+template<class T, size_t ChunkSize = CHUNK_BUFFER_SIZE>
+class PDequePool
+{
+public:
+
+    /** Element slot. */
+    struct Element
+    {
+        T data;
+    };
+
+    enum NodeKind{TREE, NODE};
+
+    /** Tree or node. A tree has the prefix digit at items[0], the middle tree (or null if empty) at
+     *  items[1] and the suffix digit at items[2]. A tree of a single item has no suffix.
+     *  A node is a digit of 1-4 items or a 2-3 node. The items are elements if depth is 0 and
+     *  nodes of depth - 1 otherwise. The items of a tree are those of it's digits.*/
+    struct Node
+    {
+        size_t   size;  //> Number of elements
+        uint16_t depth;
+        uint8_t  kind;
+        uint8_t  count; //> Number of items in a node
+        void*    items[4];
+
+        Node():size(0), depth(0), kind(NODE), count(0){}
+
+        Node* prefix() const {return (Node*) items[0];}
+        Node* middle() const {return (Node*) items[1];}
+        Node* suffix() const {return (Node*) items[2];}
+        bool  single() const {return items[2] == 0;}
+    };
+
+    /** Stores the root tree of a deque. */
+    class Deque
+    {
+    public:
+
+        /** Forward iterator. Keeps the path from the root to the current element.*/
+        struct iterator
+        {
+            struct Frame
+            {
+                const Node* node;
+                uint32_t    item;
+            };
+
+            std::vector<Frame> path;
+            size_t             index;
+            const T*           current;
+
+            iterator():index(0), current(0){}
+            iterator(const Node* root, size_t i):index(i), current(0)
+            {
+                if(root)
+                {
+                    path.push_back(Frame{root, 0});
+                    advance();
+                }
+            }
+
+            const T& operator*() const {return *current;}
+            const T* operator->() const {return current;}
+            void operator++(){++index; advance();}
+            bool operator!=(const iterator& i) const {return index != i.index;}
+            bool operator==(const iterator& i) const {return index == i.index;}
+
+        private:
+            /** Move to the next element from the top frame on.*/
+            void advance()
+            {
+                current = 0;
+                while(!path.empty())
+                {
+                    Frame& f = path.back();
+                    const Node* n = f.node;
+                    size_t item_count = n->kind == TREE ? 3 : n->count;
+                    if(f.item == item_count)
+                    {
+                        path.pop_back();
+                        continue;
+                    }
+                    void* item = n->items[f.item++];
+                    if(!item) continue;
+                    if(n->kind == NODE && n->depth == 0)
+                    {
+                        current = &((const Element*) item)->data;
+                        return;
+                    }
+                    path.push_back(Frame{(const Node*) item, 0});
+                }
+            }
+        };
+
+        typedef T value_type;
+
+        Deque(PDequePool& pool, Node* root):pool_(pool), root_(root)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Deque(const Deque& d):pool_(d.pool_), root_(d.root_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Deque(Deque&& d):pool_(d.pool_), root_(d.root_)
+        {
+            d.root_ = 0;
+        }
+
+        ~Deque(){if(root_) pool_.remove_ref(root_);}
+
+        Deque& operator=(const Deque& d)
+        {
+            if(this != &d)
+            {
+                assert(&pool_ == &d.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = d.root_;
+                if(root_) pool_.add_ref(root_);
+            }
+            return *this;
+        }
+
+        Deque& operator=(Deque&& d)
+        {
+            if(this != &d)
+            {
+                assert(&pool_ == &d.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = d.root_;
+                d.root_ = 0;
+            }
+            return *this;
+        }
+
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref(){if(root_) pool_.add_ref(root_);}
+
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const {if(root_) f((const void*) root_);}
+
+        size_t size() const {return root_ ? root_->size : 0;}
+        bool empty() const {return root_ == 0;}
+
+        Deque push_front(const T& value) const {return Deque(pool_, pool_.push_front(root_, pool_.new_element(value), 0));}
+        Deque push_back(const T& value) const {return Deque(pool_, pool_.push_back(root_, pool_.new_element(value), 0));}
+
+        /** Return deque with the elements of the iterator range appended.*/
+        template<class I>
+        Deque append(I i_begin, I i_end) const {return Deque(pool_, pool_.push_back_range(root_, i_begin, i_end));}
+
+        /** Return deque of all but the first element or empty deque. */
+        Deque rest() const {return Deque(pool_, root_ ? pool_.pop_front(root_) : 0);}
+
+        /** Return deque of all but the last element or empty deque. */
+        Deque butlast() const {return Deque(pool_, root_ ? pool_.pop_back(root_) : 0);}
+
+        /** Return deque of the elements of this followed by those of d. */
+        Deque concat(const Deque& d) const
+        {
+            assert(&pool_ == &d.pool_);
+            return Deque(pool_, pool_.concat(root_, 0, 0, d.root_, 0));
+        }
+
+        const T* first() const {return root_ ? &pool_.first_element(root_)->data : 0;}
+        const T* last() const {return root_ ? &pool_.last_element(root_)->data : 0;}
+
+        /** Return element at index, the index must be less than size().*/
+        const T& operator[](size_t index) const {return pool_.element_at(root_, index)->data;}
+
+        /** Return pointer to element at index or null if the index is out of range.*/
+        const T* get(size_t index) const {return index < size() ? &(*this)[index] : 0;}
+
+        iterator begin() const {return iterator(root_, 0);}
+        iterator end() const {return iterator(0, size());}
+
+        bool operator==(const Deque& d) const
+        {
+            if(root_ == d.root_) return true;
+            if(size() != d.size()) return false;
+            iterator i = begin(), last = end(), di = d.begin();
+            for(; i != last; ++i, ++di) if(!(*i == *di)) return false;
+            return true;
+        }
+
+    private:
+        PDequePool& pool_;
+        Node*       root_;
+    };
+
+    typedef ChunkBox<Node, ChunkSize>      node_chunk_box;
+    typedef ChunkBox<Element, ChunkSize>   element_chunk_box;
+    typedef std::unordered_map<Node*, int> ref_count_map;
+
+    PDequePool():nursery_size_(8192)
+    {
+    }
+
+    ~PDequePool()
+    {
+        kill();
+    }
+
+    /** Recycle all memory. */
+    void kill()
+    {
+        // Deleting DequePool before the end of the lifetime of all deques will result
+        // in undefined behaviour.
+        wait_for_collection();
+        clear_root_refcounts();
+        gc();
+        wait_for_collection();
+    }
+
+    /** Create new empty deque. */
+    Deque new_deque()
+    {
+        return Deque(*this, 0);
+    }
+
+    /** Create new deque from iterator range. */
+    template<class I>
+    Deque new_deque(I i_begin, I i_end)
+    {
+        return Deque(*this, push_back_range(0, i_begin, i_end));
+    }
+
+    /** Create new deque from stl compatible container. */
+    template<class Cont>
+    Deque new_deque(const Cont& container)
+    {
+        return new_deque(container.begin(), container.end());
+    }
+
+    void add_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_[n]++;
+    }
+
+    void remove_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(ref_count_, n);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
+
+    /** Start a collection cycle of all unvisitable nodes and elements. The marking and
+     *  deallocation are run on the collector thread, see wait_for_collection. */
+    void gc()
+    {
+        wait_for_collection();
+
+        copy_roots();
+
+        nodes_.lock_for_collection();
+        elements_.lock_for_collection();
+
+        PDequePool* pool = this;
+        cycle_ = GcWorkers::instance().run_cycle([pool]()
+        {
+            pool->mark_locked();
+            pool->nodes_.sweep_locked();
+            pool->elements_.sweep_locked();
+        });
+    }
+
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
+    {
+        if(cycle_.valid())
+        {
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            gc_roots_.clear();
+            nodes_.release_empty_chunks();
+            elements_.release_empty_chunks();
+        }
+    }
+
+    /** Collect the nodes and elements reserved after the previous collection. Runs on the
+     *  calling thread. Nodes are never mutated so no remembered set is needed.*/
+    void minor_gc()
+    {
+        wait_for_collection();
+
+        copy_roots();
+
+        nodes_.minor_begin();
+        elements_.minor_begin();
+
+        PDequePool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            if(pool->nodes_.set_marked_if_young(n)) pool->mark_items(n, stack, true);
+        });
+
+        nodes_.minor_sweep();
+        elements_.minor_sweep();
+        nodes_.release_empty_chunks();
+        elements_.release_empty_chunks();
+        gc_roots_.clear();
+    }
+
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count)
+    {
+        nodes_.set_retained_empty_chunks(count);
+        elements_.set_retained_empty_chunks(count);
+    }
+
+    ChunkStats chunk_stats()
+    {
+        wait_for_collection();
+        ChunkStats stats = nodes_.stats();
+        stats += elements_.stats();
+        return stats;
+    }
+
+    /** Bytes of all nodes and element arrays reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const {return nodes_.allocated_bytes() + elements_.allocated_bytes();}
+
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return nodes_.young_count() + elements_.young_count() >= nursery_size_;}
+
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_.clear();
+    }
+
+    /** Copy of the positive root reference counts. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
+
+    /** Bytes of the nodes and elements reachable from roots. Marks on the calling thread without
+     *  collecting. Young slots are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        nodes_.lock_for_collection();
+        elements_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r) gc_roots_.push_back((Node*) *r);
+        mark_locked();
+        gc_roots_.clear();
+        size_t bytes = nodes_.marked_bytes_locked() + elements_.marked_bytes_locked();
+        nodes_.release_locked();
+        elements_.release_locked();
+        return bytes;
+    }
+
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return nodes_.mark_mismatches() + elements_.mark_mismatches();
+    }
+
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        return sizeof(*this) + ref_map_size + nodes_.reserved_size_bytes() + elements_.reserved_size_bytes();
+    }
+
+    size_t live_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        return sizeof(*this) + ref_map_size + nodes_.live_size_bytes() + elements_.live_size_bytes();
+    }
+
+private:
+    PDequePool(const PDequePool&);
+    PDequePool& operator=(const PDequePool&);
+
+    enum{MAX_CONCAT_ITEMS = 12}; //> Items of a suffix, up to 4 nodes from below and a prefix
+
+    Element* new_element(const T& value)
+    {
+        Element* e = elements_.reserve_element();
+        e->data = value;
+        return e;
+    }
+
+    static size_t item_size(void* item, uint16_t depth)
+    {
+        return depth == 0 ? 1 : ((Node*) item)->size;
+    }
+
+    /** Return node of count items of depth.*/
+    Node* new_node(uint16_t depth, void* const* items, size_t count)
+    {
+        Node* n = nodes_.reserve_element();
+        n->kind = NODE;
+        n->depth = depth;
+        n->count = uint8_t(count);
+        n->size = 0;
+        for(size_t i = 0; i < count; ++i)
+        {
+            n->items[i] = items[i];
+            n->size += item_size(items[i], depth);
+        }
+        return n;
+    }
+
+    Node* new_node(uint16_t depth, void* a)
+    {
+        void* items[] = {a};
+        return new_node(depth, items, 1);
+    }
+
+    Node* new_node(uint16_t depth, void* a, void* b)
+    {
+        void* items[] = {a, b};
+        return new_node(depth, items, 2);
+    }
+
+    Node* new_node(uint16_t depth, void* a, void* b, void* c)
+    {
+        void* items[] = {a, b, c};
+        return new_node(depth, items, 3);
+    }
+
+    /** Return tree of the digits and middle tree. Suffix is null for a tree of a single item.*/
+    Node* new_tree(Node* prefix, Node* middle, Node* suffix)
+    {
+        Node* t = nodes_.reserve_element();
+        t->kind = TREE;
+        t->depth = prefix->depth;
+        t->count = 3;
+        t->items[0] = prefix;
+        t->items[1] = middle;
+        t->items[2] = suffix;
+        t->items[3] = 0;
+        t->size = prefix->size + (middle ? middle->size : 0) + (suffix ? suffix->size : 0);
+        return t;
+    }
+
+    /** Return tree of the items of digit, which may have 1-4 items.*/
+    Node* digit_to_tree(Node* digit)
+    {
+        Node* t = 0;
+        for(uint8_t i = 0; i < digit->count; ++i) t = push_back(t, digit->items[i], digit->depth);
+        return t;
+    }
+
+    /** Return tree (may be null) with item of depth added to the front.*/
+    Node* push_front(Node* tree, void* item, uint16_t depth)
+    {
+        if(!tree) return new_tree(new_node(depth, item), 0, 0);
+
+        Node* prefix = tree->prefix();
+        if(tree->single()) return new_tree(new_node(depth, item), 0, prefix);
+
+        if(prefix->count < 4)
+        {
+            void* items[4] = {item};
+            for(uint8_t i = 0; i < prefix->count; ++i) items[i + 1] = prefix->items[i];
+            return new_tree(new_node(depth, items, prefix->count + 1), tree->middle(), tree->suffix());
+        }
+
+        // Prefix is full: push three of it's items as a node to the middle tree.
+        Node* node = new_node(depth, prefix->items[1], prefix->items[2], prefix->items[3]);
+        return new_tree(new_node(depth, item, prefix->items[0]), push_front(tree->middle(), node, depth + 1),
+                        tree->suffix());
+    }
+
+    /** Return tree (may be null) with item of depth added to the back.*/
+    Node* push_back(Node* tree, void* item, uint16_t depth)
+    {
+        if(!tree) return new_tree(new_node(depth, item), 0, 0);
+
+        if(tree->single()) return new_tree(tree->prefix(), 0, new_node(depth, item));
+
+        Node* suffix = tree->suffix();
+        if(suffix->count < 4)
+        {
+            void* items[4];
+            for(uint8_t i = 0; i < suffix->count; ++i) items[i] = suffix->items[i];
+            items[suffix->count] = item;
+            return new_tree(tree->prefix(), tree->middle(), new_node(depth, items, suffix->count + 1));
+        }
+
+        Node* node = new_node(depth, suffix->items[0], suffix->items[1], suffix->items[2]);
+        return new_tree(tree->prefix(), push_back(tree->middle(), node, depth + 1),
+                        new_node(depth, suffix->items[3], item));
+    }
+
+    template<class I>
+    Node* push_back_range(Node* tree, I i_begin, I i_end)
+    {
+        for(; i_begin != i_end; ++i_begin) tree = push_back(tree, new_element(*i_begin), 0);
+        return tree;
+    }
+
+    /** Return tree without the first item or null if the tree had one item.*/
+    Node* pop_front(Node* tree)
+    {
+        if(tree->single()) return 0;
+
+        Node* prefix = tree->prefix();
+        uint16_t depth = tree->depth;
+        if(prefix->count > 1)
+            return new_tree(new_node(depth, prefix->items + 1, prefix->count - 1), tree->middle(), tree->suffix());
+
+        Node* middle = tree->middle();
+        if(!middle) return digit_to_tree(tree->suffix());
+
+        // The first node of the middle tree becomes the prefix.
+        return new_tree((Node*) first_item(middle), pop_front(middle), tree->suffix());
+    }
+
+    /** Return tree without the last item or null if the tree had one item.*/
+    Node* pop_back(Node* tree)
+    {
+        if(tree->single()) return 0;
+
+        Node* suffix = tree->suffix();
+        uint16_t depth = tree->depth;
+        if(suffix->count > 1)
+            return new_tree(tree->prefix(), tree->middle(), new_node(depth, suffix->items, suffix->count - 1));
+
+        Node* middle = tree->middle();
+        if(!middle) return digit_to_tree(tree->prefix());
+
+        return new_tree(tree->prefix(), pop_back(middle), (Node*) last_item(middle));
+    }
+
+    static void* first_item(Node* tree){return tree->prefix()->items[0];}
+
+    static void* last_item(Node* tree)
+    {
+        Node* digit = tree->single() ? tree->prefix() : tree->suffix();
+        return digit->items[digit->count - 1];
+    }
+
+    /** Return first element of a tree of depth 0.*/
+    static Element* first_element(Node* tree){return (Element*) first_item(tree);}
+
+    static Element* last_element(Node* tree){return (Element*) last_item(tree);}
+
+    /** Return tree of the items of a, the count items and the items of b. The trees may be null.*/
+    Node* concat(Node* a, void* const* items, size_t count, Node* b, uint16_t depth)
+    {
+        if(!a)
+        {
+            for(size_t i = count; i-- > 0;) b = push_front(b, items[i], depth);
+            return b;
+        }
+        if(!b)
+        {
+            for(size_t i = 0; i < count; ++i) a = push_back(a, items[i], depth);
+            return a;
+        }
+        if(a->single())
+        {
+            return push_front(concat(0, items, count, b, depth), first_item(a), depth);
+        }
+        if(b->single())
+        {
+            return push_back(concat(a, items, count, 0, depth), first_item(b), depth);
+        }
+
+        // Pack the suffix of a, the items and the prefix of b to nodes of the middle tree.
+        void* middle_items[MAX_CONCAT_ITEMS];
+        size_t middle_count = 0;
+        Node* suffix = a->suffix();
+        Node* prefix = b->prefix();
+        for(uint8_t i = 0; i < suffix->count; ++i) middle_items[middle_count++] = suffix->items[i];
+        for(size_t i = 0; i < count; ++i) middle_items[middle_count++] = items[i];
+        for(uint8_t i = 0; i < prefix->count; ++i) middle_items[middle_count++] = prefix->items[i];
+
+        void* nodes[MAX_CONCAT_ITEMS / 2];
+        size_t node_count = 0;
+        size_t i = 0;
+        while(middle_count - i > 4)
+        {
+            nodes[node_count++] = new_node(depth, middle_items[i], middle_items[i + 1], middle_items[i + 2]);
+            i += 3;
+        }
+        if(middle_count - i == 4)
+        {
+            nodes[node_count++] = new_node(depth, middle_items[i], middle_items[i + 1]);
+            nodes[node_count++] = new_node(depth, middle_items[i + 2], middle_items[i + 3]);
+        }
+        else
+        {
+            nodes[node_count++] = new_node(depth, middle_items + i, middle_count - i);
+        }
+
+        return new_tree(a->prefix(), concat(a->middle(), nodes, node_count, b->middle(), depth + 1), b->suffix());
+    }
+
+    /** Return the element at index of a tree of depth 0.*/
+    static Element* element_at(Node* tree, size_t index)
+    {
+        // Find the item holding index from the digits and middle trees.
+        void* item = 0;
+        uint16_t depth = 0;
+        while(!item)
+        {
+            depth = tree->depth;
+            Node* prefix = tree->prefix();
+            if(index < prefix->size)
+            {
+                item = prefix;
+                ++depth; // Search the digit as a node
+            }
+            else
+            {
+                index -= prefix->size;
+                Node* middle = tree->middle();
+                size_t middle_size = middle ? middle->size : 0;
+                if(index < middle_size)
+                {
+                    tree = middle;
+                }
+                else
+                {
+                    item = tree->suffix();
+                    ++depth;
+                    index -= middle_size;
+                }
+            }
+        }
+
+        // Descend the nodes to the element.
+        while(depth > 0)
+        {
+            Node* n = (Node*) item;
+            --depth;
+            for(uint8_t i = 0; i < n->count; ++i)
+            {
+                size_t s = item_size(n->items[i], depth);
+                if(index < s)
+                {
+                    item = n->items[i];
+                    break;
+                }
+                index -= s;
+            }
+        }
+        return (Element*) item;
+    }
+
+    /** Mark the elements of a node of depth 0 or push the items of n to the marking stack. */
+    /** Mark the nodes and elements in locked chunks reachable from the roots of the cycle.*/
+    void mark_locked()
+    {
+        PDequePool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            if(pool->nodes_.set_marked_if_locked(n)) pool->mark_items(n, stack, false);
+        });
+    }
+
+    void mark_items(Node* n, std::vector<Node*>& stack, bool minor)
+    {
+        size_t count = n->kind == TREE ? 3 : n->count;
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(n->kind == NODE && n->depth == 0)
+            {
+                if(minor) elements_.set_marked_if_young((Element*) n->items[i]);
+                else      elements_.set_marked_if_locked((Element*) n->items[i]);
+            }
+            else
+            {
+                stack.push_back((Node*) n->items[i]);
+            }
+        }
+    }
+
+    void copy_roots()
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        gc_roots_.clear();
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) gc_roots_.push_back(r->first);
+    }
+
+    node_chunk_box           nodes_;
+    element_chunk_box        elements_;
+    ref_count_map            ref_count_;  //> Root tree reference counts
+    std::mutex               ref_mutex_;
+    std::vector<Node*>       gc_roots_;   //> Roots of the ongoing collection cycle
+    std::shared_future<void> cycle_;
+    size_t                   nursery_size_;
+};
+
+
+/////////// Persistent map //////////////
+
+#if 1
+/** A persistent, self garbage-collecting version of Bagwell's persistent hash tries.
+    Hash key: uint32_t
+
+    The key is split to five 5-bit length fields and one 2-bit length field as
+
+level  0     1     2     3     4     5   6
+    |aaaaa|bbbbb|ccccc|ddddd|eeeee|fffff|gg
+     0-31  0-31  0-31  0-31  0-31  0-31  0-3
+
+    where each level give the index to use at the child-node array at the given level.
+
+
+    Node: used_field: uint32_t
+          ref_array = Ref * [huffmanlength(used_field)]
+
+    Each node contains 32 slots for children.
+
+    The ref_array is allocated only to the huffman length of the used_field (i.e. numbers of bits 1
+    in the field).
+
+    Each element in ref-array stores either: a) A reference to a child-node, b) A reference to the stored element or c) A reference to a list of stored elements in
+    case the hash-key is overwritten.
+
+    The datum for the element is not stored inside the node, only a reference to it.
+
+    The storage used by a node _without the stored elements_ is 
+
+    4 bytes (used_field) + 8 bytes (ref_array pointer) + elem_count(1 to 32) * 8 (ref_array contents) -> 20 to 268 bytes
+
+    The hash trie is used in a persistent manner - each modifications return a new root-node
+    with the path to the changed node re-allocated. The stored elements themselves are not
+    copied, only the references to them.
+
+    Each non-value type (i.e. that encompass more memory than just sizeof(T), std::string etc,
+    stored in the map must have it's own implementation of the hash32 function.
+
+*/
+
+template<class K>
+class AreEqual { public:
+    static bool compare(const K& k1, const K& k2){return k1 == k2;} 
+};
+
+template<class H>
+class MapHash { public:
+    static uint32_t hash(const H& h){return get_hash32(h);}
+};
+
+/** Chunk sizes (slots per chunk) of the storages of PMapPool. Child arrays are stored in size
+ *  classes, RefSlots is the number of arrays in each chunk of a size class. */
+template<size_t NodeSlots = CHUNK_BUFFER_SIZE, size_t KeyValueSlots = CHUNK_BUFFER_SIZE,
+         size_t RefSlots = CHUNK_BUFFER_SIZE>
+struct MapChunkGeometry
+{
+    enum{NODE_SLOTS = NodeSlots, KEYVALUE_SLOTS = KeyValueSlots, REF_SLOTS = RefSlots};
+};
+
+template<class K, class V, class Compare = AreEqual<K>, class HashFun = MapHash<K>,
+         class Geometry = MapChunkGeometry<>>
+class PMapPool
+{
+public:
+
+    /** Key-value pair. */
+    struct KeyValue{uint32_t hash; K first; V second;};
+   
+    static const V* keyvalue_match_get(const KeyValue& kv, const K& key, const uint32_t hash) 
+    {
+        if(kv.hash == hash && Compare::compare(key, kv.first))
+            return &kv.second;
+        else return 0;
+    }
+
+    /* Data structure types. */
+    
+    typedef          PListPool<const KeyValue*>       KeyValueListPool;
+    typedef typename PListPool<const KeyValue*>::List KeyValueList;
+
+    struct RefCell;
+    class Transient;
+
+    struct Node
+    {
+        struct Ref
+        {
+            Node* node;
+            Node& operator*(){return *node;}
+            Node& operator->(){return *node;}
+        };
+
+        enum NodeType{EmptyNode, ValueNode, CollisionNode};
+
+        uint32_t used;
+        uint32_t owner;       //> Transient that may modify the node in place, 0 if persistent
+        Ref*     child_array; //> Pointer to an allocated child sequence
+       
+        /** For ValueNodes the keyvalue field is referenced. For
+         *  CollisionNodes the collision_list field is referenced. */ 
+        union
+        {
+            const KeyValue*     keyvalue;
+            KeyValueList* collision_list; 
+            //Before end of the trie tree hash collisions are just proapagated downwards.
+            //The collided elements are always only keyvalues.
+        }value;
+
+        NodeType type; 
+        uint32_t count; //> Number of keyvalues in the node and it's children
+
+        Node():used(0), owner(0), child_array(0), count(0){}
+
+        ~Node()
+        {
+            if(type == CollisionNode && value.collision_list) delete value.collision_list;
+        }
+
+        /** Return number of elements stored */
+        size_t size(){ return count_bits(used);}
+
+        /** Return pointer to hash value if type is not EmptyNode */
+        const uint32_t* hash_value()
+        {
+            const uint32_t* result = 0;
+            if(type == CollisionNode)
+            {
+                typename KeyValueList::iterator kvi = value.collision_list->begin();
+                const KeyValue* kv(*kvi.data_ptr());
+                result = &(kv->hash);
+
+            }
+            else if(type == ValueNode)
+            {
+                result = &(value.keyvalue->hash);
+            }
+            return result;
+        }
+
+        /** Return true if the index signified by the index is used.*/
+        bool index_in_use(uint32_t index){return bit_is_on(used, index);}
+
+        /** Return index matching the bitfield. The bitfield must reflect an actually used bit.*/
+        uint32_t index(uint32_t bitfield){return count_bits(used & (bitfield - 1));}
+
+        /** Return element corresponding to the hash-key.*/
+        Node* get_child_by_fieldindex(uint32_t parsed_index)
+        {
+            if(index_in_use(parsed_index))
+            {
+                uint32_t child_index = index(1 << parsed_index);
+                return child_array[child_index].node;
+            }
+            else
+            {
+                return 0;
+            }
+        }
+
+        Node* get_child_by_hash_and_depth(const uint32_t hash, const uint32_t depth)
+        {
+            return get_child_by_fieldindex((hash >> (depth * 5)) & 0x1f);
+        }
+
+        /** Return reference matching the bit pattern or null if array is not large enough.*/
+        Ref* get(uint32_t key, uint32_t level)
+        {
+            Ref* result = 0;
+            uint32_t local_index = (key >> (level*5)) & 0x1f;
+            uint32_t child_index = index(1 << local_index);
+            if(child_index < size()) result = child_array + child_index;
+            return result;
+        }
+
+        Ref* begin(){return child_array;}
+        Ref* end(){return child_array + size();}
+    };
+
+    static bool node_has_children(Node* n) {return n->child_array != 0;}
+    static bool node_has_keyvalues(Node* n) {return n->type != Node::EmptyNode;}
+
+    /**
+     * Iterator for the values in one node.
+     */
+    struct NodeValueIterator
+    {
+        Node* node;
+        typename KeyValueList::iterator iter;
+        typename KeyValueList::iterator end;
+        
+        const KeyValue* keyvalue;
+        bool      iteration_ongoing;
+
+
+        NodeValueIterator():node(0), keyvalue(0), iteration_ongoing(false){}
+
+        NodeValueIterator(Node* node_in):node(node_in), keyvalue(0), iteration_ongoing(false)
+        {
+            if(node->type == Node::CollisionNode) end = node->value.collision_list->end();
+        }
+
+        /** Returns true as long as the iterator is ongoing. Once the iteration is complete
+         *  the internal reference to keyvalue is in undefined state. */
+        bool move_next()
+        {
+            bool result = false;
+            switch(node->type)
+            {
+                case Node::ValueNode:
+                {
+                    if(!keyvalue)
+                    {
+                        // Can visit the only value only once.
+                        keyvalue = node->value.keyvalue;
+                        result = true;
+                    }
+                    break;
+                }
+                case Node::CollisionNode:
+                {
+                    if(iteration_ongoing)
+                    {
+                        ++iter;
+                        if(iter != end)
+                        {
+                            keyvalue = *iter;
+                            result = true;
+                        }
+                    }
+                    else
+                    {
+                        iteration_ongoing = true;
+                        // The list has at least two elements. No need to check for nil head.
+                        iter = node->value.collision_list->begin();
+                        keyvalue = *iter;
+                        result = true;
+                    }
+                    break;
+                }
+                case Node::EmptyNode:
+                default:
+                    break;
+            }
+            return result;
+        }
+
+        const KeyValue* current() const {return keyvalue;}
+    };
+
+    // Itearator for children inside node.
+    struct NodeChildIterator
+    {
+        Node* node;
+        typename Node::Ref* iter;  
+        typename Node::Ref* end;  
+        bool iterating;
+        bool node_has_children;
+
+        NodeChildIterator(Node* node_in):node(node_in), iterating(false), node_has_children(false)
+        {
+            end = node->end();
+            if(node_in->size() > 0) node_has_children = true;
+        }
+
+        bool move_next()
+        {
+            if(!node_has_children) return false;
+
+            bool result = false;
+            if(iterating) 
+            {
+                iter++;
+            }
+            else
+            {
+                iter = node->begin();
+                iterating = true;
+            }
+
+            if(iter != end) result = true;
+
+            return result;
+        }
+
+        Node* current(){return iter->node;}
+    };
+    
+
+    typedef ChunkBox<KeyValue, Geometry::KEYVALUE_SLOTS>                    keyvalue_chunk_box;
+    typedef ChunkBox<Node, Geometry::NODE_SLOTS>                            node_chunk_box;
+    typedef SizeClassChunkBox<typename Node::Ref, 32, Geometry::REF_SLOTS>  ref_chunk_box; // Child arrays
+
+    typedef typename keyvalue_chunk_box::chunk_type keyvalue_chunk;
+    typedef typename node_chunk_box::chunk_type     node_chunk;
+
+    typedef std::unordered_map<Node*, int> refcount_map;
+
+    // Unordered iterator to map nodes
+    //
+    // The purpose is to support stl -like iteration.
+    class node_iterator
+    {
+        // Use stack of node child iterators to keep track of state.
+        // Algorithm:
+        //  i)  Go to the leftmost node foundable
+        //  ii) iterate it's values
+        //  ii) go to node sibling, 
+        
+        FixedStack<NodeChildIterator, 8> iter_stack; //Max tree depth is 7 plus root.
+        NodeValueIterator value_iter;
+
+        const KeyValue* current;
+
+#define CURRENT_NODE iter_stack.top()->current()
+
+        // For each node:
+        // Iterate over each value in array. If value is a node, go into node.
+        public:
+
+        node_iterator(Node* node):current(0)
+        {
+            if(node && node_has_children(node))
+            {
+                push_node(node);
+            }
+        }
+
+        // Latch onto the children of the node - make sure the node has children prior to pushing it
+        void push_node(Node* parent_node)
+        {
+            iter_stack.push(NodeChildIterator(parent_node));
+            NodeChildIterator* ni = iter_stack.top();
+            ni->move_next(); // Must succeed as node has children - now have a valid node
+
+            Node* node = ni->current();
+            if(node_has_keyvalues(node))
+            {
+                value_iter = NodeValueIterator(node);
+                advance(); // Move value_iter to valid value
+            }
+            else
+            {
+                // Push until a node with values is found.
+                push_node(node);
+            }
+        }
+
+        void advance()
+        {
+            if(value_iter.move_next())
+            {
+                current = value_iter.current();
+            }
+            else
+            {
+                NodeChildIterator* ni = iter_stack.top();
+                Node* node =ni->current();
+                // Ran out of values - find next node.
+                if(node_has_children(node))
+                {
+                    push_node(node);
+                }
+                else
+                {
+                    // Move to next sibling node or if none left pop.
+                    if(ni->move_next())
+                    {
+                        Node* next_node = ni->current();
+                        value_iter = NodeValueIterator(next_node);
+                        advance(); // Move value_iter to valid value
+                    }
+                    else
+                    {
+                        // No siblings left - pop stack
+                        pop();
+                    }
+                }
+            }
+        }
+
+        void pop()
+        {
+            iter_stack.pop();
+
+            if(iter_stack.depth() > 0)
+            {
+                NodeChildIterator* ni = iter_stack.top();
+                if(ni->move_next())
+                {
+                    Node* node = ni->current();
+                    if(node_has_keyvalues(node))
+                    {
+                        value_iter = NodeValueIterator(node);
+                        advance();
+                    }
+                    else
+                    {
+                        push_node(node);
+                    }
+                }
+                else
+                {
+                    pop();
+                }
+            }
+            else
+            {
+                // Stack emtpy, nothing left to do - terminate iteration.
+                current = 0;
+            }
+        }
+
+        void operator++(){advance();}
+
+        bool operator==(const node_iterator& i){return current == i.current;}
+        bool operator!=(const node_iterator& i){return current != i.current;}
+        const KeyValue* data_ptr(){return current;}
+        const KeyValue& operator*(){return *current;}
+        const KeyValue* operator->(){return current;}
+    };
+
+    /** The map class.*/
+    class Map
+    {
+    public:
+        typedef node_iterator iterator;
+
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef KeyValue value_type;
+
+        Map(PMapPool& pool, Node* root):pool_(pool), root_(root), hash_(0), hashed_(false)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Map(const Map& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Map(Map&& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            map.root_ = 0;
+        }
+
+        ~Map()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
+
+        Map& operator=(const Map& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                if(root_) pool_.add_ref(root_);
+            }
+            return *this;
+        }
+
+        Map& operator=(Map&& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                map.root_ = 0;
+            }
+            return *this;
+        }
+
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref()
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const {if(root_) f((const void*) root_);}
+
+        ConstOption<V> try_get_value(const K& key) const
+        {
+            if(!root_) return ConstOption<V>(0);
+
+            uint32_t hash = HashFun::hash(key);
+            uint32_t level = 0; 
+            const V* result = 0;
+            Node* current = root_;
+
+            for(;level < 8; level++) 
+            {
+                Node* n = current->get_child_by_hash_and_depth(hash, level);
+                if(n)
+                {     
+                    if(n->type == Node::ValueNode)
+                    {
+                        result = keyvalue_match_get(*n->value.keyvalue, key, hash);
+                    }
+                    else if (n->type == Node::CollisionNode)
+                    {
+                        typename KeyValueList::iterator i = n->value.collision_list->begin();
+                        typename KeyValueList::iterator end = n->value.collision_list->end();
+                        for(;i != end && (result == 0); ++i)
+                        {
+                            result = keyvalue_match_get(**i, key, hash);
+                        }
+                    }
+
+                    if(result) break;
+
+                    current = n; // Just move on if match not found.
+                }
+                else
+                {
+                    // Trie path ran out. No value.
+                    break;
+                }
+            }
+
+            return ConstOption<V>(result);
+        }
+
+        /** Rewrite value held in existing key. In most instances avoid this if possible. */
+        bool try_replace_value(const K& key, const V& value)
+        {
+            bool result = false;
+            ConstOption<V> opt = try_get_value(key);
+            if(opt.is_valid())
+            {
+                V* v = const_cast<V*>(opt.get());
+                *v = value;
+                result = true;
+            }
+            return result;
+        }
+
+        /** Add key and value to map.*/
+        Map add(const K& key, const V& value)
+        {
+            return pool_.add(*this, key, value);
+        }
+
+        /** Add sequence of keys and values in one update, see Transient. */
+        template<class KI, class VI>
+        Map add(const KI i_key, const KI key_end, const VI i_value, const VI value_end) const
+        {
+            return pool_.add(*this, i_key, key_end, i_value, value_end);
+        }
+
+        /** Remove key entry from map. Only the path to the removed keyvalue is copied.*/
+        Map remove(const K& key)
+        {
+            if(!try_get_value(key).is_valid()) return *this; // Nothing to remove.
+
+            uint32_t hash        = HashFun::hash(key);
+            uint32_t local_index = hash & 0x1f;
+            Node*    branch      = pool_.remove_from_branch(root_->get_child_by_fieldindex(local_index), key, hash, 0);
+            Node*    root        = pool_.replace_child(root_, local_index, branch);
+            root->count = root_->count - 1;
+            return Map(pool_, root);
+        }
+
+        /** Return map with the keyvalues of m added, see merge of the pool.*/
+        Map merge(const Map& m) const {return pool_.merge(*this, m);}
+
+        /** Return map of the keyvalues of m that are missing or have another value in this map.*/
+        Map diff(const Map& m) const {return pool_.diff(*this, m);}
+
+        /** Return map of the keyvalues of this map whose key is in m, see intersection of the pool.*/
+        Map intersection(const Map& m) const {return pool_.intersection(*this, m);}
+
+        /** Return map of the keyvalues of this map whose key is not in m.*/
+        Map difference(const Map& m) const {return pool_.difference(*this, m);}
+
+        // Run garbage collector on the root pool.
+        void gc(){pool_.gc();}
+
+        iterator begin() const {return iterator(root_);}
+        iterator end() const {return iterator(0);}
+      
+        /** Return hash_elements(*this). The hash is computed on the first call and copied with the handle.*/
+        template<class F>
+        uint32_t hash(F hash_elements) const
+        {
+            if(!hashed_)
+            {
+                hash_   = hash_elements(*this);
+                hashed_ = true;
+            }
+            return hash_;
+        }
+
+        bool operator==(const Map& m) const {return pool_.equal(*this, m);}
+
+        const size_t size() const {return root_ ? root_->count : 0;}
+
+        friend class PMapPool;
+        friend class Transient;
+
+    private:
+        PMapPool& pool_;
+        Node* root_;
+        mutable uint32_t hash_; //> Cached hash, valid if hashed_
+        mutable bool     hashed_;
+    };
+
+    /** Builder that adds keys to a map by modifying the nodes it has created in place. Only the
+     *  nodes on the path to a key that the builder has not copied yet are copied, so adding N keys
+     *  does not leave O(N log N) path copies as garbage.
+     *
+     *  Nodes that existed when a collection started are never modified: the collector may be
+     *  marking them and minor collection assumes old nodes do not refer to young ones. Once
+     *  a collection has started after the previous add the builder takes a new owner id and
+     *  continues by copying. The root of the builder is a gc root like the root of a Map.*/
+    class Transient
+    {
+    public:
+        Transient(const Map& map):pool_(map.pool_), root_(map.root_), owner_(pool_.new_owner()),
+            collections_(pool_.collections_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        ~Transient()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
+
+        void add(const K& key, const V& value)
+        {
+            if(collections_ != pool_.collections_)
+            {
+                owner_ = pool_.new_owner();
+                collections_ = pool_.collections_;
+            }
+            set_root(pool_.instantiate_tree_path(root_, pool_.new_keyvalue(key, value), owner_));
+        }
+
+        /** Return the built map. The nodes built so far are not modified after this.*/
+        Map persistent()
+        {
+            owner_ = pool_.new_owner();
+            return Map(pool_, root_);
+        }
+
+    private:
+        Transient(const Transient&);
+        Transient& operator=(const Transient&);
+
+        void set_root(Node* root)
+        {
+            if(root == root_) return;
+            pool_.add_ref(root);
+            if(root_) pool_.remove_ref(root_);
+            root_ = root;
+        }
+
+        PMapPool& pool_;
+        Node*     root_;
+        uint32_t  owner_;
+        uint64_t  collections_; //> Collection count of the pool when owner_ was taken
+    };
+
+    /** Recycle all memory. */
+    void kill()
+    {
+        // Must call destructor on all used cells.
+        // TODO: Should this be the responsibility of individual containers?
+        wait_for_collection();
+        clear_root_refcounts();
+        gc();
+        wait_for_collection();
+        collided_list_pool_.kill();
+    }
+
+    PMapPool():nursery_size_(8192), next_owner_(0), collections_(0)
+    {
+    }
+
+    /** Return new owner id for a Transient. */
+    uint32_t new_owner()
+    {
+        if(++next_owner_ == 0) ++next_owner_;
+        return next_owner_;
+    }
+
+    ~PMapPool()
+    {
+        kill();
+    }
+
+    /** Remove reference to node */
+    void remove_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(ref_count_, n);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
+
+    /** Add reference to node*/
+    void add_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_[n]++;
+    }
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_.clear();
+    }
+
+    /** Copy of the positive root reference counts. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
+
+    /** Bytes of the entries, nodes and child arrays reachable from roots. Marks on the calling
+     *  thread without collecting. Young slots are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        keyvalue_chunks_.lock_for_collection();
+        node_chunks_.lock_for_collection();
+        ref_chunks_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r) gc_roots_.push_back((Node*) *r);
+        mark_locked();
+        gc_roots_.clear();
+        size_t bytes = keyvalue_chunks_.marked_bytes_locked() + node_chunks_.marked_bytes_locked() +
+                       ref_chunks_.marked_bytes_locked();
+        keyvalue_chunks_.release_locked();
+        node_chunks_.release_locked();
+        ref_chunks_.release_locked();
+        return bytes;
+    }
+
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return keyvalue_chunks_.mark_mismatches() + node_chunks_.mark_mismatches() + ref_chunks_.mark_mismatches() +
+               collided_list_pool_.mark_mismatches();
+    }
+
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
+    {
+        if(cycle_.valid())
+        {
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            gc_roots_.clear();
+            release_empty_chunks();
+        }
+    }
+
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count)
+    {
+        keyvalue_chunks_.set_retained_empty_chunks(count);
+        node_chunks_.set_retained_empty_chunks(count);
+        ref_chunks_.set_retained_empty_chunks(count);
+        collided_list_pool_.set_retained_empty_chunks(count);
+    }
+
+    ChunkStats chunk_stats()
+    {
+        wait_for_collection();
+        ChunkStats s = keyvalue_chunks_.stats();
+        s += node_chunks_.stats();
+        s += ref_chunks_.stats();
+        s += collided_list_pool_.chunk_stats();
+        return s;
+    }
+
+    /** Bytes of all entries, nodes and collision lists reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const
+    {
+        return keyvalue_chunks_.allocated_bytes() + node_chunks_.allocated_bytes() + ref_chunks_.allocated_bytes()
+            + collided_list_pool_.allocated_bytes();
+    }
+
+    /** Collect the nodes reserved after the previous collection. Runs on the calling thread.*/
+    void minor_gc()
+    {
+        wait_for_collection();
+        ++collections_;
+
+        copy_roots();
+
+        keyvalue_chunks_.minor_begin();
+        node_chunks_.minor_begin();
+        ref_chunks_.minor_begin();
+
+        // Nodes mutated after they were promoted may refer to young nodes.
+        for(auto r = remembered_.begin(); r != remembered_.end(); ++r) mark_contents(*r, gc_roots_, true);
+        remembered_.clear();
+
+        PMapPool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            pool->mark_referenced(n, stack, true);
+        });
+
+        keyvalue_chunks_.minor_sweep();
+        node_chunks_.minor_sweep();
+        ref_chunks_.minor_sweep();
+        release_empty_chunks();
+        gc_roots_.clear();
+    }
+
+    /** Write barrier: add node to the remembered set if it is modified after creation. */
+    void remember(Node* n){remembered_.push_back(n);}
+
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return node_chunks_.young_count() >= nursery_size_;}
+
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
+
+    /** Create new empty map */
+    Map new_map()
+    {
+        Map m(*this, 0);
+        return m;
+    }
+    
+    /** Create a copy from existing map. TODO: Remove this?*/
+    template<class M>
+    Map new_map(const M& map_in)
+    {
+        Node* root = 0;
+
+        for(auto i = map_in.begin(); i != map_in.end(); ++i)
+        {
+            KeyValue* kv = new_keyvalue(i->first, i->second);
+            root = instantiate_tree_path(root, kv);
+        }
+
+        Map m(*this, root);
+
+        return m;
+    }
+
+    /** Create new map with one element*/
+    Map new_map(const K& key, const V& value)
+    {
+        KeyValue* kv = new_keyvalue(key, value);
+        Node* root = instantiate_tree_path(0, kv);
+
+        Map m(*this, root);
+        return m;
+    }
+
+    /** Create a new map by adding an element to existing map*/
+    Map add(const Map& old, const K& key, const V& value)
+    {
+        KeyValue* kv = new_keyvalue(key, value);
+        Node* new_root = instantiate_tree_path(old.root_, kv);
+        return Map(*this, new_root);
+    }
+
+    /** Create a new map by adding an elements and values to an existing map*/
+    template<class KI, class VI>
+    Map add(const Map& old, KI i_key, KI key_end, VI i_value, VI value_end)
+    {
+        Transient t(old);
+
+        while((i_key != key_end) && 
+              (i_value != value_end))
+        {
+            t.add(*i_key, *i_value);
+
+            ++i_key;
+            ++i_value;
+        }
+
+        return t.persistent();
+    }
+
+    /** Create a new map by adding an elements and values to an existing map. Usable in case key and 
+    *   value types are the same.*/
+    template<class KVI>
+    Map add(const Map& old, KVI i_elems, KVI elems_end)
+    {
+        Transient t(old);
+
+        KVI first;
+
+        while((i_elems != elems_end))
+        {
+            first = i_elems;
+            ++i_elems;
+            if(i_elems != elems_end) t.add(*first, *i_elems);
+            else break;
+            
+            ++i_elems;
+        }
+
+        return t.persistent();
+    }
+
+    /** Create a new map by adding an allocated keyvalue instance to an existing map.*/
+    Map add(const Map& old, const KeyValue* keyvalue)
+    {
+        Node* new_root = instantiate_tree_path(old.root_, keyvalue);
+        return Map(*this, new_root);
+    }
+
+    /** Return true if map contains key of kv with an equal value.*/
+    static bool contains(const Map& map, const KeyValue& kv)
+    {
+        ConstOption<V> v = map.try_get_value(kv.first);
+        return v.is_valid() && *v == kv.second;
+    }
+
+    /** Return a with the keyvalues of b added. Subtrees b shares with a are not visited.*/
+    Map merge(const Map& a, const Map& b)
+    {
+        Transient t(a);
+        auto add_new = [&](const KeyValue* kv)
+        {
+            if(!contains(a, *kv)) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(a.root_, b.root_, add_new);
+        return t.persistent();
+    }
+
+    /** Return map of the keyvalues of b that are missing from a or have a different value in a.
+     *  diff(a, b) holds the keys added or changed from a to b and diff(b, a) the keys removed or
+     *  changed. Subtrees b shares with a are not visited.*/
+    Map diff(const Map& a, const Map& b)
+    {
+        Transient t(new_map());
+        auto add_new = [&](const KeyValue* kv)
+        {
+            if(!contains(a, *kv)) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(a.root_, b.root_, add_new);
+        return t.persistent();
+    }
+
+    /** Return the keyvalues of a whose key is in b. A subtree a shares with b is in both maps and
+     *  is kept as is: only the unshared keys of a are looked up in b and removed if missing.*/
+    Map intersection(const Map& a, const Map& b)
+    {
+        Map result(a);
+        auto remove_missing = [&](const KeyValue* kv)
+        {
+            if(!b.try_get_value(kv->first).is_valid()) result = result.remove(kv->first);
+            return true;
+        };
+        for_each_unshared(b.root_, a.root_, remove_missing);
+        return result;
+    }
+
+    /** Return the keyvalues of a whose key is not in b. A subtree a shares with b has no keys
+     *  in the result and is not visited.*/
+    Map difference(const Map& a, const Map& b)
+    {
+        Transient t(new_map());
+        auto add_missing = [&](const KeyValue* kv)
+        {
+            if(!b.try_get_value(kv->first).is_valid()) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(b.root_, a.root_, add_missing);
+        return t.persistent();
+    }
+
+    /** Return true if the maps have equal keys and values. Shared subtrees are not visited.*/
+    bool equal(const Map& a, const Map& b)
+    {
+        if(a.root_ == b.root_) return true;
+        auto in_a = [&a](const KeyValue* kv){return contains(a, *kv);};
+        auto in_b = [&b](const KeyValue* kv){return contains(b, *kv);};
+        return for_each_unshared(a.root_, b.root_, in_a) && for_each_unshared(b.root_, a.root_, in_b);
+    }
+
+    /** Call f for the keyvalues in the subtree b, skipping the subtrees that are shared with a, the
+     *  node at the same position (or null). A keyvalue b shares with a is skipped as well. Stop
+     *  and return false once f returns false.*/
+    template<class F>
+    bool for_each_unshared(Node* a, Node* b, F& f)
+    {
+        if(!b || a == b) return true;
+
+        if(b->type == Node::ValueNode)
+        {
+            bool shared = a && a->type == Node::ValueNode && a->value.keyvalue == b->value.keyvalue;
+            if(!shared && !f(b->value.keyvalue)) return false;
+        }
+        else if(b->type == Node::CollisionNode)
+        {
+            for(auto i = b->value.collision_list->begin(); i != b->value.collision_list->end(); ++i)
+                if(!f(*i)) return false;
+        }
+
+        size_t child = 0;
+        for(uint32_t index = 0; index < 32; ++index)
+        {
+            if(!b->index_in_use(index)) continue;
+            Node* a_child = a ? a->get_child_by_fieldindex(index) : 0;
+            if(!for_each_unshared(a_child, b->child_array[child++].node, f)) return false;
+        }
+        return true;
+    }
+
+    KeyValue* new_keyvalue(const K& k, const V& v)
+    {
+        KeyValue* kv = keyvalue_chunks_.reserve_element();
+        kv->first  = k;
+        kv->second = v;
+        kv->hash   = HashFun::hash(k);
+        return kv;
+    }
+
+    /** Replace the existing reference array at node with a new array that has the newnode inserted at loc. */
+    void node_insert_replace_refarray(Node* parent, Node* newnode, const uint32_t local_index, const uint32_t child_level)
+    {
+        size_t   old_count       = parent->size();
+        size_t   new_count       = old_count + 1;
+        uint32_t local_index_bit = 1 << local_index;
+
+        typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(new_count);
+        typename Node::Ref* old_children = parent->child_array;
+
+        // Create new child array for current node and mark new index used.
+        parent->child_array = child_array;
+        parent->used |= local_index_bit;
+
+        uint32_t array_index = parent->index(local_index_bit); 
+        // TODO: Check all child_array references that they use explicitly ref.
+        child_array[array_index].node = newnode;
+
+        auto child_ref = child_array + array_index;
+
+        // Copy all other children to new places in new child array
+        for(auto oi = old_children; oi != old_children + old_count; ++oi)
+        {
+            const uint32_t* child_hash = oi->node->hash_value();
+            assert(child_hash);
+            auto ref = parent->get(*child_hash, child_level);
+            assert(ref != child_ref);
+            ref->node = oi->node;
+        }
+    }
+
+    /** Return node that owner may modify: node itself if owned, otherwise a copy that has it's
+     *  own child array.*/
+    Node* edit_node(Node* node, uint32_t owner)
+    {
+        if(node->owner == owner) return node;
+
+        Node* n = new_node();
+        copy_node(n, node);
+        n->owner = owner;
+
+        size_t count = n->size();
+        if(count > 0)
+        {
+            n->child_array = ref_chunks_.reserve_consecutive_elements(count);
+            unsafe_copy(node->child_array, node->child_array + count, n->child_array);
+        }
+        return n;
+    }
+
+    /** Create new nodes on map for the path for the given hash value
+     *  @param hash hash value in.
+     *  @param owner if not 0 the nodes of the owner (a Transient) are modified in place.
+     *  @returns RootValue for new tree
+     */
+    Node* instantiate_tree_path(Node* old_root, const KeyValue* kv, uint32_t owner = 0)
+    {
+        Node* newroot; // This will be the root of the duplicate map.
+
+        if(old_root && owner)
+        {
+            newroot = edit_node(old_root, owner);
+        }
+        else
+        {
+            newroot = new_node();
+            newroot->owner = owner;
+            if(old_root) copy_node(newroot, old_root); // At first just copy children.
+        }
+
+        uint32_t level = 0;
+        uint32_t hash = kv->hash;
+        Node* current = newroot;
+
+        // Nodes on the path to the keyvalue. Their counts grow if the key was not in the map.
+        Node* path[8];
+        size_t path_length = 0;
+        path[path_length++] = newroot;
+        bool added = false;
+
+        // Go all the way down once we find an empty node. Then assign it as the value.
+        for(;true;level++)
+        {
+            // Calculate the array index for this level of hash and the corresponding bit pattern.
+            uint32_t local_index = (hash >> (level*5)) & 0x1f; // |0-31|
+
+            if(! current->index_in_use(local_index))
+            {     
+                // Assign new node positioned at index
+
+                Node* newnode = new_node(); // This node will contain the value.
+                newnode->type =  Node::ValueNode;
+                newnode->value.keyvalue = kv;
+                newnode->owner = owner;
+                newnode->count = 1;
+
+                node_insert_replace_refarray(current, newnode, local_index, level);
+                added = true;
+
+                break; 
+            }
+            else
+            {
+                // Index was in use.
+
+                uint32_t array_index = current->index(1 << local_index); 
+                Node* newnode;
+
+                if(owner)
+                {
+                    // Current is owned and so is it's child array.
+                    newnode = edit_node(current->child_array[array_index].node, owner);
+                    current->child_array[array_index].node = newnode;
+                }
+                else
+                {
+                    size_t count = current->size();
+
+                    typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(count);
+                    typename Node::Ref* old_children = current->child_array;
+                    unsafe_copy(old_children, old_children + count, child_array);
+
+                    current->child_array = child_array;
+
+                    newnode = new_node();
+                    copy_node(newnode, child_array[array_index].node);
+                    child_array[array_index].node = newnode;
+                }
+
+                // No suitable slot found yet.
+                if(level < 6)
+                {
+                    // Check if node value matches. If they do, replace current. 
+                    const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
+                    if(v)
+                    {
+                        // Replace matching key
+                        newnode->value.keyvalue = kv;
+                        break;
+                    }
+
+                    // If not matching key, just continue onwards.
+                    current = newnode;
+                    path[path_length++] = current;
+                }
+                else
+                {
+                    // Ran out of level. Need a collision list or replace existing value.
+                    // Need collision list.
+                    if(newnode->type == Node::CollisionNode)
+                    {
+                        // Already have a list. First check if value exists, then just replace it.
+                        // Otherwise append to list.
+
+                        const KeyValueList* oldlist = newnode->value.collision_list;
+                        typename KeyValueList::iterator i    = oldlist->begin();
+                        typename KeyValueList::iterator end  = oldlist->end();
+
+                        bool replace = false;
+                        for(;i != end; ++i)
+                        {
+                            const KeyValue* ikv = *i;
+                            const V* v = keyvalue_match_get(*ikv, kv->first, hash);
+                            if(v)
+                            {
+                                replace = true;
+                                break;
+                            }
+                        }
+
+                        if(replace)
+                        {
+                            KeyValueList tmp = oldlist->remove(i);
+                            *(newnode->value.collision_list) = tmp.add(kv);
+                        }
+                        else
+                        {
+                            *(newnode->value.collision_list) = oldlist->add(kv);
+                            path[path_length++] = newnode;
+                            added = true;
+                        }
+                    }
+                    else
+                    {
+                        // Replace single value with a list or replace existing value.
+                        const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
+                        if(v)
+                        {
+                            // Replace matching key
+                            newnode->value.keyvalue = kv;
+                            break;
+                        }
+                        else
+                        {
+                            //Need collision list
+                            newnode->type = Node::CollisionNode;
+                            const KeyValue* current_kv = newnode->value.keyvalue;
+                            newnode->value.collision_list = new KeyValueList(collided_list_pool_, 0);
+                            *(newnode->value.collision_list) = collided_list_pool_.new_list(current_kv, kv);
+                            path[path_length++] = newnode;
+                            added = true;
+                        }
+                    }
+
+                    break;
+                }
+            }
+        }
+
+        if(added) for(size_t i = 0; i < path_length; ++i) ++path[i]->count;
+
+        return newroot;
+    }
+
+    /** Return copy of parent with the child at local_index replaced by child. If child is null
+     *  the position is removed.*/
+    Node* replace_child(Node* parent, uint32_t local_index, Node* child)
+    {
+        Node* n = new_node();
+        copy_node(n, parent);
+
+        uint32_t bit         = 1 << local_index;
+        uint32_t array_index = parent->index(bit);
+        size_t   count       = parent->size();
+
+        if(child)
+        {
+            n->child_array = ref_chunks_.reserve_consecutive_elements(count);
+            unsafe_copy(parent->child_array, parent->child_array + count, n->child_array);
+            n->child_array[array_index].node = child;
+        }
+        else if(count > 1)
+        {
+            n->used = set_bit_off(parent->used, local_index);
+            n->child_array = ref_chunks_.reserve_consecutive_elements(count - 1);
+            unsafe_copy(parent->child_array, parent->child_array + array_index, n->child_array);
+            unsafe_copy(parent->child_array + array_index + 1, parent->child_array + count, n->child_array + array_index);
+        }
+        else
+        {
+            n->used = 0;
+            n->child_array = 0;
+        }
+        return n;
+    }
+
+    /** Return copy of the branch node at level with the keyvalue matching key removed, or null if
+     *  the branch becomes empty. The key must be in the branch.
+     *
+     *  Each node below the root holds a keyvalue. If the removed keyvalue is held by a node with
+     *  children, a keyvalue from a leaf of the branch is moved up in it's place: all keys below
+     *  the node share the hash fragments that lead to the node.*/
+    Node* remove_from_branch(Node* node, const K& key, uint32_t hash, uint32_t level)
+    {
+        if(node->type == Node::CollisionNode)
+        {
+            // Collision nodes are at the last level and have no children.
+            Node* n = new_node();
+            copy_node(n, node);
+            KeyValueList* list = n->value.collision_list;
+            for(auto i = list->begin(); i != list->end(); ++i)
+            {
+                if(keyvalue_match_get(**i, key, hash))
+                {
+                    *list = list->remove(i);
+                    break;
+                }
+            }
+
+            if(list->size() == 1)
+            {
+                const KeyValue* kv = *list->first();
+                delete list;
+                n->type = Node::ValueNode;
+                n->value.keyvalue = kv;
+            }
+            n->count = node->count - 1;
+            return n;
+        }
+
+        if(keyvalue_match_get(*node->value.keyvalue, key, hash))
+        {
+            if(!node_has_children(node)) return 0;
+
+            // Move up a keyvalue of the first leaf below.
+            Node* leaf = node->child_array[0].node;
+            while(node_has_children(leaf)) leaf = leaf->child_array[0].node;
+            const KeyValue* kv = leaf->type == Node::CollisionNode ? *leaf->value.collision_list->first() :
+                                                                     leaf->value.keyvalue;
+
+            uint32_t local_index = (kv->hash >> ((level + 1) * 5)) & 0x1f;
+            Node* child = remove_from_branch(node->get_child_by_fieldindex(local_index), kv->first, kv->hash, level + 1);
+            Node* n = replace_child(node, local_index, child);
+            n->value.keyvalue = kv;
+            n->count = node->count - 1;
+            return n;
+        }
+
+        uint32_t local_index = (hash >> ((level + 1) * 5)) & 0x1f;
+        Node* child = remove_from_branch(node->get_child_by_fieldindex(local_index), key, hash, level + 1);
+        Node* n = replace_child(node, local_index, child);
+        n->count = node->count - 1;
+        return n;
+    }
+
+    /** Copy node contents to dst. Collision lists are owned by the node so the copy gets it's own
+     *  handle to the list - otherwise modifying dst would modify the source node as well. */
+    void copy_node(Node* dst, const Node* src)
+    {
+        *dst = *src;
+        dst->owner = 0;
+        if(src->type == Node::CollisionNode)
+            dst->value.collision_list = new KeyValueList(*src->value.collision_list);
+    }
+
+    /** Mark node if it was locked for the collection (or is young on minor collection) and
+     *  continue to it's contents. */
+    /** Mark the slots in locked chunks reachable from the roots of the cycle.*/
+    void mark_locked()
+    {
+        PMapPool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            pool->mark_referenced(n, stack, false);
+        });
+    }
+
+    void mark_referenced(Node* node, std::vector<Node*>& stack, bool minor)
+    {
+        bool marked = minor ? node_chunks_.set_marked_if_young(node) : node_chunks_.set_marked_if_locked(node);
+        if(marked) mark_contents(node, stack, minor);
+    }
+
+    /** Mark child array and keyvalues of the node and push the children to the marking stack.*/
+    void mark_contents(Node* node, std::vector<Node*>& stack, bool minor)
+    {
+        size_t size = node->size();
+        if(size > 0)
+        {
+            if(minor) ref_chunks_.set_marked_if_young_array(node->child_array, size);
+            else      ref_chunks_.set_marked_if_locked_array(node->child_array, size);
+        }
 
-        ConstOption<V> try_get_value(const K& key) const
+        if(node->type == Node::ValueNode)
         {
-            if(!root_) return ConstOption<V>(0);
+            mark_keyvalue(node->value.keyvalue, minor);
+        }
+        else if(node->type == Node::CollisionNode)
+        {
+            auto iter = node->value.collision_list->begin();
+            auto end = node->value.collision_list->end();
+            for(;iter != end; ++iter)
+            {
+                mark_keyvalue(*iter, minor);
+            }
+        }
 
-            uint32_t hash = HashFun::hash(key);
-            uint32_t level = 0; 
-            const V* result = 0;
-            Node* current = root_;
+        for(auto ref = node->begin(); ref != node->end(); ++ref)
+            stack.push_back(ref->node);
+    }
 
-            for(;level < 8; level++) 
+    void mark_keyvalue(const KeyValue* kv, bool minor)
+    {
+        if(minor) keyvalue_chunks_.set_marked_if_young(kv);
+        else      keyvalue_chunks_.set_marked_if_locked(kv);
+    }
+
+    void copy_roots()
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        gc_roots_.clear();
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) gc_roots_.push_back(r->first);
+    }
+
+    void release_empty_chunks()
+    {
+        keyvalue_chunks_.release_empty_chunks();
+        node_chunks_.release_empty_chunks();
+        ref_chunks_.release_empty_chunks();
+    }
+
+    /** Start a garbage collection cycle for map. The marking and deallocation are run on the
+     *  collector thread, see wait_for_collection.*/
+    void gc()
+    {
+        // Must cleanup keyvalues, nodes, refs and gc collided_list_pool_
+        //
+        // Visit all heads (iterate through map)
+        // For each node: mark node, mark refs, go through all keyvalues and mark them
+        // Then, collect all
+
+        wait_for_collection();
+
+        // Once the previous cycle has collected all unused nodes collect collided list pool
+        // (unused heads have been released in the possible destructors of the nodes).
+        collided_list_pool_.gc();
+
+        // Clean up unused references and copy the roots.
+        ++collections_;
+        copy_roots();
+
+        keyvalue_chunks_.lock_for_collection();
+        node_chunks_.lock_for_collection();
+        ref_chunks_.lock_for_collection();
+
+        PMapPool* pool = this;
+        cycle_ = GcWorkers::instance().run_cycle([pool]()
+        {
+            pool->mark_locked();
+
+            // Collect unused slots group by group. The chunks of each group are released for
+            // allocation as soon as they are done.
+            for(size_t g = 0; g < pool->node_chunks_.group_count(); ++g)
             {
-                Node* n = current->get_child_by_hash_and_depth(hash, level);
-                if(n)
-                {     
-                    if(n->type == Node::ValueNode)
-                    {
-                        result = keyvalue_match_get(*n->value.keyvalue, key, hash);
-                    }
-                    else if (n->type == Node::CollisionNode)
+                pool->keyvalue_chunks_.sweep_group(g);
+                pool->node_chunks_.sweep_group(g);
+                pool->ref_chunks_.sweep_group(g);
+            }
+        });
+    }
+
+    /** Allocate new empty node.*/
+    Node* new_node()
+    {
+        Node* n = node_chunks_.reserve_element();
+        n->type = Node::EmptyNode;
+        return n;
+    }
+
+    /** Allocate new node with one value.*/
+#if 0 // TODO remove?
+    Node* new_node(const KeyValue& v)
+    {
+        Node* n = node_chunks_.reserve_element();
+        *kv = v;
+
+        n->type = Node::ValueNode;
+        n->value.keyvalue = kv;
+
+        return n;
+    }
+#endif
+
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() *  sizeof(typename refcount_map::value_type);
+        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.reserved_size_bytes() + 
+                       node_chunks_.reserved_size_bytes() +  ref_chunks_.reserved_size_bytes() + collided_list_pool_.reserved_size_bytes();
+        return total;
+    }
+
+    size_t live_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * sizeof(typename refcount_map::value_type);
+        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.live_size_bytes() + 
+                       node_chunks_.live_size_bytes() +  ref_chunks_.live_size_bytes() + collided_list_pool_.live_size_bytes();
+        return total;
+    }
+private:
+    keyvalue_chunk_box keyvalue_chunks_;
+    node_chunk_box     node_chunks_;
+    ref_chunk_box      ref_chunks_;
+    KeyValueListPool   collided_list_pool_;
+    refcount_map       ref_count_; // Store references to root nodes
+    std::mutex         ref_mutex_;
+    std::vector<Node*> gc_roots_;  //> Roots of the ongoing collection cycle
+    std::shared_future<void> cycle_;
+    std::vector<Node*> remembered_; //> Write barrier, promoted nodes that have been modified
+    size_t             nursery_size_;
+    uint32_t           next_owner_;  //> Last owner id given to a Transient
+    uint64_t           collections_; //> Number of collections started
+};
+
+#endif
+
+/////////// CHAMP map //////////////
+
+/** A persistent, self garbage-collecting hash map using the compressed hash-array mapped prefix
+    tree (CHAMP) encoding of Steindorfer and Vinju.
+
+    The hash is split to levels as in PMapPool. Each node has two bitmaps: datamap gives the
+    positions holding a keyvalue and nodemap the positions holding a child node. The keyvalues
+    are stored inline in the node followed by the child pointers, so a lookup reads one node per
+    level instead of a node, a child array and a keyvalue:
+
+        | datamap | nodemap | keyvalue 0 .. keyvalue k-1 | child 0 .. child m-1 |
+
+    Nodes are stored in size classes by the number of slots they use. A slot holds one keyvalue
+    or children_per_slot() child pointers.
+
+    Once the hash runs out (MAX_LEVEL) the keys are stored in collision nodes: up to
+    COLLISION_ENTRIES keyvalues in order and an optional overflow collision node as the only child.
+
+    Removal keeps the trie canonical: a child node left with a single keyvalue is inlined to
+    it's parent.
+
+    The interface of the pool and the Map matches PMapPool.
+*/
+template<class K, class V, class Compare = AreEqual<K>, class HashFun = MapHash<K>,
+         size_t NodeSlots = CHUNK_BUFFER_SIZE>
+class PChampMapPool
+{
+public:
+
+    /** Key-value pair. */
+    struct KeyValue{uint32_t hash; K first; V second;};
+
+    static const V* keyvalue_match_get(const KeyValue& kv, const K& key, const uint32_t hash)
+    {
+        if(kv.hash == hash && Compare::compare(key, kv.first))
+            return &kv.second;
+        else return 0;
+    }
+
+    /** Storage of one keyvalue or children_per_slot() child pointers. A member class so that
+     *  K and V need to be complete only once nodes are used.*/
+    struct Slot
+    {
+        typename std::aligned_storage<sizeof(KeyValue),
+            (std::alignment_of<KeyValue>::value > std::alignment_of<void*>::value ?
+             std::alignment_of<KeyValue>::value : std::alignment_of<void*>::value)>::type storage;
+    };
+
+    enum{MAX_LEVEL         = 7,  //> Level of the collision nodes
+         MAX_SLOTS         = 32,
+         COLLISION_ENTRIES = MAX_SLOTS - 1}; //> Leaves a slot for the overflow node
+
+    static size_t children_per_slot(){return sizeof(Slot) / sizeof(void*);}
+
+    /** Number of slots used by a node with data_count keyvalues and node_count children. */
+    static size_t slots_for(size_t data_count, size_t node_count)
+    {
+        return data_count + (node_count + children_per_slot() - 1) / children_per_slot();
+    }
+
+    /** Bit of the hash fragment at level. */
+    static uint32_t hash_bit(uint32_t hash, uint32_t level){return 1 << ((hash >> (level * 5)) & 0x1f);}
+
+    /** Mask of the first count bits (count < 32). */
+    static uint32_t low_bits(size_t count){return (uint32_t(1) << count) - 1;}
+
+    template<class T, size_t Count> struct NodeBlock;
+
+    /** Node header. The slots follow the header in the NodeBlock of the node's size class.*/
+    struct Node
+    {
+        uint32_t datamap; //> Positions holding a keyvalue
+        uint32_t nodemap; //> Positions holding a child node
+        uint32_t owner;   //> Transient that may modify the node in place, 0 if persistent
+        uint32_t count;   //> Number of keyvalues in the node and it's children
+
+        size_t data_count() const {return count_bits(datamap);}
+        size_t node_count() const {return count_bits(nodemap);}
+        size_t slot_count() const {return slots_for(data_count(), node_count());}
+
+        Slot* slots(){return ((NodeBlock<Node, 1>*) this)->slots;}
+
+        KeyValue* data(size_t index){return (KeyValue*)(slots() + index);}
+        Node** children(){return (Node**)(slots() + data_count());}
+        Node* child(size_t index){return children()[index];}
+
+        /** Return array index of the position bit in map.*/
+        static uint32_t index(uint32_t map, uint32_t bit){return count_bits(map & (bit - 1));}
+    };
+
+    /** Node of Count slots as stored in a chunk. Destroys the keyvalues of the node when the
+     *  slot is collected.*/
+    template<class T, size_t Count>
+    struct NodeBlock
+    {
+        T    node;
+        Slot slots[Count];
+
+        ~NodeBlock()
+        {
+            size_t count = node.data_count();
+            for(size_t i = 0; i < count; ++i) node.data(i)->~KeyValue();
+        }
+    };
+
+    typedef SizeClassChunkBox<Node, MAX_SLOTS, NodeSlots, NodeBlock> node_chunk_box;
+
+    class Transient;
+
+    typedef std::unordered_map<Node*, int> refcount_map;
+
+    /** Unordered iterator to map keyvalues. Visits the keyvalues of a node and then it's children
+     *  depth first.*/
+    class node_iterator
+    {
+        struct Frame{Node* node; uint32_t data; uint32_t child;};
+
+        FixedStack<Frame, MAX_LEVEL + 1> iter_stack;
+        const KeyValue* current;
+
+    public:
+
+        node_iterator(Node* root):current(0)
+        {
+            if(root)
+            {
+                push(root);
+                advance();
+            }
+        }
+
+        void push(Node* node)
+        {
+            Frame f = {node, 0, 0};
+            iter_stack.push(f);
+        }
+
+        void advance()
+        {
+            current = 0;
+            while(Frame* f = iter_stack.top())
+            {
+                if(f->data < f->node->data_count())
+                {
+                    current = f->node->data(f->data++);
+                    return;
+                }
+                else if(f->child < f->node->node_count())
+                {
+                    Node* child = f->node->child(f->child++);
+                    // Nothing is left to visit in the node after it's last child, reuse the frame.
+                    if(f->child == f->node->node_count())
                     {
-                        typename KeyValueList::iterator i = n->value.collision_list->begin();
-                        typename KeyValueList::iterator end = n->value.collision_list->end();
-                        for(;i != end && (result == 0); ++i)
-                        {
-                            result = keyvalue_match_get(**i, key, hash);
-                        }
+                        Frame next = {child, 0, 0};
+                        *f = next;
                     }
+                    else push(child);
+                }
+                else iter_stack.pop();
+            }
+        }
 
-                    if(result) break;
+        void operator++(){advance();}
 
-                    current = n; // Just move on if match not found.
+        bool operator==(const node_iterator& i){return current == i.current;}
+        bool operator!=(const node_iterator& i){return current != i.current;}
+        const KeyValue* data_ptr(){return current;}
+        const KeyValue& operator*(){return *current;}
+        const KeyValue* operator->(){return current;}
+    };
+
+    /** The map class.*/
+    class Map
+    {
+    public:
+        typedef node_iterator iterator;
+
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef KeyValue value_type;
+
+        Map(PChampMapPool& pool, Node* root):pool_(pool), root_(root), hash_(0), hashed_(false)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Map(const Map& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Map(Map&& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            map.root_ = 0;
+        }
+
+        ~Map()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
+
+        Map& operator=(const Map& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                if(root_) pool_.add_ref(root_);
+            }
+            return *this;
+        }
+
+        Map& operator=(Map&& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                map.root_ = 0;
+            }
+            return *this;
+        }
+
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref()
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const {if(root_) f((const void*) root_);}
+
+        ConstOption<V> try_get_value(const K& key) const
+        {
+            uint32_t hash = HashFun::hash(key);
+            const V* result = 0;
+            Node* node = root_;
+
+            for(uint32_t level = 0; node && !result; ++level)
+            {
+                if(level >= MAX_LEVEL)
+                {
+                    size_t count = node->data_count();
+                    for(size_t i = 0; i < count && !result; ++i) result = keyvalue_match_get(*node->data(i), key, hash);
+                    node = node->nodemap ? node->child(0) : 0;
                 }
                 else
                 {
-                    // Trie path ran out. No value.
-                    break;
+                    uint32_t bit = hash_bit(hash, level);
+                    if(node->datamap & bit)
+                    {
+                        result = keyvalue_match_get(*node->data(Node::index(node->datamap, bit)), key, hash);
+                        break;
+                    }
+                    else if(node->nodemap & bit) node = node->child(Node::index(node->nodemap, bit));
+                    else break;
                 }
             }
 
@@ -1371,559 +5054,1277 @@ public:
             return result;
         }
 
-        // TODO: template<class T> Map.add_seq keyvalue-pair list - add sequence of pairs in one update
-
-        // TODO: map_add_diff -> map -> value -> diff that implements the element add operator
-        // on a map and also returns a diff between the two versions of the maps.
-
         /** Add key and value to map.*/
         Map add(const K& key, const V& value)
         {
-            return pool_.add(*this, key, value);
+            return pool_.add(*this, key, value);
+        }
+
+        /** Add sequence of keys and values in one update, see Transient. */
+        template<class KI, class VI>
+        Map add(const KI i_key, const KI key_end, const VI i_value, const VI value_end) const
+        {
+            return pool_.add(*this, i_key, key_end, i_value, value_end);
+        }
+
+        /** Remove key entry from map. Only the path to the removed entry is copied.*/
+        Map remove(const K& key)
+        {
+            if(!root_) return *this;
+            Node* root = pool_.remove(root_, key, HashFun::hash(key), 0);
+            return Map(pool_, root);
+        }
+
+        /** Return map with the keyvalues of m added, see merge of the pool.*/
+        Map merge(const Map& m) const {return pool_.merge(*this, m);}
+
+        /** Return map of the keyvalues of m that are missing or have another value in this map.*/
+        Map diff(const Map& m) const {return pool_.diff(*this, m);}
+
+        /** Return map of the keyvalues of this map whose key is in m, see intersection of the pool.*/
+        Map intersection(const Map& m) const {return pool_.intersection(*this, m);}
+
+        /** Return map of the keyvalues of this map whose key is not in m.*/
+        Map difference(const Map& m) const {return pool_.difference(*this, m);}
+
+        // Run garbage collector on the root pool.
+        void gc(){pool_.gc();}
+
+        iterator begin() const {return iterator(root_);}
+        iterator end() const {return iterator(0);}
+
+        /** Return hash_elements(*this). The hash is computed on the first call and copied with the handle.*/
+        template<class F>
+        uint32_t hash(F hash_elements) const
+        {
+            if(!hashed_)
+            {
+                hash_   = hash_elements(*this);
+                hashed_ = true;
+            }
+            return hash_;
+        }
+
+        bool operator==(const Map& m) const {return pool_.equal(*this, m);}
+
+        const size_t size() const {return root_ ? root_->count : 0;}
+
+        friend class PChampMapPool;
+        friend class Transient;
+
+    private:
+        PChampMapPool& pool_;
+        Node* root_;
+        mutable uint32_t hash_; //> Cached hash, valid if hashed_
+        mutable bool     hashed_;
+    };
+
+    /** Builder that adds keys to a map by modifying the nodes it has created in place, see
+     *  PMapPool::Transient. A node that gets a new keyvalue moves to a larger size class so it
+     *  is still copied, but the path above it is not.*/
+    class Transient
+    {
+    public:
+        Transient(const Map& map):pool_(map.pool_), root_(map.root_), owner_(pool_.new_owner()),
+            collections_(pool_.collections_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        ~Transient()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
+
+        void add(const K& key, const V& value)
+        {
+            if(collections_ != pool_.collections_)
+            {
+                owner_ = pool_.new_owner();
+                collections_ = pool_.collections_;
+            }
+            set_root(pool_.insert(root_, key, value, HashFun::hash(key), 0, owner_));
+        }
+
+        /** Return the built map. The nodes built so far are not modified after this.*/
+        Map persistent()
+        {
+            owner_ = pool_.new_owner();
+            return Map(pool_, root_);
+        }
+
+    private:
+        Transient(const Transient&);
+        Transient& operator=(const Transient&);
+
+        void set_root(Node* root)
+        {
+            if(root == root_) return;
+            pool_.add_ref(root);
+            if(root_) pool_.remove_ref(root_);
+            root_ = root;
+        }
+
+        PChampMapPool& pool_;
+        Node*          root_;
+        uint32_t       owner_;
+        uint64_t       collections_; //> Collection count of the pool when owner_ was taken
+    };
+
+    /** Recycle all memory. */
+    void kill()
+    {
+        wait_for_collection();
+        clear_root_refcounts();
+        gc();
+        wait_for_collection();
+    }
+
+    PChampMapPool():nursery_size_(8192), next_owner_(0), collections_(0)
+    {
+    }
+
+    /** Return new owner id for a Transient. */
+    uint32_t new_owner()
+    {
+        if(++next_owner_ == 0) ++next_owner_;
+        return next_owner_;
+    }
+
+    ~PChampMapPool()
+    {
+        kill();
+    }
+
+    /** Remove reference to node */
+    void remove_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(ref_count_, n);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
+
+    /** Add reference to node*/
+    void add_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_[n]++;
+    }
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_.clear();
+    }
+
+    /** Copy of the positive root reference counts. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
+
+    /** Bytes of the nodes reachable from roots. Marks on the calling thread without collecting.
+     *  Young nodes are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        node_chunks_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r) gc_roots_.push_back((Node*) *r);
+        mark_locked();
+        gc_roots_.clear();
+        size_t bytes = node_chunks_.marked_bytes_locked();
+        node_chunks_.release_locked();
+        return bytes;
+    }
+
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return node_chunks_.mark_mismatches();
+    }
+
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
+    {
+        if(cycle_.valid())
+        {
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            gc_roots_.clear();
+            release_empty_chunks();
+        }
+    }
+
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count){node_chunks_.set_retained_empty_chunks(count);}
+
+    ChunkStats chunk_stats()
+    {
+        wait_for_collection();
+        return node_chunks_.stats();
+    }
+
+    /** Bytes of all nodes reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const {return node_chunks_.allocated_bytes();}
+
+    /** Collect the nodes reserved after the previous collection. Runs on the calling thread.
+     *  Nodes are never mutated once created so no remembered set is needed.*/
+    void minor_gc()
+    {
+        wait_for_collection();
+        ++collections_;
+
+        copy_roots();
+        node_chunks_.minor_begin();
+
+        PChampMapPool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            pool->mark_referenced(n, stack, true);
+        });
+
+        node_chunks_.minor_sweep();
+        release_empty_chunks();
+        gc_roots_.clear();
+    }
+
+    void copy_roots()
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        gc_roots_.clear();
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) gc_roots_.push_back(r->first);
+    }
+
+    void release_empty_chunks(){node_chunks_.release_empty_chunks();}
+
+    /** Start a garbage collection cycle for map. The marking and deallocation are run on the
+     *  collector thread, see wait_for_collection.*/
+    void gc()
+    {
+        wait_for_collection();
+        ++collections_;
+
+        copy_roots();
+        node_chunks_.lock_for_collection();
+
+        PChampMapPool* pool = this;
+        cycle_ = GcWorkers::instance().run_cycle([pool]()
+        {
+            pool->mark_locked();
+
+            for(size_t g = 0; g < pool->node_chunks_.group_count(); ++g) pool->node_chunks_.sweep_group(g);
+        });
+    }
+
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return node_chunks_.young_count() >= nursery_size_;}
+
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
+
+    /** Create new empty map */
+    Map new_map()
+    {
+        Map m(*this, 0);
+        return m;
+    }
+
+    /** Create a copy from existing map.*/
+    template<class M>
+    Map new_map(const M& map_in)
+    {
+        Node* root = 0;
+        for(auto i = map_in.begin(); i != map_in.end(); ++i)
+            root = insert(root, i->first, i->second, HashFun::hash(i->first), 0);
+        return Map(*this, root);
+    }
+
+    /** Create new map with one element*/
+    Map new_map(const K& key, const V& value)
+    {
+        return Map(*this, insert(0, key, value, HashFun::hash(key), 0));
+    }
+
+    /** Create a new map by adding an element to existing map*/
+    Map add(const Map& old, const K& key, const V& value)
+    {
+        return Map(*this, insert(old.root_, key, value, HashFun::hash(key), 0));
+    }
+
+    /** Create a new map by adding an elements and values to an existing map*/
+    template<class KI, class VI>
+    Map add(const Map& old, KI i_key, KI key_end, VI i_value, VI value_end)
+    {
+        Transient t(old);
+        for(; i_key != key_end && i_value != value_end; ++i_key, ++i_value) t.add(*i_key, *i_value);
+        return t.persistent();
+    }
+
+    /** Create a new map by adding an elements and values to an existing map. Usable in case key and
+    *   value types are the same.*/
+    template<class KVI>
+    Map add(const Map& old, KVI i_elems, KVI elems_end)
+    {
+        Transient t(old);
+        while(i_elems != elems_end)
+        {
+            KVI first = i_elems;
+            ++i_elems;
+            if(i_elems == elems_end) break;
+            t.add(*first, *i_elems);
+            ++i_elems;
+        }
+        return t.persistent();
+    }
+
+    /** Return true if map contains key of kv with an equal value.*/
+    static bool contains(const Map& map, const KeyValue& kv)
+    {
+        ConstOption<V> v = map.try_get_value(kv.first);
+        return v.is_valid() && *v == kv.second;
+    }
+
+    /** Return a with the keyvalues of b added. Subtrees b shares with a are not visited.*/
+    Map merge(const Map& a, const Map& b)
+    {
+        Transient t(a);
+        auto add_new = [&](const KeyValue* kv)
+        {
+            if(!contains(a, *kv)) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(a.root_, b.root_, add_new);
+        return t.persistent();
+    }
+
+    /** Return map of the keyvalues of b that are missing from a or have a different value in a.
+     *  diff(a, b) holds the keys added or changed from a to b and diff(b, a) the keys removed or
+     *  changed. Subtrees b shares with a are not visited.*/
+    Map diff(const Map& a, const Map& b)
+    {
+        Transient t(new_map());
+        auto add_new = [&](const KeyValue* kv)
+        {
+            if(!contains(a, *kv)) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(a.root_, b.root_, add_new);
+        return t.persistent();
+    }
+
+    /** Return the keyvalues of a whose key is in b. A subtree a shares with b is in both maps and
+     *  is kept as is: only the unshared keys of a are looked up in b and removed if missing.*/
+    Map intersection(const Map& a, const Map& b)
+    {
+        Map result(a);
+        auto remove_missing = [&](const KeyValue* kv)
+        {
+            if(!b.try_get_value(kv->first).is_valid()) result = result.remove(kv->first);
+            return true;
+        };
+        for_each_unshared(b.root_, a.root_, remove_missing);
+        return result;
+    }
+
+    /** Return the keyvalues of a whose key is not in b. A subtree a shares with b has no keys
+     *  in the result and is not visited.*/
+    Map difference(const Map& a, const Map& b)
+    {
+        Transient t(new_map());
+        auto add_missing = [&](const KeyValue* kv)
+        {
+            if(!b.try_get_value(kv->first).is_valid()) t.add(kv->first, kv->second);
+            return true;
+        };
+        for_each_unshared(b.root_, a.root_, add_missing);
+        return t.persistent();
+    }
+
+    /** Return true if the maps have equal keys and values. Shared subtrees are not visited.*/
+    bool equal(const Map& a, const Map& b)
+    {
+        if(a.root_ == b.root_) return true;
+        auto in_a = [&a](const KeyValue* kv){return contains(a, *kv);};
+        auto in_b = [&b](const KeyValue* kv){return contains(b, *kv);};
+        return for_each_unshared(a.root_, b.root_, in_a) && for_each_unshared(b.root_, a.root_, in_b);
+    }
+
+    /** Call f for the keyvalues in the subtree b, skipping the subtrees that are shared with a, the
+     *  node at the same position (or null). Stop and return false once f returns false.*/
+    template<class F>
+    bool for_each_unshared(Node* a, Node* b, F& f)
+    {
+        if(!b || a == b) return true;
+
+        size_t count = b->data_count();
+        for(size_t i = 0; i < count; ++i) if(!f(b->data(i))) return false;
+
+        uint32_t a_nodemap = a ? a->nodemap : 0;
+        size_t child = 0;
+        for(uint32_t bit = 1; bit != 0; bit <<= 1)
+        {
+            if(!(b->nodemap & bit)) continue;
+            Node* a_child = (a_nodemap & bit) ? a->child(Node::index(a_nodemap, bit)) : 0;
+            if(!for_each_unshared(a_child, b->child(child++), f)) return false;
+        }
+        return true;
+    }
+
+    /** Reserve node with the given bitmaps. The caller constructs the keyvalues and sets the
+     *  children before the node is published.*/
+    Node* new_node(uint32_t datamap, uint32_t nodemap, uint32_t owner = 0)
+    {
+        Node* n = node_chunks_.reserve_consecutive_elements(slots_for(count_bits(datamap), count_bits(nodemap)));
+        n->datamap = datamap;
+        n->nodemap = nodemap;
+        n->owner   = owner;
+        n->count   = 0;
+        return n;
+    }
+
+    static void construct_keyvalue(KeyValue* p, const K& key, const V& value, uint32_t hash)
+    {
+        KeyValue* kv = new(p) KeyValue;
+        kv->hash   = hash;
+        kv->first  = key;
+        kv->second = value;
+    }
+
+    /** Copy of src (may be null) with new bitmaps. The keyvalues and children at positions in both
+     *  the old and new bitmaps are copied, the caller fills the new positions.*/
+    Node* copy_node(Node* src, uint32_t datamap, uint32_t nodemap, uint32_t owner = 0)
+    {
+        Node* n = new_node(datamap, nodemap, owner);
+        if(!src) return n;
+
+        for(uint32_t m = src->datamap & datamap; m; m &= m - 1)
+        {
+            uint32_t bit = m & (0 - m);
+            new(n->data(Node::index(datamap, bit))) KeyValue(*src->data(Node::index(src->datamap, bit)));
+        }
+
+        Node** children = n->children();
+        for(uint32_t m = src->nodemap & nodemap; m; m &= m - 1)
+        {
+            uint32_t bit = m & (0 - m);
+            children[Node::index(nodemap, bit)] = src->child(Node::index(src->nodemap, bit));
+        }
+
+        return n;
+    }
+
+    /** Return copy of node (may be null) with the path to key copied and key set to value.
+     *  If owner is not 0 the nodes of the owner (a Transient) are modified in place instead.*/
+    Node* insert(Node* node, const K& key, const V& value, uint32_t hash, uint32_t level, uint32_t owner = 0)
+    {
+        if(level >= MAX_LEVEL) return insert_collision(node, key, value, hash, owner);
+
+        uint32_t bit = hash_bit(hash, level);
+        uint32_t datamap = node ? node->datamap : 0;
+        uint32_t nodemap = node ? node->nodemap : 0;
+        uint32_t count   = node ? node->count : 0;
+        bool     owned   = owner && node && node->owner == owner;
+
+        if(datamap & bit)
+        {
+            uint32_t index = Node::index(datamap, bit);
+            KeyValue* kv = node->data(index);
+            if(keyvalue_match_get(*kv, key, hash))
+            {
+                Node* n = owned ? node : copy_node(node, datamap, nodemap, owner);
+                n->data(index)->first  = key;
+                n->data(index)->second = value;
+                n->count = count;
+                return n;
+            }
+
+            // Push both keyvalues down to a new child.
+            Node* child = merge(*kv, key, value, hash, level + 1, owner);
+            Node* n = copy_node(node, datamap & ~bit, nodemap | bit, owner);
+            n->children()[Node::index(n->nodemap, bit)] = child;
+            n->count = count + 1;
+            return n;
+        }
+        else if(nodemap & bit)
+        {
+            uint32_t index = Node::index(nodemap, bit);
+            uint32_t child_count = node->child(index)->count; // The child may be modified in place
+            Node* child = insert(node->child(index), key, value, hash, level + 1, owner);
+            Node* n = owned ? node : copy_node(node, datamap, nodemap, owner);
+            n->children()[index] = child;
+            n->count = count - child_count + child->count;
+            return n;
+        }
+        else
+        {
+            Node* n = copy_node(node, datamap | bit, nodemap, owner);
+            construct_keyvalue(n->data(Node::index(n->datamap, bit)), key, value, hash);
+            n->count = count + 1;
+            return n;
+        }
+    }
+
+    /** Return a node containing kv and the new key at level.*/
+    Node* merge(const KeyValue& kv, const K& key, const V& value, uint32_t hash, uint32_t level, uint32_t owner)
+    {
+        if(level >= MAX_LEVEL)
+        {
+            Node* n = new_node(low_bits(2), 0, owner);
+            new(n->data(0)) KeyValue(kv);
+            construct_keyvalue(n->data(1), key, value, hash);
+            n->count = 2;
+            return n;
         }
 
-        template<class KI, class VI>
-        Map add(const KI i_key, const KI key_end, const VI i_value, const VI value_end) const
+        uint32_t old_bit = hash_bit(kv.hash, level);
+        uint32_t new_bit = hash_bit(hash, level);
+
+        if(old_bit != new_bit)
         {
-            return pool_.add(*this, i_key, key_end, i_value, value_end);
+            Node* n = new_node(old_bit | new_bit, 0, owner);
+            new(n->data(Node::index(n->datamap, old_bit))) KeyValue(kv);
+            construct_keyvalue(n->data(Node::index(n->datamap, new_bit)), key, value, hash);
+            n->count = 2;
+            return n;
         }
 
-        // TODO: map_remove_diff -> map -> value -> diff that implements the element remove operator
-        // on a map and also returns a diff between the two versions of the maps.
+        Node* child = merge(kv, key, value, hash, level + 1, owner);
+        Node* n = new_node(0, old_bit, owner);
+        n->children()[0] = child;
+        n->count = 2;
+        return n;
+    }
 
-        /** Remove key entry from map.*/
-        Map remove(const K& key)
+    /** Insert to a collision node (may be null). Keyvalues that do not fit the node are added
+     *  to the overflow node.*/
+    Node* insert_collision(Node* node, const K& key, const V& value, uint32_t hash, uint32_t owner)
+    {
+        size_t   count = node ? node->data_count() : 0;
+        uint32_t total = node ? node->count : 0;
+        bool     owned = owner && node && node->owner == owner;
+        for(size_t i = 0; i < count; ++i)
         {
-            if(try_get_value(key).is_valid())
+            if(keyvalue_match_get(*node->data(i), key, hash))
             {
-                // Remove root and branch containing the removed value. Collect all keyvalues not equal to missing key.
-                std::list<const KeyValue*> kept_keys;
-
-                Node* root = root_;
-                Node* new_root = pool_.new_node();
-
-                // Copy values first from old root to new as is.
-                *new_root = *root;
-
-                uint32_t hash = HashFun::hash(key);
-                Node* removed_branch = root_->get_child_by_hash_and_depth(hash, 0);
-
-                // Have to collect the keyvalue from node separately.
-                NodeValueIterator node_val_iter(removed_branch);
-                while(node_val_iter.move_next())
-                {
-                    const KeyValue* current = node_val_iter.current();
-                    if(! keyvalue_match_get(*current, key, hash)) 
-                    {
-                        kept_keys.push_back(current);
-                    }
-                }
-
-                // Visit the branch containing the keyvalue and collect all keyvalues except the one to remove.
-                node_iterator iter(removed_branch);
-                node_iterator end(0);
-
-                for(;iter != end; ++iter)
-                {
-                    const KeyValue* current = iter.data_ptr();
-                    if(! keyvalue_match_get(*current, key, hash)) 
-                    {
-                        kept_keys.push_back(current);
-                    }
-                }
+                Node* n = owned ? node : copy_node(node, node->datamap, node->nodemap, owner);
+                n->data(i)->first  = key;
+                n->data(i)->second = value;
+                n->count = total;
+                return n;
+            }
+        }
 
-                // Remove the branch holding the sought out keyvalue from the new_root.
-                size_t old_size = new_root->size();
-                size_t new_size = old_size - 1;
+        if(node && node->nodemap)
+        {
+            uint32_t child_count = node->child(0)->count;
+            Node* child = insert_collision(node->child(0), key, value, hash, owner);
+            Node* n = owned ? node : copy_node(node, node->datamap, node->nodemap, owner);
+            n->children()[0] = child;
+            n->count = total - child_count + child->count;
+            return n;
+        }
+        else if(count < COLLISION_ENTRIES)
+        {
+            Node* n = copy_node(node, low_bits(count + 1), 0, owner);
+            construct_keyvalue(n->data(count), key, value, hash);
+            n->count = total + 1;
+            return n;
+        }
+        else
+        {
+            Node* child = insert_collision(0, key, value, hash, owner);
+            Node* n = copy_node(node, node->datamap, 1, owner);
+            n->children()[0] = child;
+            n->count = total + 1;
+            return n;
+        }
+    }
 
-                if(new_size > 0)
-                {
-                    uint32_t invalid_index = (hash) & 0x1f;
-                    new_root->used = set_bit_off(new_root->used, invalid_index);
-
-                    typename Node::Ref* new_child_array = pool_.ref_chunks_.reserve_consecutive_elements(new_size);
-                    new_root->child_array = new_child_array;
-                    size_t i = 0;
-                    size_t child_index = 0;
-                    for(i = 0; i < old_size; ++i)
-                    {
-                        if(root_->child_array[i].node != removed_branch) new_child_array[child_index++] = root_->child_array[i];
-                    }
-                }
-                else
-                {
-                    new_root->used = 0;
-                    new_root->child_array = 0;
-                }
+    /** Return copy of node with the path to key copied and key removed, node itself if key
+     *  was not found or null if the node became empty.*/
+    Node* remove(Node* node, const K& key, uint32_t hash, uint32_t level)
+    {
+        if(level >= MAX_LEVEL) return remove_collision(node, key, hash);
 
-                // Init new map root and child array - add the kept keyvalues from the removed branch.
+        uint32_t bit = hash_bit(hash, level);
 
-                Map out_map(pool_, new_root);
+        if(node->datamap & bit)
+        {
+            if(!keyvalue_match_get(*node->data(Node::index(node->datamap, bit)), key, hash)) return node;
+            if(node->datamap == bit && node->nodemap == 0) return 0;
+            Node* n = copy_node(node, node->datamap & ~bit, node->nodemap);
+            n->count = node->count - 1;
+            return n;
+        }
+        else if(node->nodemap & bit)
+        {
+            uint32_t index = Node::index(node->nodemap, bit);
+            Node* old_child = node->child(index);
+            Node* child = remove(old_child, key, hash, level + 1);
 
-                for(auto i = kept_keys.begin(); i != kept_keys.end(); ++i)
-                {
-                    out_map = pool_.add(out_map, *i);
-                }
+            if(child == old_child) return node;
 
-                return out_map;
+            Node* n;
+            if(!child)
+            {
+                if(node->nodemap == bit && node->datamap == 0) return 0;
+                n = copy_node(node, node->datamap, node->nodemap & ~bit);
+            }
+            else if(child->data_count() == 1 && child->nodemap == 0)
+            {
+                // Inline the only keyvalue left in the child.
+                n = copy_node(node, node->datamap | bit, node->nodemap & ~bit);
+                new(n->data(Node::index(n->datamap, bit))) KeyValue(*child->data(0));
             }
             else
             {
-                // Nothing to remove, just return a new instance of the current map.
-                return *this;
+                n = copy_node(node, node->datamap, node->nodemap);
+                n->children()[index] = child;
             }
+            n->count = node->count - 1;
+            return n;
         }
 
-        // Run garbage collector on the root pool.
-        void gc(){pool_.gc();}
+        return node;
+    }
 
-        iterator begin() const {return iterator(root_);}
-        iterator end() const {return iterator(0);}
-      
-        bool operator==(const Map& m) const
+    Node* remove_collision(Node* node, const K& key, uint32_t hash)
+    {
+        size_t count = node->data_count();
+        for(size_t i = 0; i < count; ++i)
         {
-            iterator i = begin(), last = end();
-            while(i != last)
+            if(keyvalue_match_get(*node->data(i), key, hash))
             {
-                ConstOption<V> opt = m.try_get_value(i->first);
-                if(! (opt.is_valid() && (*opt) == i->second)) return false;
-                ++i;
+                if(count == 1) return node->nodemap ? node->child(0) : 0;
+
+                Node* n = new_node(low_bits(count - 1), node->nodemap);
+                for(size_t j = 0, d = 0; j < count; ++j)
+                    if(j != i) new(n->data(d++)) KeyValue(*node->data(j));
+                if(node->nodemap) n->children()[0] = node->child(0);
+                n->count = node->count - 1;
+                return n;
             }
-            return true;
         }
 
-        const size_t size() const
+        if(node->nodemap)
         {
-            return orb::iterator_range_length(begin(), end());
-        }
+            Node* old_child = node->child(0);
+            Node* child = remove_collision(old_child, key, hash);
+            if(child == old_child) return node;
 
-        friend class PMapPool;
-
-    private:
-        PMapPool& pool_;
-        Node* root_;
-    };
+            Node* n = copy_node(node, node->datamap, child ? 1 : 0);
+            if(child) n->children()[0] = child;
+            n->count = node->count - 1;
+            return n;
+        }
 
-    /** Recycle all memory. */
-    void kill()
-    {
-        // Must call destructor on all used cells.
-        // TODO: Should this be the responsibility of individual containers?
-        ref_count_.clear();
-        gc();
+        return node;
     }
 
-    ~PMapPool()
+    /** Mark node if it was locked for the collection (or is young on minor collection) and push
+     *  it's children to the marking stack. */
+    /** Mark the slots in locked chunks reachable from the roots of the cycle.*/
+    void mark_locked()
     {
-        kill();
+        PChampMapPool* pool = this;
+        ParallelMarker<Node*>::run(gc_roots_, [pool](Node* n, std::vector<Node*>& stack)
+        {
+            pool->mark_referenced(n, stack, false);
+        });
     }
 
-    /** Remove reference to node */
-    void remove_ref(Node* n)
+    void mark_referenced(Node* node, std::vector<Node*>& stack, bool minor)
     {
-        int* ref_count = try_get_value(ref_count_, n);
-        if(ref_count && (*ref_count > 0)) --(*ref_count);
+        size_t slots = node->slot_count();
+        bool marked = minor ? node_chunks_.set_marked_if_young_array(node, slots)
+                            : node_chunks_.set_marked_if_locked_array(node, slots);
+        if(marked)
+        {
+            size_t count = node->node_count();
+            for(size_t i = 0; i < count; ++i) stack.push_back(node->child(i));
+        }
     }
 
-    /** Add reference to node*/
-    void add_ref(Node* n)
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
     {
-        if(has_key(ref_count_, n)) ref_count_[n]++;
-        else ref_count_[n] = 1;
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() *  sizeof(typename refcount_map::value_type);
+        return sizeof(*this) + ref_map_size + node_chunks_.reserved_size_bytes();
     }
 
-    /** Clear refcounts. Warning: use only if you know what you are doing. */
-    void clear_root_refcounts()
+    size_t live_size_bytes()
     {
-        ref_count_.clear();
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * sizeof(typename refcount_map::value_type);
+        return sizeof(*this) + ref_map_size + node_chunks_.live_size_bytes();
     }
 
-    /** Create new empty map */
-    Map new_map()
-    {
-        Map m(*this, 0);
-        return m;
-    }
-    
-    /** Create a copy from existing map. TODO: Remove this?*/
-    template<class M>
-    Map new_map(const M& map_in)
-    {
-        Node* root = 0;
+private:
+    node_chunk_box     node_chunks_;
+    refcount_map       ref_count_; // Store references to root nodes
+    std::mutex         ref_mutex_;
+    std::vector<Node*> gc_roots_;  //> Roots of the ongoing collection cycle
+    std::shared_future<void> cycle_;
+    size_t             nursery_size_;
+    uint32_t           next_owner_;  //> Last owner id given to a Transient
+    uint64_t           collections_; //> Number of collections started
+};
 
-        for(auto i = map_in.begin(); i != map_in.end(); ++i)
-        {
-            KeyValue* kv = new_keyvalue(i->first, i->second);
-            root = instantiate_tree_path(root, kv);
-        }
+/////////// Persistent sorted map //////////////
 
-        Map m(*this, root);
+template<class K>
+class IsLess { public:
+    static bool compare(const K& k1, const K& k2){return k1 < k2;}
+};
 
-        return m;
-    }
+/** Pool manager and collector for persistent sorted maps. The map is an AVL tree of keyvalue
+ *  nodes annotated with subtree sizes: insert, remove, lookup, rank and select are O(log n).
+ *  Modifications copy the path to the changed node, nodes are immutable once created.
+ *  Less::compare(a, b) must be a strict weak ordering of the keys.
+ *  ChunkSize is the number of nodes in each chunk. */
+template<class K, class V, class Less = IsLess<K>, size_t ChunkSize = CHUNK_BUFFER_SIZE>
+class PSortedMapPool
+{
+public:
 
-    /** Create new map with one element*/
-    Map new_map(const K& key, const V& value)
+    /** Tree node, stores one keyvalue. */
+    struct Node
     {
-        KeyValue* kv = new_keyvalue(key, value);
-        Node* root = instantiate_tree_path(0, kv);
+        Node*    left;
+        Node*    right;
+        size_t   size;   //> Number of keyvalues in the subtree
+        uint32_t height;
+        K        first;
+        V        second;
+    };
 
-        Map m(*this, root);
-        return m;
-    }
+    class Map;
 
-    /** Create a new map by adding an element to existing map*/
-    Map add(const Map& old, const K& key, const V& value)
+    /** In-order iterator, ascending or descending. The top of the stack is the current node, the
+     *  rest are the ancestors that are visited after it.*/
+    class iterator
     {
-        KeyValue* kv = new_keyvalue(key, value);
-        Node* new_root = instantiate_tree_path(old.root_, kv);
-        return Map(*this, new_root);
-    }
+    public:
+        iterator():descending_(false){}
+        iterator(bool descending):descending_(descending){}
 
-    /** Create a new map by adding an elements and values to an existing map*/
-    template<class KI, class VI>
-    Map add(const Map& old, KI i_key, KI key_end, VI i_value, VI value_end)
-    {
-        Node* new_root = old.root_;
+        const Node& operator*() const {return *stack_.back();}
+        const Node* operator->() const {return stack_.back();}
 
-        while((i_key != key_end) && 
-              (i_value != value_end))
+        void operator++()
         {
-            KeyValue* kv = new_keyvalue(*i_key, *i_value);
+            const Node* n = stack_.back();
+            stack_.pop_back();
+            push_path(descending_ ? n->left : n->right);
+        }
 
-            new_root = instantiate_tree_path(new_root, kv);
+        bool operator!=(const iterator& i) const {return !(*this == i);}
+        bool operator==(const iterator& i) const
+        {
+            return stack_.empty() ? i.stack_.empty() : (!i.stack_.empty() && stack_.back() == i.stack_.back());
+        }
 
-            ++i_key;
-            ++i_value;
+        friend class Map;
+
+    private:
+        /** Push n and the nodes on the path to the first node of it's subtree.*/
+        void push_path(const Node* n)
+        {
+            while(n)
+            {
+                stack_.push_back(n);
+                n = descending_ ? n->right : n->left;
+            }
         }
 
-        return Map(*this, new_root);
-    }
+        std::vector<const Node*> stack_;
+        bool                     descending_;
+    };
 
-    /** Create a new map by adding an elements and values to an existing map. Usable in case key and 
-    *   value types are the same.*/
-    template<class KVI>
-    Map add(const Map& old, KVI i_elems, KVI elems_end)
+    class Map
     {
-        Node* new_root = old.root_;
+    public:
+        typedef typename PSortedMapPool::iterator iterator;
 
-        KVI first;
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef Node value_type;
 
-        while((i_elems != elems_end))
+        Map(PSortedMapPool& pool, Node* root):pool_(pool), root_(root), hash_(0), hashed_(false)
         {
-            first = i_elems;
-            ++i_elems;
-            if(i_elems != elems_end)
-            {
-                KeyValue* kv = new_keyvalue(*first, *i_elems);
-                new_root = instantiate_tree_path(new_root, kv);
-            }
-            
-            ++i_elems;
+            if(root_) pool_.add_ref(root_);
         }
 
-        return Map(*this, new_root);
-    }
+        Map(const Map& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            if(root_) pool_.add_ref(root_);
+        }
 
-    /** Create a new map by adding an allocated keyvalue instance to an existing map.*/
-    Map add(const Map& old, const KeyValue* keyvalue)
-    {
-        Node* new_root = instantiate_tree_path(old.root_, keyvalue);
-        return Map(*this, new_root);
-    }
+        Map(Map&& map):pool_(map.pool_), root_(map.root_), hash_(map.hash_), hashed_(map.hashed_)
+        {
+            map.root_ = 0;
+        }
 
-    KeyValue* new_keyvalue(const K& k, const V& v)
-    {
-        KeyValue* kv = keyvalue_chunks_.reserve_element();
-        kv->first  = k;
-        kv->second = v;
-        kv->hash   = HashFun::hash(k);
-        return kv;
-    }
+        ~Map()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
 
-    /** Replace the existing reference array at node with a new array that has the newnode inserted at loc. */
-    void node_insert_replace_refarray(Node* parent, Node* newnode, const uint32_t local_index, const uint32_t child_level)
-    {
-        size_t   old_count       = parent->size();
-        size_t   new_count       = old_count + 1;
-        uint32_t local_index_bit = 1 << local_index;
+        Map& operator=(const Map& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                if(root_) pool_.add_ref(root_);
+            }
+            return *this;
+        }
 
-        typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(new_count);
-        typename Node::Ref* old_children = parent->child_array;
+        Map& operator=(Map&& map)
+        {
+            if(this != &map)
+            {
+                assert(&pool_ == &map.pool_);
+                if(root_) pool_.remove_ref(root_);
+                root_ = map.root_;
+                hash_ = map.hash_;
+                hashed_ = map.hashed_;
+                map.root_ = 0;
+            }
+            return *this;
+        }
 
-        // Create new child array for current node and mark new index used.
-        parent->child_array = child_array;
-        parent->used |= local_index_bit;
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref(){if(root_) pool_.add_ref(root_);}
 
-        uint32_t array_index = parent->index(local_index_bit); 
-        // TODO: Check all child_array references that they use explicitly ref.
-        child_array[array_index].node = newnode;
+        /** Call f with each node the handle holds a reference count on.*/
+        template<class F>
+        void for_each_root(F f) const {if(root_) f((const void*) root_);}
 
-        auto child_ref = child_array + array_index;
+        /** Return map with key set to value. */
+        Map add(const K& key, const V& value) const {return Map(pool_, pool_.insert(root_, key, value));}
 
-        // Copy all other children to new places in new child array
-        for(auto oi = old_children; oi != old_children + old_count; ++oi)
+        /** Return map with the keyvalues of the iterator ranges added. */
+        template<class KI, class VI>
+        Map add(KI k_begin, KI k_end, VI v_begin, VI v_end) const
         {
-            const uint32_t* child_hash = oi->node->hash_value();
-            assert(child_hash);
-            auto ref = parent->get(*child_hash, child_level);
-            assert(ref != child_ref);
-            ref->node = oi->node;
+            Node* root = root_;
+            for(; k_begin != k_end && v_begin != v_end; ++k_begin, ++v_begin) root = pool_.insert(root, *k_begin, *v_begin);
+            return Map(pool_, root);
+        }
+
+        /** Return map without key. */
+        Map remove(const K& key) const
+        {
+            if(!try_get_value(key).is_valid()) return *this; // Nothing to remove.
+            return Map(pool_, pool_.erase(root_, key));
+        }
+
+        ConstOption<V> try_get_value(const K& key) const
+        {
+            const Node* n = root_;
+            while(n)
+            {
+                if(Less::compare(key, n->first))      n = n->left;
+                else if(Less::compare(n->first, key)) n = n->right;
+                else return ConstOption<V>(&n->second);
+            }
+            return ConstOption<V>(0);
         }
-    }
 
-    /** Create new nodes on map for the path for the given hash value
-     *  @param hash hash value in.
-     *  @returns RootValue for new tree
-     */
-    Node* instantiate_tree_path(const Node* old_root, const KeyValue* kv)
-    {
-        Node* newroot = new_node();// This will be the root of the duplicate map.
+        size_t size() const {return root_ ? root_->size : 0;}
+        bool empty() const {return root_ == 0;}
 
-        if(old_root) *newroot = *old_root; // At first just copy children.
+        iterator begin() const {iterator i(false); i.push_path(root_); return i;}
+        iterator end() const {return iterator(false);}
 
-        uint32_t level = 0;
-        uint32_t hash = kv->hash;
-        Node* current = newroot;
+        /** Iterate in descending order of keys. */
+        iterator rbegin() const {iterator i(true); i.push_path(root_); return i;}
+        iterator rend() const {return iterator(true);}
 
-        // Go all the way down once we find an empty node. Then assign it as the value.
-        for(;true;level++)
+        /** Return iterator to the first keyvalue with key not less than key. */
+        iterator lower_bound(const K& key) const
         {
-            // Calculate the array index for this level of hash and the corresponding bit pattern.
-            uint32_t local_index = (hash >> (level*5)) & 0x1f; // |0-31|
+            iterator i(false);
+            for(const Node* n = root_; n;)
+            {
+                if(Less::compare(n->first, key)) n = n->right;
+                else {i.stack_.push_back(n); n = n->left;}
+            }
+            return i;
+        }
 
-            if(! current->index_in_use(local_index))
-            {     
-                // Assign new node positioned at index
+        /** Return iterator to the first keyvalue with key greater than key. */
+        iterator upper_bound(const K& key) const
+        {
+            iterator i(false);
+            for(const Node* n = root_; n;)
+            {
+                if(Less::compare(key, n->first)) {i.stack_.push_back(n); n = n->left;}
+                else n = n->right;
+            }
+            return i;
+        }
 
-                Node* newnode = new_node(); // This node will contain the value.
-                newnode->type =  Node::ValueNode;
-                newnode->value.keyvalue = kv;
+        /** Return number of keys less than key. */
+        size_t rank(const K& key) const
+        {
+            size_t r = 0;
+            for(const Node* n = root_; n;)
+            {
+                if(Less::compare(n->first, key))
+                {
+                    r += subtree_size(n->left) + 1;
+                    n = n->right;
+                }
+                else n = n->left;
+            }
+            return r;
+        }
 
-                node_insert_replace_refarray(current, newnode, local_index, level);
+        /** Return iterator to the keyvalue of rank index, end if index is not less than size(). */
+        iterator select(size_t index) const
+        {
+            iterator i(false);
+            if(index >= size()) return i;
+            for(const Node* n = root_; n;)
+            {
+                size_t left_size = subtree_size(n->left);
+                if(index < left_size)
+                {
+                    i.stack_.push_back(n);
+                    n = n->left;
+                }
+                else if(index == left_size)
+                {
+                    i.stack_.push_back(n);
+                    break;
+                }
+                else
+                {
+                    index -= left_size + 1;
+                    n = n->right;
+                }
+            }
+            return i;
+        }
 
-                break; 
+        /** Return hash_elements(*this). The hash is computed on the first call and copied with the handle.*/
+        template<class F>
+        uint32_t hash(F hash_elements) const
+        {
+            if(!hashed_)
+            {
+                hash_   = hash_elements(*this);
+                hashed_ = true;
             }
-            else
+            return hash_;
+        }
+
+        bool operator==(const Map& m) const
+        {
+            if(root_ == m.root_) return true;
+            if(size() != m.size()) return false;
+            for(iterator i = begin(), mi = m.begin(), e = end(); i != e; ++i, ++mi)
             {
-                // Index was in use.
+                if(Less::compare(i->first, mi->first) || Less::compare(mi->first, i->first)) return false;
+                if(!(i->second == mi->second)) return false;
+            }
+            return true;
+        }
 
-                size_t count = current->size();
+    private:
+        PSortedMapPool& pool_;
+        Node*           root_;
+        mutable uint32_t hash_;  //> Cached hash, valid if hashed_
+        mutable bool     hashed_;
+    };
 
-                typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(count);
-                typename Node::Ref* old_children = current->child_array;
-                unsafe_copy(old_children, old_children + count, child_array);
+    typedef ChunkBox<Node, ChunkSize>      node_chunk_box;
+    typedef std::unordered_map<Node*, int> ref_count_map;
 
-                current->child_array = child_array;
+    PSortedMapPool():nursery_size_(8192)
+    {
+    }
 
-                uint32_t array_index = current->index(1 << local_index); 
+    ~PSortedMapPool()
+    {
+        kill();
+    }
 
-                Node* newnode = new_node();
-                *newnode = *child_array[array_index].node;
-                child_array[array_index].node = newnode;
+    /** Recycle all memory. */
+    void kill()
+    {
+        // Deleting SortedMapPool before the end of the lifetime of all maps will result
+        // in undefined behaviour.
+        wait_for_collection();
+        clear_root_refcounts();
+        gc();
+        wait_for_collection();
+    }
 
-                // No suitable slot found yet.
-                if(level < 6)
-                {
-                    // Check if node value matches. If they do, replace current. 
-                    const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
-                    if(v)
-                    {
-                        // Replace matching key
-                        newnode->value.keyvalue = kv;
-                        break;
-                    }
+    /** Create new empty map. */
+    Map new_map()
+    {
+        return Map(*this, 0);
+    }
 
-                    // If not matching key, just continue onwards.
-                    current = newnode;
-                }
-                else
-                {
-                    // Ran out of level. Need a collision list or replace existing value.
-                    // Need collision list.
-                    if(newnode->type == Node::CollisionNode)
-                    {
-                        // Already have a list. First check if value exists, then just replace it.
-                        // Otherwise append to list.
+    void add_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_[n]++;
+    }
 
-                        const KeyValueList* oldlist = newnode->value.collision_list;
-                        typename KeyValueList::iterator i    = oldlist->begin();
-                        typename KeyValueList::iterator end  = oldlist->end();
+    void remove_ref(Node* n)
+    {
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        int* ref_count = try_get_value(ref_count_, n);
+        if(ref_count && (*ref_count > 0)) --(*ref_count);
+    }
 
-                        bool replace = false;
-                        for(;i != end; ++i)
-                        {
-                            const KeyValue* ikv = *i;
-                            const V* v = keyvalue_match_get(*ikv, kv->first, hash);
-                            if(v)
-                            {
-                                replace = true;
-                                break;
-                            }
-                        }
+    /** Start a collection cycle of all unvisitable nodes. The marking and deallocation are
+     *  run on the collector thread, see wait_for_collection. */
+    void gc()
+    {
+        wait_for_collection();
 
-                        if(replace)
-                        {
-                            KeyValueList tmp = oldlist->remove(i);
-                            *(newnode->value.collision_list) = tmp.add(kv);
-                        }
-                        else
-                        {
-                            *(newnode->value.collision_list) = oldlist->add(kv);
-                        }
-                    }
-                    else
-                    {
-                        // Replace single value with a list or replace existing value.
-                        const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
-                        if(v)
-                        {
-                            // Replace matching key
-                            newnode->value.keyvalue = kv;
-                            break;
-                        }
-                        else
-                        {
-                            //Need collision list
-                            newnode->type = Node::CollisionNode;
-                            const KeyValue* current_kv = newnode->value.keyvalue;
-                            newnode->value.collision_list = new KeyValueList(collided_list_pool_, 0);
-                            *(newnode->value.collision_list) = collided_list_pool_.new_list(current_kv, kv);
-                        }
-                    }
+        copy_roots();
 
-                    break;
-                }
-            }
-        }
+        nodes_.lock_for_collection();
 
-        return newroot;
+        node_chunk_box* nodes = &nodes_;
+        const std::vector<Node*>* roots = &gc_roots_;
+        cycle_ = GcWorkers::instance().run_cycle([nodes, roots]()
+        {
+            mark_locked(*nodes, *roots);
+            nodes->sweep_locked();
+        });
     }
 
-    // TODO all absolutely non-member functions to static
-    void recursive_mark(Node* node)
+    /** Block until the ongoing collection cycle, if any, has finished. */
+    void wait_for_collection()
     {
-        node_chunks_.set_marked_if_contained(node); 
-        size_t size = node->size();
-        if(size > 0)
+        if(cycle_.valid())
         {
-            ref_chunks_.set_marked_if_contained_array(node->child_array, size);
+            cycle_.get();
+            cycle_ = std::shared_future<void>();
+            gc_roots_.clear();
+            nodes_.release_empty_chunks();
         }
+    }
 
-        if(node->type == Node::ValueNode)
-        {
-            keyvalue_chunks_.set_marked_if_contained(node->value.keyvalue);
-        }
-        else if(node->type == Node::CollisionNode)
+    /** Collect the nodes reserved after the previous collection. Runs on the calling thread.
+     *  Nodes are never mutated so no remembered set is needed.*/
+    void minor_gc()
+    {
+        wait_for_collection();
+
+        copy_roots();
+
+        nodes_.minor_begin();
+
+        node_chunk_box& nodes = nodes_;
+        ParallelMarker<Node*>::run(gc_roots_, [&nodes](Node* n, std::vector<Node*>& stack)
         {
-            auto iter = node->value.collision_list->begin();
-            auto end = node->value.collision_list->end();
-            for(;iter != end; ++iter)
+            if(nodes.set_marked_if_young(n))
             {
-                keyvalue_chunks_.set_marked_if_contained(*iter);
+                stack.push_back(n->left);
+                stack.push_back(n->right);
             }
-        }
+        });
 
-        for(auto ref = node->begin(); ref != node->end(); ++ref)
-            recursive_mark(ref->node);
+        nodes_.minor_sweep();
+        nodes_.release_empty_chunks();
+        gc_roots_.clear();
+    }
 
-    };
+    /** Set number of empty chunks kept for allocation after collection. */
+    void set_retained_empty_chunks(size_t count){nodes_.set_retained_empty_chunks(count);}
 
-    /** Mark all found entries when iterating from this node. Maximum child depth is
-     * seven so stack should not be terribly wasted. */
-    void mark_referenced(Node* node)
+    ChunkStats chunk_stats()
     {
-        recursive_mark(node);
+        wait_for_collection();
+        return nodes_.stats();
     }
 
-    /** Garbage collection for map.*/
-    void gc()
+    /** Bytes of all nodes reserved since the pool was created. Monotonic, differences measure allocation.*/
+    size_t allocated_bytes() const {return nodes_.allocated_bytes();}
+
+    /** True once the nursery has grown past its size and minor_gc should be run. */
+    bool nursery_full() const {return nodes_.young_count() >= nursery_size_;}
+
+    /** Set the number of young nodes after which nursery_full returns true. */
+    void set_nursery_size(size_t node_count){nursery_size_ = node_count;}
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
     {
-        // Must cleanup keyvalues, nodes, refs and gc collided_list_pool_
-        // Mark all empty
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_.clear();
+    }
 
-        // Visit all heads (iterate through map)
-        // For each node: mark node, mark refs, go through all keyvalues and mark them
-        // Then, collect all
-        // Finally gc collided_list_pool_
-        
-        // TODO: Make gc more efficient.
-        // i) collect all live references to an array and sort them.
-        // ii) Sort all chunks in order of their first address
-        // Now the two lists can be passed in linear fashion. 
-        // Takes space (on 64 bit system) 8 * Chunk bytes + 8 * reference bytes.
-        // i.e. for million references ~9MB.
+    /** Copy of the positive root reference counts. */
+    RootRefcounts root_refcounts()
+    {
+        wait_for_collection();
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        RootRefcounts counts;
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) if(r->second > 0) counts[r->first] = r->second;
+        return counts;
+    }
 
+    /** Bytes of the nodes reachable from roots. Marks on the calling thread without collecting.
+     *  Young nodes are promoted, so follow with a full collection.*/
+    size_t reachable_bytes(const std::vector<const void*>& roots)
+    {
+        wait_for_collection();
+        nodes_.lock_for_collection();
+        for(auto r = roots.begin(); r != roots.end(); ++r) gc_roots_.push_back((Node*) *r);
+        mark_locked(nodes_, gc_roots_);
+        gc_roots_.clear();
+        size_t bytes = nodes_.marked_bytes_locked();
+        nodes_.release_locked();
+        return bytes;
+    }
 
-        // Clean mark fields.
-        keyvalue_chunks_.mark_all_empty();
-        node_chunks_.mark_all_empty();
-        ref_chunks_.mark_all_empty();
+    /** Slots whose allocation disagrees with the marks of the last full collection. Call right
+     *  after the collection has finished: nonzero means it reached freed slots.*/
+    size_t mark_mismatches()
+    {
+        wait_for_collection();
+        return nodes_.mark_mismatches();
+    }
 
-        // Then clean up unused references, visit all heads and mark visited nodes as active
-        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        return sizeof(*this) + ref_map_size + nodes_.reserved_size_bytes();
+    }
 
-        // Go through each head.
-        for(auto r = ref_count_.begin(); r!= ref_count_.end(); ++r) mark_referenced(r->first);
+    size_t live_size_bytes()
+    {
+        wait_for_collection();
+        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        return sizeof(*this) + ref_map_size + nodes_.live_size_bytes();
+    }
 
-        // Lastly, collect unused slots.
-        keyvalue_chunks_.collect_chunks();
-        node_chunks_.collect_chunks();
-        ref_chunks_.collect_chunks();
+private:
+    PSortedMapPool(const PSortedMapPool&);
+    PSortedMapPool& operator=(const PSortedMapPool&);
 
-        // After all used slots are collected garbage collect collided list pool (unused heads
-        // have been released in the possible destructors of the list heads).
-        collided_list_pool_.gc();
+    static size_t subtree_size(const Node* n){return n ? n->size : 0;}
+    static uint32_t height(const Node* n){return n ? n->height : 0;}
 
+    /** Mark the nodes in locked chunks reachable from roots.*/
+    static void mark_locked(node_chunk_box& nodes, const std::vector<Node*>& roots)
+    {
+        ParallelMarker<Node*>::run(roots, [&nodes](Node* n, std::vector<Node*>& stack)
+        {
+            if(nodes.set_marked_if_locked(n))
+            {
+                stack.push_back(n->left);
+                stack.push_back(n->right);
+            }
+        });
     }
 
-    /** Allocate new empty node.*/
-    Node* new_node()
+    Node* new_node(Node* left, const K& key, const V& value, Node* right)
     {
-        Node* n = node_chunks_.reserve_element();
-        n->type = Node::EmptyNode;
+        Node* n = nodes_.reserve_element();
+        n->left = left;
+        n->right = right;
+        n->size = subtree_size(left) + subtree_size(right) + 1;
+        n->height = std::max(height(left), height(right)) + 1;
+        n->first = key;
+        n->second = value;
         return n;
     }
 
-    /** Allocate new node with one value.*/
-#if 0 // TODO remove?
-    Node* new_node(const KeyValue& v)
+    /** Return copy of n with the given children. */
+    Node* with_children(const Node* n, Node* left, Node* right){return new_node(left, n->first, n->second, right);}
+
+    /** Return tree of left, the keyvalue of n and right rebalanced. The heights of left and right
+     *  may differ by at most two.*/
+    Node* balance(Node* left, const Node* n, Node* right)
     {
-        Node* n = node_chunks_.reserve_element();
-        *kv = v;
+        uint32_t hl = height(left), hr = height(right);
+        if(hl > hr + 1)
+        {
+            if(height(left->left) >= height(left->right))
+                return with_children(left, left->left, with_children(n, left->right, right));
+            Node* lr = left->right;
+            return with_children(lr, with_children(left, left->left, lr->left), with_children(n, lr->right, right));
+        }
+        if(hr > hl + 1)
+        {
+            if(height(right->right) >= height(right->left))
+                return with_children(right, with_children(n, left, right->left), right->right);
+            Node* rl = right->left;
+            return with_children(rl, with_children(n, left, rl->left), with_children(right, rl->right, right->right));
+        }
+        return with_children(n, left, right);
+    }
 
-        n->type = Node::ValueNode;
-        n->value.keyvalue = kv;
+    Node* insert(Node* n, const K& key, const V& value)
+    {
+        if(!n) return new_node(0, key, value, 0);
+        if(Less::compare(key, n->first)) return balance(insert(n->left, key, value), n, n->right);
+        if(Less::compare(n->first, key)) return balance(n->left, n, insert(n->right, key, value));
+        return new_node(n->left, key, value, n->right);
+    }
 
-        return n;
+    /** Return tree n without key, which must be in the tree. */
+    Node* erase(Node* n, const K& key)
+    {
+        if(Less::compare(key, n->first)) return balance(erase(n->left, key), n, n->right);
+        if(Less::compare(n->first, key)) return balance(n->left, n, erase(n->right, key));
+        if(!n->left) return n->right;
+        if(!n->right) return n->left;
+
+        // Replace n by the first node of the right subtree.
+        const Node* next = n->right;
+        while(next->left) next = next->left;
+        return balance(n->left, next, erase_first(n->right));
     }
-#endif
 
-    /** Return number of bytes used by the chunk pool in total. */
-    size_t reserved_size_bytes()
+    Node* erase_first(Node* n)
     {
-        size_t ref_map_size = ref_count_.size() *  sizeof(typename refcount_map::value_type);
-        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.reserved_size_bytes() + 
-                       node_chunks_.reserved_size_bytes() +  ref_chunks_.reserved_size_bytes() + collided_list_pool_.reserved_size_bytes();
-        return total;
+        if(!n->left) return n->right;
+        return balance(erase_first(n->left), n, n->right);
     }
 
-    size_t live_size_bytes()
+    void copy_roots()
     {
-        size_t ref_map_size = ref_count_.size() * sizeof(typename refcount_map::value_type);
-        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.live_size_bytes() + 
-                       node_chunks_.live_size_bytes() +  ref_chunks_.live_size_bytes() + collided_list_pool_.live_size_bytes();
-        return total;
+        std::lock_guard<std::mutex> lock(ref_mutex_);
+        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        gc_roots_.clear();
+        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) gc_roots_.push_back(r->first);
     }
-private:
-    keyvalue_chunk_box keyvalue_chunks_;
-    node_chunk_box     node_chunks_;
-    ref_chunk_box      ref_chunks_;
-    KeyValueListPool   collided_list_pool_;
-    refcount_map       ref_count_; // Store references to root nodes
-};
 
-#endif
+    node_chunk_box           nodes_;
+    ref_count_map            ref_count_;  //> Root node reference counts
+    std::mutex               ref_mutex_;
+    std::vector<Node*>       gc_roots_;   //> Roots of the ongoing collection cycle
+    std::shared_future<void> cycle_;
+    size_t                   nursery_size_;
+};
 
 #if 0
 /** Generic collection printer */
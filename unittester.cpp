@@ -68,7 +68,10 @@ void run_group(TestSet::value_type& group)
 bool run_all_tests()
 {
     bool result = true;
-    for(auto t = g_tests->begin(); t != g_tests->end(); ++t) run_group(*t);
+    for(auto t = g_tests->begin(); t != g_tests->end(); ++t)
+    {
+        if(t->first != "benchmark") run_group(*t);
+    }
     return result;
 }
 
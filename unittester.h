@@ -27,6 +27,8 @@ MIT licence.
 //
 // catch erroneus states, seize the execution of a particular test and signal the test suite of failure in a particular test.
 //
+// Tests in the group 'benchmark' are run only when they are selected by name from the command line.
+//
 // Error in one test does not terminate the execution of the entire test suite.
 //
 // Example:
@@ -80,6 +82,7 @@ MIT licence.
 #include<iostream> 
 #include<string>
 #include<memory>
+#include<chrono>
 
 
 /** Ouput stream for test logging. Usage: ut_test_out() << "Hello, you feisty tester's little helper!" */
@@ -117,6 +120,16 @@ std::list<T> range_to_list(T start, T delta, T end)
     return result;
 }
 
+/** Run f and return the elapsed wall clock time in milliseconds. */
+template<class F>
+double ut_time_ms(F f)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
 template<class T>
 void print_container(T container)
 {